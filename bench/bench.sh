@@ -0,0 +1,248 @@
+#!/bin/sh
+#######################################################################
+#  bench.sh - End to end benchmarks of scp against sshd on loopback
+#
+#  Copyright (C) 2015 by Patrick S. Avery
+#
+#  This source code is released under the New BSD License, (the "License").
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+#######################################################################
+#
+# Usage: bench.sh [path to scp]
+#
+# Generates the datasets below (once, they are kept between runs), copies
+# each of them to and from localhost BENCH_REPEAT times, and writes the
+# median and percentiles of the wall time and throughput of each case to
+# BENCH_OUT as JSON.
+#
+#   tiny    BENCH_TINY_FILES files of 1K in 100 directories
+#   mixed   A source tree of 2000 files from 100 bytes to 1M
+#   big     One file of BENCH_BIG_SIZE
+#   sparse  A 1G file that is all holes except for 16 blocks of 1M
+#
+# sshd must be listening on port 22 of localhost, and BENCH_USER must be
+# able to log in to it with a public key that needs no passphrase, with
+# localhost already in ~/.ssh/known_hosts.
+#
+# Settings, from the environment:
+#   BENCH_USER        The user to log in as (default $USER)
+#   BENCH_DIR         Where the datasets and copies are kept
+#                     (default ./bench-data)
+#   BENCH_OUT         The JSON results (default ./bench-results.json)
+#   BENCH_REPEAT      How many times each case is run (default 5)
+#   BENCH_CASES       The datasets to run (default "tiny mixed big sparse")
+#   BENCH_BIG_SIZE    The size of the big file, in MB (default 2048)
+#   BENCH_TINY_FILES  The number of tiny files (default 10000)
+#   BENCH_SCP_OPTS    Options passed to every copy, such as "--backend=sftp"
+
+set -u
+
+SCP=${1:-./scp}
+BENCH_USER=${BENCH_USER:-${USER:-$(id -un)}}
+BENCH_DIR=${BENCH_DIR:-./bench-data}
+BENCH_OUT=${BENCH_OUT:-./bench-results.json}
+BENCH_REPEAT=${BENCH_REPEAT:-5}
+BENCH_CASES=${BENCH_CASES:-"tiny mixed big sparse"}
+BENCH_BIG_SIZE=${BENCH_BIG_SIZE:-2048}
+BENCH_TINY_FILES=${BENCH_TINY_FILES:-10000}
+BENCH_SCP_OPTS=${BENCH_SCP_OPTS:-}
+
+if [ ! -x "$SCP" ]; then
+  echo "Error: $SCP is not an executable. Pass the path of scp." >&2
+  exit 1
+fi
+
+mkdir -p "$BENCH_DIR" || exit 1
+BENCH_DIR=$(cd "$BENCH_DIR" && pwd)
+DATA=$BENCH_DIR/data
+# The server's side of the copies. The server is this machine, so it is
+# cleaned up with rm.
+REMOTE=$BENCH_DIR/remote
+LOCAL=$BENCH_DIR/local
+
+# Each dataset is generated once. Its stamp records the settings that it was
+# generated with, so that changing them generates it again.
+make_dataset()
+{
+  name=$1
+  stamp=$2
+  if [ -f "$DATA/$name.stamp" ] && [ "$(cat "$DATA/$name.stamp")" = "$stamp" ]
+  then
+    return 0
+  fi
+
+  echo "Generating the $name dataset" >&2
+  rm -rf "${DATA:?}/$name"
+  mkdir -p "$DATA/$name"
+  case $name in
+    tiny)
+      i=0
+      while [ $i -lt "$BENCH_TINY_FILES" ]; do
+        dir=$DATA/tiny/d$((i % 100))
+        [ -d "$dir" ] || mkdir "$dir"
+        head -c 1024 /dev/urandom > "$dir/f$i"
+        i=$((i + 1))
+      done
+      ;;
+    mixed)
+      # The sizes and layout come from a fixed seed, so that every machine
+      # gets the same tree
+      awk 'BEGIN {
+        srand(1)
+        for (i = 0; i < 2000; i++) {
+          # Mostly small files, a few large ones, like a source tree
+          size = int(100 * exp(rand() ^ 2 * log(10000)))
+          printf "d%d/s%d/f%d %d\n", i % 20, i % 7, i, size
+        }
+      }' | while read -r path size; do
+        mkdir -p "$DATA/mixed/$(dirname "$path")"
+        head -c "$size" /dev/urandom > "$DATA/mixed/$path"
+      done
+      ;;
+    big)
+      dd if=/dev/urandom of="$DATA/big/file" bs=1M count="$BENCH_BIG_SIZE" \
+        2> /dev/null
+      ;;
+    sparse)
+      truncate -s 1G "$DATA/sparse/file"
+      i=0
+      while [ $i -lt 16 ]; do
+        dd if=/dev/urandom of="$DATA/sparse/file" bs=1M count=1 \
+          seek=$((i * 64)) conv=notrunc 2> /dev/null
+        i=$((i + 1))
+      done
+      ;;
+  esac
+  echo "$stamp" > "$DATA/$name.stamp"
+}
+
+now()
+{
+  date +%s.%N
+}
+
+# Prints "median p10 p90 min max" of the numbers on stdin
+stats()
+{
+  sort -g | awk '
+    { v[NR] = $1 }
+    function rank(p,  r) {
+      r = int(p * NR + 0.999999)
+      return v[r < 1 ? 1 : r]
+    }
+    END {
+      if (NR == 0) { print "null null null null null"; exit }
+      median = NR % 2 ? v[(NR + 1) / 2] : (v[NR / 2] + v[NR / 2 + 1]) / 2
+      printf "%.4f %.4f %.4f %.4f %.4f\n", median, rank(0.1), rank(0.9),
+             v[1], v[NR]
+    }'
+}
+
+# Prints a JSON object of the stats of the numbers on stdin
+stats_json()
+{
+  stats | awk '{ printf "{ \"median\": %s, \"p10\": %s, \"p90\": %s, " \
+                        "\"min\": %s, \"max\": %s }", $1, $2, $3, $4, $5 }'
+}
+
+# Runs one case BENCH_REPEAT times and prints its JSON object
+run_case()
+{
+  name=$1
+  direction=$2
+  src=$DATA/$name
+  bytes=$(find "$src" -type f -printf '%s\n' |
+          awk '{ n += $1 } END { print n }')
+  files=$(find "$src" -type f | wc -l)
+  times=$BENCH_DIR/times
+  : > "$times"
+  failures=0
+
+  run=0
+  while [ "$run" -lt "$BENCH_REPEAT" ]; do
+    rm -rf "${REMOTE:?}/dst" "${LOCAL:?}/dst"
+    if [ "$direction" = upload ]; then
+      from=$src
+      to=$BENCH_USER@localhost:$REMOTE/dst
+    else
+      from=$BENCH_USER@localhost:$REMOTE/src/$name
+      to=$LOCAL/dst
+    fi
+
+    start=$(now)
+    # shellcheck disable=SC2086
+    if "$SCP" $BENCH_SCP_OPTS "$from" "$to" > /dev/null 2>> "$BENCH_DIR/errors"
+    then
+      end=$(now)
+      echo "$start $end" | awk '{ printf "%.6f\n", $2 - $1 }' >> "$times"
+    else
+      failures=$((failures + 1))
+      echo "Error: $name $direction failed, see $BENCH_DIR/errors" >&2
+    fi
+    run=$((run + 1))
+  done
+
+  wall=$(stats_json < "$times")
+  throughput=$(awk -v bytes="$bytes" \
+                 '$1 > 0 { printf "%.4f\n", bytes / $1 / 1e6 }' "$times" |
+               stats_json)
+  echo "$name $direction: median $(stats < "$times" | cut -d' ' -f1)s" >&2
+
+  printf '    { "name": "%s-%s", "dataset": "%s", "direction": "%s",\n' \
+         "$name" "$direction" "$name" "$direction"
+  printf '      "bytes": %s, "files": %s, "runs": %s, "failures": %s,\n' \
+         "$bytes" "$files" "$BENCH_REPEAT" "$failures"
+  printf '      "wall_seconds": %s,\n' "$wall"
+  printf '      "throughput_mb_per_s": %s }' "$throughput"
+}
+
+if ! ssh -o BatchMode=yes "$BENCH_USER@localhost" true 2> /dev/null; then
+  echo "Error: $BENCH_USER can't log in to localhost with a key" >&2
+  exit 1
+fi
+
+mkdir -p "$DATA" "$REMOTE/src" "$LOCAL" || exit 1
+: > "$BENCH_DIR/errors"
+
+version=$(git -C "$(dirname "$0")" describe --always --dirty 2> /dev/null ||
+          echo unknown)
+{
+  printf '{\n'
+  printf '  "version": "%s",\n' "$version"
+  printf '  "date": "%s",\n' "$(date -u +%Y-%m-%dT%H:%M:%SZ)"
+  printf '  "host": "%s",\n' "$(uname -n)"
+  printf '  "options": "%s",\n' "$BENCH_SCP_OPTS"
+  printf '  "repeat": %s,\n' "$BENCH_REPEAT"
+  printf '  "cases": [\n'
+
+  first=true
+  for name in $BENCH_CASES; do
+    case $name in
+      tiny)   make_dataset tiny "$BENCH_TINY_FILES" ;;
+      mixed)  make_dataset mixed 2 ;;
+      big)    make_dataset big "$BENCH_BIG_SIZE" ;;
+      sparse) make_dataset sparse 1 ;;
+      *)      echo "Error: unknown dataset $name" >&2; continue ;;
+    esac
+
+    # The server's copy that the downloads read
+    rm -rf "${REMOTE:?}/src/$name"
+    cp -a "$DATA/$name" "$REMOTE/src/$name"
+
+    for direction in upload download; do
+      $first || printf ',\n'
+      first=false
+      run_case "$name" "$direction"
+    done
+  done
+
+  printf '\n  ]\n}\n'
+} > "$BENCH_OUT"
+
+rm -rf "${REMOTE:?}/dst" "${LOCAL:?}/dst" "$BENCH_DIR/times"
+echo "Results are in $BENCH_OUT" >&2
@@ -0,0 +1,57 @@
+# - Try to find zstd
+# Once done this will define
+#
+#  ZSTD_FOUND - system has zstd
+#  ZSTD_INCLUDE_DIRS - the zstd include directory
+#  ZSTD_LIBRARIES - Link these to use zstd
+#
+
+if (ZSTD_LIBRARIES AND ZSTD_INCLUDE_DIRS)
+  # in cache already
+  set(ZSTD_FOUND TRUE)
+else (ZSTD_LIBRARIES AND ZSTD_INCLUDE_DIRS)
+
+  find_path(ZSTD_INCLUDE_DIR
+    NAMES
+      zstd.h
+    PATHS
+      /usr/include
+      /usr/local/include
+      /opt/local/include
+      /sw/include
+      ${CMAKE_INCLUDE_PATH}
+      ${CMAKE_INSTALL_PREFIX}/include
+  )
+
+  find_library(ZSTD_LIBRARY
+    NAMES
+      zstd
+      libzstd
+    PATHS
+      /usr/lib
+      /usr/local/lib
+      /opt/local/lib
+      /sw/lib
+      ${CMAKE_LIBRARY_PATH}
+      ${CMAKE_INSTALL_PREFIX}/lib
+  )
+
+  if (ZSTD_INCLUDE_DIR AND ZSTD_LIBRARY)
+    set(ZSTD_INCLUDE_DIRS
+      ${ZSTD_INCLUDE_DIR}
+    )
+    set(ZSTD_LIBRARIES
+      ${ZSTD_LIBRARY}
+    )
+    set(ZSTD_FOUND TRUE)
+  endif (ZSTD_INCLUDE_DIR AND ZSTD_LIBRARY)
+
+  if (ZSTD_FOUND)
+    include(FindPackageHandleStandardArgs)
+    find_package_handle_standard_args(Zstd DEFAULT_MSG ZSTD_LIBRARIES ZSTD_INCLUDE_DIRS)
+  endif (ZSTD_FOUND)
+
+  # show the ZSTD_INCLUDE_DIRS and ZSTD_LIBRARIES variables only in the advanced view
+  mark_as_advanced(ZSTD_INCLUDE_DIRS ZSTD_LIBRARIES)
+
+endif (ZSTD_LIBRARIES AND ZSTD_INCLUDE_DIRS)
@@ -0,0 +1,43 @@
+/**********************************************************************
+  batch.h - Header file for batch mode, which runs every copy listed in
+            a manifest while reusing one session per host
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#ifndef BATCH_H
+#define BATCH_H
+
+/*
+ * Runs every copy in a manifest. Each line of the manifest holds a <from>
+ * and a <to> in the same format as the command line, separated by a tab
+ * (so that the paths may contain spaces) or by spaces. Blank lines and
+ * lines that start with '#' are skipped.
+ *
+ * The copies are grouped by remote host (or by pair of hosts for remote to
+ * remote copies, see relay.h) and run back to back, so each host is only
+ * connected to once. A copy that fails does not stop the others.
+ *
+ * If resultsPath is set, a tab separated line is written to it for every
+ * copy as it finishes, with a header line first:
+ *   line  status  seconds  from  to
+ * line is the line of the manifest. status is one of ok, failed,
+ * connect-failed or invalid.
+ *
+ * @param manifestPath The path to the manifest, or "-" to read it from
+ * stdin. Passwords cannot be prompted for when it is read from stdin.
+ * @param resultsPath The path to the results file. May be NULL.
+ *
+ * @return Returns 0 if every copy succeeded and -1 otherwise.
+ */
+int batch_run(const char* manifestPath, const char* resultsPath);
+
+#endif // BATCH_H
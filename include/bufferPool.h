@@ -0,0 +1,51 @@
+/**********************************************************************
+  bufferPool.h - Header file for the pool of aligned buffers that the
+                 transfers share
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+
+/*
+ * Every file needs staging buffers of a chunk or more, and with many small
+ * files allocating and freeing them for each one costs more than copying
+ * the file. Buffers that are put back are kept, up to a limit, and handed
+ * out again to the next file that asks for the same size. All threads
+ * share the pool.
+ */
+
+// Every buffer starts on a page, so the kernel can copy whole pages
+#define BUFFER_POOL_ALIGNMENT 4096
+
+/*
+ * Gets a buffer from the pool, or allocates one if the pool has none of
+ * this size. It must be given back with bufferPool_put().
+ *
+ * @param size The size of the buffer in bytes.
+ *
+ * @return A buffer that is aligned to BUFFER_POOL_ALIGNMENT. Returns NULL
+ * if allocation failed.
+ */
+void* bufferPool_D_get(size_t size);
+
+/*
+ * Gives a buffer back to the pool. It is freed if the pool is full.
+ *
+ * @param buffer A buffer from bufferPool_D_get(). May be NULL.
+ * @param size The size that it was obtained with.
+ */
+void bufferPool_put(void* buffer, size_t size);
+
+#endif // BUFFER_POOL_H
@@ -0,0 +1,132 @@
+/**********************************************************************
+  checksum.h - Header file for the checksums that delta transfers use to
+               find the blocks that both ends already have
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The size of an MD5 digest in bytes
+#define CHECKSUM_MD5_SIZE 16
+
+// The state of an MD5 digest that is computed a piece at a time
+typedef struct {
+  uint32_t state[4];
+  uint64_t numBytes;
+  unsigned char buffer[64];
+} md5Context;
+
+typedef md5Context* pmd5Context;
+
+// The size of an XXH64 digest in bytes
+#define CHECKSUM_XXH64_SIZE 8
+
+// The state of an XXH64 digest that is computed a piece at a time
+typedef struct {
+  uint64_t lanes[4];
+  uint64_t numBytes;
+  unsigned char buffer[32];
+} xxh64Context;
+
+typedef xxh64Context* pxxh64Context;
+
+/*
+ * Computes the weak checksum of a block, as rsync does. It is cheap to
+ * compute and can be rolled forward one byte at a time, but it is only
+ * good for finding blocks that might match.
+ *
+ * @param data The block.
+ * @param len The length of the block.
+ *
+ * @return The checksum.
+ */
+uint32_t checksum_weak(const void* data, size_t len);
+
+/*
+ * Moves the window that a weak checksum covers forward by one byte.
+ *
+ * @param weak The checksum of the len bytes that start with out.
+ * @param out The byte that leaves the window.
+ * @param in The byte that enters the window.
+ * @param len The length of the window.
+ *
+ * @return The checksum of the len bytes that end with in.
+ */
+uint32_t checksum_roll(uint32_t weak, unsigned char out, unsigned char in,
+                       size_t len);
+
+/*
+ * Starts an MD5 digest.
+ *
+ * @param ctx The context to be set up.
+ */
+void checksum_md5Init(pmd5Context ctx);
+
+/*
+ * Adds data to an MD5 digest.
+ *
+ * @param ctx A context set up with checksum_md5Init().
+ * @param data The data.
+ * @param len The length of the data.
+ */
+void checksum_md5Update(pmd5Context ctx, const void* data, size_t len);
+
+/*
+ * Finishes an MD5 digest.
+ *
+ * @param ctx A context set up with checksum_md5Init().
+ * @param digest The CHECKSUM_MD5_SIZE bytes of the digest are written here.
+ */
+void checksum_md5Final(pmd5Context ctx, unsigned char* digest);
+
+/*
+ * Computes the MD5 digest of a block of data at once.
+ *
+ * @param data The data.
+ * @param len The length of the data.
+ * @param digest The CHECKSUM_MD5_SIZE bytes of the digest are written here.
+ */
+void checksum_md5(const void* data, size_t len, unsigned char* digest);
+
+/*
+ * Starts an XXH64 digest with a seed of 0. XXH64 is not cryptographic, but
+ * it is many times faster than MD5 and good at catching corruption. Each
+ * 32 byte stripe is split over four independent lanes, so the CPU works on
+ * all four at once.
+ *
+ * @param ctx The context to be set up.
+ */
+void checksum_xxh64Init(pxxh64Context ctx);
+
+/*
+ * Adds data to an XXH64 digest.
+ *
+ * @param ctx A context set up with checksum_xxh64Init().
+ * @param data The data.
+ * @param len The length of the data.
+ */
+void checksum_xxh64Update(pxxh64Context ctx, const void* data, size_t len);
+
+/*
+ * Finishes an XXH64 digest.
+ *
+ * @param ctx A context set up with checksum_xxh64Init().
+ * @param digest The CHECKSUM_XXH64_SIZE bytes of the digest are written here,
+ * most significant first (as xxhsum prints them).
+ */
+void checksum_xxh64Final(pxxh64Context ctx, unsigned char* digest);
+
+#endif // CHECKSUM_H
@@ -0,0 +1,131 @@
+/**********************************************************************
+  chunkQueue.h - Header file for a bounded queue of fixed-size buffers
+                 that is shared between a producer and a consumer thread
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#ifndef CHUNK_QUEUE_H
+#define CHUNK_QUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// A single buffer that is passed between the producer and the consumer
+typedef struct {
+  char* data;
+  // The number of valid bytes in data
+  size_t len;
+} chunk;
+
+typedef chunk* pchunk;
+
+// The queue itself is opaque. See chunkQueue.c for the definition.
+typedef struct chunkQueue chunkQueue;
+
+typedef chunkQueue* pchunkQueue;
+
+/*
+ * Creates a new queue with a fixed number of buffers. All of the memory the
+ * queue will ever use is allocated here, so the memory usage is
+ * chunkSize * depth no matter how much data passes through it.
+ * The returned queue must be freed with chunkQueue_free().
+ *
+ * @param chunkSize The size of each buffer in bytes.
+ * @param depth The number of buffers in the queue.
+ *
+ * @return A pointer to the new queue. Returns NULL if allocation failed.
+ */
+pchunkQueue chunkQueue_D_new(size_t chunkSize, size_t depth);
+
+/*
+ * Frees a queue and all of its buffers. No thread may be using the queue
+ * when this is called.
+ *
+ * @param queue The queue to be freed.
+ */
+void chunkQueue_free(pchunkQueue queue);
+
+/*
+ * Returns the size in bytes of each buffer in the queue.
+ *
+ * @param queue The queue to be investigated.
+ *
+ * @return The size of each buffer in bytes.
+ */
+size_t chunkQueue_getChunkSize(pchunkQueue queue);
+
+/*
+ * Called by the producer to obtain an empty buffer to fill. Blocks until a
+ * buffer is available.
+ *
+ * @param queue The queue from which to obtain the buffer.
+ *
+ * @return A pointer to an empty chunk. Returns NULL if the consumer has
+ * aborted the queue with chunkQueue_abort().
+ */
+pchunk chunkQueue_acquireFree(pchunkQueue queue);
+
+/*
+ * Called by the producer to hand a filled buffer to the consumer.
+ *
+ * @param queue The queue to which the chunk belongs.
+ * @param c The chunk that was obtained with chunkQueue_acquireFree().
+ */
+void chunkQueue_pushFull(pchunkQueue queue, pchunk c);
+
+/*
+ * Called by the producer when it will not push any more chunks. If success
+ * is false, the consumer will see the error after it drains the queue.
+ *
+ * @param queue The queue to be finished.
+ * @param success Set this false if the producer stopped because of an error.
+ */
+void chunkQueue_finish(pchunkQueue queue, bool success);
+
+/*
+ * Called by the consumer to obtain the next filled buffer. Blocks until a
+ * buffer is available. Chunks are returned in the order they were pushed.
+ *
+ * @param queue The queue from which to obtain the buffer.
+ *
+ * @return A pointer to a filled chunk. Returns NULL once the producer has
+ * called chunkQueue_finish() and every chunk has been consumed.
+ */
+pchunk chunkQueue_popFull(pchunkQueue queue);
+
+/*
+ * Called by the consumer to return a buffer so the producer may refill it.
+ *
+ * @param queue The queue to which the chunk belongs.
+ * @param c The chunk that was obtained with chunkQueue_popFull().
+ */
+void chunkQueue_releaseFree(pchunkQueue queue, pchunk c);
+
+/*
+ * Called by the consumer to make the producer stop early. Any producer
+ * waiting in chunkQueue_acquireFree() will return NULL.
+ *
+ * @param queue The queue to be aborted.
+ */
+void chunkQueue_abort(pchunkQueue queue);
+
+/*
+ * Checks whether the producer finished successfully. Only meaningful after
+ * chunkQueue_popFull() has returned NULL.
+ *
+ * @param queue The queue to be investigated.
+ *
+ * @return Returns true if the producer finished without an error.
+ */
+bool chunkQueue_succeeded(pchunkQueue queue);
+
+#endif // CHUNK_QUEUE_H
@@ -0,0 +1,106 @@
+/**********************************************************************
+  chunkSizer.h - Header file for choosing the size of each read from and
+                 write to the channel while a copy runs
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#ifndef CHUNK_SIZER_H
+#define CHUNK_SIZER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <trace.h>
+
+/*
+ * A read from the channel returns whatever libssh has buffered, up to the
+ * size that was asked for. On a fast link a small size means many calls
+ * for each file, and on a slow one a large size only leaves the buffer
+ * half used.
+ *
+ * The sizer measures the reads in windows of a few calls. If most of them
+ * came back full, it tries a size twice as large (or half as large, if
+ * the last step made things slower) and keeps going while the throughput
+ * improves. If most of them came back short, the link is what limits the
+ * copy, and the size shrinks towards what the reads return. It never grows
+ * while a single call takes longer than CHUNK_SIZER_MAX_LATENCY.
+ *
+ * Writes to the channel are sized the same way. A write sends everything
+ * it is given, so it always counts as full, and the size follows the
+ * throughput alone.
+ *
+ * Every size that is chosen is written to the trace (see trace.h).
+ */
+
+// The sizes are powers of two between these...
+#define CHUNK_SIZER_MIN (16 * 1024)
+#define CHUNK_SIZER_MAX (1024 * 1024)
+// ...and start at this one
+#define CHUNK_SIZER_START (64 * 1024)
+// The longest a single call may take, in nanoseconds, for the size to grow
+#define CHUNK_SIZER_MAX_LATENCY (10 * 1000 * 1000)
+
+typedef struct {
+  size_t size;
+  // The phase that the sizes are traced under
+  tracePhase phase;
+
+  // The window being measured
+  uint64_t windowStart;
+  size_t windowCalls;
+  size_t windowFullCalls;
+  size_t windowBytes;
+
+  // The throughput of the last window, and which way the last step went
+  double lastRate;
+  bool isGrowing;
+  // The number of windows since the size last changed
+  size_t numSteady;
+} chunkSizer;
+
+/*
+ * Starts a sizer at CHUNK_SIZER_START.
+ *
+ * @param sizer The sizer, kept by the caller.
+ * @param phase The phase that its sizes are traced under.
+ */
+void chunkSizer_init(chunkSizer* sizer, tracePhase phase);
+
+/*
+ * Gets the size of the next call.
+ *
+ * @param sizer The sizer.
+ *
+ * @return The size in bytes.
+ */
+size_t chunkSizer_get(const chunkSizer* sizer);
+
+/*
+ * Records a call. This only adds to counters, except at the end of a
+ * window.
+ *
+ * @param sizer The sizer.
+ * @param requested The size that the call asked for.
+ * @param got The number of bytes that it returned.
+ */
+void chunkSizer_record(chunkSizer* sizer, size_t requested, size_t got);
+
+/*
+ * Drops the window being measured, so that the time between two files is
+ * not taken for a slow call.
+ *
+ * @param sizer The sizer.
+ */
+void chunkSizer_restart(chunkSizer* sizer);
+
+#endif // CHUNK_SIZER_H
@@ -0,0 +1,63 @@
+/**********************************************************************
+  cipherProbe.h - Header file for choosing the ciphers and MACs that are
+                  fastest on this machine
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#ifndef CIPHER_PROBE_H
+#define CIPHER_PROBE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * The ssh server picks the first cipher and MAC in the client's lists that
+ * it also supports, so the order of the lists decides how fast the copy can
+ * be encrypted. The probe encrypts and signs a buffer in memory with each
+ * cipher and MAC that libssh supports for a few milliseconds, and orders the
+ * lists by the throughput it measured. A cipher that needs a separate MAC
+ * is ranked together with the fastest MAC.
+ *
+ * The results are kept in $XDG_CACHE_HOME/scp (or ~/.cache/scp) for each
+ * host name, so the probe only runs the first time. It needs OpenSSL, which
+ * libssh usually uses too. Without it, libssh's defaults are kept.
+ */
+
+// Big enough for every algorithm that is probed, separated by commas
+#define CIPHER_PROBE_LIST_SIZE 512
+
+/*
+ * Gets the lists of ciphers and MACs to offer the server, fastest first.
+ * The probe runs the first time this is called on this machine.
+ *
+ * @param ciphers The cipher list is written here. It must be of size
+ * CIPHER_PROBE_LIST_SIZE.
+ * @param macs The MAC list is written here. It must be of size
+ * CIPHER_PROBE_LIST_SIZE.
+ *
+ * @return Returns true if the lists were written and false if there is
+ * nothing to choose from, in which case libssh's defaults should be used.
+ */
+bool cipherProbe_getPreferences(char* ciphers, char* macs);
+
+/*
+ * Runs the probe again, saves the results and prints a table of them with
+ * the lists that will be offered.
+ *
+ * @param stream The stream that the table is printed to.
+ *
+ * @return Returns true if the probe could be run and false otherwise.
+ */
+bool cipherProbe_printTable(FILE* stream);
+
+#endif // CIPHER_PROBE_H
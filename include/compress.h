@@ -0,0 +1,156 @@
+/**********************************************************************
+  compress.h - Header file for compressing a stream in chunks with zstd,
+               while choosing for each chunk whether it is worth it
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+// Only built if zstd was found (see CMakeLists.txt)
+#ifdef SCP_HAVE_ZSTD
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// How much of a chunk is compressed to guess how well the rest will do
+#define COMPRESS_SAMPLE_SIZE 65536
+// Chunks that don't shrink by at least this factor are sent as they are
+#define COMPRESS_MIN_RATIO 1.1
+// The most threads zstd is given to compress a chunk with
+#define COMPRESS_MAX_THREADS 8
+
+// What went through an encoder or a decoder
+typedef struct {
+  // The bytes before compression and after it
+  size_t rawBytes;
+  size_t wireBytes;
+  // The number of chunks that were compressed and that were sent as they
+  // are. Only counted by encoders.
+  size_t compressedChunks;
+  size_t storedChunks;
+} compressStats;
+
+typedef struct compressEncoder compressEncoder;
+typedef compressEncoder* pcompressEncoder;
+
+typedef struct compressDecoder compressDecoder;
+typedef compressDecoder* pcompressDecoder;
+
+/*
+ * Creates an encoder. Every chunk that is given to it becomes one zstd
+ * frame, so the output is an ordinary zstd stream that "zstd -d" can read.
+ *
+ * @param level The zstd compression level.
+ * @param chunkSize The largest chunk that will be encoded at once.
+ *
+ * @return The encoder, which must be freed with compress_freeEncoder().
+ * Returns NULL if it failed.
+ */
+pcompressEncoder compress_D_newEncoder(int level, size_t chunkSize);
+
+/*
+ * Frees an encoder. Does nothing if encoder is NULL.
+ *
+ * @param encoder The encoder to be freed.
+ */
+void compress_freeEncoder(pcompressEncoder encoder);
+
+/*
+ * Encodes a chunk. A sample of the chunk is compressed first, and the
+ * chunk is only compressed if the sample shrinks by COMPRESS_MIN_RATIO and
+ * the time that compressing it would take is less than the time it would
+ * save on the network (see compress_addSendTime()). Otherwise the chunk is
+ * stored in the frame as it is, which costs a copy and a few bytes.
+ *
+ * @param encoder The encoder.
+ * @param data The chunk.
+ * @param len The length of the chunk. It may not be more than the
+ * chunkSize that the encoder was created with.
+ * @param outLen Set to the length of the frame.
+ *
+ * @return The frame, which is valid until the next call. Returns NULL if
+ * it failed.
+ */
+const void* compress_encode(pcompressEncoder encoder, const void* data,
+                            size_t len, size_t* outLen);
+
+/*
+ * Tells an encoder how long it took to send some of its output, so that it
+ * can weigh the time spent compressing against the time that it saves.
+ *
+ * @param encoder The encoder.
+ * @param bytes The number of bytes that were sent.
+ * @param seconds The time that it took to send them.
+ */
+void compress_addSendTime(pcompressEncoder encoder, size_t bytes,
+                          double seconds);
+
+/*
+ * @param encoder The encoder.
+ *
+ * @return What has gone through the encoder so far.
+ */
+const compressStats* compress_getEncoderStats(pcompressEncoder encoder);
+
+/*
+ * Creates a decoder for a zstd stream of any number of frames.
+ *
+ * @return The decoder, which must be freed with compress_freeDecoder().
+ * Returns NULL if it failed.
+ */
+pcompressDecoder compress_D_newDecoder();
+
+/*
+ * Frees a decoder. Does nothing if decoder is NULL.
+ *
+ * @param decoder The decoder to be freed.
+ */
+void compress_freeDecoder(pcompressDecoder decoder);
+
+/*
+ * Decodes as much of the input as fits in the output.
+ *
+ * @param decoder The decoder.
+ * @param in The input.
+ * @param inLen The length of the input.
+ * @param inUsed Set to the number of bytes of the input that were used.
+ * The rest must be passed in again.
+ * @param out The buffer for the output.
+ * @param outSize The size of out.
+ * @param outLen Set to the number of bytes written to out.
+ *
+ * @return Returns true if it succeeded and false if the input is not valid.
+ */
+bool compress_decode(pcompressDecoder decoder, const void* in, size_t inLen,
+                     size_t* inUsed, void* out, size_t outSize,
+                     size_t* outLen);
+
+/*
+ * @param decoder The decoder.
+ *
+ * @return What has gone through the decoder so far.
+ */
+const compressStats* compress_getDecoderStats(pcompressDecoder decoder);
+
+/*
+ * Prints what the stats amount to: the ratio, and the rate of the data
+ * against the rate of the bytes that went over the network.
+ *
+ * @param stats The stats from an encoder or a decoder.
+ * @param seconds The time that the transfer took.
+ */
+void compress_printStats(const compressStats* stats, double seconds);
+
+#endif // SCP_HAVE_ZSTD
+
+#endif // COMPRESS_H
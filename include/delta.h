@@ -0,0 +1,103 @@
+/**********************************************************************
+  delta.h - Header file for delta transfers, which only send the parts of
+            a file that the other end's old copy doesn't already have
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <libssh/libssh.h>
+
+// The old copy is split into blocks of about the square root of its size,
+// but no smaller or larger than these
+#define DELTA_MIN_BLOCK_SIZE 1024
+#define DELTA_MAX_BLOCK_SIZE (128 * 1024)
+// Smaller files are always sent whole
+#define DELTA_MIN_FILE_SIZE (1024 * 1024)
+
+// The helper exits with this status if the file to be sent is not a
+// regular file
+#define DELTA_EXIT_NOT_FILE 2
+
+// The results of a delta transfer
+enum delta_result_e {
+  DELTA_OK = 0,
+  DELTA_FAILED,
+  // A delta transfer doesn't apply here (it is turned off, the file is
+  // small or not a regular file, or the helper is missing on the server),
+  // and the file should be copied whole instead
+  DELTA_UNAVAILABLE
+};
+
+/*
+ * Delta transfers work like rsync. The receiver splits its old copy of the
+ * file into blocks and sends a weak rolling checksum and an MD5 digest of
+ * each one. The sender looks for those blocks at every offset of the new
+ * file, and sends references to the blocks it finds and the bytes in
+ * between. The receiver builds the new file next to the old one, checks
+ * the MD5 digest of the whole file and then renames it over the old one.
+ *
+ * The end on the server is this same program run as a helper over an exec
+ * channel (see delta_serveReceive() and delta_serveSend()). Its path on the
+ * server is set with --delta-helper, which also turns delta transfers on.
+ */
+
+/*
+ * Copies a regular file to the server as a delta against the server's
+ * copy. If to is a directory, the file is copied into it.
+ *
+ * @param session A session that has already been connected to the server.
+ * @param from The local file.
+ * @param to The path on the server.
+ *
+ * @return A delta_result_e. Nothing has been changed on the server if it
+ * is DELTA_UNAVAILABLE.
+ */
+int delta_copyToServer(ssh_session session, const char* from, const char* to);
+
+/*
+ * Copies a regular file from the server as a delta against the local copy.
+ * If to is a directory, the file is copied into it.
+ *
+ * @param session A session that has already been connected to the server.
+ * @param from The path on the server.
+ * @param to The local file.
+ *
+ * @return A delta_result_e. Nothing has been changed locally if it is
+ * DELTA_UNAVAILABLE.
+ */
+int delta_copyFromServer(ssh_session session, const char* from,
+                         const char* to);
+
+/*
+ * The helper's end of delta_copyToServer(). Sends the signatures of path
+ * to stdout and builds the new path from the delta read from stdin.
+ *
+ * @param path The file to be replaced. It need not exist.
+ *
+ * @return The exit status for the helper.
+ */
+int delta_serveReceive(const char* path);
+
+/*
+ * The helper's end of delta_copyFromServer(). Reads signatures from stdin
+ * and sends the delta of path against them to stdout.
+ *
+ * @param path The file to be sent.
+ *
+ * @return The exit status for the helper. It is DELTA_EXIT_NOT_FILE if
+ * path is not a regular file.
+ */
+int delta_serveSend(const char* path);
+
+#endif // DELTA_H
@@ -0,0 +1,73 @@
+/**********************************************************************
+  eventEngine.h - Header file for the event loop that copies many files
+                  at once over non-blocking channels in a single thread
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#ifndef EVENT_ENGINE_H
+#define EVENT_ENGINE_H
+
+#include <libssh/libssh.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <sshUtils.h>
+
+/*
+ * The other parallel copies give each session a thread, and each session
+ * copies one file at a time with blocking calls, so a file that is slow to
+ * read or write holds up its whole session.
+ *
+ * The event loop instead puts the sessions in non-blocking mode and runs
+ * up to channelsPerSession channels on each of them (see scpOptions.h),
+ * each copying one file with its own "scp -t" or "scp -f" on the server.
+ * A single thread steps every channel as far as it can go without
+ * waiting, and waits in ssh_event_dopoll() when none of them can move.
+ * The local files are opened, read, written and closed by a small pool of
+ * disk threads, which wake the loop through an eventfd in the same poll.
+ * So a slow file only holds up its own channel, and thousands of files in
+ * flight need no more threads than a few.
+ *
+ * If the server refuses to open another channel on a session, the file
+ * waits for a channel to close and that session is not given any more
+ * channels than it has open.
+ */
+
+// A file to be copied. For downloads, to is the local path of the file.
+// For uploads, it is the remote directory that the file is copied into.
+typedef struct {
+  char* from;
+  char* to;
+} engineJob;
+
+/*
+ * Copies a list of files over several sessions at once. The first session
+ * fails the whole copy if it fails, as a single session would. Once a file
+ * fails, no more are started.
+ *
+ * @param session A session that has already been connected to the server.
+ * It is put back in blocking mode before this returns.
+ * @param info The sshInfo that the other sessions are connected with. It
+ * may be NULL if numSessions is 1.
+ * @param jobs The files to be copied. Every directory that they are copied
+ * into must exist already.
+ * @param numJobs The number of files.
+ * @param numSessions The number of sessions to copy over, including the
+ * one that was passed in.
+ * @param isDownload Set this true to copy from the server.
+ *
+ * @return Returns SSH_OK if every file was copied and SSH_ERROR otherwise.
+ */
+int eventEngine_run(ssh_session session, psshInfo info, engineJob* jobs,
+                    size_t numJobs, int numSessions, bool isDownload);
+
+#endif // EVENT_ENGINE_H
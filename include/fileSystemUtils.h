@@ -18,6 +18,8 @@
 #define DEFAULT_MODE_T 0755
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
 
 // A basic enum for file types
 enum identify_file_type_e {
@@ -28,6 +30,37 @@ enum identify_file_type_e {
   DOES_NOT_EXIST
 };
 
+// Directories with at least this many entries have their entries stat'ed
+// by statThreads threads at once (see scpOptions.h)
+#define FILE_META_PREFETCH_MIN_ENTRIES 64
+
+// The metadata of a file that the copy functions need. It is filled in by a
+// single stat so that it can be passed along instead of stat'ing the file
+// again for each piece.
+typedef struct {
+  // The identify_file_type_e type of the file, after following symlinks
+  int type;
+  size_t size;
+  // The permission bits of the mode
+  int permissions;
+  time_t mtime;
+} fileMeta;
+
+typedef fileMeta* pfileMeta;
+
+/*
+ * Fills in a fileMeta with a single statx() (or fstatat() where statx() is
+ * not available). Symlinks are followed.
+ *
+ * @param dirFd The directory that path is relative to, or AT_FDCWD.
+ * @param path The path of the file to be investigated.
+ * @param meta A pointer to the fileMeta to be filled in. If the file could
+ * not be stat'ed, only its type is set (to DOES_NOT_EXIST or READ_ERROR).
+ *
+ * @return Returns true if the file was stat'ed and false otherwise.
+ */
+bool fileSystemUtils_getMeta(int dirFd, const char* path, pfileMeta meta);
+
 /*
  * Discovers and returns the type of a given file.
  *
@@ -88,19 +121,97 @@ bool fileSystemUtils_chdir(const char* path);
 bool fileSystemUtils_getCWD(char* string);
 
 /*
- * Returns a dynamically allocated character array that contains a
- * comma delimited list of the files in a directory
- * The returned character array needs to be freed by calling free()
- * The function currently DOES include "." and ".." in the return.
+ * Writes the path of the directory that scp keeps its state in between runs,
+ * $XDG_CACHE_HOME/scp (or ~/.cache/scp), creating it if needed.
+ *
+ * @param dir The string to be written to. Make sure it is of size PATH_MAX.
+ *
+ * @return Returns true if it succeeded and false if it failed
+ */
+bool fileSystemUtils_getCacheDir(char* dir);
+
+// One entry of a directory that was read by fileSystemUtils_D_readDir()
+typedef struct {
+  // The name of the entry. It is stored in the arena of the dirList.
+  const char* name;
+  // The d_type that readdir() gave for the entry (DT_REG, DT_DIR, ...)
+  unsigned char dType;
+  // The metadata of the entry, after following symlinks
+  fileMeta meta;
+} dirEntry;
+
+typedef dirEntry* pdirEntry;
+
+// All of the entries of one directory
+typedef struct {
+  // The directory itself, to open the entries with openat() and friends
+  int fd;
+  pdirEntry entries;
+  size_t numEntries;
+  // The names of all of the entries, stored back to back
+  char* arena;
+} dirList;
+
+typedef dirList* pdirList;
+
+/*
+ * Reads every entry of a directory except for "." and "..", and stats each
+ * of them relative to the directory (see fileSystemUtils_getMeta()), so
+ * nothing is looked up by its full path and the working directory is never
+ * changed. The time taken is linear in the number of entries.
+ * For a large directory on a filesystem with a high latency (such as NFS),
+ * set the statThreads option to stat several entries at once.
+ * The returned dirList needs to be freed by calling
+ * fileSystemUtils_freeDirList().
  *
- * @param dirName The name of the directory from which to obtain the list of
- * files and directories that it obtains.
+ * @param parentFd The directory that name is relative to, or AT_FDCWD.
+ * @param name The path of the directory to be read.
  *
- * @return A pointer to the new dynamically allocated character array that
- * contains the comma-delimited list of files. Be sure to free this when
- * finished using it.
+ * @return A pointer to the new dirList. Returns NULL if the directory could
+ * not be read.
  */
+pdirList fileSystemUtils_D_readDir(int parentFd, const char* name);
 
-char* fileSystemUtils_D_getDelimitedFileList(const char* dirName);
+/*
+ * Closes the directory of a dirList and frees it.
+ *
+ * @param list The dirList to be freed.
+ */
+void fileSystemUtils_freeDirList(pdirList list);
+
+/*
+ * The function called by fileSystemUtils_walkTree() for every file and
+ * directory in the tree.
+ *
+ * @param path The path of the file (the root joined with relPath).
+ * @param relPath The path of the file relative to the root. This is an empty
+ * string for the root itself.
+ * @param meta The metadata of the file. Only meta->type is set if the file
+ * could not be stat'ed.
+ * @param userData The userData that was passed to fileSystemUtils_walkTree()
+ *
+ * @return Return true to continue the walk and false to stop it.
+ */
+typedef bool (*fileSystemUtils_walkCallback)(const char* path,
+                                             const char* relPath,
+                                             const fileMeta* meta,
+                                             void* userData);
+
+/*
+ * Walks a directory tree and calls a function for every file and directory
+ * in it, including the root. A directory is always visited before anything
+ * inside of it, so it is safe to create directories in the order they are
+ * visited. The "." and ".." entries are skipped.
+ *
+ * @param root The path of the directory to walk.
+ * @param callback The function to call for every file and directory.
+ * @param userData A pointer that is passed to every call of callback.
+ *
+ * @return Returns true if the whole tree was walked and false if an error
+ * occurred or callback returned false.
+ */
+bool fileSystemUtils_walkTree(const char* root,
+                              fileSystemUtils_walkCallback callback,
+                              void* userData);
 
 #endif
@@ -0,0 +1,82 @@
+/**********************************************************************
+  incrementalSync.h - Header file for incremental copies of directories,
+                      which skip the files that the other end already has
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#ifndef INCREMENTAL_SYNC_H
+#define INCREMENTAL_SYNC_H
+
+#include <libssh/libssh.h>
+
+#include <sshUtils.h>
+
+// The results of an incremental copy
+enum incrementalSync_result_e {
+  INCREMENTAL_SYNC_OK = 0,
+  INCREMENTAL_SYNC_FAILED,
+  // from is not a directory, so it should be copied as usual
+  INCREMENTAL_SYNC_UNAVAILABLE
+};
+
+/*
+ * An incremental copy lists the whole remote directory with a single find
+ * (so the server needs GNU find), walks the local one, and then only copies
+ * the files that differ.
+ *
+ * A file is left alone if the destination has the same size and:
+ *   - the source and destination are both unchanged since they were last
+ *     synced, according to the manifest, or
+ *   - there is no record of them in the manifest, and the destination is at
+ *     least as new as the source (scp doesn't keep modification times, so
+ *     a copy is always newer than its source), or
+ *   - the compareChecksums option is set, and their MD5 digests match. The
+ *     remote digests are all computed by one md5sum on the server.
+ *
+ * The manifest records what each file looked like on both ends after it
+ * was synced, for each pair of local directory and host:path. It is kept
+ * in $XDG_CACHE_HOME/scp (or ~/.cache/scp). When nothing has changed, the
+ * listing is the only round trip.
+ */
+
+/*
+ * Copies a local directory to the server, skipping the files that the
+ * server already has. The files that are sent go through a single
+ * scp_copyToServerFiltered().
+ *
+ * @param session A session that has already been connected to the server.
+ * @param info The sshInfo that was used to connect the session.
+ * @param from The local directory.
+ * @param to The path on the server, with the same meaning as for scp.
+ *
+ * @return An incrementalSync_result_e.
+ */
+int incrementalSync_copyToServer(ssh_session session, psshInfo info,
+                                 char* from, char* to);
+
+/*
+ * Copies a directory from the server, skipping the files that are already
+ * here. Each file that changed is copied on its own, unless more than half
+ * of them changed, in which case the whole directory is copied again.
+ *
+ * @param session A session that has already been connected to the server.
+ * @param info The sshInfo that was used to connect the session.
+ * @param from The directory on the server.
+ * @param to The local directory. As with scp_copyFromServer(), the copy
+ * is to/<base name of from>, and to is created if it doesn't exist.
+ *
+ * @return An incrementalSync_result_e.
+ */
+int incrementalSync_copyFromServer(ssh_session session, psshInfo info,
+                                   char* from, char* to);
+
+#endif // INCREMENTAL_SYNC_H
@@ -0,0 +1,178 @@
+/**********************************************************************
+  libscp.h - Header file for running copies as jobs from a program that
+             links the scp library
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#ifndef LIBSCP_H
+#define LIBSCP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <progress.h>
+#include <scpOptions.h>
+
+/*
+ * Everything but main.c is built as libscp (static and shared), and the
+ * scp executable is a client of it that runs a single job.
+ *
+ * A pool runs the jobs that are submitted to it on a few threads of its
+ * own, in the order that they were submitted. Each job is a copy like one
+ * run of the executable, with its own options, and it connects with
+ * sessions from a sessionPool (see sessionPool.h), so jobs to the same
+ * host reuse the same session one after another instead of connecting
+ * again. The buffers of the copies are shared through the bufferPool (see
+ * bufferPool.h).
+ *
+ * The callbacks of a job are called on the pool's threads, never two at
+ * once, and its progress callbacks always come before its done callback.
+ * They may submit and cancel jobs, but must not wait for or free the pool.
+ */
+
+// The pool is opaque. See libscp.c for the definition.
+typedef struct libscpPool libscpPool;
+
+typedef libscpPool* plibscpPool;
+
+// The ways that a job can end
+enum libscp_status_e {
+  LIBSCP_OK = 0,
+  LIBSCP_FAILED,
+  // The session to the server couldn't be connected
+  LIBSCP_CONNECT_FAILED,
+  LIBSCP_CANCELED
+};
+
+/*
+ * Called once when a job ends.
+ *
+ * @param jobId What libscp_submit() returned for the job.
+ * @param status A libscp_status_e.
+ * @param userData The userData of the job's callbacks.
+ */
+typedef void (*libscpDoneCallback)(uint64_t jobId, int status,
+                                   void* userData);
+
+/*
+ * Called every LIBSCP_PROGRESS_INTERVAL while a job copies, if it has
+ * copied anything since the last call, and once more just before the done
+ * callback if it has copied anything since then. The snapshot only has
+ * totals if the job's countTotals option is set (see progress.h).
+ *
+ * @param jobId What libscp_submit() returned for the job.
+ * @param progress The job's progress so far. It is only valid during the
+ * call.
+ * @param userData The userData of the job's callbacks.
+ */
+typedef void (*libscpProgressCallback)(uint64_t jobId,
+                                       const progressSnapshot* progress,
+                                       void* userData);
+
+// How often the progress callbacks are called, in milliseconds
+#define LIBSCP_PROGRESS_INTERVAL 100
+
+// What is called back for a job. Either callback may be NULL.
+typedef struct {
+  libscpDoneCallback onDone;
+  libscpProgressCallback onProgress;
+  void* userData;
+} libscpCallbacks;
+
+// A snapshot of a pool's counters
+typedef struct {
+  size_t numQueued;
+  size_t numRunning;
+  size_t numSucceeded;
+  size_t numFailed;
+  size_t numCanceled;
+  // The bytes that every job has copied, including those still running
+  uint64_t bytesCopied;
+  // The sessions that the pool holds, in use or idle, as of the last time
+  // that idle ones were closed (once a second)
+  int numSessions;
+} libscpStats;
+
+/*
+ * Creates a pool and starts its threads. The returned pool must be freed
+ * with libscp_freePool().
+ *
+ * @param numThreads The number of jobs that run at once.
+ * @param idleTimeout The number of seconds a session may go unused before
+ * it is disconnected.
+ * @param canPrompt Set this true to let the jobs prompt on the terminal
+ * for passwords. Otherwise a job that needs one and wasn't given one fails.
+ *
+ * @return A pointer to the new pool. Returns NULL if it couldn't be created.
+ */
+plibscpPool libscp_D_newPool(int numThreads, int idleTimeout, bool canPrompt);
+
+/*
+ * Cancels every job that hasn't ended, waits for them to end and frees the
+ * pool, disconnecting its sessions.
+ *
+ * @param pool The pool to be freed.
+ */
+void libscp_freePool(plibscpPool pool);
+
+/*
+ * Queues a copy.
+ *
+ * @param pool The pool to run it in.
+ * @param from The source, in the same format as on the command line
+ * ([[user@]host:]/path/to/file).
+ * @param to The destination, in the same format.
+ * @param options The options to copy with, which are copied into the job.
+ * The strings that they point to must stay valid until the job ends. The
+ * options that choose something other than a copy (such as batchFile or
+ * runMuxDaemon) are ignored, and so are progress and tracer, since each
+ * job counts its own progress and writes its own trace to its traceFile.
+ * NULL copies with the defaults.
+ * @param callbacks What to call back. May be NULL.
+ *
+ * @return The id of the job, which is never 0. Returns 0 if the job
+ * couldn't be queued, in which case nothing is called back.
+ */
+uint64_t libscp_submit(plibscpPool pool, const char* from, const char* to,
+                       const scpOptions* options,
+                       const libscpCallbacks* callbacks);
+
+/*
+ * Cancels a job. A queued job ends without being started. A running job
+ * stops at the next chunk of a scp or sftp copy or of the event loop, and
+ * its partial files are left as they are. Either way it ends with
+ * LIBSCP_CANCELED.
+ *
+ * @param pool The pool that the job was submitted to.
+ * @param jobId What libscp_submit() returned.
+ *
+ * @return Returns false if the job had already ended.
+ */
+bool libscp_cancel(plibscpPool pool, uint64_t jobId);
+
+/*
+ * Waits until every job that was submitted has ended.
+ *
+ * @param pool The pool.
+ */
+void libscp_wait(plibscpPool pool);
+
+/*
+ * Reads the counters of a pool.
+ *
+ * @param pool The pool.
+ * @param stats Set to the counters.
+ */
+void libscp_getStats(plibscpPool pool, libscpStats* stats);
+
+#endif // LIBSCP_H
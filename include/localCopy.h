@@ -0,0 +1,44 @@
+/**********************************************************************
+  localCopy.h - Header file for copying files and directories when both
+                ends are on the local machine
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#ifndef LOCAL_COPY_H
+#define LOCAL_COPY_H
+
+#include <stdbool.h>
+
+// Trees with at least this many files are copied by several threads
+#define LOCAL_COPY_PARALLEL_MIN_FILES 32
+// The number of threads used for a large tree when --jobs is not given
+#define LOCAL_COPY_DEFAULT_THREADS 4
+
+/*
+ * Copies a file or directory on the local machine, without running a
+ * shell. Like scp, from is copied into to if to is a directory that
+ * exists, and is copied to to otherwise. Directories are copied
+ * recursively.
+ *
+ * The data of each file is copied by the fastest method that works: a
+ * reflink (FICLONE), then copy_file_range(), then sendfile(), and then
+ * read() and write(). The files of a large tree are copied by several
+ * threads at once (numJobs of them if the option is set).
+ *
+ * @param from The path of the file or directory to be copied.
+ * @param to The path to the destination for the copied file or dir.
+ *
+ * @return Returns true if it succeeded and false if it failed
+ */
+bool localCopy_copy(const char* from, const char* to);
+
+#endif // LOCAL_COPY_H
@@ -0,0 +1,89 @@
+/**********************************************************************
+  mux.h - Header file for the mux daemon, which keeps authenticated
+          sessions open so that later copies can skip the ssh handshake
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#ifndef MUX_H
+#define MUX_H
+
+#include <stdbool.h>
+
+#include <sshUtils.h>
+
+// The results of mux_copyFromServer() and mux_copyToServer()
+enum mux_result_e {
+  MUX_OK = 0,
+  // The daemon tried the copy and it failed
+  MUX_FAILED,
+  // The daemon could not be reached or could not connect to the server.
+  // The caller should connect to the server itself instead.
+  MUX_UNAVAILABLE
+};
+
+/*
+ * Runs the mux daemon in the calling process. It listens on a Unix socket
+ * that only the current user may use. Each copy that it is sent is run on
+ * a new channel of a session from a sessionPool (see sessionPool.h), so
+ * only the first copy to each user@host:port pays for the ssh handshake.
+ * Each client is served on a thread of its own, so copies run at once.
+ *
+ * @param idleTime Sessions that have been idle for this many seconds are
+ * closed. The daemon returns once it has no sessions and has been idle this
+ * long.
+ *
+ * @return Returns 0 when the daemon exits normally and -1 if it could not
+ * start (for example, because another daemon is already running).
+ */
+int mux_runDaemon(int idleTime);
+
+/*
+ * Starts the mux daemon in a detached child process if it is not running,
+ * and waits for it to begin listening. It forks, so it must be called
+ * before the process starts any threads (such as those of a libscp pool).
+ *
+ * @param idleTime Passed to mux_runDaemon().
+ *
+ * @return Returns true if the daemon is running.
+ */
+bool mux_startDaemon(int idleTime);
+
+/*
+ * Asks the mux daemon to copy a file/dir from a remote computer to the
+ * local machine with the current scpOptions. The daemon must have been
+ * started with mux_startDaemon(). If it needs a password to connect, the
+ * user is prompted for it here and it is sent to the daemon, unless
+ * info->noPrompt is set, in which case MUX_UNAVAILABLE is returned. If the
+ * traceFile option is set, the daemon writes the trace of the copy.
+ *
+ * @param info The sshInfo for the remote computer.
+ * @param from The path to the file or directory to be copied on the server.
+ * @param to The path to the local destination for the copied file or dir.
+ *
+ * @return Returns a mux_result_e.
+ */
+int mux_copyFromServer(psshInfo info, char* from, char* to);
+
+/*
+ * Asks the mux daemon to copy a file/dir from the local machine to a remote
+ * computer. It behaves the same way as mux_copyFromServer().
+ *
+ * @param info The sshInfo for the remote computer.
+ * @param from The path to the file or directory to be copied on the local
+ * machine.
+ * @param to The path to the remote destination for the copied file or dir.
+ *
+ * @return Returns a mux_result_e.
+ */
+int mux_copyToServer(psshInfo info, char* from, char* to);
+
+#endif // MUX_H
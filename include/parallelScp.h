@@ -0,0 +1,112 @@
+/**********************************************************************
+  parallelScp.h - Header file for the functions that copy a directory
+                  tree or a large file over several ssh sessions
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#ifndef PARALLEL_SCP_H
+#define PARALLEL_SCP_H
+
+#include <libssh/libssh.h>
+
+#include <sshUtils.h>
+
+// The results of parallelScp_copyDirFromServer() and
+// parallelScp_copyDirToServer()
+enum parallel_scp_result_e {
+  PARALLEL_SCP_OK = 0,
+  PARALLEL_SCP_FAILED,
+  // The source is not a directory, or the server has no sftp to list it
+  // with, and it should be copied over a single channel instead
+  PARALLEL_SCP_UNAVAILABLE
+};
+
+/*
+ * Copies a file/dir from a remote computer to a local machine over several
+ * sessions at once, as set by the numJobs and numStripes options.
+ *
+ * For a directory, all of the directories are created first, in order,
+ * and then the files are spread across numJobs threads, each with its own
+ * session. A thread that runs out of files steals them from the others.
+ * A single file that is big enough is split into byte ranges that are
+ * copied over numStripes sessions (see stripe.h). Anything else, or
+ * anything at all if the server has no sftp, is copied with
+ * scp_copyFromServer().
+ *
+ * @param session A session that has already been connected to the server.
+ * It is used by the first thread. The other sessions are opened with info.
+ * @param info The sshInfo that was used to connect the session.
+ * @param from The path to the file or directory to be copied on the server.
+ * @param to The path to the local destination for the copied file or dir.
+ *
+ * @return Returns SSH_OK if it succeeded and SSH_ERROR if it failed
+ */
+int parallelScp_copyFromServer(ssh_session session, psshInfo info,
+                               char* from, char* to);
+
+/*
+ * Copies a file/dir from a local machine to a remote computer over several
+ * sessions at once, as set by the numJobs and numStripes options.
+ *
+ * For a directory, all of the directories are created first, in order,
+ * and then the files are spread across numJobs threads, each with its own
+ * session. A thread that runs out of files steals them from the others.
+ * A single file that is big enough is split into byte ranges that are
+ * copied over numStripes sessions (see stripe.h). Anything else, or
+ * anything at all if the server has no sftp, is copied with
+ * scp_copyToServer().
+ *
+ * @param session A session that has already been connected to the server.
+ * It is used by the first thread. The other sessions are opened with info.
+ * @param info The sshInfo that was used to connect the session.
+ * @param from The path to the file or directory to be copied on the local
+ * machine.
+ * @param to The path to the remote destination for the copied file or dir.
+ *
+ * @return Returns SSH_OK if it succeeded and SSH_ERROR if it failed
+ */
+int parallelScp_copyToServer(ssh_session session, psshInfo info,
+                             char* from, char* to);
+
+/*
+ * Copies a directory from a remote computer to a local machine over
+ * several channels of a single session, as set by the channelsPerSession
+ * option, with the event loop (see eventEngine.h). The directories are
+ * created first, as with parallelScp_copyFromServer(). This is how
+ * scp_copyFromServer() copies a directory when the event loop is on, so
+ * that one key exchange and authentication are enough.
+ *
+ * @param session A session that has already been connected to the server.
+ * @param from The path to the directory to be copied on the server.
+ * @param to The path to the local destination for the copied dir.
+ *
+ * @return A parallel_scp_result_e. Nothing has been copied if it is
+ * PARALLEL_SCP_UNAVAILABLE.
+ */
+int parallelScp_copyDirFromServer(ssh_session session, char* from, char* to);
+
+/*
+ * Copies a directory from a local machine to a remote computer over
+ * several channels of a single session, as set by the channelsPerSession
+ * option, with the event loop (see eventEngine.h). This is how
+ * scp_copyToServer() copies a directory when the event loop is on.
+ *
+ * @param session A session that has already been connected to the server.
+ * @param from The path to the directory to be copied on the local machine.
+ * @param to The path to the remote destination for the copied dir.
+ *
+ * @return A parallel_scp_result_e. Nothing has been copied if it is
+ * PARALLEL_SCP_UNAVAILABLE.
+ */
+int parallelScp_copyDirToServer(ssh_session session, char* from, char* to);
+
+#endif // PARALLEL_SCP_H
@@ -0,0 +1,166 @@
+/**********************************************************************
+  progress.h - Header file for counting the progress of a copy
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libssh/libssh.h>
+
+/*
+ * Each copy that is watched has a progress of its own, which it finds
+ * through its progress option (see scpOptions.h). The copy loops only add
+ * to its counters, and whoever shows it takes snapshots of them with
+ * progress_getSnapshot(): libscp passes them to the progress callbacks of
+ * its jobs (see libscp.h), and the scp executable draws them as a line on
+ * the terminal. Nothing here draws anything.
+ *
+ * The ETA and files left need the totals, which are only counted if the
+ * countTotals option is set (see progress_addLocalTotal() and
+ * progress_addRemoteTotal()). A snapshot only has them once every copy
+ * that the progress covers has been counted, since a partial total would
+ * make them wrong.
+ *
+ * If the progress option is NULL, every function returns at once.
+ *
+ * Each thread has a current file, which progress_update() adds to. Threads
+ * that copy parts of the same file share it with progress_shareFile().
+ */
+
+// The progress of a copy. See progress.c for the definition.
+typedef struct progress progress;
+
+typedef progress* pprogress;
+
+// A file that is being copied. See progress.c for the definition.
+typedef struct progressFile progressFile;
+
+typedef progressFile* pprogressFile;
+
+// Only the end of a long file name is kept
+#define PROGRESS_NAME_SIZE 256
+
+// The counters of a progress at one moment
+typedef struct {
+  uint64_t bytes;
+  size_t filesDone;
+  // The totals are only set if they are known
+  bool isTotalKnown;
+  size_t totalFiles;
+  uint64_t totalBytes;
+  // The file that was begun most recently, if one is being copied
+  bool hasFile;
+  char fileName[PROGRESS_NAME_SIZE];
+  size_t fileSize;
+  size_t fileBytes;
+  // How long ago the file was begun
+  double fileSeconds;
+} progressSnapshot;
+
+/*
+ * Creates a progress for a copy. It must be freed with progress_free().
+ *
+ * @return The progress. Returns NULL if it couldn't be allocated.
+ */
+pprogress progress_D_new();
+
+/*
+ * Frees a progress. Every thread that copied with it must have ended,
+ * except the calling one.
+ *
+ * @param p The progress. May be NULL.
+ */
+void progress_free(pprogress p);
+
+/*
+ * Takes a snapshot of the counters of a progress. It may be called on any
+ * thread while the copy runs.
+ *
+ * @param p The progress.
+ * @param snapshot Set to the counters.
+ */
+void progress_getSnapshot(pprogress p, progressSnapshot* snapshot);
+
+/*
+ * Gets the number of bytes that have been copied, which is cheaper than a
+ * whole snapshot.
+ *
+ * @param p The progress.
+ *
+ * @return The number of bytes.
+ */
+uint64_t progress_getBytes(pprogress p);
+
+/*
+ * Starts counting a file as this thread's current file.
+ *
+ * @param name The name of the file.
+ * @param size The size of the file.
+ *
+ * @return The file, to pass to progress_shareFile(). NULL if nothing is
+ * counted.
+ */
+pprogressFile progress_beginFile(const char* name, size_t size);
+
+/*
+ * Makes a file that another thread began this thread's current file.
+ *
+ * @param file What progress_beginFile() returned.
+ */
+void progress_shareFile(pprogressFile file);
+
+/*
+ * Adds bytes that were copied to this thread's current file (if it has
+ * one) and to the whole copy. This is only an atomic add.
+ *
+ * @param bytes The number of bytes.
+ */
+void progress_update(size_t bytes);
+
+/*
+ * Ends this thread's current file, which counts it as done.
+ */
+void progress_endFile();
+
+/*
+ * Adds to the number of files and bytes that the whole copy is expected to
+ * have, for its ETA.
+ *
+ * @param numFiles The number of files.
+ * @param numBytes The number of bytes.
+ */
+void progress_addTotal(size_t numFiles, size_t numBytes);
+
+/*
+ * Adds the files under a local path to the totals. It does nothing unless
+ * the countTotals option is set, so the tree isn't walked for nothing.
+ *
+ * @param path A local file or directory.
+ */
+void progress_addLocalTotal(const char* path);
+
+/*
+ * Adds the files under a path on the server to the totals, counted by a
+ * single command there. Like progress_addLocalTotal(), it does nothing
+ * unless the countTotals option is set.
+ *
+ * @param session A session that has already been connected to the server.
+ * @param path A file or directory on the server.
+ */
+void progress_addRemoteTotal(ssh_session session, const char* path);
+
+#endif // PROGRESS_H
@@ -0,0 +1,74 @@
+/**********************************************************************
+  readAhead.h - Header file for the read-ahead thread that reads a file
+                from the disk in chunks while the chunks before it are
+                being sent over the network
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#ifndef READ_AHEAD_H
+#define READ_AHEAD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <chunkQueue.h>
+
+// The reader is opaque. See readAhead.c for the definition.
+typedef struct readAhead readAhead;
+
+typedef readAhead* preadAhead;
+
+/*
+ * Starts a thread that reads the file descriptor from its current position
+ * until the end of the file. At most queueDepth chunks of chunkSize bytes
+ * are ever in memory at once. The reader must be stopped with
+ * readAhead_finish(), which also frees it.
+ *
+ * @param fd An open file descriptor to be read. It is not closed.
+ * @param chunkSize The size of each chunk in bytes.
+ * @param queueDepth The number of chunks that may be read ahead.
+ *
+ * @return A pointer to the new reader. Returns NULL if it failed to start.
+ */
+preadAhead readAhead_D_start(int fd, size_t chunkSize, size_t queueDepth);
+
+/*
+ * Obtains the next chunk of the file. Blocks until it has been read. Give it
+ * back with readAhead_release() when finished with it.
+ *
+ * @param reader The reader from which to obtain the chunk.
+ *
+ * @return A pointer to the next chunk. Returns NULL at the end of the file
+ * or if a read error occurred.
+ */
+pchunk readAhead_next(preadAhead reader);
+
+/*
+ * Gives a chunk back to the reader so that it can be refilled.
+ *
+ * @param reader The reader to which the chunk belongs.
+ * @param c The chunk that was obtained with readAhead_next().
+ */
+void readAhead_release(preadAhead reader, pchunk c);
+
+/*
+ * Stops the reader thread, waits for it, and frees the reader. This may be
+ * called before the end of the file is reached to abandon the read.
+ *
+ * @param reader The reader to be stopped and freed.
+ *
+ * @return Returns true if the whole file was read without an error and false
+ * otherwise.
+ */
+bool readAhead_finish(preadAhead reader);
+
+#endif // READ_AHEAD_H
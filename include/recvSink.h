@@ -0,0 +1,111 @@
+/**********************************************************************
+  recvSink.h - Header file for the sink that writes a received file to
+               the disk in large blocks
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#ifndef RECV_SINK_H
+#define RECV_SINK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// The sink is opaque. See recvSink.c for the definition.
+typedef struct recvSink recvSink;
+
+typedef recvSink* precvSink;
+
+/*
+ * Opens a file for receiving. The file is created or truncated, and the
+ * space for it is preallocated so that it is not fragmented as it grows.
+ *
+ * In the default mode, received bytes are gathered in an aligned buffer of
+ * blockSize bytes that is written with pwrite() every time it fills up.
+ * In mmap mode, the whole file is mapped into memory and the received bytes
+ * are read directly into the mapping so no copy is made at all.
+ *
+ * The sink must be closed with recvSink_close(), which also frees it.
+ *
+ * @param path The path of the file to be written.
+ * @param size The number of bytes that will be received.
+ * @param useMmap Set this true to read directly into a mapping of the file.
+ * @param blockSize The size in bytes of each pwrite() in the default mode.
+ *
+ * @return A pointer to the new sink. Returns NULL if the file could not be
+ * opened.
+ */
+precvSink recvSink_D_open(const char* path, size_t size, bool useMmap,
+                          size_t blockSize);
+
+/*
+ * Opens a file to carry on receiving it where an earlier transfer stopped.
+ * It behaves like recvSink_D_open(), except that the first offset bytes of
+ * the file are kept and the received bytes are placed after them.
+ *
+ * @param path The path of the file to be written. It must be at least offset
+ * bytes long if offset is not zero.
+ * @param size The size of the whole file.
+ * @param offset The number of bytes of the file that are already in place.
+ * @param useMmap Set this true to read directly into a mapping of the file.
+ * @param blockSize The size in bytes of each pwrite() in the default mode.
+ *
+ * @return A pointer to the new sink. Returns NULL if the file could not be
+ * opened.
+ */
+precvSink recvSink_D_openAt(const char* path, size_t size, size_t offset,
+                            bool useMmap, size_t blockSize);
+
+/*
+ * Returns the location where the next received bytes must be placed.
+ * After placing them there, call recvSink_commit() with how many were placed.
+ *
+ * @param sink The sink to be written to.
+ * @param len Is set to the number of bytes that may be placed at the
+ * returned location. This is never more than the bytes left in the file.
+ *
+ * @return A pointer to the location for the next bytes.
+ */
+char* recvSink_getBuffer(precvSink sink, size_t* len);
+
+/*
+ * Tells the sink that bytes have been placed at the location given by
+ * recvSink_getBuffer(). The sink writes them to the disk when it has a
+ * full block.
+ *
+ * @param sink The sink that was written to.
+ * @param len The number of bytes that were placed.
+ *
+ * @return Returns true if it succeeded and false if a write failed.
+ */
+bool recvSink_commit(precvSink sink, size_t len);
+
+/*
+ * Writes any bytes that are still buffered and waits for everything that
+ * has been committed to reach the disk.
+ *
+ * @param sink The sink to be synced.
+ *
+ * @return Returns true if it succeeded and false if a write failed.
+ */
+bool recvSink_sync(precvSink sink);
+
+/*
+ * Writes any bytes that are still buffered, sets the length of the file to
+ * the number of bytes that were received, and closes and frees the sink.
+ *
+ * @param sink The sink to be closed.
+ *
+ * @return Returns true if every byte was written and false otherwise.
+ */
+bool recvSink_close(precvSink sink);
+
+#endif // RECV_SINK_H
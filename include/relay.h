@@ -0,0 +1,42 @@
+/**********************************************************************
+  relay.h - Header file for copying from one remote computer to another
+            without going through the local disk
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <libssh/libssh.h>
+
+/*
+ * Copies a file/dir from one remote computer to another. Everything that
+ * is read from the source's scp channel is written to the destination's
+ * scp channel, and directories are recreated as they are read. Nothing
+ * is written to the local disk.
+ *
+ * Large files are relayed through a chunkQueue (see chunkQueue.h): one
+ * thread reads chunks from the source while the calling thread writes the
+ * previous chunks to the destination.
+ *
+ * @param fromSession A session that has been connected to the source.
+ * @param from The path to the file or directory on the source.
+ * @param toSession A session that has been connected to the destination.
+ * It must not be the same session as fromSession.
+ * @param to The path to the destination for the copied file or dir.
+ *
+ * @return Returns SSH_OK if it succeeded and SSH_ERROR if it failed
+ */
+int relay_copy(ssh_session fromSession, char* from,
+               ssh_session toSession, char* to);
+
+#endif // RELAY_H
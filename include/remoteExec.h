@@ -0,0 +1,100 @@
+/**********************************************************************
+  remoteExec.h - Header file for running commands on the remote computer
+                 over an exec channel
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#ifndef REMOTE_EXEC_H
+#define REMOTE_EXEC_H
+
+#include <libssh/libssh.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Quotes an argument for the remote shell, so that it is passed to the
+ * command as it is no matter which characters it contains.
+ *
+ * @param arg The argument to be quoted.
+ * @param out The buffer to write the quoted argument into.
+ * @param outSize The size of out.
+ *
+ * @return Returns true if the quoted argument fit in out and false
+ * otherwise.
+ */
+bool remoteExec_quote(const char* arg, char* out, size_t outSize);
+
+/*
+ * Opens a channel on a session and starts a command in it. What is written
+ * to the channel is the command's stdin, and what is read from it is the
+ * command's stdout. The channel must be closed with remoteExec_close().
+ *
+ * @param session A session that has already been connected to the server.
+ * @param command The command to be run by the remote shell.
+ *
+ * @return The channel. Returns NULL if it failed.
+ */
+ssh_channel remoteExec_D_open(ssh_session session, const char* command);
+
+/*
+ * Copies whatever the command has written to its stderr to our stderr,
+ * without waiting for more. A command whose stderr is never read may stop
+ * once the channel's window is full.
+ *
+ * @param channel A channel opened with remoteExec_D_open().
+ */
+void remoteExec_forwardStderr(ssh_channel channel);
+
+/*
+ * Tells the command that its stdin is finished, waits for it to exit and
+ * frees the channel. Anything left on its stdout is discarded.
+ *
+ * @param channel A channel opened with remoteExec_D_open().
+ *
+ * @return The exit status of the command. Returns -1 if it is not known.
+ */
+int remoteExec_close(ssh_channel channel);
+
+/*
+ * Runs a command and reads everything it writes to its stdout.
+ *
+ * @param session A session that has already been connected to the server.
+ * @param command The command to be run by the remote shell.
+ * @param outputLen If this is not NULL, it is set to the number of bytes
+ * that were read. The output itself is also NUL terminated.
+ *
+ * @return The output, which must be freed. Returns NULL if the command
+ * could not be run or exited with a status other than 0.
+ */
+char* remoteExec_D_run(ssh_session session, const char* command,
+                       size_t* outputLen);
+
+/*
+ * Runs a command, writes input to its stdin and reads everything it writes
+ * to its stdout. The output is read while the input is written, so the
+ * input may be as large as needed.
+ *
+ * @param session A session that has already been connected to the server.
+ * @param command The command to be run by the remote shell.
+ * @param input The bytes for the command's stdin.
+ * @param inputLen The number of bytes in input.
+ * @param outputLen If this is not NULL, it is set to the number of bytes
+ * that were read. The output itself is also NUL terminated.
+ *
+ * @return The output, which must be freed. Returns NULL if the command
+ * could not be run or exited with a status other than 0.
+ */
+char* remoteExec_D_runWithInput(ssh_session session, const char* command,
+                                const char* input, size_t inputLen,
+                                size_t* outputLen);
+
+#endif // REMOTE_EXEC_H
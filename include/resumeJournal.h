@@ -0,0 +1,135 @@
+/**********************************************************************
+  resumeJournal.h - Header file for the journal that lets an interrupted
+                    copy carry on where it stopped
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#ifndef RESUME_JOURNAL_H
+#define RESUME_JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <fileSystemUtils.h>
+#include <sshUtils.h>
+
+// A file is written to its destination with this appended, and only renamed
+// to the destination once all of it is there
+#define RESUME_PART_SUFFIX ".part"
+// The progress of a large file is recorded each time this many more bytes
+// of it have been written
+#define RESUME_CHECKPOINT_SIZE (64 * 1024 * 1024)
+
+/*
+ * The journal of a copy records which files have been copied, and how much
+ * of a file that was being copied is safely in its part file. If the copy
+ * fails, running it again skips the files that were copied and carries on
+ * with the part files from their last checkpoint.
+ *
+ * A copy is identified by its direction, host, working directory, from and
+ * to, so the same command has to be run again. Its journal is kept in
+ * $XDG_CACHE_HOME/scp (or ~/.cache/scp) and removed once the copy succeeds.
+ * Everything is recorded with the size and modification time of the source,
+ * and is ignored if the source has changed since.
+ */
+
+// The journal is opaque. See resumeJournal.c for the definition.
+typedef struct resumeJournal resumeJournal;
+
+typedef resumeJournal* presumeJournal;
+
+/*
+ * Opens the journal of a copy, reading what an earlier run of it recorded.
+ * It must be closed with resumeJournal_close().
+ *
+ * @param info The sshInfo of the remote end.
+ * @param isUpload Set this true if the copy is to the server.
+ * @param from The path that is copied from.
+ * @param to The path that is copied to.
+ *
+ * @return The journal. Returns NULL if it could not be opened.
+ */
+presumeJournal resumeJournal_D_open(psshInfo info, bool isUpload,
+                                    const char* from, const char* to);
+
+/*
+ * Looks up what an earlier run recorded about a file. The caller should
+ * check that the destination (or part file) is still there before trusting
+ * it.
+ *
+ * @param journal The journal of the copy.
+ * @param dest The destination of the file.
+ * @param src The metadata of the source of the file.
+ * @param isDone Is set to true if the file was copied completely.
+ *
+ * @return The number of bytes of the part file that were written and synced.
+ * It is zero if nothing is known about the file.
+ */
+size_t resumeJournal_getOffset(presumeJournal journal, const char* dest,
+                               const fileMeta* src, bool* isDone);
+
+/*
+ * Records that the first offset bytes of a file's part file are on the disk.
+ *
+ * @param journal The journal of the copy.
+ * @param dest The destination of the file.
+ * @param src The metadata of the source of the file.
+ * @param offset The number of bytes that have been written and synced.
+ *
+ * @return Returns true if the record was written and false otherwise.
+ */
+bool resumeJournal_recordOffset(presumeJournal journal, const char* dest,
+                                const fileMeta* src, size_t offset);
+
+/*
+ * Records that a file has been copied and renamed to its destination.
+ *
+ * @param journal The journal of the copy.
+ * @param dest The destination of the file.
+ * @param src The metadata of the source of the file.
+ *
+ * @return Returns true if the record was written and false otherwise.
+ */
+bool resumeJournal_recordDone(presumeJournal journal, const char* dest,
+                              const fileMeta* src);
+
+/*
+ * Returns the destination that an earlier run of the copy resolved to.
+ * Whether "to" names the copy or a directory to copy into changes once the
+ * copy has created it, so a resumed copy must use the same one.
+ *
+ * @param journal The journal of the copy.
+ *
+ * @return The destination, or NULL if none was recorded.
+ */
+const char* resumeJournal_getRoot(presumeJournal journal);
+
+/*
+ * Records the destination that the copy resolved to.
+ *
+ * @param journal The journal of the copy.
+ * @param root The destination.
+ *
+ * @return Returns true if the record was written and false otherwise.
+ */
+bool resumeJournal_recordRoot(presumeJournal journal, const char* root);
+
+/*
+ * Closes and frees the journal.
+ *
+ * @param journal The journal to be closed.
+ * @param isFinished Set this true if the whole copy succeeded, so that the
+ * journal is removed.
+ */
+void resumeJournal_close(presumeJournal journal, bool isFinished);
+
+#endif // RESUME_JOURNAL_H
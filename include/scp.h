@@ -19,12 +19,47 @@
 #include <stdbool.h>
 #include <linux/limits.h>
 
+#include <chunkSizer.h>
+#include <fileSystemUtils.h>
+#include <scpOptions.h>
+#include <verify.h>
+
+/*
+ * Decides whether a file or directory in a directory that is being copied
+ * to the server is sent. A directory that is skipped is skipped along with
+ * everything in it.
+ *
+ * @param relPath The path of the file relative to the top of the copy.
+ * @param meta What was read when the file was stat'ed.
+ * @param userData The filterData that was passed to
+ * scp_copyToServerFiltered().
+ *
+ * @return Returns true if the file is to be sent.
+ */
+typedef bool (*scpFilter)(const char* relPath, const fileMeta* meta,
+                          void* userData);
+
 // A helper struct that contains scp info
 typedef struct {
   ssh_session session;
   ssh_scp scp;
   char from[PATH_MAX];
   bool isRecursive;
+  pscpOptions options;
+  // Only used when copying to the server. May be NULL.
+  scpFilter filter;
+  void* filterData;
+  // Checks the copied files in verify mode (see verify.h). May be NULL.
+  pverifier verifier;
+  // When copying from the server, the remote path of the directory that is
+  // being received (empty at the top). When copying to the server, the
+  // remote path of the top of the copy. Only kept for the verifier.
+  char remotePath[PATH_MAX];
+  // Sizes the reads from the channel. Only used when copying from the
+  // server.
+  chunkSizer readSizer;
+  // Sizes the writes to the channel. Only used when copying to the server.
+  chunkSizer writeSizer;
 } scpInfo;
 
 // The pointer to be passed around
@@ -38,6 +73,12 @@ typedef scpInfo* pscpInfo;
  * @param to The path to the local destination for the copied file or dir.
  * @param isRecursive Set this false if you do not want directories to be copied
  *
+ * If the sftp backend is selected in scpOptions, this is done with
+ * sftpTransfer_copyFromServer() instead.
+ * If the event loop is on in scpOptions, the files of a directory are
+ * copied over several channels of the session at once with
+ * parallelScp_copyDirFromServer().
+ *
  * @return Returns SSH_OK if it succeeded and something else if it failed
  * (potentially SSH_ERROR)
  */
@@ -53,6 +94,12 @@ int scp_copyFromServer(ssh_session session, char* from,
  * @param to The path to the remote destination for the copied file or dir.
  * @param isRecursive Set this false if you do not want directories to be copied
  *
+ * If the sftp backend is selected in scpOptions, this is done with
+ * sftpTransfer_copyToServer() instead.
+ * If the event loop is on in scpOptions, the files of a directory are
+ * copied over several channels of the session at once with
+ * parallelScp_copyDirToServer().
+ *
  * @return Returns SSH_OK if it succeeded and something else if it failed
  * (potentially SSH_ERROR)
  */
@@ -60,6 +107,77 @@ int scp_copyFromServer(ssh_session session, char* from,
 int scp_copyToServer(ssh_session session, char* from,
                      char* to, bool isRecursive);
 
+/*
+ * Same as scp_copyToServer(), except that only the files and directories
+ * that filter returns true for are sent. It always uses scp, whatever
+ * backend is selected in scpOptions.
+ *
+ * @param session A session that has already been connected to the server.
+ * @param from The path to the local file or directory.
+ * @param to The path to the remote destination for the copied file or dir.
+ * @param isRecursive Set this false if you do not want directories to be copied
+ * @param filter Called for everything inside from. May be NULL.
+ * @param filterData Passed to filter.
+ *
+ * @return Returns SSH_OK if it succeeded and something else if it failed
+ * (potentially SSH_ERROR)
+ */
+int scp_copyToServerFiltered(ssh_session session, char* from, char* to,
+                             bool isRecursive, scpFilter filter,
+                             void* filterData);
+
+/*
+ * A lane copies many files one after another over one session. For
+ * uploads it is a single recursive "scp -t" at the top of the remote tree,
+ * which moves into the directory of each file as it is sent, so that each
+ * file doesn't need a channel and a remote scp of its own. For downloads an
+ * "scp -f" can only send the path that it was started with, so the lane
+ * opens an scp for each file in turn, and the files share its verifier and
+ * read sizer.
+ */
+typedef struct scpLane scpLane;
+
+typedef scpLane* pscpLane;
+
+/*
+ * Opens a lane. Its files are checked in verify mode when it is closed.
+ *
+ * @param session A session that has already been connected to the server.
+ * @param remoteRoot For uploads, the remote directory that every file is
+ * copied into or below. It must exist. Not used for downloads.
+ * @param isDownload Set this true to copy from the server.
+ *
+ * @return The lane, to be closed with scp_closeLane(). Returns NULL if it
+ * could not be opened.
+ */
+pscpLane scp_D_openLane(ssh_session session, const char* remoteRoot,
+                        bool isDownload);
+
+/*
+ * Copies a single file down a lane. If it fails, the lane can't be used
+ * for any more files.
+ *
+ * @param lane The lane.
+ * @param from For uploads, the local file. For downloads, the remote one.
+ * @param to For uploads, the remote directory to copy the file into, at or
+ * below the lane's remoteRoot. For downloads, the local file.
+ *
+ * @return Returns true if the file was copied.
+ */
+bool scp_laneCopy(pscpLane lane, char* from, char* to);
+
+/*
+ * Closes a lane.
+ *
+ * @param lane The lane.
+ * @param success Set this false if a copy failed, so that the files aren't
+ * checked.
+ *
+ * @return Returns true if success was true and, in verify mode, every file
+ * matched.
+ */
+bool scp_closeLane(pscpLane lane, bool success);
+
 // Disable doxygen parsing
 /// \cond
 
@@ -93,18 +211,29 @@ static bool _scp_handlePullRequest(pscpInfo scp_info, const char* destination,
  * Function called to copy a file to a server from a specific location.
  * The reason scp_info->from is not used is because the "from" location
  * may need to change in the case that it is recursive.
+ * from is opened relative to dirFd (which may be AT_FDCWD), and meta is
+ * what was read when it was stat'ed. relPath is its path relative to the
+ * top of the copy (empty for the top), for scp_info->verifier.
  *
  */
-static bool _scp_copyFileToServer(pscpInfo scp_info, const char* from);
+static bool _scp_copyFileToServer(pscpInfo scp_info, int dirFd,
+                                  const char* from, const fileMeta* meta,
+                                  const char* relPath);
 
 /*
  * Function called to copy a dir to a server from a specific location.
  * The reason scp_info->from is not used is because the "from" location
  * may need to change in the case that it is recursive.
  * This function will be called recursively for directories inside directories.
+ * from is opened relative to dirFd (which may be AT_FDCWD), and meta is
+ * what was read when it was stat'ed. relPath is its path relative to the
+ * top of the copy (empty for the top), for scp_info->filter and
+ * scp_info->verifier.
  *
  */
-static bool _scp_copyDirToServer(pscpInfo scp_info, const char* from);
+static bool _scp_copyDirToServer(pscpInfo scp_info, int dirFd,
+                                 const char* from, const fileMeta* meta,
+                                 const char* relPath);
 
 // Resume doxygen parsing
 /// \endcond
@@ -0,0 +1,209 @@
+/**********************************************************************
+  scpOptions.h - Header file for the options that tune how the scp
+                 functions perform a transfer
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#ifndef SCP_OPTIONS_H
+#define SCP_OPTIONS_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// Files are read from and written to the disk in chunks of this size...
+#define DEFAULT_CHUNK_SIZE (1024 * 1024)
+// ...and at most this many chunks are read ahead of the network for uploads
+#define DEFAULT_QUEUE_DEPTH 4
+// The sftp backend keeps this many requests in flight at once
+#define DEFAULT_PIPELINE_DEPTH 64
+// The mux daemon exits after it has been idle for this many seconds
+#define DEFAULT_MUX_IDLE_TIME 600
+// Files smaller than this are sent through the tar stream (see tarStream.h)
+#define DEFAULT_TAR_THRESHOLD (1 << 20)
+// The zstd level that the tar stream is compressed with
+#define DEFAULT_COMPRESS_LEVEL 1
+// The event loop opens at most this many channels on each session. OpenSSH
+// allows 10 by default (MaxSessions).
+#define DEFAULT_CHANNELS_PER_SESSION 8
+
+// The protocols that files may be transferred with
+enum scp_backend_e {
+  SCP_BACKEND_SCP = 0,
+  SCP_BACKEND_SFTP
+};
+
+// Struct that contains the options for a transfer
+typedef struct {
+  size_t chunkSize;
+  size_t queueDepth;
+  // Downloads are received directly into a memory mapping of the file
+  bool useMmap;
+  // The number of sessions to copy a directory tree over at once
+  int numJobs;
+  // The number of sessions to split a single large file over
+  int numStripes;
+  // A scp_backend_e
+  int backend;
+  // The number of sftp requests to keep in flight at once
+  size_t pipelineDepth;
+  // Copy through the mux daemon (see mux.h), starting it if needed
+  bool useMux;
+  // Run as the mux daemon instead of copying anything
+  bool runMuxDaemon;
+  // The number of seconds the mux daemon keeps idle sessions open
+  int muxIdleTime;
+  // Run the copies listed in this manifest ("-" for stdin) instead
+  const char* batchFile;
+  // Write the result of each copy in the manifest to this file
+  const char* batchResultsFile;
+  // The number of threads that stat the entries of a large directory
+  int statThreads;
+  // Copy directory trees as one tar stream over an exec channel
+  bool useTar;
+  // Only files smaller than this many bytes go through the tar stream
+  size_t tarThreshold;
+  // Compress the tar stream with zstd, or if this was built without zstd,
+  // turn on the ssh connection's compression
+  bool compress;
+  int compressLevel;
+  // The path of this program on the server. Setting it sends large files
+  // that the other end has an old copy of as deltas (see delta.h).
+  const char* deltaHelper;
+  // Run as the helper on the server instead of copying anything
+  bool deltaReceive;
+  bool deltaSend;
+  // Skip the files of a directory that the destination already has (see
+  // incrementalSync.h)...
+  bool incremental;
+  // ...comparing MD5 digests where the sizes match but nothing else tells
+  bool compareChecksums;
+  // Copy over sftp with a journal, so that a copy that failed carries on
+  // where it stopped when it is run again (see resumeJournal.h)
+  bool resume;
+  // Hash each file as it is copied and check it against the server's copy
+  // once the copy is finished (see verify.h)
+  bool verify;
+  // Run as the hashing helper on the server instead of copying anything
+  bool verifyHash;
+  // The ciphers and MACs to offer the server, separated by commas. If they
+  // are NULL, the fastest ones on this machine are offered first (see
+  // cipherProbe.h).
+  const char* ciphers;
+  const char* macs;
+  // Print the results of the cipher probe instead of copying anything
+  bool printCipherProbe;
+  // Time each phase of the copy and write them to this file as Chrome trace
+  // events (see trace.h). NULL turns it off.
+  const char* traceFile;
+  // Copy the files of a directory with the event loop, which runs many
+  // channels on each session in one thread (see eventEngine.h)
+  bool useEventLoop;
+  // The most channels that the event loop opens on each session
+  int channelsPerSession;
+  // The progress that the copy counts into (see progress.h), and the
+  // tracer that it times its phases with (see trace.h). Either may be NULL,
+  // which turns it off. libscp sets both for each of its jobs, and the scp
+  // executable for its one copy.
+  struct progress* progress;
+  struct tracer* tracer;
+  // Count the files and bytes of each copy before it starts, so that the
+  // progress has totals to give an ETA with
+  bool countTotals;
+  // Set by libscp for each of its jobs (see libscp.h), and NULL otherwise.
+  // The copy stops at its next chunk once it is set.
+  bool* jobCanceled;
+} scpOptions;
+
+typedef scpOptions* pscpOptions;
+
+/*
+ * Sets every member of an scpOptions struct to its default value.
+ *
+ * @param options A pointer to the scpOptions struct to be set.
+ */
+void scpOptions_setDefaults(pscpOptions options);
+
+/*
+ * Returns the options that are used by the scp functions. These are the
+ * calling thread's own, if it was given some with scpOptions_setForThread(),
+ * and otherwise the global ones, which are set to the defaults until they
+ * are changed.
+ *
+ * @return A pointer to the options used by the scp functions.
+ */
+pscpOptions scpOptions_get();
+
+/*
+ * Makes scpOptions_get() return options on the calling thread, and on the
+ * threads that it starts with scpOptions_startThread(). This lets several
+ * copies with different options run at once.
+ *
+ * @param options The options, which must outlive their use on the thread.
+ * NULL goes back to the global options.
+ */
+void scpOptions_setForThread(pscpOptions options);
+
+/*
+ * Starts a thread like pthread_create() does, with the calling thread's
+ * options (see scpOptions_setForThread()). Every thread that a copy starts
+ * is started with this.
+ *
+ * @param thread Set to the thread that was started.
+ * @param run The function that the thread runs.
+ * @param arg Passed to run.
+ *
+ * @return 0 if the thread was started, and an error number otherwise.
+ */
+int scpOptions_startThread(pthread_t* thread, void* (*run)(void*), void* arg);
+
+/*
+ * Checks whether the copy that the calling thread runs was canceled (see
+ * the jobCanceled option).
+ *
+ * @return Returns true if the copy should stop.
+ */
+bool scpOptions_isCanceled();
+
+/*
+ * Checks that the options can be used together, printing what is wrong if
+ * they can't. The tar stream and the event loop don't hash the files that
+ * they copy, so --verify can't be combined with them.
+ *
+ * @param options The options to check.
+ *
+ * @return Returns true if the options can be used together.
+ */
+bool scpOptions_check(const scpOptions* options);
+
+/*
+ * Reads the command line options (everything before <from> and <to>) into
+ * an scpOptions struct.
+ *
+ * @param argc The argc that was passed to main()
+ * @param argv The argv that was passed to main()
+ * @param options A pointer to an scpOptions struct whose members will be set.
+ *
+ * @return Returns the index in argv of the first argument that is not an
+ * option. Returns -1 if an option could not be read.
+ */
+int scpOptions_parseArgs(int argc, char* argv[], pscpOptions options);
+
+/*
+ * Prints the usage statement, including all of the options, to a stream.
+ *
+ * @param stream The stream to print to (i. e., stdout or stderr)
+ */
+void scpOptions_printUsage(FILE* stream);
+
+#endif // SCP_OPTIONS_H
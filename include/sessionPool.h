@@ -0,0 +1,84 @@
+/**********************************************************************
+  sessionPool.h - Header file for a pool of connected ssh sessions that
+                  are kept open so they can be reused
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#ifndef SESSION_POOL_H
+#define SESSION_POOL_H
+
+#include <libssh/libssh.h>
+#include <stdbool.h>
+
+#include <sshUtils.h>
+
+// The pool is opaque. See sessionPool.c for the definition.
+typedef struct sessionPool sessionPool;
+
+typedef sessionPool* psessionPool;
+
+/*
+ * Creates a new, empty pool. The returned pool must be freed with
+ * sessionPool_free().
+ *
+ * @param idleTimeout The number of seconds a session may go unused before
+ * sessionPool_closeIdle() disconnects it.
+ *
+ * @return A pointer to the new pool. Returns NULL if allocation failed.
+ */
+psessionPool sessionPool_D_new(int idleTimeout);
+
+/*
+ * Disconnects every session in the pool and frees it. None of the sessions
+ * may be in use.
+ *
+ * @param pool The pool to be freed.
+ */
+void sessionPool_free(psessionPool pool);
+
+/*
+ * Obtains a connected session for the user, host and port in info. An idle
+ * session to the same place is reused if there is one. Otherwise a new one
+ * is connected with connectSSH_getConnectedSession(). The session belongs to
+ * the caller until it is given back with sessionPool_release(), so it may
+ * be used without any locking.
+ *
+ * @param pool The pool from which to obtain the session.
+ * @param info The sshInfo for the remote location.
+ *
+ * @return A connected session. Returns NULL if a new session was needed and
+ * it could not be connected.
+ */
+ssh_session sessionPool_acquire(psessionPool pool, psshInfo info);
+
+/*
+ * Gives a session back to the pool so that it may be reused.
+ *
+ * @param pool The pool from which the session was obtained.
+ * @param session The session that was obtained with sessionPool_acquire().
+ * @param reusable Set this false if an error occurred that may have left the
+ * session in a bad state. It will then be disconnected instead of reused.
+ */
+void sessionPool_release(psessionPool pool, ssh_session session,
+                         bool reusable);
+
+/*
+ * Disconnects every session that has not been used for longer than the
+ * idle timeout of the pool.
+ *
+ * @param pool The pool to be cleaned up.
+ *
+ * @return The number of sessions that are still in the pool.
+ */
+int sessionPool_closeIdle(psessionPool pool);
+
+#endif // SESSION_POOL_H
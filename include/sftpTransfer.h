@@ -0,0 +1,138 @@
+/**********************************************************************
+  sftpTransfer.h - Header file for the sftp transfer backend, which keeps
+                   many read or write requests in flight at once
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#ifndef SFTP_TRANSFER_H
+#define SFTP_TRANSFER_H
+
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <resumeJournal.h>
+#include <verify.h>
+
+// The size of each sftp read or write request. Every server must accept
+// requests of this size.
+#define SFTP_REQUEST_SIZE 32768
+
+/*
+ * The function called by sftpTransfer_readRange() with the data that has
+ * been read. It is called in order of increasing offset.
+ *
+ * @param data The data that was read.
+ * @param len The number of bytes in data.
+ * @param offset The offset in the remote file of the first byte of data.
+ * @param userData The userData that was passed to sftpTransfer_readRange()
+ *
+ * @return Return true to continue and false to stop with an error.
+ */
+typedef bool (*sftpTransfer_dataCallback)(const char* data, size_t len,
+                                          size_t offset, void* userData);
+
+/*
+ * Reads a range of a remote file with up to pipelineDepth read requests in
+ * flight at once (see scpOptions.h), so the transfer is not stalled by a
+ * round trip for every request.
+ *
+ * @param file A remote file that has been opened for reading.
+ * @param offset The offset of the first byte to be read.
+ * @param length The number of bytes to be read.
+ * @param callback The function that receives the data as it arrives.
+ * @param userData A pointer that is passed to every call of callback.
+ *
+ * @return Returns true if the whole range was read and false otherwise.
+ */
+bool sftpTransfer_readRange(sftp_file file, size_t offset, size_t length,
+                            sftpTransfer_dataCallback callback,
+                            void* userData);
+
+/*
+ * Writes a range of a local file to the same range of a remote file with up
+ * to pipelineDepth write requests in flight at once (see scpOptions.h).
+ *
+ * @param file A remote file that has been opened for writing.
+ * @param fd A local file that has been opened for reading.
+ * @param offset The offset of the first byte to be written.
+ * @param length The number of bytes to be written.
+ * @param verifier If it isn't NULL, the bytes are added to the hash of its
+ * current file as they are read (see verify.h).
+ *
+ * @return Returns true if the whole range was written and false otherwise.
+ */
+bool sftpTransfer_writeRange(sftp_file file, int fd, size_t offset,
+                             size_t length, pverifier verifier);
+
+/*
+ * The sftp version of scp_copyFromServer(). It behaves the same way.
+ *
+ * @param session A session that has already been connected to the server.
+ * @param from The path to the file or directory to be copied on the server.
+ * @param to The path to the local destination for the copied file or dir.
+ * @param isRecursive Set this false if you do not want directories to be copied
+ *
+ * @return Returns SSH_OK if it succeeded and SSH_ERROR if it failed
+ */
+int sftpTransfer_copyFromServer(ssh_session session, char* from,
+                                char* to, bool isRecursive);
+
+/*
+ * The sftp version of scp_copyToServer(). It behaves the same way.
+ *
+ * @param session A session that has already been connected to the server.
+ * @param from The path to the file or directory to be copied on the local
+ * machine.
+ * @param to The path to the remote destination for the copied file or dir.
+ * @param isRecursive Set this false if you do not want directories to be copied
+ *
+ * @return Returns SSH_OK if it succeeded and SSH_ERROR if it failed
+ */
+int sftpTransfer_copyToServer(ssh_session session, char* from,
+                              char* to, bool isRecursive);
+
+/*
+ * A resumable sftpTransfer_copyFromServer(). Each file is written to a part
+ * file that is renamed when it is complete, and its progress is recorded in
+ * the journal. Files that the journal says were copied are skipped, and part
+ * files carry on from their last checkpoint with a ranged read.
+ *
+ * @param session A session that has already been connected to the server.
+ * @param journal The journal of the copy (see resumeJournal.h).
+ * @param from The path to the file or directory to be copied on the server.
+ * @param to The path to the local destination for the copied file or dir.
+ * @param isRecursive Set this false if you do not want directories to be copied
+ *
+ * @return Returns SSH_OK if it succeeded and SSH_ERROR if it failed
+ */
+int sftpTransfer_resumeFromServer(ssh_session session, presumeJournal journal,
+                                  char* from, char* to, bool isRecursive);
+
+/*
+ * A resumable sftpTransfer_copyToServer(). It works like
+ * sftpTransfer_resumeFromServer(), with the part files on the server.
+ *
+ * @param session A session that has already been connected to the server.
+ * @param journal The journal of the copy (see resumeJournal.h).
+ * @param from The path to the file or directory to be copied on the local
+ * machine.
+ * @param to The path to the remote destination for the copied file or dir.
+ * @param isRecursive Set this false if you do not want directories to be copied
+ *
+ * @return Returns SSH_OK if it succeeded and SSH_ERROR if it failed
+ */
+int sftpTransfer_resumeToServer(ssh_session session, presumeJournal journal,
+                                char* from, char* to, bool isRecursive);
+
+#endif // SFTP_TRANSFER_H
@@ -0,0 +1,89 @@
+/**********************************************************************
+  sftpUtils.h - Header file for some sftp utility functions that are used
+                to inspect and prepare the remote file system
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#ifndef SFTP_UTILS_H
+#define SFTP_UTILS_H
+
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+#include <stdbool.h>
+
+#include <fileSystemUtils.h>
+
+/*
+ * Opens and initializes an sftp session on a connected ssh session.
+ * The returned sftp session must be freed with sftp_free().
+ *
+ * @param session A session that has already been connected to the server.
+ *
+ * @return The new sftp session. Returns NULL if it failed.
+ */
+sftp_session sftpUtils_D_openSession(ssh_session session);
+
+/*
+ * Discovers and returns the type of a remote file. Symbolic links are
+ * followed, as they are by scp.
+ *
+ * @param sftp An sftp session that has already been initialized.
+ * @param path The path to the remote file to be investigated.
+ * @param size If this is not NULL, it is set to the size of the file.
+ *
+ * @return Returns an identify_file_type_e enum with the type of file.
+ */
+int sftpUtils_getFileType(sftp_session sftp, const char* path, size_t* size);
+
+/*
+ * The sftp version of fileSystemUtils_getMeta(). Symbolic links are followed.
+ *
+ * @param sftp An sftp session that has already been initialized.
+ * @param path The path to the remote file to be investigated.
+ * @param meta A pointer to the fileMeta to be filled in. If the file could
+ * not be stat'ed, only its type is set (to DOES_NOT_EXIST or READ_ERROR).
+ *
+ * @return Returns true if the file was stat'ed and false otherwise.
+ */
+bool sftpUtils_getMeta(sftp_session sftp, const char* path, pfileMeta meta);
+
+/*
+ * Makes a remote directory if one does not already exist.
+ *
+ * @param sftp An sftp session that has already been initialized.
+ * @param path The path of the remote directory to be created.
+ * @param permissions The permissions for the directory if it is created.
+ *
+ * @return Returns true if the directory exists when this returns and false
+ * otherwise.
+ */
+bool sftpUtils_mkdirIfNeeded(sftp_session sftp, const char* path,
+                             int permissions);
+
+/*
+ * Walks a remote directory tree and calls a function for every file and
+ * directory in it, including the root. It behaves the same way as
+ * fileSystemUtils_walkTree() so the same callback may be used for both.
+ *
+ * @param sftp An sftp session that has already been initialized.
+ * @param root The path of the remote directory to walk.
+ * @param callback The function to call for every file and directory.
+ * @param userData A pointer that is passed to every call of callback.
+ *
+ * @return Returns true if the whole tree was walked and false if an error
+ * occurred or callback returned false.
+ */
+bool sftpUtils_walkTree(sftp_session sftp, const char* root,
+                        fileSystemUtils_walkCallback callback,
+                        void* userData);
+
+#endif // SFTP_UTILS_H
@@ -30,6 +30,8 @@ typedef struct {
   char pass[PASS_SIZE];
   int port;
   bool isLocal;
+  // Fail instead of prompting if a password is needed and pass is empty
+  bool noPrompt;
 } sshInfo;
 
 typedef sshInfo* psshInfo;
@@ -56,6 +58,6 @@ bool sshUtils_fileIsLocal(const char* path);
  * @return Returns true if the read was successful and false if the read
  * failed.
  */
-bool sshUtils_setSCPInfo(char* input, psshInfo info);
+bool sshUtils_setSSHInfo(char* input, psshInfo info);
 
 #endif
@@ -0,0 +1,78 @@
+/**********************************************************************
+  stripe.h - Header file for the functions that copy a single large file
+             as byte ranges over several ssh sessions at once
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#ifndef STRIPE_H
+#define STRIPE_H
+
+#include <libssh/libssh.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <sshUtils.h>
+
+// Files smaller than this many bytes per stripe are not worth striping
+#define STRIPE_MIN_RANGE_SIZE (8 * 1024 * 1024)
+
+/*
+ * Checks whether a file is big enough to be striped.
+ *
+ * @param size The size of the file in bytes.
+ * @param numStripes The number of stripes requested.
+ *
+ * @return Returns true if the file should be striped.
+ */
+bool stripe_isWorthwhile(size_t size, int numStripes);
+
+/*
+ * Copies a single remote file to a local machine as byte ranges, each of
+ * which is read with sftp over one of numStripes sessions and written in
+ * place with pwrite(). The ranges go into a temporary file next to the
+ * destination, which is renamed over it once every stripe has succeeded
+ * and removed if any failed.
+ *
+ * @param session A session that has already been connected to the server.
+ * It is used by the first stripe. The others are opened with info.
+ * @param info The sshInfo that was used to connect the session.
+ * @param from The path to the regular file to be copied on the server.
+ * @param size The size of the file in bytes.
+ * @param to The path to the local destination. If it is a directory, the
+ * file is copied into it.
+ * @param numStripes The number of sessions (and threads) to use.
+ *
+ * @return Returns SSH_OK if it succeeded and SSH_ERROR if it failed
+ */
+int stripe_copyFromServer(ssh_session session, psshInfo info,
+                          const char* from, size_t size, const char* to,
+                          int numStripes);
+
+/*
+ * Copies a single local file to a remote computer as byte ranges, each of
+ * which is read with pread() and written in place with sftp over one of
+ * numStripes sessions.
+ *
+ * @param session A session that has already been connected to the server.
+ * It is used by the first stripe. The others are opened with info.
+ * @param info The sshInfo that was used to connect the session.
+ * @param from The path to the regular file to be copied on the local machine.
+ * @param to The path to the remote destination. If it is a directory, the
+ * file is copied into it.
+ * @param numStripes The number of sessions (and threads) to use.
+ *
+ * @return Returns SSH_OK if it succeeded and SSH_ERROR if it failed
+ */
+int stripe_copyToServer(ssh_session session, psshInfo info,
+                        const char* from, const char* to, int numStripes);
+
+#endif // STRIPE_H
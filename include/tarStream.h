@@ -0,0 +1,102 @@
+/**********************************************************************
+  tarStream.h - Header file for copying directory trees as a single tar
+                stream over an exec channel
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#ifndef TAR_STREAM_H
+#define TAR_STREAM_H
+
+#include <libssh/libssh.h>
+#include <stdbool.h>
+
+/*
+ * Copies a directory from a local machine to a remote computer. The tree
+ * is packed into a tar stream as it is walked and written to "tar -x" on
+ * the server, so the files are not announced and acknowledged one at a
+ * time as they are with scp. Nothing is written to a temporary file.
+ *
+ * Only files smaller than the tarThreshold option go through the stream.
+ * The larger files are copied afterwards with scp_copyToServer().
+ *
+ * The server needs a tar that reads POSIX (ustar and pax) archives, which
+ * GNU tar, bsdtar and busybox tar all do.
+ *
+ * If the compress option is set and zstd is on the server, the stream is
+ * compressed chunk by chunk (see compress.h) and every file goes through
+ * it, however large.
+ *
+ * from may also be a single file, which is only worth sending as a stream
+ * when it is compressed. Without zstd on the server, it is copied with
+ * scp_copyToServer() instead.
+ *
+ * @param session A session that has already been connected to the server.
+ * @param from The path to the file or directory to be copied on the local
+ * machine.
+ * @param to The path to the remote destination for the copy. Like scp, from
+ * is copied into to if to is a directory that exists.
+ *
+ * @return Returns SSH_OK if it succeeded and SSH_ERROR if it failed
+ */
+int tarStream_copyToServer(ssh_session session, char* from, char* to);
+
+/*
+ * Copies a file/dir from a remote computer to a local machine. The server
+ * packs the tree with "tar -c", and it is unpacked into the destination as
+ * the stream arrives.
+ *
+ * Only files smaller than the tarThreshold option go through the stream.
+ * The larger files are listed with find and copied afterwards with
+ * scp_copyFromServer().
+ *
+ * The server needs find and a tar that can read the list of files from
+ * stdin (GNU tar or bsdtar).
+ *
+ * If the compress option is set and zstd is on the server, the server
+ * compresses the stream with zstd and every file goes through it.
+ *
+ * @param session A session that has already been connected to the server.
+ * @param from The path to the file or directory to be copied on the server.
+ * @param to The path to the local destination for the copied file or dir.
+ *
+ * @return Returns SSH_OK if it succeeded and SSH_ERROR if it failed
+ */
+int tarStream_copyFromServer(ssh_session session, char* from, char* to);
+
+/*
+ * Packs a local file tree into a tar stream and writes it to fd. Every
+ * name is put under the base name of from, as "tar -c" names them on the
+ * server for tarStream_copyFromServer(), and every file goes through the
+ * stream, however large. Nothing is compressed.
+ *
+ * @param from The path to the file or directory to be packed.
+ * @param fd The file descriptor to write the stream to.
+ *
+ * @return Returns true if every file was packed whole.
+ */
+bool tarStream_write(char* from, int fd);
+
+/*
+ * Unpacks a tar stream that is read from fd, the way that
+ * tarStream_copyFromServer() unpacks the stream from the server.
+ *
+ * @param fd The file descriptor to read the stream from.
+ * @param base The name that every entry must be, or be under.
+ * @param to The path to the local destination. The tree is unpacked into
+ * to/base if to is a directory that exists, and into to otherwise.
+ *
+ * @return Returns true if the stream was read to its end and every entry
+ * was unpacked.
+ */
+bool tarStream_extract(int fd, const char* base, const char* to);
+
+#endif // TAR_STREAM_H
@@ -0,0 +1,127 @@
+/**********************************************************************
+  trace.h - Header file for timing the phases of a copy
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * With --trace=FILE (the traceFile option), each phase of connecting the
+ * session and of copying each file is timed with the monotonic clock. The
+ * connection phases, the requests and the files are written to FILE as
+ * Chrome trace events (load it in chrome://tracing or Perfetto). The reads
+ * and writes of the disk and the channel are too many to write one by one,
+ * so they are added up into the event of their file. The size of the reads
+ * from and writes to the channel (see chunkSizer.h) is written as a counter
+ * each time it changes. Each thread keeps its events and totals to itself
+ * until a file ends, so the copy loops never wait for one another. When the
+ * trace is finished, a table of the time and bytes of each phase is
+ * printed.
+ *
+ * Each copy that is traced has a tracer of its own, which it finds through
+ * its tracer option (see scpOptions.h), so that the jobs of libscp that run
+ * at once each write their own file. If the tracer option is NULL,
+ * trace_begin() returns 0 and every other function returns at once.
+ */
+
+// A trace that is being written. See trace.c for the definition.
+typedef struct tracer tracer;
+
+typedef tracer* ptracer;
+
+typedef enum {
+  // Looking up the host and connecting to it, or starting its ProxyCommand
+  TRACE_CONNECT,
+  TRACE_KEY_EXCHANGE,
+  TRACE_HOST_KEY,
+  TRACE_AUTH,
+  // Waiting for the server to accept or announce a file or directory
+  TRACE_REQUEST,
+  TRACE_DISK_READ,
+  TRACE_DISK_WRITE,
+  TRACE_CHANNEL_READ,
+  TRACE_CHANNEL_WRITE,
+  TRACE_NUM_PHASES
+} tracePhase;
+
+// The time that a file started at, and the time that its thread had spent
+// in each phase by then
+typedef struct {
+  uint64_t start;
+  uint64_t phaseTimes[TRACE_NUM_PHASES];
+} traceFile;
+
+/*
+ * Starts a trace. It is written to by the copies whose tracer option is
+ * set to it, and must be finished with trace_finish().
+ *
+ * @param path The file that the trace events are written to.
+ *
+ * @return The tracer. Returns NULL if the file couldn't be opened.
+ */
+ptracer trace_D_start(const char* path);
+
+/*
+ * Finishes a trace, prints its table and frees it. Every thread that traced
+ * with it must have ended, except the calling one.
+ *
+ * @param t The tracer. May be NULL.
+ */
+void trace_finish(ptracer t);
+
+/*
+ * Gets the time that a phase starts at.
+ *
+ * @return The time in nanoseconds, or 0 if nothing is being traced.
+ */
+uint64_t trace_begin();
+
+/*
+ * Ends a phase that was started with trace_begin().
+ *
+ * @param phase The phase.
+ * @param start What trace_begin() returned.
+ * @param bytes The number of bytes that went through the phase, if any.
+ */
+void trace_end(tracePhase phase, uint64_t start, size_t bytes);
+
+/*
+ * Starts timing a file.
+ *
+ * @param file The timing of the file, kept by the caller.
+ */
+void trace_beginFile(traceFile* file);
+
+/*
+ * Ends the timing of a file, and writes its event with the time that was
+ * spent in each phase since trace_beginFile().
+ *
+ * @param file The timing of the file.
+ * @param name The path of the file.
+ * @param bytes The size of the file.
+ */
+void trace_endFile(traceFile* file, const char* name, size_t bytes);
+
+/*
+ * Records the size that the calls of a phase are now made with.
+ *
+ * @param phase The phase.
+ * @param size The size in bytes.
+ */
+void trace_chunkSize(tracePhase phase, size_t size);
+
+#endif // TRACE_H
@@ -0,0 +1,62 @@
+/**********************************************************************
+  transfer.h - Header file for the functions that pick how a copy is
+               carried out based upon the scpOptions
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <libssh/libssh.h>
+
+#include <sshUtils.h>
+
+/*
+ * Copies a file/dir from a remote computer to a local machine. If the resume
+ * option is set, it is copied with sftpTransfer_resumeFromServer() and a
+ * resumeJournal. A directory is copied with incrementalSync_copyFromServer()
+ * if the incremental option is set. Otherwise it is copied as a tar stream with
+ * tarStream_copyFromServer() if the useTar option is set, over several
+ * sessions with parallelScp_copyFromServer() if the numJobs or numStripes
+ * options ask for it, and with scp_copyFromServer() (recursively) otherwise.
+ *
+ * @param session A session that has already been connected to the server.
+ * @param info The sshInfo that was used to connect the session.
+ * @param from The path to the file or directory to be copied on the server.
+ * @param to The path to the local destination for the copied file or dir.
+ *
+ * @return Returns SSH_OK if it succeeded and SSH_ERROR if it failed
+ */
+int transfer_copyFromServer(ssh_session session, psshInfo info,
+                            char* from, char* to);
+
+/*
+ * Copies a file/dir from a local machine to a remote computer. If the resume
+ * option is set, it is copied with sftpTransfer_resumeToServer() and a
+ * resumeJournal. A directory is copied with incrementalSync_copyToServer()
+ * if the incremental option is set, or as a tar stream with tarStream_copyToServer() if the useTar
+ * option is set. Otherwise it is copied over several sessions with
+ * parallelScp_copyToServer() if the numJobs or numStripes options ask for
+ * it, and with scp_copyToServer() (recursively) if they don't.
+ *
+ * @param session A session that has already been connected to the server.
+ * @param info The sshInfo that was used to connect the session.
+ * @param from The path to the file or directory to be copied on the local
+ * machine.
+ * @param to The path to the remote destination for the copied file or dir.
+ *
+ * @return Returns SSH_OK if it succeeded and SSH_ERROR if it failed
+ */
+int transfer_copyToServer(ssh_session session, psshInfo info,
+                          char* from, char* to);
+
+#endif // TRANSFER_H
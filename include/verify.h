@@ -0,0 +1,144 @@
+/**********************************************************************
+  verify.h - Header file for checking that the copies of files match
+             their sources from end to end
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <libssh/libssh.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * In verify mode, the bytes of each file are hashed as they go through the
+ * copy loops, by a thread of their own so that the copy never waits for
+ * the hash. Once the copy is finished, the files on the server are hashed
+ * by a single command, and any file whose digests differ is reported.
+ *
+ * If a delta helper is set (see delta.h), it hashes the files on the server
+ * with XXH64. Otherwise MD5 is used, since every server has md5sum.
+ *
+ * Every function except verify_getRemoteDest() does nothing when it is
+ * passed a NULL verifier, so the copy loops don't need to check.
+ */
+
+// The verifier is opaque. See verify.c for the definition.
+typedef struct verifier verifier;
+
+typedef verifier* pverifier;
+
+/*
+ * Starts a verifier if the verify option is set. It must be finished with
+ * verify_finish().
+ *
+ * @param session The session that the files are copied over.
+ *
+ * @return The verifier. Returns NULL if the verify option is not set or if
+ * the verifier could not be started.
+ */
+pverifier verify_D_start(ssh_session session);
+
+/*
+ * Starts hashing a file. Every file that is started must be ended with
+ * verify_endFile() before the next one is started.
+ *
+ * @param v The verifier.
+ * @param localPath The path of the local file, for the report.
+ * @param remotePath The path of the file on the server.
+ */
+void verify_beginFile(pverifier v, const char* localPath,
+                      const char* remotePath);
+
+/*
+ * Adds the next bytes of the file to its hash. They are copied, so the
+ * buffer may be reused as soon as this returns.
+ *
+ * @param v The verifier.
+ * @param data The bytes.
+ * @param len The number of bytes.
+ */
+void verify_update(pverifier v, const void* data, size_t len);
+
+/*
+ * Adds the first bytes of a local file to the hash of the current file.
+ * This is for the part of a file that an earlier copy already wrote.
+ *
+ * @param v The verifier.
+ * @param fd The local file.
+ * @param len The number of bytes from the start of fd to add.
+ *
+ * @return Returns true if they could all be read and false otherwise.
+ */
+bool verify_updateFromFile(pverifier v, int fd, size_t len);
+
+/*
+ * Ends the current file.
+ *
+ * @param v The verifier.
+ */
+void verify_endFile(pverifier v);
+
+/*
+ * Stops the hashing thread, hashes every file that was ended on the server
+ * and reports each one whose digests differ. Then the verifier is freed.
+ *
+ * @param v The verifier.
+ * @param check Set this false if the copy failed, to only free the
+ * verifier.
+ *
+ * @return Returns true if every file matched (or check is false) and false
+ * otherwise.
+ */
+bool verify_finish(pverifier v, bool check);
+
+/*
+ * Checks a single file that was copied without going through the copy
+ * loops (as a delta or in stripes) by hashing the whole local copy, and
+ * then the server's copy. Does nothing if the verify option is not set.
+ *
+ * @param session The session that the file was copied over.
+ * @param localPath The path of the local file.
+ * @param remotePath The path of the file on the server.
+ *
+ * @return Returns true if the digests match (or the verify option is not
+ * set) and false otherwise.
+ */
+bool verify_checkFile(ssh_session session, const char* localPath,
+                      const char* remotePath);
+
+/*
+ * Finds out the path that scp on the server gives the copy of a local file
+ * or directory: to itself, or to/<base name of from> if to is a directory.
+ * This has to be asked before the copy, which may create to.
+ *
+ * @param session A session that has already been connected to the server.
+ * @param from The local path that is copied.
+ * @param to The remote path that it is copied to.
+ * @param dest The path is written here. It must be of size PATH_MAX.
+ *
+ * @return Returns true if it succeeded and false otherwise.
+ */
+bool verify_getRemoteDest(ssh_session session, const char* from,
+                          const char* to, char* dest);
+
+/*
+ * The helper's end of verify mode. Reads paths separated by NULs from stdin
+ * and writes the XXH64 digest of each file to stdout, one per line, or "-"
+ * if the file can't be read.
+ *
+ * @return The exit status for the helper.
+ */
+int verify_serveHash();
+
+#endif // VERIFY_H
@@ -0,0 +1,97 @@
+/**********************************************************************
+  workQueue.h - Header file for a work-stealing queue that spreads a list
+                of jobs across a number of worker threads
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#ifndef WORK_QUEUE_H
+#define WORK_QUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// The queue is opaque. See workQueue.c for the definition.
+typedef struct workQueue workQueue;
+
+typedef workQueue* pworkQueue;
+
+/*
+ * Creates a new queue with one deque per worker. The returned queue must be
+ * freed with workQueue_free().
+ *
+ * @param numWorkers The number of workers that will take jobs from the queue.
+ *
+ * @return A pointer to the new queue. Returns NULL if allocation failed.
+ */
+pworkQueue workQueue_D_new(int numWorkers);
+
+/*
+ * Frees a queue. The jobs themselves are not freed.
+ *
+ * @param queue The queue to be freed.
+ */
+void workQueue_free(pworkQueue queue);
+
+/*
+ * Adds a job to the back of a worker's deque.
+ *
+ * @param queue The queue to add the job to.
+ * @param worker The index of the worker whose deque receives the job.
+ * @param job A pointer to the job. It may not be NULL.
+ *
+ * @return Returns true if it succeeded and false if allocation failed.
+ */
+bool workQueue_push(pworkQueue queue, int worker, void* job);
+
+/*
+ * Adds a list of jobs, splitting it into one contiguous block per worker so
+ * that each worker starts with jobs that are next to each other in the list.
+ *
+ * @param queue The queue to add the jobs to.
+ * @param jobs An array of pointers to jobs.
+ * @param numJobs The number of jobs in the array.
+ *
+ * @return Returns true if it succeeded and false if allocation failed.
+ */
+bool workQueue_pushAll(pworkQueue queue, void** jobs, size_t numJobs);
+
+/*
+ * Takes the next job for a worker. A worker takes jobs from the front of its
+ * own deque. When its own deque is empty, it steals a job from the back of
+ * the deque of the worker with the most jobs left, so no worker is idle while
+ * there is still work to do.
+ *
+ * @param queue The queue to take the job from.
+ * @param worker The index of the worker taking the job.
+ *
+ * @return A pointer to the job. Returns NULL when there are no jobs left in
+ * any deque or if the queue has been canceled.
+ */
+void* workQueue_pop(pworkQueue queue, int worker);
+
+/*
+ * Cancels a queue so that every later call to workQueue_pop() returns NULL.
+ *
+ * @param queue The queue to be canceled.
+ */
+void workQueue_cancel(pworkQueue queue);
+
+/*
+ * Checks whether a queue has been canceled.
+ *
+ * @param queue The queue to be investigated.
+ *
+ * @return Returns true if workQueue_cancel() has been called.
+ */
+bool workQueue_isCanceled(pworkQueue queue);
+
+#endif // WORK_QUEUE_H
@@ -0,0 +1,345 @@
+/**********************************************************************
+  batch.c - Source code for batch mode, which runs every copy listed in
+            a manifest while reusing one session per host
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <batch.h>
+#include <localCopy.h>
+#include <relay.h>
+#include <sessionPool.h>
+#include <sshUtils.h>
+#include <transfer.h>
+
+// Large enough for "user@host:port>user@host:port"
+#define BATCH_KEY_SIZE (2 * (USER_SIZE + HOST_SIZE + 16))
+
+// The status of each entry. They are written to the results file as
+// _batch_statusNames.
+enum batch_status_e {
+  BATCH_PENDING = 0,
+  BATCH_OK,
+  BATCH_FAILED,
+  BATCH_CONNECT_FAILED,
+  BATCH_INVALID
+};
+
+static const char* _batch_statusNames[] = {
+  "pending", "ok", "failed", "connect-failed", "invalid"
+};
+
+// One copy in the manifest
+typedef struct {
+  int line;
+  // The order in the manifest, to keep the sort stable
+  size_t index;
+  char* from;
+  char* to;
+  sshInfo fromInfo;
+  sshInfo toInfo;
+  // The remote end(s), or "" if both ends are local
+  char key[BATCH_KEY_SIZE];
+  int status;
+  double seconds;
+} batchEntry;
+
+typedef batchEntry* pbatchEntry;
+
+static double _batch_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Splits a manifest line into from and to. A tab is used as the separator
+// if there is one, and spaces otherwise.
+static bool _batch_splitLine(char* line, char** from, char** to)
+{
+  const char* seps = strchr(line, '\t') ? "\t" : " ";
+  char* sep = strpbrk(line, seps);
+  if (!sep) return false;
+
+  *sep = '\0';
+  char* rest = sep + 1;
+  while (*rest != '\0' && strchr(seps, *rest)) rest++;
+
+  // There may only be one separator between the two paths
+  if (strpbrk(rest, seps)) return false;
+
+  *from = line;
+  *to = rest;
+  return **from != '\0' && **to != '\0';
+}
+
+// Fills in everything about the entry that can be worked out up front
+static void _batch_setUpEntry(pbatchEntry entry)
+{
+  // sshUtils_setSSHInfo() cuts up the string it reads, so give it copies
+  char* from = strdup(entry->from);
+  char* to = strdup(entry->to);
+  if (!from || !to ||
+      !sshUtils_setSSHInfo(from, &entry->fromInfo) ||
+      !sshUtils_setSSHInfo(to, &entry->toInfo)) {
+    entry->status = BATCH_INVALID;
+  }
+  free(from);
+  free(to);
+  if (entry->status == BATCH_INVALID) return;
+
+  psshInfo src = &entry->fromInfo;
+  psshInfo dest = &entry->toInfo;
+  if (!src->isLocal && dest->isLocal)
+    snprintf(entry->key, BATCH_KEY_SIZE, "%s@%s:%i", src->user, src->host,
+             src->port);
+  else if (src->isLocal && !dest->isLocal)
+    snprintf(entry->key, BATCH_KEY_SIZE, "%s@%s:%i", dest->user, dest->host,
+             dest->port);
+  // A relay needs both hosts
+  else if (!src->isLocal && !dest->isLocal)
+    snprintf(entry->key, BATCH_KEY_SIZE, "%s@%s:%i>%s@%s:%i", src->user,
+             src->host, src->port, dest->user, dest->host, dest->port);
+}
+
+static void _batch_freeEntries(pbatchEntry entries, size_t numEntries)
+{
+  size_t i;
+  for (i = 0; i < numEntries; ++i) {
+    free(entries[i].from);
+    free(entries[i].to);
+  }
+  free(entries);
+}
+
+// Reads the manifest into a newly allocated array of entries
+static pbatchEntry _batch_D_readManifest(const char* path, size_t* count)
+{
+  FILE* f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+  if (!f) {
+    fprintf(stderr, "Error opening manifest %s\n", path);
+    return NULL;
+  }
+
+  pbatchEntry entries = NULL;
+  size_t numEntries = 0, capacity = 0;
+  char* line = NULL;
+  size_t lineSize = 0;
+  int lineNum = 0;
+  bool success = true;
+
+  while (getline(&line, &lineSize, f) != -1) {
+    lineNum++;
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0' || line[0] == '#') continue;
+
+    if (numEntries == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      pbatchEntry bigger = realloc(entries, capacity * sizeof(batchEntry));
+      if (!bigger) {
+        fprintf(stderr, "Error allocating memory in %s\n", __FUNCTION__);
+        success = false;
+        break;
+      }
+      entries = bigger;
+    }
+
+    pbatchEntry entry = &entries[numEntries];
+    memset(entry, 0, sizeof(batchEntry));
+    entry->line = lineNum;
+    entry->index = numEntries++;
+
+    char* from;
+    char* to;
+    if (!_batch_splitLine(line, &from, &to)) {
+      fprintf(stderr, "Error reading line %i of the manifest\n", lineNum);
+      entry->status = BATCH_INVALID;
+      entry->from = strdup(line);
+      entry->to = strdup("");
+      continue;
+    }
+
+    entry->from = strdup(from);
+    entry->to = strdup(to);
+    _batch_setUpEntry(entry);
+  }
+
+  free(line);
+  if (f != stdin) fclose(f);
+
+  // An empty manifest is not an error
+  if (success && !entries) {
+    entries = malloc(sizeof(batchEntry));
+    success = entries != NULL;
+  }
+
+  if (!success) {
+    _batch_freeEntries(entries, numEntries);
+    return NULL;
+  }
+
+  *count = numEntries;
+  return entries;
+}
+
+// Sorts by host, keeping the manifest order within each host
+static int _batch_compareEntries(const void* a, const void* b)
+{
+  const batchEntry* lhs = *(const batchEntry* const*)a;
+  const batchEntry* rhs = *(const batchEntry* const*)b;
+  int cmp = strcmp(lhs->key, rhs->key);
+  if (cmp != 0) return cmp;
+  return (lhs->index > rhs->index) - (lhs->index < rhs->index);
+}
+
+static void _batch_writeResult(FILE* results, pbatchEntry entry)
+{
+  if (!results) return;
+  fprintf(results, "%i\t%s\t%.3f\t%s\t%s\n", entry->line,
+          _batch_statusNames[entry->status], entry->seconds, entry->from,
+          entry->to);
+  // Flush so the results survive if we are killed part way through
+  fflush(results);
+}
+
+// Runs the copy for one entry with sessions from the pool. hostInfo[0] is
+// the source if it is remote and the destination otherwise. hostInfo[1] is
+// the destination of a relay.
+static void _batch_runEntry(psessionPool pool, sshInfo hostInfo[2],
+                            pbatchEntry entry)
+{
+  if (entry->fromInfo.isLocal && entry->toInfo.isLocal) {
+    entry->status = localCopy_copy(entry->from, entry->to) ? BATCH_OK :
+                                                             BATCH_FAILED;
+    return;
+  }
+
+  ssh_session session = sessionPool_acquire(pool, &hostInfo[0]);
+  if (!session) {
+    entry->status = BATCH_CONNECT_FAILED;
+    return;
+  }
+
+  int rc;
+  if (entry->toInfo.isLocal)
+    rc = transfer_copyFromServer(session, &hostInfo[0],
+                                 entry->fromInfo.filePath, entry->to);
+  else if (entry->fromInfo.isLocal)
+    rc = transfer_copyToServer(session, &hostInfo[0], entry->from,
+                               entry->toInfo.filePath);
+  else {
+    ssh_session toSession = sessionPool_acquire(pool, &hostInfo[1]);
+    if (!toSession) {
+      sessionPool_release(pool, session, true);
+      entry->status = BATCH_CONNECT_FAILED;
+      return;
+    }
+    rc = relay_copy(session, entry->fromInfo.filePath, toSession,
+                    entry->toInfo.filePath);
+    sessionPool_release(pool, toSession, true);
+  }
+
+  entry->status = rc == SSH_OK ? BATCH_OK : BATCH_FAILED;
+
+  // The pool drops the session if the copy left it disconnected, and the
+  // next entry for this host connects again
+  sessionPool_release(pool, session, true);
+}
+
+int batch_run(const char* manifestPath, const char* resultsPath)
+{
+  size_t numEntries = 0;
+  pbatchEntry entries = _batch_D_readManifest(manifestPath, &numEntries);
+  if (!entries) return -1;
+
+  FILE* results = NULL;
+  if (resultsPath) {
+    results = fopen(resultsPath, "w");
+    if (!results) {
+      fprintf(stderr, "Error opening results file %s\n", resultsPath);
+      _batch_freeEntries(entries, numEntries);
+      return -1;
+    }
+    fprintf(results, "line\tstatus\tseconds\tfrom\tto\n");
+  }
+
+  pbatchEntry* order = malloc((numEntries + 1) * sizeof(pbatchEntry));
+  psessionPool pool = sessionPool_D_new(0);
+  if (!order || !pool) {
+    fprintf(stderr, "Error allocating memory in %s\n", __FUNCTION__);
+    free(order);
+    sessionPool_free(pool);
+    if (results) fclose(results);
+    _batch_freeEntries(entries, numEntries);
+    return -1;
+  }
+
+  size_t i;
+  for (i = 0; i < numEntries; ++i) order[i] = &entries[i];
+  qsort(order, numEntries, sizeof(pbatchEntry), _batch_compareEntries);
+
+  // The info for the host(s) that are being copied to/from. The passwords
+  // that are prompted for are kept here for the rest of the entries.
+  sshInfo hostInfo[2];
+  memset(hostInfo, 0, sizeof(hostInfo));
+  const char* hostKey = NULL;
+  bool hostFailed = false;
+  size_t numFailed = 0;
+
+  for (i = 0; i < numEntries; ++i) {
+    pbatchEntry entry = order[i];
+
+    if (entry->status == BATCH_PENDING) {
+      if (!hostKey || strcmp(hostKey, entry->key) != 0) {
+        // We are done with the last host, so let its session go
+        sessionPool_closeIdle(pool);
+        hostInfo[0] = entry->fromInfo.isLocal ? entry->toInfo :
+                                                entry->fromInfo;
+        hostInfo[1] = entry->toInfo;
+        hostKey = entry->key;
+        hostFailed = false;
+      }
+
+      double start = _batch_now();
+      // Don't try again (and prompt again) for a host we couldn't reach
+      if (hostFailed) entry->status = BATCH_CONNECT_FAILED;
+      else {
+        _batch_runEntry(pool, hostInfo, entry);
+        hostFailed = entry->status == BATCH_CONNECT_FAILED;
+      }
+      entry->seconds = _batch_now() - start;
+    }
+
+    if (entry->status != BATCH_OK) {
+      fprintf(stderr, "Error: line %i of the manifest (%s -> %s): %s\n",
+              entry->line, entry->from, entry->to,
+              _batch_statusNames[entry->status]);
+      numFailed++;
+    }
+    _batch_writeResult(results, entry);
+  }
+
+  memset(hostInfo, 0, sizeof(hostInfo));
+  sessionPool_free(pool);
+  free(order);
+  if (results) fclose(results);
+  _batch_freeEntries(entries, numEntries);
+
+  fprintf(stdout, "%zu of %zu copies succeeded\n", numEntries - numFailed,
+          numEntries);
+  return numFailed == 0 ? 0 : -1;
+}
@@ -0,0 +1,83 @@
+/**********************************************************************
+  bufferPool.c - Source code for the pool of aligned buffers that the
+                 transfers share
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include <bufferPool.h>
+
+// The most buffers, and bytes in all, that are kept for reuse
+#define BUFFER_POOL_MAX_BUFFERS 32
+#define BUFFER_POOL_MAX_BYTES (256 * 1024 * 1024)
+
+typedef struct {
+  void* data;
+  size_t size;
+} pooledBuffer;
+
+static pthread_mutex_t _bufferPool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pooledBuffer _bufferPool_buffers[BUFFER_POOL_MAX_BUFFERS];
+static size_t _bufferPool_numBuffers = 0;
+static size_t _bufferPool_bytes = 0;
+
+// Sizes are kept in whole pages, so that sizes that only differ by a few
+// bytes share buffers
+static size_t _bufferPool_round(size_t size)
+{
+  if (size == 0) size = 1;
+  return (size + BUFFER_POOL_ALIGNMENT - 1) / BUFFER_POOL_ALIGNMENT *
+         BUFFER_POOL_ALIGNMENT;
+}
+
+void* bufferPool_D_get(size_t size)
+{
+  size = _bufferPool_round(size);
+
+  pthread_mutex_lock(&_bufferPool_mutex);
+  size_t i;
+  for (i = 0; i < _bufferPool_numBuffers; ++i) {
+    if (_bufferPool_buffers[i].size == size) {
+      void* data = _bufferPool_buffers[i].data;
+      _bufferPool_buffers[i] = _bufferPool_buffers[--_bufferPool_numBuffers];
+      _bufferPool_bytes -= size;
+      pthread_mutex_unlock(&_bufferPool_mutex);
+      return data;
+    }
+  }
+  pthread_mutex_unlock(&_bufferPool_mutex);
+
+  void* data;
+  if (posix_memalign(&data, BUFFER_POOL_ALIGNMENT, size) != 0) return NULL;
+  return data;
+}
+
+void bufferPool_put(void* buffer, size_t size)
+{
+  if (!buffer) return;
+  size = _bufferPool_round(size);
+
+  pthread_mutex_lock(&_bufferPool_mutex);
+  if (_bufferPool_numBuffers < BUFFER_POOL_MAX_BUFFERS &&
+      _bufferPool_bytes + size <= BUFFER_POOL_MAX_BYTES) {
+    _bufferPool_buffers[_bufferPool_numBuffers].data = buffer;
+    _bufferPool_buffers[_bufferPool_numBuffers].size = size;
+    _bufferPool_numBuffers++;
+    _bufferPool_bytes += size;
+    buffer = NULL;
+  }
+  pthread_mutex_unlock(&_bufferPool_mutex);
+
+  free(buffer);
+}
@@ -0,0 +1,300 @@
+/**********************************************************************
+  checksum.c - Source code for the checksums that delta transfers use to
+               find the blocks that both ends already have
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#include <string.h>
+
+#include <checksum.h>
+
+// The weak checksum is two 16 bit sums: a is the sum of the bytes, and b is
+// the sum of a over every prefix of the block. b is kept in the high half.
+uint32_t checksum_weak(const void* data, size_t len)
+{
+  const unsigned char* p = data;
+  uint32_t a = 0;
+  uint32_t b = 0;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    a += p[i];
+    b += a;
+  }
+  return (a & 0xffff) | (b << 16);
+}
+
+uint32_t checksum_roll(uint32_t weak, unsigned char out, unsigned char in,
+                       size_t len)
+{
+  uint32_t a = weak & 0xffff;
+  uint32_t b = weak >> 16;
+  a = (a - out + in) & 0xffff;
+  b = (b - (uint32_t)len * out + a) & 0xffff;
+  return a | (b << 16);
+}
+
+// MD5 as described in RFC 1321
+#define _CHECKSUM_ROTATE(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static const uint32_t _checksum_md5K[64] = {
+  0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a,
+  0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+  0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340,
+  0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+  0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+  0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+  0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+  0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+  0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92,
+  0xffeff47d, 0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+  0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const unsigned char _checksum_md5Shift[64] = {
+  7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+  5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+  4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+  6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+static void _checksum_md5Block(uint32_t* state, const unsigned char* block)
+{
+  uint32_t m[16];
+  int i;
+  for (i = 0; i < 16; i++) {
+    m[i] = (uint32_t)block[i * 4] | ((uint32_t)block[i * 4 + 1] << 8) |
+           ((uint32_t)block[i * 4 + 2] << 16) |
+           ((uint32_t)block[i * 4 + 3] << 24);
+  }
+
+  uint32_t a = state[0];
+  uint32_t b = state[1];
+  uint32_t c = state[2];
+  uint32_t d = state[3];
+
+  for (i = 0; i < 64; i++) {
+    uint32_t f;
+    int g;
+    if (i < 16) {
+      f = (b & c) | (~b & d);
+      g = i;
+    }
+    else if (i < 32) {
+      f = (d & b) | (~d & c);
+      g = (5 * i + 1) % 16;
+    }
+    else if (i < 48) {
+      f = b ^ c ^ d;
+      g = (3 * i + 5) % 16;
+    }
+    else {
+      f = c ^ (b | ~d);
+      g = (7 * i) % 16;
+    }
+
+    uint32_t rotated = a + f + _checksum_md5K[i] + m[g];
+    a = d;
+    d = c;
+    c = b;
+    b += _CHECKSUM_ROTATE(rotated, _checksum_md5Shift[i]);
+  }
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+}
+
+void checksum_md5Init(pmd5Context ctx)
+{
+  ctx->state[0] = 0x67452301;
+  ctx->state[1] = 0xefcdab89;
+  ctx->state[2] = 0x98badcfe;
+  ctx->state[3] = 0x10325476;
+  ctx->numBytes = 0;
+}
+
+void checksum_md5Update(pmd5Context ctx, const void* data, size_t len)
+{
+  const unsigned char* p = data;
+  size_t used = ctx->numBytes % 64;
+  ctx->numBytes += len;
+
+  // Finish the block that was started last time
+  if (used > 0) {
+    size_t n = 64 - used < len ? 64 - used : len;
+    memcpy(ctx->buffer + used, p, n);
+    p += n;
+    len -= n;
+    if (used + n < 64) return;
+    _checksum_md5Block(ctx->state, ctx->buffer);
+  }
+
+  while (len >= 64) {
+    _checksum_md5Block(ctx->state, p);
+    p += 64;
+    len -= 64;
+  }
+
+  memcpy(ctx->buffer, p, len);
+}
+
+void checksum_md5Final(pmd5Context ctx, unsigned char* digest)
+{
+  // Pad with a 1 bit and zeros up to 8 bytes short of a block, and then
+  // add the length in bits
+  uint64_t numBits = ctx->numBytes * 8;
+  unsigned char padding[72];
+  size_t padLen = 64 - (ctx->numBytes + 8) % 64;
+  memset(padding, 0, sizeof(padding));
+  padding[0] = 0x80;
+
+  int i;
+  for (i = 0; i < 8; i++) padding[padLen + i] = (numBits >> (i * 8)) & 0xff;
+  checksum_md5Update(ctx, padding, padLen + 8);
+
+  for (i = 0; i < 16; i++)
+    digest[i] = (ctx->state[i / 4] >> ((i % 4) * 8)) & 0xff;
+}
+
+void checksum_md5(const void* data, size_t len, unsigned char* digest)
+{
+  md5Context ctx;
+  checksum_md5Init(&ctx);
+  checksum_md5Update(&ctx, data, len);
+  checksum_md5Final(&ctx, digest);
+}
+
+// XXH64 as described in the xxHash specification
+#define _CHECKSUM_ROTATE64(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+static const uint64_t _checksum_xxh64Prime1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t _checksum_xxh64Prime2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t _checksum_xxh64Prime3 = 0x165667B19E3779F9ULL;
+static const uint64_t _checksum_xxh64Prime4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t _checksum_xxh64Prime5 = 0x27D4EB2F165667C5ULL;
+
+static uint64_t _checksum_read64(const unsigned char* p)
+{
+  uint64_t v = 0;
+  int i;
+  for (i = 7; i >= 0; i--) v = (v << 8) | p[i];
+  return v;
+}
+
+static uint32_t _checksum_read32(const unsigned char* p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+         ((uint32_t)p[3] << 24);
+}
+
+static uint64_t _checksum_xxh64Round(uint64_t acc, uint64_t input)
+{
+  acc += input * _checksum_xxh64Prime2;
+  acc = _CHECKSUM_ROTATE64(acc, 31);
+  return acc * _checksum_xxh64Prime1;
+}
+
+static uint64_t _checksum_xxh64Merge(uint64_t acc, uint64_t lane)
+{
+  acc ^= _checksum_xxh64Round(0, lane);
+  return acc * _checksum_xxh64Prime1 + _checksum_xxh64Prime4;
+}
+
+static void _checksum_xxh64Stripe(uint64_t* lanes, const unsigned char* p)
+{
+  lanes[0] = _checksum_xxh64Round(lanes[0], _checksum_read64(p));
+  lanes[1] = _checksum_xxh64Round(lanes[1], _checksum_read64(p + 8));
+  lanes[2] = _checksum_xxh64Round(lanes[2], _checksum_read64(p + 16));
+  lanes[3] = _checksum_xxh64Round(lanes[3], _checksum_read64(p + 24));
+}
+
+void checksum_xxh64Init(pxxh64Context ctx)
+{
+  ctx->lanes[0] = _checksum_xxh64Prime1 + _checksum_xxh64Prime2;
+  ctx->lanes[1] = _checksum_xxh64Prime2;
+  ctx->lanes[2] = 0;
+  ctx->lanes[3] = -_checksum_xxh64Prime1;
+  ctx->numBytes = 0;
+}
+
+void checksum_xxh64Update(pxxh64Context ctx, const void* data, size_t len)
+{
+  const unsigned char* p = data;
+  size_t used = ctx->numBytes % 32;
+  ctx->numBytes += len;
+
+  // Finish the stripe that was started last time
+  if (used > 0) {
+    size_t n = 32 - used < len ? 32 - used : len;
+    memcpy(ctx->buffer + used, p, n);
+    p += n;
+    len -= n;
+    if (used + n < 32) return;
+    _checksum_xxh64Stripe(ctx->lanes, ctx->buffer);
+  }
+
+  while (len >= 32) {
+    _checksum_xxh64Stripe(ctx->lanes, p);
+    p += 32;
+    len -= 32;
+  }
+
+  memcpy(ctx->buffer, p, len);
+}
+
+void checksum_xxh64Final(pxxh64Context ctx, unsigned char* digest)
+{
+  uint64_t h;
+  if (ctx->numBytes >= 32) {
+    h = _CHECKSUM_ROTATE64(ctx->lanes[0], 1) +
+        _CHECKSUM_ROTATE64(ctx->lanes[1], 7) +
+        _CHECKSUM_ROTATE64(ctx->lanes[2], 12) +
+        _CHECKSUM_ROTATE64(ctx->lanes[3], 18);
+    int i;
+    for (i = 0; i < 4; i++) h = _checksum_xxh64Merge(h, ctx->lanes[i]);
+  }
+  else {
+    h = _checksum_xxh64Prime5;
+  }
+  h += ctx->numBytes;
+
+  // The bytes left over after the last whole stripe
+  const unsigned char* p = ctx->buffer;
+  size_t len = ctx->numBytes % 32;
+  for (; len >= 8; p += 8, len -= 8) {
+    h ^= _checksum_xxh64Round(0, _checksum_read64(p));
+    h = _CHECKSUM_ROTATE64(h, 27) * _checksum_xxh64Prime1 +
+        _checksum_xxh64Prime4;
+  }
+  if (len >= 4) {
+    h ^= (uint64_t)_checksum_read32(p) * _checksum_xxh64Prime1;
+    h = _CHECKSUM_ROTATE64(h, 23) * _checksum_xxh64Prime2 +
+        _checksum_xxh64Prime3;
+    p += 4;
+    len -= 4;
+  }
+  for (; len > 0; p++, len--) {
+    h ^= *p * _checksum_xxh64Prime5;
+    h = _CHECKSUM_ROTATE64(h, 11) * _checksum_xxh64Prime1;
+  }
+
+  h ^= h >> 33;
+  h *= _checksum_xxh64Prime2;
+  h ^= h >> 29;
+  h *= _checksum_xxh64Prime3;
+  h ^= h >> 32;
+
+  int i;
+  for (i = 0; i < CHECKSUM_XXH64_SIZE; i++)
+    digest[i] = (h >> (56 - 8 * i)) & 0xff;
+}
@@ -0,0 +1,177 @@
+/**********************************************************************
+  chunkQueue.c - Source code for a bounded queue of fixed-size buffers
+                 that is shared between a producer and a consumer thread
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include <bufferPool.h>
+#include <chunkQueue.h>
+
+struct chunkQueue {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  size_t chunkSize;
+  size_t depth;
+
+  // All of the chunks and their memory. These are never reallocated.
+  chunk* chunks;
+  char* memory;
+
+  // Stack of chunks that are empty and ready for the producer
+  pchunk* freeList;
+  size_t numFree;
+
+  // Ring of chunks that are filled and waiting for the consumer
+  pchunk* fullRing;
+  size_t fullHead;
+  size_t numFull;
+
+  bool finished;
+  bool aborted;
+  bool success;
+};
+
+pchunkQueue chunkQueue_D_new(size_t chunkSize, size_t depth)
+{
+  if (chunkSize == 0 || depth == 0) return NULL;
+
+  pchunkQueue queue = calloc(1, sizeof(chunkQueue));
+  if (!queue) return NULL;
+
+  queue->chunkSize = chunkSize;
+  queue->depth = depth;
+  queue->chunks = calloc(depth, sizeof(chunk));
+  // Every file that is copied makes a queue, so its memory comes from
+  // the pool
+  queue->memory = bufferPool_D_get(chunkSize * depth);
+  queue->freeList = calloc(depth, sizeof(pchunk));
+  queue->fullRing = calloc(depth, sizeof(pchunk));
+
+  if (!queue->chunks || !queue->memory ||
+      !queue->freeList || !queue->fullRing) {
+    chunkQueue_free(queue);
+    return NULL;
+  }
+
+  size_t i;
+  for (i = 0; i < depth; i++) {
+    queue->chunks[i].data = queue->memory + i * chunkSize;
+    queue->chunks[i].len = 0;
+    queue->freeList[i] = &queue->chunks[i];
+  }
+  queue->numFree = depth;
+  queue->success = true;
+
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->cond, NULL);
+
+  return queue;
+}
+
+void chunkQueue_free(pchunkQueue queue)
+{
+  if (!queue) return;
+
+  // The lock and cond are only initialized if all allocations succeeded
+  if (queue->fullRing) {
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->cond);
+  }
+
+  free(queue->chunks);
+  bufferPool_put(queue->memory, queue->chunkSize * queue->depth);
+  free(queue->freeList);
+  free(queue->fullRing);
+  free(queue);
+}
+
+size_t chunkQueue_getChunkSize(pchunkQueue queue)
+{
+  return queue->chunkSize;
+}
+
+pchunk chunkQueue_acquireFree(pchunkQueue queue)
+{
+  pthread_mutex_lock(&queue->lock);
+  while (queue->numFree == 0 && !queue->aborted)
+    pthread_cond_wait(&queue->cond, &queue->lock);
+
+  pchunk c = NULL;
+  if (!queue->aborted) {
+    c = queue->freeList[--queue->numFree];
+    c->len = 0;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return c;
+}
+
+void chunkQueue_pushFull(pchunkQueue queue, pchunk c)
+{
+  pthread_mutex_lock(&queue->lock);
+  queue->fullRing[(queue->fullHead + queue->numFull) % queue->depth] = c;
+  queue->numFull++;
+  pthread_cond_broadcast(&queue->cond);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+void chunkQueue_finish(pchunkQueue queue, bool success)
+{
+  pthread_mutex_lock(&queue->lock);
+  queue->finished = true;
+  queue->success = success;
+  pthread_cond_broadcast(&queue->cond);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+pchunk chunkQueue_popFull(pchunkQueue queue)
+{
+  pthread_mutex_lock(&queue->lock);
+  while (queue->numFull == 0 && !queue->finished)
+    pthread_cond_wait(&queue->cond, &queue->lock);
+
+  pchunk c = NULL;
+  if (queue->numFull > 0) {
+    c = queue->fullRing[queue->fullHead];
+    queue->fullHead = (queue->fullHead + 1) % queue->depth;
+    queue->numFull--;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return c;
+}
+
+void chunkQueue_releaseFree(pchunkQueue queue, pchunk c)
+{
+  pthread_mutex_lock(&queue->lock);
+  queue->freeList[queue->numFree++] = c;
+  pthread_cond_broadcast(&queue->cond);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+void chunkQueue_abort(pchunkQueue queue)
+{
+  pthread_mutex_lock(&queue->lock);
+  queue->aborted = true;
+  pthread_cond_broadcast(&queue->cond);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+bool chunkQueue_succeeded(pchunkQueue queue)
+{
+  pthread_mutex_lock(&queue->lock);
+  bool success = queue->success;
+  pthread_mutex_unlock(&queue->lock);
+  return success;
+}
@@ -0,0 +1,125 @@
+/**********************************************************************
+  chunkSizer.c - Source code for choosing the size of each read from and
+                 write to the channel while a copy runs
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#include <time.h>
+
+#include <chunkSizer.h>
+
+// The number of calls in each window
+#define CHUNK_SIZER_WINDOW_CALLS 16
+// How much the throughput must change to count as a change
+#define CHUNK_SIZER_TOLERANCE 0.05
+// After this many windows at the same size, a step is tried again in case
+// the link has changed
+#define CHUNK_SIZER_PROBE_WINDOWS 64
+
+static uint64_t _chunkSizer_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void _chunkSizer_setSize(chunkSizer* sizer, size_t size)
+{
+  if (size < CHUNK_SIZER_MIN) size = CHUNK_SIZER_MIN;
+  if (size > CHUNK_SIZER_MAX) size = CHUNK_SIZER_MAX;
+  if (size == sizer->size) return;
+
+  sizer->size = size;
+  sizer->numSteady = 0;
+  trace_chunkSize(sizer->phase, size);
+}
+
+// Picks the size of the next window from the one that just ended
+static void _chunkSizer_endWindow(chunkSizer* sizer)
+{
+  uint64_t now = _chunkSizer_now();
+  double elapsed = now - sizer->windowStart;
+  if (elapsed <= 0) elapsed = 1;
+  double rate = sizer->windowBytes / elapsed;
+  double latency = elapsed / sizer->windowCalls;
+  size_t size = sizer->size;
+  size_t next = size;
+  bool isUndo = false;
+
+  if (sizer->windowFullCalls * 2 < sizer->windowCalls) {
+    // Most calls came back short, so a bigger size would not be filled
+    if (sizer->windowBytes / sizer->windowCalls * 2 <= size) next = size / 2;
+    sizer->isGrowing = false;
+  }
+  else if (sizer->numSteady == 0 && sizer->lastRate > 0 &&
+           rate < sizer->lastRate * (1 - CHUNK_SIZER_TOLERANCE)) {
+    // The last step made the copy slower. Take it back and stay there.
+    sizer->isGrowing = !sizer->isGrowing;
+    next = sizer->isGrowing ? size * 2 : size / 2;
+    isUndo = true;
+  }
+  else if (sizer->lastRate == 0 ||
+           (sizer->numSteady == 0 &&
+            rate > sizer->lastRate * (1 + CHUNK_SIZER_TOLERANCE)) ||
+           sizer->numSteady >= CHUNK_SIZER_PROBE_WINDOWS) {
+    next = sizer->isGrowing ? size * 2 : size / 2;
+  }
+
+  // Long calls hold up everything else that runs between them
+  if (next > size && latency > CHUNK_SIZER_MAX_LATENCY) next = size;
+
+  sizer->lastRate = rate;
+  sizer->numSteady++;
+  _chunkSizer_setSize(sizer, next);
+  // The window after a step is compared with this one to judge the step,
+  // but a step that was taken back is not judged again
+  if (isUndo) sizer->numSteady = 1;
+
+  sizer->windowStart = now;
+  sizer->windowCalls = 0;
+  sizer->windowFullCalls = 0;
+  sizer->windowBytes = 0;
+}
+
+void chunkSizer_init(chunkSizer* sizer, tracePhase phase)
+{
+  sizer->size = CHUNK_SIZER_START;
+  sizer->phase = phase;
+  sizer->lastRate = 0;
+  sizer->isGrowing = true;
+  sizer->numSteady = 0;
+  chunkSizer_restart(sizer);
+  trace_chunkSize(phase, sizer->size);
+}
+
+size_t chunkSizer_get(const chunkSizer* sizer)
+{
+  return sizer->size;
+}
+
+void chunkSizer_record(chunkSizer* sizer, size_t requested, size_t got)
+{
+  sizer->windowCalls++;
+  sizer->windowBytes += got;
+  if (got >= requested) sizer->windowFullCalls++;
+
+  if (sizer->windowCalls == CHUNK_SIZER_WINDOW_CALLS)
+    _chunkSizer_endWindow(sizer);
+}
+
+void chunkSizer_restart(chunkSizer* sizer)
+{
+  sizer->windowStart = _chunkSizer_now();
+  sizer->windowCalls = 0;
+  sizer->windowFullCalls = 0;
+  sizer->windowBytes = 0;
+}
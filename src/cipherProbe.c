@@ -0,0 +1,376 @@
+/**********************************************************************
+  cipherProbe.c - Source code for choosing the ciphers and MACs that are
+                  fastest on this machine
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#include <cipherProbe.h>
+
+#ifdef SCP_HAVE_OPENSSL
+
+#include <libssh/libssh.h>
+#include <linux/limits.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fileSystemUtils.h>
+
+// The largest packet that libssh sends, so each algorithm is measured the
+// way it is used
+#define CIPHER_PROBE_BUFFER_SIZE 32768
+// How long each algorithm is measured for
+#define CIPHER_PROBE_TIME 0.005
+// The first line of the cache, followed by the OpenSSL version that it was
+// measured with
+#define CIPHER_PROBE_HEADER "scp-cipher-probe 1"
+
+// libssh added AES-GCM and the encrypt-then-MAC variants in 0.9.0. They are
+// as fast as the plain MACs, so they are offered in their place.
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0, 9, 0)
+#define CIPHER_PROBE_HAVE_GCM
+#define CIPHER_PROBE_MAC(name) name "-etm@openssh.com," name
+#else
+#define CIPHER_PROBE_MAC(name) name
+#endif
+
+typedef struct {
+  // The names that libssh knows it by, separated by commas
+  const char* name;
+  // Set for a cipher that authenticates the data itself, so that the MAC
+  // isn't used
+  bool isAead;
+  const EVP_CIPHER* (*cipher)(void);
+  const EVP_MD* (*md)(void);
+  // The throughput in MB/s, or 0 if it couldn't be measured
+  double speed;
+} cipherProbeAlgorithm;
+
+static cipherProbeAlgorithm _cipherProbe_ciphers[] = {
+#ifdef CIPHER_PROBE_HAVE_GCM
+  { "aes128-gcm@openssh.com",        true,  EVP_aes_128_gcm, NULL, 0 },
+  { "aes256-gcm@openssh.com",        true,  EVP_aes_256_gcm, NULL, 0 },
+#endif
+#ifndef OPENSSL_NO_CHACHA
+  { "chacha20-poly1305@openssh.com", true,  EVP_chacha20_poly1305, NULL, 0 },
+#endif
+  { "aes128-ctr",                    false, EVP_aes_128_ctr, NULL, 0 },
+  { "aes192-ctr",                    false, EVP_aes_192_ctr, NULL, 0 },
+  { "aes256-ctr",                    false, EVP_aes_256_ctr, NULL, 0 }
+};
+
+static cipherProbeAlgorithm _cipherProbe_macs[] = {
+  { CIPHER_PROBE_MAC("hmac-sha2-256"), false, NULL, EVP_sha256, 0 },
+  { CIPHER_PROBE_MAC("hmac-sha2-512"), false, NULL, EVP_sha512, 0 },
+  { CIPHER_PROBE_MAC("hmac-sha1"),     false, NULL, EVP_sha1,   0 }
+};
+
+#define CIPHER_PROBE_NUM_CIPHERS \
+  (sizeof(_cipherProbe_ciphers) / sizeof(cipherProbeAlgorithm))
+#define CIPHER_PROBE_NUM_MACS \
+  (sizeof(_cipherProbe_macs) / sizeof(cipherProbeAlgorithm))
+
+// The probe runs (or the cache is read) once per process, however many
+// sessions are connected
+static pthread_once_t _cipherProbe_once = PTHREAD_ONCE_INIT;
+static bool _cipherProbe_isReady = false;
+
+static double _cipherProbe_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Encrypts one packet the way libssh does, starting from a fresh IV
+static bool _cipherProbe_encrypt(EVP_CIPHER_CTX* ctx, bool isAead,
+                                 unsigned char* buffer)
+{
+  static const unsigned char iv[16] = { 0 };
+  unsigned char tag[16];
+  int len;
+  return EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, iv) == 1 &&
+         EVP_EncryptUpdate(ctx, buffer, &len, buffer,
+                           CIPHER_PROBE_BUFFER_SIZE) == 1 &&
+         EVP_EncryptFinal_ex(ctx, buffer + len, &len) == 1 &&
+         (!isAead ||
+          EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, sizeof(tag),
+                              tag) == 1);
+}
+
+static double _cipherProbe_measureCipher(const cipherProbeAlgorithm* a,
+                                         unsigned char* buffer)
+{
+  static const unsigned char key[64] = { 0 };
+  EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+  if (!ctx) return 0;
+
+  double speed = 0;
+  // One packet first, so that nothing is measured cold
+  if (EVP_EncryptInit_ex(ctx, a->cipher(), NULL, key, NULL) == 1 &&
+      _cipherProbe_encrypt(ctx, a->isAead, buffer)) {
+    size_t bytes = 0;
+    double start = _cipherProbe_now();
+    double elapsed;
+    do {
+      if (!_cipherProbe_encrypt(ctx, a->isAead, buffer)) break;
+      bytes += CIPHER_PROBE_BUFFER_SIZE;
+    } while ((elapsed = _cipherProbe_now() - start) < CIPHER_PROBE_TIME);
+    if (elapsed >= CIPHER_PROBE_TIME) speed = bytes / elapsed / 1e6;
+  }
+
+  EVP_CIPHER_CTX_free(ctx);
+  return speed;
+}
+
+static double _cipherProbe_measureMac(const cipherProbeAlgorithm* a,
+                                      const unsigned char* buffer)
+{
+  static const unsigned char key[64] = { 0 };
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int len;
+  if (!HMAC(a->md(), key, sizeof(key), buffer, CIPHER_PROBE_BUFFER_SIZE,
+            digest, &len))
+    return 0;
+
+  size_t bytes = 0;
+  double start = _cipherProbe_now();
+  double elapsed;
+  do {
+    if (!HMAC(a->md(), key, sizeof(key), buffer, CIPHER_PROBE_BUFFER_SIZE,
+              digest, &len))
+      return 0;
+    bytes += CIPHER_PROBE_BUFFER_SIZE;
+  } while ((elapsed = _cipherProbe_now() - start) < CIPHER_PROBE_TIME);
+
+  return bytes / elapsed / 1e6;
+}
+
+static bool _cipherProbe_run()
+{
+  unsigned char* buffer = calloc(1, CIPHER_PROBE_BUFFER_SIZE + 64);
+  if (!buffer) return false;
+
+  size_t i;
+  for (i = 0; i < CIPHER_PROBE_NUM_CIPHERS; ++i)
+    _cipherProbe_ciphers[i].speed =
+      _cipherProbe_measureCipher(&_cipherProbe_ciphers[i], buffer);
+  for (i = 0; i < CIPHER_PROBE_NUM_MACS; ++i)
+    _cipherProbe_macs[i].speed =
+      _cipherProbe_measureMac(&_cipherProbe_macs[i], buffer);
+
+  free(buffer);
+  return true;
+}
+
+// The cache is kept per host name, since the home directory may be shared
+// by machines with different CPUs
+static bool _cipherProbe_getCachePath(char* path)
+{
+  char dir[PATH_MAX];
+  char host[256];
+  if (!fileSystemUtils_getCacheDir(dir)) return false;
+  if (gethostname(host, sizeof(host)) != 0) return false;
+  host[sizeof(host) - 1] = '\0';
+  return snprintf(path, PATH_MAX, "%s/cipher-probe-%s", dir, host) <
+         PATH_MAX;
+}
+
+static cipherProbeAlgorithm* _cipherProbe_find(const char* name)
+{
+  size_t i;
+  for (i = 0; i < CIPHER_PROBE_NUM_CIPHERS; ++i)
+    if (strcmp(_cipherProbe_ciphers[i].name, name) == 0)
+      return &_cipherProbe_ciphers[i];
+  for (i = 0; i < CIPHER_PROBE_NUM_MACS; ++i)
+    if (strcmp(_cipherProbe_macs[i].name, name) == 0)
+      return &_cipherProbe_macs[i];
+  return NULL;
+}
+
+// Reads the results of an earlier probe. Each line after the header is
+// "<name> <speed>". Returns false unless every algorithm was found.
+static bool _cipherProbe_load()
+{
+  char path[PATH_MAX];
+  if (!_cipherProbe_getCachePath(path)) return false;
+  FILE* f = fopen(path, "r");
+  if (!f) return false;
+
+  char line[CIPHER_PROBE_LIST_SIZE];
+  char expected[sizeof(line)];
+  snprintf(expected, sizeof(expected), "%s %lx\n", CIPHER_PROBE_HEADER,
+           (unsigned long)OPENSSL_VERSION_NUMBER);
+  size_t numFound = 0;
+  if (fgets(line, sizeof(line), f) && strcmp(line, expected) == 0) {
+    char name[CIPHER_PROBE_LIST_SIZE];
+    double speed;
+    while (fgets(line, sizeof(line), f) &&
+           sscanf(line, "%511s %lf", name, &speed) == 2) {
+      cipherProbeAlgorithm* a = _cipherProbe_find(name);
+      if (!a) continue;
+      a->speed = speed;
+      numFound++;
+    }
+  }
+
+  fclose(f);
+  return numFound == CIPHER_PROBE_NUM_CIPHERS + CIPHER_PROBE_NUM_MACS;
+}
+
+// Saves the results. They are written to a temporary file first, so that
+// another scp never reads half of them.
+static void _cipherProbe_save()
+{
+  char path[PATH_MAX];
+  char tmpPath[PATH_MAX + 32];
+  if (!_cipherProbe_getCachePath(path)) return;
+  snprintf(tmpPath, sizeof(tmpPath), "%s.%ld", path, (long)getpid());
+
+  FILE* f = fopen(tmpPath, "w");
+  if (!f) return;
+
+  fprintf(f, "%s %lx\n", CIPHER_PROBE_HEADER,
+          (unsigned long)OPENSSL_VERSION_NUMBER);
+  size_t i;
+  for (i = 0; i < CIPHER_PROBE_NUM_CIPHERS; ++i)
+    fprintf(f, "%s %.1f\n", _cipherProbe_ciphers[i].name,
+            _cipherProbe_ciphers[i].speed);
+  for (i = 0; i < CIPHER_PROBE_NUM_MACS; ++i)
+    fprintf(f, "%s %.1f\n", _cipherProbe_macs[i].name,
+            _cipherProbe_macs[i].speed);
+
+  if (fclose(f) != 0 || rename(tmpPath, path) != 0) unlink(tmpPath);
+}
+
+static void _cipherProbe_init()
+{
+  if (_cipherProbe_load()) {
+    _cipherProbe_isReady = true;
+    return;
+  }
+  _cipherProbe_isReady = _cipherProbe_run();
+  if (_cipherProbe_isReady) _cipherProbe_save();
+}
+
+static double _cipherProbe_bestMacSpeed()
+{
+  double best = 0;
+  size_t i;
+  for (i = 0; i < CIPHER_PROBE_NUM_MACS; ++i)
+    if (_cipherProbe_macs[i].speed > best) best = _cipherProbe_macs[i].speed;
+  return best;
+}
+
+// The throughput of a cipher once its packets are also signed. Every byte
+// goes through both, one after the other.
+static double _cipherProbe_effectiveSpeed(const cipherProbeAlgorithm* a)
+{
+  if (a->isAead || a->speed <= 0) return a->speed;
+  double mac = _cipherProbe_bestMacSpeed();
+  if (mac <= 0) return 0;
+  return 1 / (1 / a->speed + 1 / mac);
+}
+
+// Writes the names of the algorithms that could be measured, fastest first
+static bool _cipherProbe_writeList(cipherProbeAlgorithm* algorithms,
+                                   size_t numAlgorithms, char* list)
+{
+  bool isUsed[CIPHER_PROBE_NUM_CIPHERS + CIPHER_PROBE_NUM_MACS] = { false };
+  size_t len = 0;
+  list[0] = '\0';
+
+  size_t n;
+  for (n = 0; n < numAlgorithms; ++n) {
+    size_t best = numAlgorithms;
+    double bestSpeed = 0;
+    size_t i;
+    for (i = 0; i < numAlgorithms; ++i) {
+      double speed = _cipherProbe_effectiveSpeed(&algorithms[i]);
+      if (!isUsed[i] && speed > bestSpeed) {
+        best = i;
+        bestSpeed = speed;
+      }
+    }
+    if (best == numAlgorithms) break;
+
+    isUsed[best] = true;
+    len += snprintf(list + len, CIPHER_PROBE_LIST_SIZE - len, "%s%s",
+                    len > 0 ? "," : "", algorithms[best].name);
+  }
+
+  return len > 0 && len < CIPHER_PROBE_LIST_SIZE;
+}
+
+bool cipherProbe_getPreferences(char* ciphers, char* macs)
+{
+  pthread_once(&_cipherProbe_once, _cipherProbe_init);
+  if (!_cipherProbe_isReady) return false;
+
+  return _cipherProbe_writeList(_cipherProbe_ciphers,
+                                CIPHER_PROBE_NUM_CIPHERS, ciphers) &&
+         _cipherProbe_writeList(_cipherProbe_macs, CIPHER_PROBE_NUM_MACS,
+                                macs);
+}
+
+bool cipherProbe_printTable(FILE* stream)
+{
+  if (!_cipherProbe_run()) {
+    fprintf(stderr, "Error allocating the cipher probe buffer\n");
+    return false;
+  }
+  _cipherProbe_save();
+
+  fprintf(stream, "%-46s %10s %10s\n", "Algorithm", "MB/s", "With MAC");
+  size_t i;
+  for (i = 0; i < CIPHER_PROBE_NUM_CIPHERS; ++i)
+    fprintf(stream, "%-46s %10.1f %10.1f\n", _cipherProbe_ciphers[i].name,
+            _cipherProbe_ciphers[i].speed,
+            _cipherProbe_effectiveSpeed(&_cipherProbe_ciphers[i]));
+  for (i = 0; i < CIPHER_PROBE_NUM_MACS; ++i)
+    fprintf(stream, "%-46s %10.1f\n", _cipherProbe_macs[i].name,
+            _cipherProbe_macs[i].speed);
+
+  char ciphers[CIPHER_PROBE_LIST_SIZE];
+  char macs[CIPHER_PROBE_LIST_SIZE];
+  if (_cipherProbe_writeList(_cipherProbe_ciphers, CIPHER_PROBE_NUM_CIPHERS,
+                             ciphers) &&
+      _cipherProbe_writeList(_cipherProbe_macs, CIPHER_PROBE_NUM_MACS,
+                             macs)) {
+    fprintf(stream, "\nCiphers offered: %s\n", ciphers);
+    fprintf(stream, "MACs offered:    %s\n", macs);
+  }
+  return true;
+}
+
+#else // SCP_HAVE_OPENSSL
+
+bool cipherProbe_getPreferences(char* ciphers, char* macs)
+{
+  (void)ciphers;
+  (void)macs;
+  return false;
+}
+
+bool cipherProbe_printTable(FILE* stream)
+{
+  (void)stream;
+  fprintf(stderr, "Error: this scp was built without OpenSSL, so the "
+                  "ciphers can't be probed\n");
+  return false;
+}
+
+#endif // SCP_HAVE_OPENSSL
@@ -0,0 +1,271 @@
+/**********************************************************************
+  compress.c - Source code for compressing a stream in chunks with zstd,
+               while choosing for each chunk whether it is worth it
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#ifdef SCP_HAVE_ZSTD
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zstd.h>
+
+#include <compress.h>
+
+// A stored frame is a frame header followed by raw blocks of at most this
+// size (RFC 8878)
+#define COMPRESS_MAX_BLOCK (1 << 17)
+#define COMPRESS_BLOCK_HEADER_SIZE 3
+// The magic number, a frame header descriptor with no optional fields, and
+// a window descriptor for a 128K window (2^(10 + 7))
+static const unsigned char _compress_storedFrameHeader[] =
+  { 0x28, 0xb5, 0x2f, 0xfd, 0x00, 0x38 };
+
+struct compressEncoder {
+  // The context that compresses whole chunks, with worker threads
+  ZSTD_CCtx* cctx;
+  // The context that compresses samples
+  ZSTD_CCtx* sampleCtx;
+  int level;
+  int numThreads;
+  void* frame;
+  size_t frameSize;
+  void* sample;
+  size_t sampleSize;
+  // Time spent compressing samples, per byte of input
+  double compressSeconds;
+  size_t compressBytes;
+  // Time spent sending, per byte of output
+  double sendSeconds;
+  size_t sendBytes;
+  compressStats stats;
+};
+
+struct compressDecoder {
+  ZSTD_DCtx* dctx;
+  compressStats stats;
+};
+
+static double _compress_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t _compress_storedFrameBound(size_t len)
+{
+  return sizeof(_compress_storedFrameHeader) +
+         (len / COMPRESS_MAX_BLOCK + 1) * COMPRESS_BLOCK_HEADER_SIZE + len;
+}
+
+pcompressEncoder compress_D_newEncoder(int level, size_t chunkSize)
+{
+  pcompressEncoder e = calloc(1, sizeof(compressEncoder));
+  if (!e) return NULL;
+
+  e->level = level;
+  e->cctx = ZSTD_createCCtx();
+  e->sampleCtx = ZSTD_createCCtx();
+
+  e->frameSize = ZSTD_compressBound(chunkSize);
+  if (e->frameSize < _compress_storedFrameBound(chunkSize))
+    e->frameSize = _compress_storedFrameBound(chunkSize);
+  e->frame = malloc(e->frameSize);
+
+  e->sampleSize = ZSTD_compressBound(COMPRESS_SAMPLE_SIZE);
+  e->sample = malloc(e->sampleSize);
+
+  if (!e->cctx || !e->sampleCtx || !e->frame || !e->sample) {
+    fprintf(stderr, "Error allocating the zstd encoder\n");
+    compress_freeEncoder(e);
+    return NULL;
+  }
+
+  ZSTD_CCtx_setParameter(e->cctx, ZSTD_c_compressionLevel, level);
+  ZSTD_CCtx_setParameter(e->sampleCtx, ZSTD_c_compressionLevel, level);
+
+  // A zstd that was built without threads refuses this, and compresses
+  // on the calling thread instead
+  long numCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+  e->numThreads = numCPUs > COMPRESS_MAX_THREADS ? COMPRESS_MAX_THREADS :
+                  numCPUs > 1 ? (int)numCPUs : 1;
+  if (e->numThreads > 1 &&
+      ZSTD_isError(ZSTD_CCtx_setParameter(e->cctx, ZSTD_c_nbWorkers,
+                                          e->numThreads)))
+    e->numThreads = 1;
+
+  return e;
+}
+
+void compress_freeEncoder(pcompressEncoder e)
+{
+  if (!e) return;
+  ZSTD_freeCCtx(e->cctx);
+  ZSTD_freeCCtx(e->sampleCtx);
+  free(e->frame);
+  free(e->sample);
+  free(e);
+}
+
+// Wraps a chunk in a frame of raw blocks, so that it can sit in the same
+// stream as the compressed chunks without being compressed
+static size_t _compress_storeFrame(pcompressEncoder e, const void* data,
+                                   size_t len)
+{
+  unsigned char* p = e->frame;
+  memcpy(p, _compress_storedFrameHeader, sizeof(_compress_storedFrameHeader));
+  p += sizeof(_compress_storedFrameHeader);
+
+  do {
+    size_t n = len < COMPRESS_MAX_BLOCK ? len : COMPRESS_MAX_BLOCK;
+    // The size, then the block type (0 is raw), then whether it is the last
+    uint32_t header = (uint32_t)(n << 3) | (n == len ? 1 : 0);
+    p[0] = header & 0xff;
+    p[1] = (header >> 8) & 0xff;
+    p[2] = (header >> 16) & 0xff;
+    p += COMPRESS_BLOCK_HEADER_SIZE;
+
+    memcpy(p, data, n);
+    p += n;
+    data = (const char*)data + n;
+    len -= n;
+  } while (len > 0);
+
+  return p - (unsigned char*)e->frame;
+}
+
+// Guesses from a sample whether compressing the chunk will pay off
+static bool _compress_isWorthwhile(pcompressEncoder e, const void* data,
+                                   size_t len)
+{
+  size_t sampleLen = len < COMPRESS_SAMPLE_SIZE ? len : COMPRESS_SAMPLE_SIZE;
+  if (sampleLen == 0) return false;
+
+  double start = _compress_now();
+  size_t n = ZSTD_compress2(e->sampleCtx, e->sample, e->sampleSize, data,
+                            sampleLen);
+  e->compressSeconds += _compress_now() - start;
+  e->compressBytes += sampleLen;
+
+  if (ZSTD_isError(n) || n == 0) return false;
+  double ratio = (double)sampleLen / n;
+  if (ratio < COMPRESS_MIN_RATIO) return false;
+
+  // Nothing has been sent yet, so there is nothing to compare against
+  if (e->sendBytes == 0) return true;
+
+  // The samples are compressed on one thread, and the chunks on numThreads
+  double compressCost = e->compressSeconds / e->compressBytes * len /
+                        e->numThreads;
+  double sendSaved = e->sendSeconds / e->sendBytes * (len - len / ratio);
+  return compressCost < sendSaved;
+}
+
+const void* compress_encode(pcompressEncoder e, const void* data, size_t len,
+                            size_t* outLen)
+{
+  e->stats.rawBytes += len;
+
+  if (_compress_isWorthwhile(e, data, len)) {
+    size_t n = ZSTD_compress2(e->cctx, e->frame, e->frameSize, data, len);
+    if (!ZSTD_isError(n) && n * COMPRESS_MIN_RATIO <= len) {
+      e->stats.compressedChunks++;
+      e->stats.wireBytes += n;
+      *outLen = n;
+      return e->frame;
+    }
+  }
+
+  e->stats.storedChunks++;
+  *outLen = _compress_storeFrame(e, data, len);
+  e->stats.wireBytes += *outLen;
+  return e->frame;
+}
+
+void compress_addSendTime(pcompressEncoder e, size_t bytes, double seconds)
+{
+  e->sendBytes += bytes;
+  e->sendSeconds += seconds;
+}
+
+const compressStats* compress_getEncoderStats(pcompressEncoder e)
+{
+  return &e->stats;
+}
+
+pcompressDecoder compress_D_newDecoder()
+{
+  pcompressDecoder d = calloc(1, sizeof(compressDecoder));
+  if (!d) return NULL;
+
+  d->dctx = ZSTD_createDCtx();
+  if (!d->dctx) {
+    fprintf(stderr, "Error allocating the zstd decoder\n");
+    free(d);
+    return NULL;
+  }
+  return d;
+}
+
+void compress_freeDecoder(pcompressDecoder d)
+{
+  if (!d) return;
+  ZSTD_freeDCtx(d->dctx);
+  free(d);
+}
+
+bool compress_decode(pcompressDecoder d, const void* in, size_t inLen,
+                     size_t* inUsed, void* out, size_t outSize,
+                     size_t* outLen)
+{
+  ZSTD_inBuffer input = { in, inLen, 0 };
+  ZSTD_outBuffer output = { out, outSize, 0 };
+
+  size_t rc = ZSTD_decompressStream(d->dctx, &output, &input);
+  if (ZSTD_isError(rc)) {
+    fprintf(stderr, "Error decompressing: %s\n", ZSTD_getErrorName(rc));
+    return false;
+  }
+
+  *inUsed = input.pos;
+  *outLen = output.pos;
+  d->stats.wireBytes += input.pos;
+  d->stats.rawBytes += output.pos;
+  return true;
+}
+
+const compressStats* compress_getDecoderStats(pcompressDecoder d)
+{
+  return &d->stats;
+}
+
+void compress_printStats(const compressStats* stats, double seconds)
+{
+  double ratio = stats->wireBytes ?
+                 (double)stats->rawBytes / stats->wireBytes : 1.0;
+  if (seconds <= 0) seconds = 1e-9;
+
+  printf("Compression: %zu bytes sent as %zu (%.2fx)",
+         stats->rawBytes, stats->wireBytes, ratio);
+  if (stats->compressedChunks + stats->storedChunks > 0)
+    printf(", %zu of %zu chunks compressed", stats->compressedChunks,
+           stats->compressedChunks + stats->storedChunks);
+  printf("\n  %.1f MB/s of data over %.1f MB/s on the network\n",
+         stats->rawBytes / seconds / 1e6, stats->wireBytes / seconds / 1e6);
+}
+
+#endif // SCP_HAVE_ZSTD
@@ -16,8 +16,78 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <libssh/callbacks.h>
+
+#include <cipherProbe.h>
 #include <connectSSH.h>
 #include <passwordPrompt.h>
+#include <scpOptions.h>
+#include <trace.h>
+
+// Offers the ciphers and MACs that were asked for, or else the ones that are
+// fastest on this machine first. Returns false if the ones that were asked
+// for can't be used.
+static bool _connectSSH_setAlgorithms(ssh_session session)
+{
+  pscpOptions options = scpOptions_get();
+  char ciphers[CIPHER_PROBE_LIST_SIZE];
+  char macs[CIPHER_PROBE_LIST_SIZE];
+  const char* cipherList = options->ciphers;
+  const char* macList = options->macs;
+
+  if ((!cipherList || !macList) && cipherProbe_getPreferences(ciphers, macs)) {
+    if (!cipherList) cipherList = ciphers;
+    if (!macList) macList = macs;
+  }
+
+  if (cipherList &&
+      (ssh_options_set(session, SSH_OPTIONS_CIPHERS_C_S, cipherList) < 0 ||
+       ssh_options_set(session, SSH_OPTIONS_CIPHERS_S_C, cipherList) < 0)) {
+    fprintf(stderr, "Error: can't use the ciphers %s: %s\n", cipherList,
+            ssh_get_error(session));
+    return false;
+  }
+  if (macList &&
+      (ssh_options_set(session, SSH_OPTIONS_HMAC_C_S, macList) < 0 ||
+       ssh_options_set(session, SSH_OPTIONS_HMAC_S_C, macList) < 0)) {
+    fprintf(stderr, "Error: can't use the MACs %s: %s\n", macList,
+            ssh_get_error(session));
+    return false;
+  }
+  return true;
+}
+
+// When tracing, libssh reports how far ssh_connect() has got, so that the
+// connect is timed apart from the key exchange without taking the socket
+// away from libssh (which would bypass a ProxyCommand). The callback runs
+// on the thread that calls ssh_connect().
+static __thread uint64_t _connectSSH_connectStart;
+static __thread uint64_t _connectSSH_keyExchangeStart;
+
+static void _connectSSH_traceStatus(void* userdata, float status)
+{
+  (void)userdata;
+
+  // 0.2 is reported once the socket is connected, or the ProxyCommand has
+  // been started
+  if (status < 0.2f || _connectSSH_keyExchangeStart != 0) return;
+  trace_end(TRACE_CONNECT, _connectSSH_connectStart, 0);
+  _connectSSH_keyExchangeStart = trace_begin();
+}
+
+static struct ssh_callbacks_struct _connectSSH_traceCallbacks = {
+  .size = sizeof(struct ssh_callbacks_struct),
+  .connect_status_function = _connectSSH_traceStatus
+};
+
+// Frees a session that couldn't be set up. Returns NULL for the caller to
+// return.
+static ssh_session _connectSSH_fail(ssh_session session)
+{
+  ssh_disconnect(session);
+  ssh_free(session);
+  return NULL;
+}
 
 // Even though ssh_session is already a pointer to a struct, the pointer gets
 // altered by ssh_new(). So we need to pass ssh_session into connectSession()
@@ -32,6 +102,7 @@ ssh_session connectSSH_getConnectedSession(psshInfo info)
 
   if (!info->host) {
     fprintf(stderr, "Error in connectSSH_getConnectedSession(). Host was not set.\n");
+    ssh_free(session);
     return NULL;
   }
 
@@ -50,14 +121,34 @@ ssh_session connectSSH_getConnectedSession(psshInfo info)
   }
   ssh_options_set(session, SSH_OPTIONS_PORT, &info->port);
 
+  if (!_connectSSH_setAlgorithms(session)) {
+    ssh_free(session);
+    return NULL;
+  }
+
+#ifndef SCP_HAVE_ZSTD
+  // Without zstd, the tar stream can't be compressed, so let ssh do it
+  if (scpOptions_get()->compress)
+    ssh_options_set(session, SSH_OPTIONS_COMPRESSION, "yes");
+#endif
+
   // Connect
+  uint64_t start = trace_begin();
+  _connectSSH_connectStart = start;
+  _connectSSH_keyExchangeStart = 0;
+  if (start != 0) ssh_set_callbacks(session, &_connectSSH_traceCallbacks);
   if (ssh_connect(session) != SSH_OK) {
     printf("SSH error: %s", ssh_get_error(session));
-    return NULL;
+    return _connectSSH_fail(session);
   }
+  // Without the status, the whole of ssh_connect() counts as key exchange
+  trace_end(TRACE_KEY_EXCHANGE, _connectSSH_keyExchangeStart ?
+                                _connectSSH_keyExchangeStart : start, 0);
 
   // Verify that host is known
+  start = trace_begin();
   int state = ssh_is_server_known(session);
+  trace_end(TRACE_HOST_KEY, start, 0);
   switch (state) {
   case SSH_SERVER_KNOWN_OK:
     break;
@@ -71,11 +162,11 @@ ssh_session connectSSH_getConnectedSession(psshInfo info)
     printf("Error. Host is not known.");
     // hlen = ssh_get_pubkey_hash(session, &hash);
     // hexa = ssh_get_hexa(hash, hlen);
-    return NULL;
+    return _connectSSH_fail(session);
   }
   case SSH_SERVER_ERROR:
     printf("SSH error: %s", ssh_get_error(session));
-    return NULL;
+    return _connectSSH_fail(session);
   }
 
   // Authenticate
@@ -83,10 +174,11 @@ ssh_session connectSSH_getConnectedSession(psshInfo info)
   int method;
 
   // Try to authenticate
+  start = trace_begin();
   rc = ssh_userauth_none(session, NULL);
   if (rc == SSH_AUTH_ERROR) {
     printf("SSH error: %s", ssh_get_error(session));
-    return NULL;
+    return _connectSSH_fail(session);
   }
 
   method = ssh_auth_list(session);
@@ -100,7 +192,7 @@ ssh_session connectSSH_getConnectedSession(psshInfo info)
       if (rc == SSH_AUTH_ERROR) {
         printf("Error during auth (pubkey)");
         printf("Error: %s", ssh_get_error(session));
-        return NULL;
+        return _connectSSH_fail(session);
       } else if (rc == SSH_AUTH_SUCCESS) {
         break;
       }
@@ -108,9 +200,18 @@ ssh_session connectSSH_getConnectedSession(psshInfo info)
 
     // Try to authenticate with password
     if (method & SSH_AUTH_METHOD_PASSWORD) {
-      char request[sizeof(char) * (34 + strlen(info->user) + strlen(info->host))];
-      snprintf(request, sizeof(request), "Please enter the password for %s@%s ", info->user, info->host);
-      snprintf(info->pass, PASS_SIZE, "%s", passwordPrompt_getPassword(request));
+      // Only prompt if we don't already have the password from an earlier
+      // session to the same host
+      if (info->pass[0] == '\0' && info->noPrompt) {
+        printf("Error. A password is needed for %s@%s\n", info->user,
+               info->host);
+        return _connectSSH_fail(session);
+      }
+      else if (info->pass[0] == '\0') {
+        char request[sizeof(char) * (34 + strlen(info->user) + strlen(info->host))];
+        snprintf(request, sizeof(request), "Please enter the password for %s@%s ", info->user, info->host);
+        snprintf(info->pass, PASS_SIZE, "%s", passwordPrompt_getPassword(request));
+      }
 
       rc = ssh_userauth_password(session,
                                  info->user,
@@ -118,17 +219,18 @@ ssh_session connectSSH_getConnectedSession(psshInfo info)
       if (rc == SSH_AUTH_ERROR) {
         printf("Error during auth (passwd)");
         printf("Error: %s", ssh_get_error(session));
-        return NULL;
+        return _connectSSH_fail(session);
       } else if (rc == SSH_AUTH_DENIED) {
         printf("Error. Authentication denied with passwd!\n");
-        return NULL;
+        return _connectSSH_fail(session);
       } else if (rc == SSH_AUTH_SUCCESS) {
         break;
       }
     }
 
-    return NULL;
+    return _connectSSH_fail(session);
   }
+  trace_end(TRACE_AUTH, start, 0);
   return session;
 }
 
@@ -0,0 +1,937 @@
+/**********************************************************************
+  delta.c - Source code for delta transfers, which only send the parts of
+            a file that the other end's old copy doesn't already have
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <checksum.h>
+#include <delta.h>
+#include <fileSystemUtils.h>
+#include <remoteExec.h>
+#include <scpOptions.h>
+#include <verify.h>
+
+// Both streams start with this, so that a helper that printed something
+// else is caught right away
+#define DELTA_MAGIC "SCPD"
+#define DELTA_MAGIC_SIZE 4
+
+// The operations that the new copy is built from
+#define DELTA_OP_LITERAL 'L'
+#define DELTA_OP_BLOCKS 'B'
+#define DELTA_OP_END 'E'
+
+// Literal data is sent in pieces of at most this size
+#define DELTA_MAX_LITERAL (64 * 1024)
+#define DELTA_BUFFER_SIZE (64 * 1024)
+
+// A path may grow up to four times when it is quoted for the shell
+#define DELTA_QUOTED_SIZE (4 * PATH_MAX + 3)
+#define DELTA_COMMAND_SIZE (2 * DELTA_QUOTED_SIZE + PATH_MAX + 256)
+
+// The exit statuses of the shell for a command that could not be run
+#define DELTA_EXIT_NOT_EXECUTABLE 126
+#define DELTA_EXIT_NOT_FOUND 127
+
+// The signature of one block of the receiver's old copy
+typedef struct {
+  uint32_t weak;
+  unsigned char strong[CHECKSUM_MD5_SIZE];
+} deltaBlock;
+
+// The signatures of all of the blocks, with a hash table on the weak
+// checksums. The blocks in a bucket are chained through next.
+typedef struct {
+  uint32_t blockSize;
+  size_t numBlocks;
+  deltaBlock* blocks;
+  size_t* buckets;
+  size_t* next;
+  size_t mask;
+} deltaSignature;
+
+typedef struct {
+  size_t literalBytes;
+  size_t matchedBytes;
+} deltaStats;
+
+// Our end of the conversation with the other side, which is either a
+// channel or our own stdin and stdout
+typedef struct {
+  // Reads up to len bytes. Returns 0 at the end of the stream and a
+  // negative number if it failed.
+  int (*read)(void* handle, void* data, size_t len);
+  bool (*write)(void* handle, const void* data, size_t len);
+  void* handle;
+  unsigned char in[DELTA_BUFFER_SIZE];
+  size_t inPos;
+  size_t inLen;
+  unsigned char out[DELTA_BUFFER_SIZE];
+  size_t outLen;
+} deltaPeer;
+
+static double _delta_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns a pointer to the last component of a path
+static const char* _delta_baseName(const char* path)
+{
+  const char* p = strrchr(path, '/');
+  return p ? p + 1 : path;
+}
+
+/*****************************************************************************
+ * Talking to the other side
+ *****************************************************************************/
+
+static int _delta_readChannel(void* handle, void* data, size_t len)
+{
+  ssh_channel channel = handle;
+  int n = ssh_channel_read(channel, data, len, 0);
+  if (n < 0) {
+    fprintf(stderr, "Error reading from the delta helper: %s\n",
+            ssh_get_error(ssh_channel_get_session(channel)));
+  }
+  remoteExec_forwardStderr(channel);
+  return n;
+}
+
+static bool _delta_writeChannel(void* handle, const void* data, size_t len)
+{
+  ssh_channel channel = handle;
+  size_t sent = 0;
+  while (sent < len) {
+    int n = ssh_channel_write(channel, (const char*)data + sent, len - sent);
+    if (n == SSH_ERROR) {
+      fprintf(stderr, "Error writing to the delta helper: %s\n",
+              ssh_get_error(ssh_channel_get_session(channel)));
+      return false;
+    }
+    sent += n;
+  }
+
+  // Don't let the helper block on a full stderr while we wait for it
+  remoteExec_forwardStderr(channel);
+  return true;
+}
+
+static int _delta_readStdin(void* handle, void* data, size_t len)
+{
+  (void)handle;
+  ssize_t n;
+  while ((n = read(STDIN_FILENO, data, len)) < 0 && errno == EINTR);
+  if (n < 0) fprintf(stderr, "Error reading stdin: %s\n", strerror(errno));
+  return n;
+}
+
+static bool _delta_writeAll(int fd, const void* data, size_t len)
+{
+  const char* p = data;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool _delta_writeStdout(void* handle, const void* data, size_t len)
+{
+  (void)handle;
+  if (_delta_writeAll(STDOUT_FILENO, data, len)) return true;
+  fprintf(stderr, "Error writing stdout: %s\n", strerror(errno));
+  return false;
+}
+
+static deltaPeer* _delta_D_newPeer(int (*readFunc)(void*, void*, size_t),
+                                   bool (*writeFunc)(void*, const void*,
+                                                     size_t),
+                                   void* handle)
+{
+  deltaPeer* p = malloc(sizeof(deltaPeer));
+  if (!p) {
+    fprintf(stderr, "Error allocating memory in %s\n", __FUNCTION__);
+    return NULL;
+  }
+  p->read = readFunc;
+  p->write = writeFunc;
+  p->handle = handle;
+  p->inPos = 0;
+  p->inLen = 0;
+  p->outLen = 0;
+  return p;
+}
+
+static bool _delta_read(deltaPeer* p, void* data, size_t len)
+{
+  unsigned char* dst = data;
+  while (len > 0) {
+    if (p->inPos == p->inLen) {
+      int n = p->read(p->handle, p->in, sizeof(p->in));
+      if (n <= 0) return false;
+      p->inPos = 0;
+      p->inLen = n;
+    }
+
+    size_t n = p->inLen - p->inPos;
+    if (n > len) n = len;
+    memcpy(dst, p->in + p->inPos, n);
+    p->inPos += n;
+    dst += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool _delta_flush(deltaPeer* p)
+{
+  if (p->outLen == 0) return true;
+  bool success = p->write(p->handle, p->out, p->outLen);
+  p->outLen = 0;
+  return success;
+}
+
+static bool _delta_write(deltaPeer* p, const void* data, size_t len)
+{
+  // Large pieces go straight out instead of through the buffer
+  if (len >= sizeof(p->out))
+    return _delta_flush(p) && p->write(p->handle, data, len);
+
+  if (p->outLen + len > sizeof(p->out) && !_delta_flush(p)) return false;
+  memcpy(p->out + p->outLen, data, len);
+  p->outLen += len;
+  return true;
+}
+
+// Numbers are sent big endian
+static bool _delta_write32(deltaPeer* p, uint32_t value)
+{
+  unsigned char bytes[4];
+  int i;
+  for (i = 0; i < 4; i++) bytes[i] = (value >> (24 - 8 * i)) & 0xff;
+  return _delta_write(p, bytes, sizeof(bytes));
+}
+
+static bool _delta_write64(deltaPeer* p, uint64_t value)
+{
+  return _delta_write32(p, value >> 32) &&
+         _delta_write32(p, value & 0xffffffff);
+}
+
+static bool _delta_read32(deltaPeer* p, uint32_t* value)
+{
+  unsigned char bytes[4];
+  if (!_delta_read(p, bytes, sizeof(bytes))) return false;
+  *value = ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) |
+           ((uint32_t)bytes[2] << 8) | bytes[3];
+  return true;
+}
+
+static bool _delta_read64(deltaPeer* p, uint64_t* value)
+{
+  uint32_t high;
+  uint32_t low;
+  if (!_delta_read32(p, &high) || !_delta_read32(p, &low)) return false;
+  *value = ((uint64_t)high << 32) | low;
+  return true;
+}
+
+// The sender's header holds the permissions of the new copy
+static bool _delta_sendHeader(deltaPeer* p, uint32_t mode)
+{
+  return _delta_write(p, DELTA_MAGIC, DELTA_MAGIC_SIZE) &&
+         _delta_write32(p, mode);
+}
+
+static bool _delta_readHeader(deltaPeer* p, uint32_t* mode)
+{
+  char magic[DELTA_MAGIC_SIZE];
+  return _delta_read(p, magic, sizeof(magic)) &&
+         memcmp(magic, DELTA_MAGIC, DELTA_MAGIC_SIZE) == 0 &&
+         _delta_read32(p, mode);
+}
+
+/*****************************************************************************
+ * Signatures
+ *****************************************************************************/
+
+// The square root of the size, rounded up to a multiple of the smallest
+// block size. Bigger blocks mean fewer signatures to send, but more data
+// to send again for each change.
+static uint32_t _delta_blockSize(size_t fileSize)
+{
+  uint64_t blockSize = DELTA_MIN_BLOCK_SIZE;
+  while (blockSize < DELTA_MAX_BLOCK_SIZE && blockSize * blockSize < fileSize)
+    blockSize += DELTA_MIN_BLOCK_SIZE;
+  return blockSize;
+}
+
+static bool _delta_preadAll(int fd, void* data, size_t len, off_t offset)
+{
+  char* p = data;
+  while (len > 0) {
+    ssize_t n = pread(fd, p, len, offset);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    offset += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Sends the signature of every whole block of the old copy. A trailing
+// partial block is never matched, and is sent again as literal data.
+static bool _delta_sendSignatures(deltaPeer* p, int fd, size_t fileSize,
+                                  uint32_t blockSize, const char* path)
+{
+  size_t numBlocks = fd >= 0 ? fileSize / blockSize : 0;
+  if (!_delta_write(p, DELTA_MAGIC, DELTA_MAGIC_SIZE) ||
+      !_delta_write32(p, blockSize) || !_delta_write64(p, numBlocks))
+    return false;
+
+  unsigned char* block = malloc(blockSize);
+  if (!block) {
+    fprintf(stderr, "Error allocating memory in %s\n", __FUNCTION__);
+    return false;
+  }
+
+  size_t i;
+  for (i = 0; i < numBlocks; ++i) {
+    if (!_delta_preadAll(fd, block, blockSize, (off_t)i * blockSize)) {
+      fprintf(stderr, "Error reading %s\n", path);
+      break;
+    }
+
+    unsigned char strong[CHECKSUM_MD5_SIZE];
+    checksum_md5(block, blockSize, strong);
+    if (!_delta_write32(p, checksum_weak(block, blockSize)) ||
+        !_delta_write(p, strong, sizeof(strong)))
+      break;
+  }
+
+  free(block);
+  return i == numBlocks && _delta_flush(p);
+}
+
+static size_t _delta_bucket(const deltaSignature* sig, uint32_t weak)
+{
+  return (size_t)((weak * 0x9e3779b97f4a7c15ULL) >> 32) & sig->mask;
+}
+
+static void _delta_freeSignature(deltaSignature* sig)
+{
+  free(sig->blocks);
+  free(sig->buckets);
+  free(sig->next);
+}
+
+static bool _delta_readSignature(deltaPeer* p, deltaSignature* sig)
+{
+  char magic[DELTA_MAGIC_SIZE];
+  uint64_t numBlocks;
+  memset(sig, 0, sizeof(deltaSignature));
+  if (!_delta_read(p, magic, sizeof(magic)) ||
+      memcmp(magic, DELTA_MAGIC, DELTA_MAGIC_SIZE) != 0 ||
+      !_delta_read32(p, &sig->blockSize) || !_delta_read64(p, &numBlocks))
+    return false;
+
+  if (sig->blockSize < DELTA_MIN_BLOCK_SIZE ||
+      sig->blockSize > DELTA_MAX_BLOCK_SIZE ||
+      numBlocks > SIZE_MAX / 4 / sizeof(deltaBlock)) {
+    fprintf(stderr, "Error: the block signatures are not valid\n");
+    return false;
+  }
+  sig->numBlocks = numBlocks;
+
+  size_t numBuckets = 16;
+  while (numBuckets < 2 * sig->numBlocks) numBuckets *= 2;
+  sig->mask = numBuckets - 1;
+
+  sig->blocks = malloc(sig->numBlocks * sizeof(deltaBlock) + 1);
+  sig->buckets = malloc(numBuckets * sizeof(size_t));
+  sig->next = malloc(sig->numBlocks * sizeof(size_t) + 1);
+  if (!sig->blocks || !sig->buckets || !sig->next) {
+    fprintf(stderr, "Error allocating memory in %s\n", __FUNCTION__);
+    _delta_freeSignature(sig);
+    return false;
+  }
+
+  size_t i;
+  for (i = 0; i < sig->numBlocks; ++i) {
+    if (!_delta_read32(p, &sig->blocks[i].weak) ||
+        !_delta_read(p, sig->blocks[i].strong, CHECKSUM_MD5_SIZE)) {
+      _delta_freeSignature(sig);
+      return false;
+    }
+  }
+
+  // Insert them backwards, so that each bucket lists its blocks in order
+  for (i = 0; i < numBuckets; ++i) sig->buckets[i] = SIZE_MAX;
+  for (i = sig->numBlocks; i-- > 0;) {
+    size_t bucket = _delta_bucket(sig, sig->blocks[i].weak);
+    sig->next[i] = sig->buckets[bucket];
+    sig->buckets[bucket] = i;
+  }
+  return true;
+}
+
+/*****************************************************************************
+ * Sending
+ *****************************************************************************/
+
+static bool _delta_sendLiteral(deltaPeer* p, const unsigned char* data,
+                               size_t len, deltaStats* stats)
+{
+  while (len > 0) {
+    size_t n = len < DELTA_MAX_LITERAL ? len : DELTA_MAX_LITERAL;
+    unsigned char op = DELTA_OP_LITERAL;
+    if (!_delta_write(p, &op, 1) || !_delta_write32(p, n) ||
+        !_delta_write(p, data, n))
+      return false;
+    stats->literalBytes += n;
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+// A run of consecutive blocks is sent as one reference
+static bool _delta_sendBlocks(deltaPeer* p, size_t first, size_t count,
+                              uint32_t blockSize, deltaStats* stats)
+{
+  if (count == 0) return true;
+  unsigned char op = DELTA_OP_BLOCKS;
+  stats->matchedBytes += count * blockSize;
+  return _delta_write(p, &op, 1) && _delta_write64(p, first) &&
+         _delta_write64(p, count);
+}
+
+// Returns the index of a block of the old copy that is the same as data,
+// or SIZE_MAX if there is none. The expected block (the one after the last
+// match) is tried first, so that unchanged stretches become long runs.
+static size_t _delta_findBlock(const deltaSignature* sig, uint32_t weak,
+                               const unsigned char* data, size_t expected)
+{
+  unsigned char strong[CHECKSUM_MD5_SIZE];
+  bool haveStrong = false;
+
+  if (expected < sig->numBlocks && sig->blocks[expected].weak == weak) {
+    checksum_md5(data, sig->blockSize, strong);
+    haveStrong = true;
+    if (memcmp(strong, sig->blocks[expected].strong, CHECKSUM_MD5_SIZE) == 0)
+      return expected;
+  }
+
+  size_t i;
+  for (i = sig->buckets[_delta_bucket(sig, weak)]; i != SIZE_MAX;
+       i = sig->next[i]) {
+    if (sig->blocks[i].weak != weak || i == expected) continue;
+    if (!haveStrong) {
+      checksum_md5(data, sig->blockSize, strong);
+      haveStrong = true;
+    }
+    if (memcmp(strong, sig->blocks[i].strong, CHECKSUM_MD5_SIZE) == 0)
+      return i;
+  }
+  return SIZE_MAX;
+}
+
+// Looks for the old copy's blocks at every offset of the new copy, and
+// sends references to them along with the data in between
+static bool _delta_sendDelta(deltaPeer* p, const unsigned char* data,
+                             size_t size, const deltaSignature* sig,
+                             deltaStats* stats)
+{
+  size_t blockSize = sig->blockSize;
+  size_t pos = 0;
+  size_t literalStart = 0;
+  size_t runFirst = 0;
+  size_t runCount = 0;
+  size_t nextBlock = 0;
+  uint32_t weak = 0;
+  bool haveWeak = false;
+
+  while (sig->numBlocks > 0 && pos + blockSize <= size) {
+    if (!haveWeak) {
+      weak = checksum_weak(data + pos, blockSize);
+      haveWeak = true;
+    }
+
+    size_t block = _delta_findBlock(sig, weak, data + pos, nextBlock);
+    if (block != SIZE_MAX) {
+      if (pos > literalStart) {
+        if (!_delta_sendBlocks(p, runFirst, runCount, blockSize, stats) ||
+            !_delta_sendLiteral(p, data + literalStart, pos - literalStart,
+                                stats))
+          return false;
+        runCount = 0;
+      }
+      else if (runCount > 0 && block != runFirst + runCount) {
+        if (!_delta_sendBlocks(p, runFirst, runCount, blockSize, stats))
+          return false;
+        runCount = 0;
+      }
+
+      if (runCount == 0) runFirst = block;
+      runCount++;
+      nextBlock = block + 1;
+      pos += blockSize;
+      literalStart = pos;
+      haveWeak = false;
+      continue;
+    }
+
+    // Send what doesn't match as we go, rather than all at the end
+    if (pos - literalStart >= DELTA_MAX_LITERAL) {
+      if (!_delta_sendBlocks(p, runFirst, runCount, blockSize, stats) ||
+          !_delta_sendLiteral(p, data + literalStart, pos - literalStart,
+                              stats))
+        return false;
+      runCount = 0;
+      literalStart = pos;
+    }
+
+    if (pos + blockSize < size)
+      weak = checksum_roll(weak, data[pos], data[pos + blockSize], blockSize);
+    pos++;
+  }
+
+  if (!_delta_sendBlocks(p, runFirst, runCount, blockSize, stats) ||
+      !_delta_sendLiteral(p, data + literalStart, size - literalStart, stats))
+    return false;
+
+  // The receiver checks the whole file against this
+  unsigned char digest[CHECKSUM_MD5_SIZE];
+  unsigned char op = DELTA_OP_END;
+  checksum_md5(data, size, digest);
+  return _delta_write(p, &op, 1) && _delta_write64(p, size) &&
+         _delta_write(p, digest, sizeof(digest)) && _delta_flush(p);
+}
+
+/*****************************************************************************
+ * Receiving
+ *****************************************************************************/
+
+// Writes the new copy to outFd from the operations that are read from p.
+// Block references are read from basisFd.
+static bool _delta_applyDelta(deltaPeer* p, int basisFd, uint32_t blockSize,
+                              int outFd, deltaStats* stats)
+{
+  unsigned char* buffer = malloc(DELTA_MAX_BLOCK_SIZE);
+  if (!buffer) {
+    fprintf(stderr, "Error allocating memory in %s\n", __FUNCTION__);
+    return false;
+  }
+
+  md5Context ctx;
+  checksum_md5Init(&ctx);
+  uint64_t written = 0;
+  bool success = false;
+
+  for (;;) {
+    unsigned char op;
+    if (!_delta_read(p, &op, 1)) {
+      fprintf(stderr, "Error: the delta ended early\n");
+      break;
+    }
+
+    if (op == DELTA_OP_LITERAL) {
+      uint32_t len;
+      if (!_delta_read32(p, &len) || len > DELTA_MAX_LITERAL ||
+          !_delta_read(p, buffer, len)) {
+        fprintf(stderr, "Error reading the literal data of the delta\n");
+        break;
+      }
+      if (!_delta_writeAll(outFd, buffer, len)) {
+        fprintf(stderr, "Error writing the new copy: %s\n", strerror(errno));
+        break;
+      }
+      checksum_md5Update(&ctx, buffer, len);
+      stats->literalBytes += len;
+      written += len;
+    }
+
+    else if (op == DELTA_OP_BLOCKS) {
+      uint64_t first;
+      uint64_t count;
+      if (!_delta_read64(p, &first) || !_delta_read64(p, &count) ||
+          basisFd < 0 || first > UINT64_MAX / blockSize ||
+          count > UINT64_MAX / blockSize - first) {
+        fprintf(stderr, "Error: the delta refers to blocks that don't "
+                        "exist\n");
+        break;
+      }
+
+      uint64_t offset = first * blockSize;
+      uint64_t end = (first + count) * blockSize;
+      while (offset < end) {
+        if (!_delta_preadAll(basisFd, buffer, blockSize, offset)) {
+          fprintf(stderr, "Error reading block %llu of the old copy\n",
+                  (unsigned long long)(offset / blockSize));
+          break;
+        }
+        if (!_delta_writeAll(outFd, buffer, blockSize)) {
+          fprintf(stderr, "Error writing the new copy: %s\n",
+                  strerror(errno));
+          break;
+        }
+        checksum_md5Update(&ctx, buffer, blockSize);
+        offset += blockSize;
+      }
+      if (offset < end) break;
+      stats->matchedBytes += count * blockSize;
+      written += count * blockSize;
+    }
+
+    else if (op == DELTA_OP_END) {
+      uint64_t size;
+      unsigned char expected[CHECKSUM_MD5_SIZE];
+      unsigned char actual[CHECKSUM_MD5_SIZE];
+      if (!_delta_read64(p, &size) ||
+          !_delta_read(p, expected, sizeof(expected))) {
+        fprintf(stderr, "Error: the delta ended early\n");
+        break;
+      }
+
+      checksum_md5Final(&ctx, actual);
+      success = size == written &&
+                memcmp(expected, actual, CHECKSUM_MD5_SIZE) == 0;
+      if (!success)
+        fprintf(stderr, "Error: the new copy built from the delta does not "
+                        "match the original\n");
+      break;
+    }
+
+    else {
+      fprintf(stderr, "Error: unknown operation in the delta\n");
+      break;
+    }
+  }
+
+  free(buffer);
+  return success;
+}
+
+// Builds the new copy in a temporary file next to path, and renames it
+// over path once its digest has been checked
+static bool _delta_receive(deltaPeer* p, const char* path, int basisFd,
+                           uint32_t blockSize, mode_t mode, deltaStats* stats)
+{
+  char tempPath[PATH_MAX];
+  if (snprintf(tempPath, PATH_MAX, "%s.delta.XXXXXX", path) >= PATH_MAX) {
+    fprintf(stderr, "Error: path too long for %s\n", path);
+    return false;
+  }
+
+  int fd = mkstemp(tempPath);
+  if (fd < 0) {
+    fprintf(stderr, "Error creating %s: %s\n", tempPath, strerror(errno));
+    return false;
+  }
+
+  bool success = _delta_applyDelta(p, basisFd, blockSize, fd, stats);
+  if (success && fchmod(fd, mode) != 0) {
+    fprintf(stderr, "Error setting the permissions of %s: %s\n", tempPath,
+            strerror(errno));
+    success = false;
+  }
+  if (close(fd) != 0) success = false;
+
+  if (success && rename(tempPath, path) != 0) {
+    fprintf(stderr, "Error renaming %s to %s: %s\n", tempPath, path,
+            strerror(errno));
+    success = false;
+  }
+  if (!success) unlink(tempPath);
+  return success;
+}
+
+/*****************************************************************************
+ * The helper on the server
+ *****************************************************************************/
+
+int delta_serveReceive(const char* path)
+{
+  deltaPeer* p = _delta_D_newPeer(_delta_readStdin, _delta_writeStdout, NULL);
+  if (!p) return 1;
+
+  // If there is no old copy yet, everything is sent as literal data
+  struct stat st;
+  int basisFd = open(path, O_RDONLY | O_CLOEXEC);
+  if (basisFd >= 0 && (fstat(basisFd, &st) != 0 || !S_ISREG(st.st_mode))) {
+    close(basisFd);
+    basisFd = -1;
+  }
+  size_t basisSize = basisFd >= 0 ? (size_t)st.st_size : 0;
+  uint32_t blockSize = _delta_blockSize(basisSize);
+
+  uint32_t mode;
+  deltaStats stats = { 0, 0 };
+  bool success = _delta_sendSignatures(p, basisFd, basisSize, blockSize,
+                                       path) &&
+                 _delta_readHeader(p, &mode);
+
+  if (success) {
+    // An existing file keeps its permissions, as it would with scp
+    if (basisFd >= 0) mode = st.st_mode;
+    else {
+      mode_t mask = umask(0);
+      umask(mask);
+      mode &= ~mask;
+    }
+    success = _delta_receive(p, path, basisFd, blockSize,
+                             mode & (S_IRWXU | S_IRWXG | S_IRWXO), &stats);
+  }
+
+  if (basisFd >= 0) close(basisFd);
+  free(p);
+  return success ? 0 : 1;
+}
+
+int delta_serveSend(const char* path)
+{
+  struct stat st;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    if (fd >= 0) close(fd);
+    return DELTA_EXIT_NOT_FILE;
+  }
+
+  size_t size = st.st_size;
+  unsigned char* data = NULL;
+  if (size > 0) {
+    data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      fprintf(stderr, "Error mapping %s: %s\n", path, strerror(errno));
+      close(fd);
+      return 1;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+
+  deltaPeer* p = _delta_D_newPeer(_delta_readStdin, _delta_writeStdout, NULL);
+  deltaSignature sig;
+  deltaStats stats = { 0, 0 };
+
+  // The header goes out first, so that the other side knows that we are
+  // here before it sends the signatures
+  bool success = p && _delta_sendHeader(p, st.st_mode & 07777) &&
+                 _delta_flush(p) && _delta_readSignature(p, &sig);
+  if (success) {
+    success = _delta_sendDelta(p, data, size, &sig, &stats);
+    _delta_freeSignature(&sig);
+  }
+
+  if (data) munmap(data, size);
+  free(p);
+  return success ? 0 : 1;
+}
+
+/*****************************************************************************
+ * Our end
+ *****************************************************************************/
+
+// Works out what happened from the helper's exit status
+static int _delta_result(bool success, int status)
+{
+  if (success && status == 0) return DELTA_OK;
+
+  if (status == DELTA_EXIT_NOT_FILE) return DELTA_UNAVAILABLE;
+  if (status == DELTA_EXIT_NOT_FOUND || status == DELTA_EXIT_NOT_EXECUTABLE) {
+    fprintf(stderr, "Warning: could not run the delta helper %s on the "
+                    "server. Copying the whole file instead.\n",
+            scpOptions_get()->deltaHelper);
+    return DELTA_UNAVAILABLE;
+  }
+
+  if (status != 0)
+    fprintf(stderr, "Error: the delta helper exited with status %i\n",
+            status);
+  return DELTA_FAILED;
+}
+
+static void _delta_printStats(const char* name, const deltaStats* stats,
+                              double seconds)
+{
+  size_t total = stats->literalBytes + stats->matchedBytes;
+  printf("Delta: %s: %zu of %zu bytes were already there, %zu were sent "
+         "(%.1f s)\n", name, stats->matchedBytes, total, stats->literalBytes,
+         seconds);
+}
+
+int delta_copyToServer(ssh_session session, const char* from, const char* to)
+{
+  const char* helper = scpOptions_get()->deltaHelper;
+  if (!helper) return DELTA_UNAVAILABLE;
+
+  // Anything that isn't a large regular file is left for scp, which also
+  // reports the errors
+  struct stat st;
+  int fd = open(from, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return DELTA_UNAVAILABLE;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+      st.st_size < DELTA_MIN_FILE_SIZE) {
+    close(fd);
+    return DELTA_UNAVAILABLE;
+  }
+
+  char quotedTo[DELTA_QUOTED_SIZE];
+  char quotedBase[DELTA_QUOTED_SIZE];
+  char command[DELTA_COMMAND_SIZE];
+  if (strlen(helper) >= PATH_MAX ||
+      !remoteExec_quote(to, quotedTo, sizeof(quotedTo)) ||
+      !remoteExec_quote(_delta_baseName(from), quotedBase,
+                        sizeof(quotedBase))) {
+    fprintf(stderr, "Error: path too long in %s\n", __FUNCTION__);
+    close(fd);
+    return DELTA_FAILED;
+  }
+
+  // Like scp, copy into the destination if it is a directory
+  snprintf(command, sizeof(command),
+           "d=%s; if [ -d \"$d\" ]; then d=\"$d\"/%s; fi; "
+           "exec %s --delta-receive -- \"$d\"",
+           quotedTo, quotedBase, helper);
+
+  size_t size = st.st_size;
+  unsigned char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Error mapping %s: %s\n", from, strerror(errno));
+    return DELTA_FAILED;
+  }
+  madvise(data, size, MADV_SEQUENTIAL);
+
+  double start = _delta_now();
+  ssh_channel channel = remoteExec_D_open(session, command);
+  if (!channel) {
+    munmap(data, size);
+    return DELTA_FAILED;
+  }
+
+  deltaPeer* p = _delta_D_newPeer(_delta_readChannel, _delta_writeChannel,
+                                  channel);
+  deltaSignature sig;
+  deltaStats stats = { 0, 0 };
+
+  bool success = p && _delta_readSignature(p, &sig);
+  if (success) {
+    success = _delta_sendHeader(p, st.st_mode & 07777) &&
+              _delta_sendDelta(p, data, size, &sig, &stats);
+    _delta_freeSignature(&sig);
+  }
+
+  int rc = _delta_result(success, remoteExec_close(channel));
+  if (rc == DELTA_OK)
+    _delta_printStats(from, &stats, _delta_now() - start);
+
+  free(p);
+  munmap(data, size);
+
+  // The delta isn't hashed as it goes, so the whole file is checked after
+  char remoteDest[PATH_MAX];
+  if (rc == DELTA_OK && scpOptions_get()->verify) {
+    if (!verify_getRemoteDest(session, from, to, remoteDest))
+      fprintf(stderr, "Warning: can't find %s on the server to verify it\n",
+              to);
+    else if (!verify_checkFile(session, from, remoteDest))
+      rc = DELTA_FAILED;
+  }
+  return rc;
+}
+
+int delta_copyFromServer(ssh_session session, const char* from,
+                         const char* to)
+{
+  const char* helper = scpOptions_get()->deltaHelper;
+  if (!helper) return DELTA_UNAVAILABLE;
+
+  // Like scp, copy into the destination if it is a directory
+  char dest[PATH_MAX];
+  if (fileSystemUtils_getFileType(to) == FILE_IS_DIR)
+    snprintf(dest, PATH_MAX, "%s/%s", to, _delta_baseName(from));
+  else
+    snprintf(dest, PATH_MAX, "%s", to);
+
+  // There is nothing to gain without a large old copy
+  struct stat st;
+  int basisFd = open(dest, O_RDONLY | O_CLOEXEC);
+  if (basisFd < 0) return DELTA_UNAVAILABLE;
+  if (fstat(basisFd, &st) != 0 || !S_ISREG(st.st_mode) ||
+      st.st_size < DELTA_MIN_FILE_SIZE) {
+    close(basisFd);
+    return DELTA_UNAVAILABLE;
+  }
+
+  char quotedFrom[DELTA_QUOTED_SIZE];
+  char command[DELTA_COMMAND_SIZE];
+  if (strlen(helper) >= PATH_MAX ||
+      !remoteExec_quote(from, quotedFrom, sizeof(quotedFrom))) {
+    fprintf(stderr, "Error: path too long in %s\n", __FUNCTION__);
+    close(basisFd);
+    return DELTA_FAILED;
+  }
+  snprintf(command, sizeof(command), "exec %s --delta-send -- %s", helper,
+           quotedFrom);
+
+  double start = _delta_now();
+  ssh_channel channel = remoteExec_D_open(session, command);
+  if (!channel) {
+    close(basisFd);
+    return DELTA_FAILED;
+  }
+
+  deltaPeer* p = _delta_D_newPeer(_delta_readChannel, _delta_writeChannel,
+                                  channel);
+  uint32_t blockSize = _delta_blockSize(st.st_size);
+  uint32_t mode;
+  deltaStats stats = { 0, 0 };
+
+  // The old copy keeps its permissions, as it would with scp
+  bool success = p && _delta_readHeader(p, &mode) &&
+                 _delta_sendSignatures(p, basisFd, st.st_size, blockSize,
+                                       dest) &&
+                 _delta_receive(p, dest, basisFd, blockSize,
+                                st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO),
+                                &stats);
+
+  int rc = _delta_result(success, remoteExec_close(channel));
+  if (rc == DELTA_OK)
+    _delta_printStats(dest, &stats, _delta_now() - start);
+  if (rc == DELTA_OK && !verify_checkFile(session, dest, from))
+    rc = DELTA_FAILED;
+
+  free(p);
+  close(basisFd);
+  return rc;
+}
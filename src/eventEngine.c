@@ -0,0 +1,1058 @@
+/**********************************************************************
+  eventEngine.c - Source code for the event loop that copies many files
+                  at once over non-blocking channels in a single thread
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <bufferPool.h>
+#include <connectSSH.h>
+#include <eventEngine.h>
+#include <progress.h>
+#include <remoteExec.h>
+#include <scpOptions.h>
+#include <trace.h>
+
+// Each file has this many buffers of this size, so that one can be on the
+// disk while another is on the channel
+#define ENGINE_BUFFER_SIZE (128 * 1024)
+#define ENGINE_NUM_BUFFERS 2
+// The number of threads that do the disk work of every file
+#define ENGINE_DISK_THREADS 4
+// How long the loop waits when nothing can move, in milliseconds
+#define ENGINE_POLL_TIMEOUT 100
+// Room for "C0644 <size> <name>\n" and for the messages of the server
+#define ENGINE_LINE_SIZE (PATH_MAX + 64)
+
+// The steps of copying one file. Uploads go through the steps that start
+// with UPLOAD and downloads through the ones that start with DOWNLOAD.
+typedef enum {
+  // Waiting for a session that has room for another channel
+  STATE_WAIT_CHANNEL,
+  STATE_OPEN_CHANNEL,
+  STATE_EXEC,
+  // The disk threads open the local file and stat it
+  STATE_UPLOAD_OPEN_FILE,
+  // scp -t says that it is ready
+  STATE_UPLOAD_READY,
+  STATE_UPLOAD_SEND_HEADER,
+  STATE_UPLOAD_HEADER_ACK,
+  STATE_UPLOAD_DATA,
+  STATE_UPLOAD_SEND_END,
+  STATE_UPLOAD_END_ACK,
+  // Tell scp -f to start
+  STATE_DOWNLOAD_SEND_READY,
+  STATE_DOWNLOAD_READ_HEADER,
+  // The disk threads create the local file
+  STATE_DOWNLOAD_CREATE_FILE,
+  STATE_DOWNLOAD_SEND_HEADER_ACK,
+  STATE_DOWNLOAD_DATA,
+  // scp -f says that all of the data was sent
+  STATE_DOWNLOAD_END_ACK,
+  STATE_DOWNLOAD_SEND_END_ACK,
+  // Waiting for the last writes to reach the disk
+  STATE_DOWNLOAD_FLUSH,
+  // The disk threads close the local file
+  STATE_CLOSE_FILE,
+  STATE_DONE,
+  STATE_FAILED
+} transferState;
+
+// What a buffer is being used for
+typedef enum {
+  BUFFER_FREE,
+  // A disk thread is reading into it or writing it out
+  BUFFER_DISK,
+  // Uploads: it is full and waits to be sent. Downloads: it is being
+  // received into.
+  BUFFER_CHANNEL
+} bufferState;
+
+typedef struct transfer transfer;
+
+typedef struct {
+  char* data;
+  bufferState state;
+  // The offset in the file of data, its length, and how much of it has
+  // been sent or received
+  size_t offset;
+  size_t len;
+  size_t done;
+} engineBuffer;
+
+typedef enum {
+  DISK_OPEN_READ,
+  DISK_CREATE,
+  DISK_READ,
+  DISK_WRITE,
+  DISK_CLOSE
+} diskOpType;
+
+// A piece of disk work. Each transfer has one for its file and one for
+// each buffer, so none are allocated while the copy runs.
+typedef struct diskOp {
+  diskOpType type;
+  transfer* t;
+  // NULL for the ops on the file itself
+  engineBuffer* buffer;
+  bool ok;
+  struct diskOp* next;
+} diskOp;
+
+// The threads that do the disk work. Ops are handed back on the done list,
+// and the loop is woken through eventFd.
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  diskOp* todoHead;
+  diskOp* todoTail;
+  diskOp* done;
+  bool isStopping;
+  int eventFd;
+  pthread_t threads[ENGINE_DISK_THREADS];
+  int numThreads;
+} diskPool;
+
+typedef struct {
+  ssh_session session;
+  // The sessions after the first are connected and disconnected here
+  bool isOwned;
+  int numChannels;
+  // Lowered when the server refuses to open another channel
+  int maxChannels;
+} engineSession;
+
+struct transfer {
+  engineJob* job;
+  engineSession* session;
+  ssh_channel channel;
+  transferState state;
+  char command[ENGINE_LINE_SIZE];
+
+  // The local file
+  int fd;
+  size_t size;
+  int permissions;
+
+  // A control line that is being sent or received
+  char line[ENGINE_LINE_SIZE];
+  size_t lineLen;
+  size_t lineDone;
+  // The server replied with an error, whose message is in line
+  bool isReadingError;
+
+  engineBuffer buffers[ENGINE_NUM_BUFFERS];
+  size_t channelBytes;
+  // Uploads: the bytes that have been handed to the disk threads to read
+  size_t diskBytes;
+
+  diskOp fileOp;
+  diskOp bufferOps[ENGINE_NUM_BUFFERS];
+  // The ops that the disk threads still have. The transfer is not freed
+  // until this is 0.
+  int numDiskOps;
+
+  pprogressFile progress;
+  traceFile trace;
+  transfer* next;
+};
+
+typedef struct {
+  engineJob* jobs;
+  size_t numJobs;
+  size_t nextJob;
+  bool isDownload;
+
+  engineSession* sessions;
+  int numSessions;
+  transfer* transfers;
+
+  ssh_event event;
+  diskPool pool;
+  bool success;
+  // Set once a file fails, so that no more are started
+  bool isCanceled;
+} engine;
+
+static const char* _eventEngine_baseName(const char* path)
+{
+  const char* p = strrchr(path, '/');
+  return p ? p + 1 : path;
+}
+
+static bool _eventEngine_doDiskOp(diskOp* op)
+{
+  transfer* t = op->t;
+  engineBuffer* b = op->buffer;
+  struct stat st;
+  size_t done = 0;
+
+  switch (op->type) {
+    case DISK_OPEN_READ:
+      t->fd = open(t->job->from, O_RDONLY | O_CLOEXEC);
+      if (t->fd < 0 || fstat(t->fd, &st) != 0) {
+        fprintf(stderr, "Error opening %s: %s\n", t->job->from,
+                strerror(errno));
+        return false;
+      }
+      t->size = st.st_size;
+      t->permissions = st.st_mode & 07777;
+      posix_fadvise(t->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+      return true;
+    case DISK_CREATE:
+      t->fd = open(t->job->to, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                   0666);
+      if (t->fd < 0) {
+        fprintf(stderr, "Error opening %s for writing: %s\n", t->job->to,
+                strerror(errno));
+        return false;
+      }
+      return true;
+    case DISK_READ:
+      while (done < b->len) {
+        ssize_t rc = pread(t->fd, b->data + done, b->len - done,
+                           b->offset + done);
+        if (rc < 0 && errno == EINTR) continue;
+        if (rc <= 0) {
+          fprintf(stderr, "Error reading %s: %s\n", t->job->from,
+                  rc < 0 ? strerror(errno) : "the file shrank");
+          return false;
+        }
+        done += rc;
+      }
+      return true;
+    case DISK_WRITE:
+      while (done < b->len) {
+        ssize_t rc = pwrite(t->fd, b->data + done, b->len - done,
+                            b->offset + done);
+        if (rc < 0 && errno == EINTR) continue;
+        if (rc < 0) {
+          fprintf(stderr, "Error writing %s: %s\n", t->job->to,
+                  strerror(errno));
+          return false;
+        }
+        done += rc;
+      }
+      return true;
+    case DISK_CLOSE:
+      if (close(t->fd) != 0) {
+        fprintf(stderr, "Error closing the local copy of %s: %s\n",
+                t->job->from, strerror(errno));
+        t->fd = -1;
+        return false;
+      }
+      t->fd = -1;
+      return true;
+  }
+  return false;
+}
+
+static void* _eventEngine_runDiskThread(void* arg)
+{
+  diskPool* pool = arg;
+
+  pthread_mutex_lock(&pool->mutex);
+  while (true) {
+    while (!pool->todoHead && !pool->isStopping)
+      pthread_cond_wait(&pool->cond, &pool->mutex);
+    if (!pool->todoHead) break;
+
+    diskOp* op = pool->todoHead;
+    pool->todoHead = op->next;
+    if (!pool->todoHead) pool->todoTail = NULL;
+    pthread_mutex_unlock(&pool->mutex);
+
+    op->ok = _eventEngine_doDiskOp(op);
+
+    pthread_mutex_lock(&pool->mutex);
+    op->next = pool->done;
+    pool->done = op;
+    uint64_t one = 1;
+    if (write(pool->eventFd, &one, sizeof(one)) < 0) {
+      // The counter can't overflow, and the loop polls anyway
+    }
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return NULL;
+}
+
+static bool _eventEngine_startDiskPool(diskPool* pool)
+{
+  memset(pool, 0, sizeof(*pool));
+  pool->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (pool->eventFd < 0) return false;
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+
+  int i;
+  for (i = 0; i < ENGINE_DISK_THREADS; ++i) {
+    if (scpOptions_startThread(&pool->threads[i], _eventEngine_runDiskThread,
+                               pool) != 0)
+      break;
+    pool->numThreads++;
+  }
+  return pool->numThreads > 0;
+}
+
+static void _eventEngine_stopDiskPool(diskPool* pool)
+{
+  pthread_mutex_lock(&pool->mutex);
+  pool->isStopping = true;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->mutex);
+
+  int i;
+  for (i = 0; i < pool->numThreads; ++i)
+    pthread_join(pool->threads[i], NULL);
+
+  pthread_mutex_destroy(&pool->mutex);
+  pthread_cond_destroy(&pool->cond);
+  if (pool->eventFd >= 0) close(pool->eventFd);
+}
+
+static void _eventEngine_submit(engine* e, diskOp* op, diskOpType type)
+{
+  op->type = type;
+  op->next = NULL;
+  op->t->numDiskOps++;
+
+  pthread_mutex_lock(&e->pool.mutex);
+  if (e->pool.todoTail) e->pool.todoTail->next = op;
+  else e->pool.todoHead = op;
+  e->pool.todoTail = op;
+  pthread_cond_signal(&e->pool.cond);
+  pthread_mutex_unlock(&e->pool.mutex);
+}
+
+// Called by ssh_event_dopoll() when disk ops have finished. The ops are
+// taken off the done list afterwards, so this only clears the eventfd.
+static int _eventEngine_onDiskDone(socket_t fd, int revents, void* userData)
+{
+  (void)revents;
+  (void)userData;
+  uint64_t count;
+  if (read(fd, &count, sizeof(count)) < 0) {
+    // Another wakeup already cleared it
+  }
+  return 0;
+}
+
+static void _eventEngine_sendLine(transfer* t, transferState state,
+                                  const char* line, size_t len)
+{
+  memcpy(t->line, line, len);
+  t->lineLen = len;
+  t->lineDone = 0;
+  t->state = state;
+}
+
+static void _eventEngine_fail(engine* e, transfer* t, const char* message)
+{
+  if (message)
+    fprintf(stderr, "Error copying %s: %s\n", t->job->from, message);
+  if (t->channel) remoteExec_forwardStderr(t->channel);
+  t->state = STATE_FAILED;
+  e->success = false;
+  e->isCanceled = true;
+}
+
+// Applies the result of a finished disk op. Only the loop's thread
+// changes the transfers, so this is where the disk threads' work becomes
+// visible to it.
+static void _eventEngine_finishDiskOp(engine* e, diskOp* op)
+{
+  transfer* t = op->t;
+  t->numDiskOps--;
+  if (t->state == STATE_FAILED) return;
+  if (!op->ok) {
+    _eventEngine_fail(e, t, NULL);
+    return;
+  }
+
+  if (op->buffer) {
+    // Uploads send the buffer that was read, downloads reuse the one that
+    // was written
+    op->buffer->state = e->isDownload ? BUFFER_FREE : BUFFER_CHANNEL;
+    return;
+  }
+
+  switch (op->type) {
+    case DISK_OPEN_READ:
+      t->progress = progress_beginFile(t->job->from, t->size);
+      t->state = STATE_OPEN_CHANNEL;
+      break;
+    case DISK_CREATE:
+      _eventEngine_sendLine(t, STATE_DOWNLOAD_SEND_HEADER_ACK, "", 1);
+      break;
+    case DISK_CLOSE:
+      t->state = STATE_DONE;
+      break;
+    default:
+      break;
+  }
+}
+
+static bool _eventEngine_collectDiskOps(engine* e)
+{
+  pthread_mutex_lock(&e->pool.mutex);
+  diskOp* op = e->pool.done;
+  e->pool.done = NULL;
+  pthread_mutex_unlock(&e->pool.mutex);
+
+  bool any = op != NULL;
+  while (op) {
+    diskOp* next = op->next;
+    _eventEngine_finishDiskOp(e, op);
+    op = next;
+  }
+  return any;
+}
+
+// Reads what has arrived on the channel, up to len bytes. Returns the
+// number of bytes, 0 if nothing has arrived yet and -1 if the channel
+// failed or ended.
+static int _eventEngine_read(transfer* t, void* data, size_t len)
+{
+  int rc = ssh_channel_read_nonblocking(t->channel, data, len, 0);
+  if (rc > 0) return rc;
+  if ((rc == 0 || rc == SSH_AGAIN) && !ssh_channel_is_eof(t->channel))
+    return 0;
+  return -1;
+}
+
+// Sends what is left of t->line. Returns 1 once it is sent, 0 if the
+// channel has no room yet and -1 on an error.
+static int _eventEngine_writeLine(transfer* t)
+{
+  while (t->lineDone < t->lineLen) {
+    uint32_t window = ssh_channel_window_size(t->channel);
+    if (window == 0) return 0;
+    size_t len = t->lineLen - t->lineDone;
+    if (len > window) len = window;
+    int rc = ssh_channel_write(t->channel, t->line + t->lineDone, len);
+    if (rc == SSH_ERROR) return -1;
+    if (rc <= 0) return 0;
+    t->lineDone += rc;
+  }
+  return 1;
+}
+
+// Reads the rest of a line into t->line. Returns 1 once it ends in '\n',
+// 0 if more has to arrive first and -1 on an error.
+static int _eventEngine_readLine(transfer* t)
+{
+  while (true) {
+    char c;
+    int rc = _eventEngine_read(t, &c, 1);
+    if (rc <= 0) return rc;
+    if (c == '\n') {
+      t->line[t->lineLen] = '\0';
+      return 1;
+    }
+    if (t->lineLen + 1 < sizeof(t->line)) t->line[t->lineLen++] = c;
+  }
+}
+
+// Reads the one byte reply of scp. Returns 1 if it was OK, 0 if it has
+// not arrived yet and -1 if it was an error (which is printed) or the
+// channel failed.
+static int _eventEngine_readAck(transfer* t)
+{
+  if (!t->isReadingError) {
+    char c;
+    int rc = _eventEngine_read(t, &c, 1);
+    if (rc <= 0) return rc;
+    if (c == '\0') return 1;
+    // 1 is a warning and 2 an error, and either way a message follows
+    t->isReadingError = true;
+    t->lineLen = 0;
+  }
+
+  int rc = _eventEngine_readLine(t);
+  if (rc == 0) return 0;
+  if (rc > 0) fprintf(stderr, "%s\n", t->line);
+  return -1;
+}
+
+// Parses "C<mode> <size> <name>" from scp -f. The name is the one that
+// was asked for, so it is not needed.
+static bool _eventEngine_parseHeader(transfer* t)
+{
+  unsigned int mode;
+  unsigned long long size;
+  if (t->line[0] != 'C' || sscanf(t->line + 1, "%o %llu ", &mode, &size) != 2)
+    return false;
+
+  t->permissions = mode & 07777;
+  t->size = size;
+  return true;
+}
+
+static bool _eventEngine_getBuffers(transfer* t)
+{
+  int i;
+  for (i = 0; i < ENGINE_NUM_BUFFERS; ++i) {
+    if (t->buffers[i].data) continue;
+    t->buffers[i].data = bufferPool_D_get(ENGINE_BUFFER_SIZE);
+    if (!t->buffers[i].data) return false;
+    t->buffers[i].state = BUFFER_FREE;
+  }
+  return true;
+}
+
+static void _eventEngine_addProgress(transfer* t, size_t bytes)
+{
+  progress_shareFile(t->progress);
+  progress_update(bytes);
+}
+
+// Reads buffers ahead from the disk and sends the ones that are ready, in
+// order. Returns true if anything moved.
+static bool _eventEngine_stepUpload(engine* e, transfer* t)
+{
+  bool moved = false;
+  int i;
+
+  for (i = 0; i < ENGINE_NUM_BUFFERS; ++i) {
+    engineBuffer* b = &t->buffers[i];
+    if (b->state != BUFFER_FREE || t->diskBytes == t->size) continue;
+    b->offset = t->diskBytes;
+    b->len = t->size - t->diskBytes;
+    if (b->len > ENGINE_BUFFER_SIZE) b->len = ENGINE_BUFFER_SIZE;
+    b->done = 0;
+    b->state = BUFFER_DISK;
+    t->diskBytes += b->len;
+    _eventEngine_submit(e, &t->bufferOps[i], DISK_READ);
+    moved = true;
+  }
+
+  while (t->channelBytes < t->size) {
+    engineBuffer* b = NULL;
+    for (i = 0; i < ENGINE_NUM_BUFFERS; ++i)
+      if (t->buffers[i].state == BUFFER_CHANNEL &&
+          t->buffers[i].offset + t->buffers[i].done == t->channelBytes)
+        b = &t->buffers[i];
+    if (!b) break;
+
+    uint32_t window = ssh_channel_window_size(t->channel);
+    if (window == 0) break;
+    size_t len = b->len - b->done;
+    if (len > window) len = window;
+    int rc = ssh_channel_write(t->channel, b->data + b->done, len);
+    if (rc == SSH_ERROR) {
+      _eventEngine_fail(e, t, ssh_get_error(t->session->session));
+      return true;
+    }
+    if (rc <= 0) break;
+
+    b->done += rc;
+    t->channelBytes += rc;
+    _eventEngine_addProgress(t, rc);
+    if (b->done == b->len) b->state = BUFFER_FREE;
+    moved = true;
+  }
+
+  if (t->channelBytes == t->size) {
+    _eventEngine_sendLine(t, STATE_UPLOAD_SEND_END, "", 1);
+    moved = true;
+  }
+  return moved;
+}
+
+// Receives into the free buffers and hands the full ones to the disk.
+// Returns true if anything moved.
+static bool _eventEngine_stepDownload(engine* e, transfer* t)
+{
+  bool moved = false;
+
+  while (t->channelBytes < t->size) {
+    engineBuffer* b = NULL;
+    int i;
+    for (i = 0; i < ENGINE_NUM_BUFFERS && !b; ++i)
+      if (t->buffers[i].state == BUFFER_CHANNEL) b = &t->buffers[i];
+    for (i = 0; i < ENGINE_NUM_BUFFERS && !b; ++i) {
+      if (t->buffers[i].state == BUFFER_FREE) {
+        b = &t->buffers[i];
+        b->state = BUFFER_CHANNEL;
+        b->offset = t->channelBytes;
+        b->len = t->size - t->channelBytes;
+        if (b->len > ENGINE_BUFFER_SIZE) b->len = ENGINE_BUFFER_SIZE;
+        b->done = 0;
+      }
+    }
+    // Every buffer is on the disk. The channel's window fills up in the
+    // meantime, which holds back only this file.
+    if (!b) break;
+
+    int rc = _eventEngine_read(t, b->data + b->done, b->len - b->done);
+    if (rc < 0) {
+      _eventEngine_fail(e, t, "the server stopped sending it");
+      return true;
+    }
+    if (rc == 0) break;
+
+    b->done += rc;
+    t->channelBytes += rc;
+    _eventEngine_addProgress(t, rc);
+    if (b->done == b->len) {
+      b->state = BUFFER_DISK;
+      _eventEngine_submit(e, &t->bufferOps[b - t->buffers], DISK_WRITE);
+    }
+    moved = true;
+  }
+
+  if (t->channelBytes == t->size) {
+    t->state = STATE_DOWNLOAD_END_ACK;
+    moved = true;
+  }
+  return moved;
+}
+
+// Moves a transfer on as far as it can go without waiting. Returns true if
+// anything moved.
+static bool _eventEngine_step(engine* e, transfer* t)
+{
+  transferState start = t->state;
+  ssh_session session = t->session ? t->session->session : NULL;
+  int rc;
+  char header[ENGINE_LINE_SIZE];
+  int i;
+
+  switch (t->state) {
+    case STATE_WAIT_CHANNEL:
+    case STATE_UPLOAD_OPEN_FILE:
+    case STATE_DOWNLOAD_CREATE_FILE:
+    case STATE_CLOSE_FILE:
+    case STATE_DONE:
+    case STATE_FAILED:
+      return false;
+
+    case STATE_OPEN_CHANNEL:
+      if (!t->channel) t->channel = ssh_channel_new(session);
+      if (!t->channel) {
+        _eventEngine_fail(e, t, ssh_get_error(session));
+        break;
+      }
+      rc = ssh_channel_open_session(t->channel);
+      if (rc == SSH_AGAIN) break;
+      if (rc == SSH_OK) {
+        t->state = STATE_EXEC;
+        break;
+      }
+      // The server has a limit on the channels of a session. Wait for one
+      // of this session's channels to close, and don't go past it again.
+      ssh_channel_free(t->channel);
+      t->channel = NULL;
+      t->session->numChannels--;
+      if (t->session->numChannels > 0 && ssh_is_connected(session)) {
+        t->session->maxChannels = t->session->numChannels;
+        t->session = NULL;
+        t->state = STATE_WAIT_CHANNEL;
+        break;
+      }
+      t->session = NULL;
+      _eventEngine_fail(e, t, ssh_get_error(session));
+      break;
+
+    case STATE_EXEC:
+      rc = ssh_channel_request_exec(t->channel, t->command);
+      if (rc == SSH_AGAIN) break;
+      if (rc != SSH_OK) {
+        _eventEngine_fail(e, t, ssh_get_error(session));
+        break;
+      }
+      if (e->isDownload) {
+        _eventEngine_sendLine(t, STATE_DOWNLOAD_SEND_READY, "", 1);
+      }
+      else {
+        t->state = STATE_UPLOAD_READY;
+      }
+      break;
+
+    case STATE_UPLOAD_READY:
+    case STATE_UPLOAD_HEADER_ACK:
+    case STATE_UPLOAD_END_ACK:
+    case STATE_DOWNLOAD_END_ACK:
+      rc = _eventEngine_readAck(t);
+      if (rc == 0) break;
+      if (rc < 0) {
+        _eventEngine_fail(e, t, t->isReadingError ? "the server refused it" :
+                                ssh_get_error(session));
+        break;
+      }
+      if (t->state == STATE_UPLOAD_READY) {
+        int len = snprintf(header, sizeof(header), "C%04o %zu %s\n",
+                           t->permissions, t->size,
+                           _eventEngine_baseName(t->job->from));
+        _eventEngine_sendLine(t, STATE_UPLOAD_SEND_HEADER, header, len);
+      }
+      else if (t->state == STATE_UPLOAD_HEADER_ACK) {
+        if (!_eventEngine_getBuffers(t)) {
+          _eventEngine_fail(e, t, "out of memory");
+          break;
+        }
+        t->state = STATE_UPLOAD_DATA;
+      }
+      else if (t->state == STATE_UPLOAD_END_ACK) {
+        t->state = STATE_CLOSE_FILE;
+        _eventEngine_submit(e, &t->fileOp, DISK_CLOSE);
+      }
+      else {
+        _eventEngine_sendLine(t, STATE_DOWNLOAD_SEND_END_ACK, "", 1);
+      }
+      break;
+
+    case STATE_UPLOAD_SEND_HEADER:
+    case STATE_UPLOAD_SEND_END:
+    case STATE_DOWNLOAD_SEND_READY:
+    case STATE_DOWNLOAD_SEND_HEADER_ACK:
+    case STATE_DOWNLOAD_SEND_END_ACK:
+      rc = _eventEngine_writeLine(t);
+      if (rc == 0) break;
+      if (rc < 0) {
+        _eventEngine_fail(e, t, ssh_get_error(session));
+        break;
+      }
+      if (t->state == STATE_UPLOAD_SEND_HEADER) {
+        t->state = STATE_UPLOAD_HEADER_ACK;
+      }
+      else if (t->state == STATE_UPLOAD_SEND_END) {
+        t->state = STATE_UPLOAD_END_ACK;
+      }
+      else if (t->state == STATE_DOWNLOAD_SEND_READY) {
+        t->lineLen = 0;
+        t->state = STATE_DOWNLOAD_READ_HEADER;
+      }
+      else if (t->state == STATE_DOWNLOAD_SEND_HEADER_ACK) {
+        if (!_eventEngine_getBuffers(t)) {
+          _eventEngine_fail(e, t, "out of memory");
+          break;
+        }
+        t->state = STATE_DOWNLOAD_DATA;
+      }
+      else {
+        t->state = STATE_DOWNLOAD_FLUSH;
+      }
+      break;
+
+    case STATE_DOWNLOAD_READ_HEADER:
+      // An error reply starts with 1 or 2 instead of a header
+      if (t->lineLen == 0 && !t->isReadingError) {
+        char c;
+        rc = _eventEngine_read(t, &c, 1);
+        if (rc == 0) break;
+        if (rc < 0) {
+          _eventEngine_fail(e, t, "the server closed the channel");
+          break;
+        }
+        if (c == 1 || c == 2) t->isReadingError = true;
+        else t->line[t->lineLen++] = c;
+      }
+      rc = _eventEngine_readLine(t);
+      if (rc == 0) break;
+      if (rc < 0 || t->isReadingError) {
+        if (rc > 0) fprintf(stderr, "%s\n", t->line);
+        _eventEngine_fail(e, t, "the server could not send it");
+        break;
+      }
+      if (!_eventEngine_parseHeader(t)) {
+        _eventEngine_fail(e, t, "the server sent something other than a "
+                                "file");
+        break;
+      }
+      t->progress = progress_beginFile(t->job->to, t->size);
+      t->state = STATE_DOWNLOAD_CREATE_FILE;
+      _eventEngine_submit(e, &t->fileOp, DISK_CREATE);
+      break;
+
+    case STATE_UPLOAD_DATA:
+      return _eventEngine_stepUpload(e, t) || t->state != start;
+
+    case STATE_DOWNLOAD_DATA:
+      return _eventEngine_stepDownload(e, t) || t->state != start;
+
+    case STATE_DOWNLOAD_FLUSH:
+      for (i = 0; i < ENGINE_NUM_BUFFERS; ++i)
+        if (t->buffers[i].state == BUFFER_DISK) return false;
+      t->state = STATE_CLOSE_FILE;
+      _eventEngine_submit(e, &t->fileOp, DISK_CLOSE);
+      break;
+  }
+
+  return t->state != start;
+}
+
+// Gives a transfer a channel on the session that has the most room
+static bool _eventEngine_placeTransfer(engine* e, transfer* t)
+{
+  engineSession* best = NULL;
+  int i;
+  for (i = 0; i < e->numSessions; ++i) {
+    engineSession* s = &e->sessions[i];
+    if (s->numChannels >= s->maxChannels) continue;
+    if (!best || s->numChannels < best->numChannels) best = s;
+  }
+  if (!best) return false;
+
+  best->numChannels++;
+  t->session = best;
+  t->state = STATE_OPEN_CHANNEL;
+  return true;
+}
+
+static transfer* _eventEngine_newTransfer(engine* e, engineJob* job)
+{
+  transfer* t = calloc(1, sizeof(transfer));
+  if (!t) return NULL;
+
+  t->job = job;
+  t->fd = -1;
+  t->fileOp.t = t;
+  int i;
+  for (i = 0; i < ENGINE_NUM_BUFFERS; ++i) {
+    t->bufferOps[i].t = t;
+    t->bufferOps[i].buffer = &t->buffers[i];
+  }
+
+  char quoted[ENGINE_LINE_SIZE];
+  if (!remoteExec_quote(e->isDownload ? job->from : job->to, quoted,
+                        sizeof(quoted)) ||
+      snprintf(t->command, sizeof(t->command), "scp %s %s",
+               e->isDownload ? "-f" : "-t", quoted) >=
+      (int)sizeof(t->command)) {
+    fprintf(stderr, "Error: path too long for %s\n", job->from);
+    free(t);
+    return NULL;
+  }
+  trace_beginFile(&t->trace);
+  return t;
+}
+
+// Starts the transfers that are waiting for a channel, then new ones,
+// while the sessions have room
+static void _eventEngine_startTransfers(engine* e)
+{
+  bool hasSession = false;
+  int i;
+  for (i = 0; i < e->numSessions; ++i)
+    if (e->sessions[i].maxChannels > 0) hasSession = true;
+
+  transfer* t;
+  for (t = e->transfers; t; t = t->next) {
+    if (t->state != STATE_WAIT_CHANNEL) continue;
+    // Nothing will make room for it
+    if (e->isCanceled || !hasSession) {
+      t->state = STATE_FAILED;
+      e->success = false;
+      continue;
+    }
+    if (!_eventEngine_placeTransfer(e, t)) return;
+  }
+
+  while (!e->isCanceled && e->nextJob < e->numJobs) {
+    t = _eventEngine_newTransfer(e, &e->jobs[e->nextJob]);
+    if (!t) {
+      e->success = false;
+      e->isCanceled = true;
+      return;
+    }
+    if (!_eventEngine_placeTransfer(e, t)) {
+      free(t);
+      return;
+    }
+    e->nextJob++;
+    t->next = e->transfers;
+    e->transfers = t;
+
+    // The size of an upload is only known once the file is open
+    if (!e->isDownload) {
+      t->state = STATE_UPLOAD_OPEN_FILE;
+      _eventEngine_submit(e, &t->fileOp, DISK_OPEN_READ);
+    }
+  }
+}
+
+static void _eventEngine_freeTransfer(transfer* t)
+{
+  if (t->channel) {
+    ssh_channel_send_eof(t->channel);
+    ssh_channel_close(t->channel);
+    ssh_channel_free(t->channel);
+  }
+  if (t->session) t->session->numChannels--;
+  if (t->fd >= 0) close(t->fd);
+
+  int i;
+  for (i = 0; i < ENGINE_NUM_BUFFERS; ++i)
+    bufferPool_put(t->buffers[i].data, ENGINE_BUFFER_SIZE);
+  free(t);
+}
+
+// Frees the transfers that are finished and that the disk threads are done
+// with
+static bool _eventEngine_reap(engine* e)
+{
+  bool any = false;
+  transfer** p = &e->transfers;
+  while (*p) {
+    transfer* t = *p;
+    if ((t->state != STATE_DONE && t->state != STATE_FAILED) ||
+        t->numDiskOps > 0) {
+      p = &t->next;
+      continue;
+    }
+
+    if (t->progress) {
+      progress_shareFile(t->progress);
+      progress_endFile();
+    }
+    if (t->state == STATE_DONE)
+      trace_endFile(&t->trace, e->isDownload ? t->job->to : t->job->from,
+                    t->size);
+    *p = t->next;
+    _eventEngine_freeTransfer(t);
+    any = true;
+  }
+  return any;
+}
+
+static void _eventEngine_loop(engine* e)
+{
+  bool moved = true;
+  while (true) {
+    _eventEngine_startTransfers(e);
+    if (!e->transfers) break;
+
+    // Anything that moved may be able to move again at once, so only wait
+    // in the poll when nothing did
+    int rc = ssh_event_dopoll(e->event, moved ? 0 : ENGINE_POLL_TIMEOUT);
+    if (rc == SSH_ERROR) {
+      int i;
+      for (i = 0; i < e->numSessions; ++i) {
+        if (!ssh_is_connected(e->sessions[i].session))
+          e->sessions[i].maxChannels = 0;
+      }
+    }
+
+    moved = _eventEngine_collectDiskOps(e);
+    bool isCanceled = scpOptions_isCanceled();
+    transfer* t;
+    for (t = e->transfers; t; t = t->next) {
+      if (t->state == STATE_DONE || t->state == STATE_FAILED) {}
+      else if (isCanceled)
+        _eventEngine_fail(e, t, "the copy was canceled");
+      else if (t->session && t->session->maxChannels == 0)
+        _eventEngine_fail(e, t, "the session was disconnected");
+      while (_eventEngine_step(e, t)) moved = true;
+    }
+    if (_eventEngine_reap(e)) moved = true;
+  }
+}
+
+// Connects the sessions after the first one. Those that can't connect are
+// left out.
+static bool _eventEngine_connectSessions(engine* e, ssh_session session,
+                                         psshInfo info, int numSessions)
+{
+  e->sessions = calloc(numSessions, sizeof(engineSession));
+  if (!e->sessions) return false;
+
+  int maxChannels = scpOptions_get()->channelsPerSession;
+  int i;
+  for (i = 0; i < numSessions; ++i) {
+    engineSession* s = &e->sessions[e->numSessions];
+    if (i == 0) {
+      s->session = session;
+    }
+    else {
+      // Each session gets its own copy so that they don't share the
+      // password
+      sshInfo sessionInfo = *info;
+      s->session = connectSSH_getConnectedSession(&sessionInfo);
+      if (!s->session) {
+        fprintf(stderr, "Warning: session %i could not connect: continuing "
+                        "with fewer sessions\n", i);
+        continue;
+      }
+      s->isOwned = true;
+    }
+    s->maxChannels = maxChannels;
+    ssh_set_blocking(s->session, 0);
+    ssh_event_add_session(e->event, s->session);
+    e->numSessions++;
+  }
+  return true;
+}
+
+int eventEngine_run(ssh_session session, psshInfo info, engineJob* jobs,
+                    size_t numJobs, int numSessions, bool isDownload)
+{
+  if (numJobs == 0) return SSH_OK;
+  if (numSessions < 1) numSessions = 1;
+
+  engine e;
+  memset(&e, 0, sizeof(e));
+  e.jobs = jobs;
+  e.numJobs = numJobs;
+  e.isDownload = isDownload;
+  e.success = true;
+
+  e.event = ssh_event_new();
+  if (!e.event || !_eventEngine_startDiskPool(&e.pool)) {
+    fprintf(stderr, "Error starting the event loop in %s\n", __FUNCTION__);
+    if (e.event) ssh_event_free(e.event);
+    return SSH_ERROR;
+  }
+  ssh_event_add_fd(e.event, e.pool.eventFd, POLLIN, _eventEngine_onDiskDone,
+                   NULL);
+
+  if (_eventEngine_connectSessions(&e, session, info, numSessions)) {
+    _eventEngine_loop(&e);
+  }
+  else {
+    fprintf(stderr, "Error allocating sessions in %s\n", __FUNCTION__);
+    e.success = false;
+  }
+
+  // Nothing that the disk threads still have can be left, since every
+  // transfer waits for its ops before it is freed
+  _eventEngine_stopDiskPool(&e.pool);
+  ssh_event_remove_fd(e.event, e.pool.eventFd);
+
+  int i;
+  for (i = 0; i < e.numSessions; ++i) {
+    ssh_event_remove_session(e.event, e.sessions[i].session);
+    ssh_set_blocking(e.sessions[i].session, 1);
+    if (e.sessions[i].isOwned)
+      connectSSH_disconnectSession(&e.sessions[i].session);
+  }
+  free(e.sessions);
+  ssh_event_free(e.event);
+
+  if (e.success && e.nextJob < e.numJobs) {
+    fprintf(stderr, "Error: not every file was copied\n");
+    e.success = false;
+  }
+  return e.success ? SSH_OK : SSH_ERROR;
+}
@@ -12,9 +12,15 @@
   limitations under the License.
  ***********************************************************************/
 
+// For statx()
+#define _GNU_SOURCE
+
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <linux/limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,6 +29,10 @@
 #include <unistd.h>
 
 #include <fileSystemUtils.h>
+#include <scpOptions.h>
+
+// The number of entries a prefetch thread claims at once
+#define FILE_META_PREFETCH_BLOCK 16
 
 int fileSystemUtils_getFileType(const char* path)
 {
@@ -112,6 +122,23 @@ bool fileSystemUtils_getCWD(char* string)
   return true;
 }
 
+bool fileSystemUtils_getCacheDir(char* dir)
+{
+  const char* cacheDir = getenv("XDG_CACHE_HOME");
+  const char* home = getenv("HOME");
+  if (cacheDir && *cacheDir)
+    snprintf(dir, PATH_MAX, "%s/scp", cacheDir);
+  else if (home && *home)
+    snprintf(dir, PATH_MAX, "%s/.cache/scp", home);
+  else return false;
+
+  if (!fileSystemUtils_mkdirIfNeeded(dir)) {
+    fprintf(stderr, "Warning: could not create %s\n", dir);
+    return false;
+  }
+  return true;
+}
+
 bool fileSystemUtils_chdir(const char* path)
 {
   int ret = chdir(path);
@@ -124,43 +151,287 @@ bool fileSystemUtils_chdir(const char* path)
   return true;
 }
 
-// The _D_ stands for "dynamic". It is there to emphasize
-// that the array that is returned is dynamically allocated and needs to be
-// freed
-// This returns a character array of every file/directory in a directory
-// It is delimited by commas. It also returns '.' and '..'
-char* fileSystemUtils_D_getDelimitedFileList(const char* dirName)
+// Converts the mode from a stat into an identify_file_type_e
+static int _fileSystemUtils_getType(mode_t mode)
+{
+  if (S_ISREG(mode)) return FILE_IS_REG;
+  if (S_ISDIR(mode)) return FILE_IS_DIR;
+  return UNKNOWN_FILE_TYPE;
+}
+
+// Makes room for at least one more entry and len more bytes of names
+static bool _fileSystemUtils_growDirList(pdirList list, size_t* capacity,
+                                         size_t arenaUsed,
+                                         size_t* arenaCapacity, size_t len)
+{
+  if (list->numEntries == *capacity) {
+    size_t newCapacity = *capacity ? *capacity * 2 : 64;
+    pdirEntry entries = realloc(list->entries, newCapacity * sizeof(dirEntry));
+    if (!entries) return false;
+    list->entries = entries;
+    *capacity = newCapacity;
+  }
+
+  if (arenaUsed + len > *arenaCapacity) {
+    size_t newCapacity = *arenaCapacity ? *arenaCapacity * 2 : 4096;
+    while (newCapacity < arenaUsed + len) newCapacity *= 2;
+    char* arena = realloc(list->arena, newCapacity);
+    if (!arena) return false;
+    list->arena = arena;
+    *arenaCapacity = newCapacity;
+  }
+
+  return true;
+}
+
+bool fileSystemUtils_getMeta(int dirFd, const char* path, pfileMeta meta)
 {
-  DIR *dir;
-  struct dirent *ent;
+  mode_t mode;
 
-  if ((dir = opendir(dirName)) != NULL) {
-    // First loop will be to get the size to malloc
-    size_t size = 0;
-    while ((ent = readdir(dir)) != NULL) {
-      // +1 is for the comma or the \0 at the end
-      size += strlen(ent->d_name) + 1;
-    }
-    closedir(dir);
-    // Second loop is to copy over the list
-    if ((dir = opendir(dirName)) != NULL) {
-      char* fileList = malloc(sizeof(char) * size);
-
-      // Set the first value to be the NULL terminator
-      *fileList = '\0';
-
-      // Now catenate each file from the list
-      while ((ent = readdir(dir)) != NULL) {
-        strcat(fileList, ent->d_name);
-        // Add a comma unless we reached the end
-        if (strlen(fileList) + 1 < size) strcat(fileList, ",");
-      }
-      closedir(dir);
-      return fileList;
+#ifdef STATX_BASIC_STATS
+  // Only ask for what we use, so that filesystems such as NFS may skip
+  // the rest
+  struct statx stx;
+  if (statx(dirFd, path, 0, STATX_TYPE | STATX_MODE | STATX_SIZE |
+            STATX_MTIME, &stx) != 0) {
+    meta->type = errno == ENOENT ? DOES_NOT_EXIST : READ_ERROR;
+    return false;
+  }
+  mode = stx.stx_mode;
+  meta->size = stx.stx_size;
+  meta->mtime = stx.stx_mtime.tv_sec;
+#else
+  struct stat st;
+  if (fstatat(dirFd, path, &st, 0) != 0) {
+    meta->type = errno == ENOENT ? DOES_NOT_EXIST : READ_ERROR;
+    return false;
+  }
+  mode = st.st_mode;
+  meta->size = st.st_size;
+  meta->mtime = st.st_mtime;
+#endif
+
+  meta->type = _fileSystemUtils_getType(mode);
+  meta->permissions = mode & (S_IRWXU | S_IRWXG | S_IRWXO);
+  return true;
+}
+
+// The state that is shared by the threads that stat a directory's entries
+typedef struct {
+  pdirList list;
+  size_t next;
+  pthread_mutex_t mutex;
+} metaPrefetch;
+
+static void* _fileSystemUtils_prefetchMeta(void* arg)
+{
+  metaPrefetch* prefetch = arg;
+  pdirList list = prefetch->list;
+
+  while (true) {
+    pthread_mutex_lock(&prefetch->mutex);
+    size_t begin = prefetch->next;
+    prefetch->next += FILE_META_PREFETCH_BLOCK;
+    pthread_mutex_unlock(&prefetch->mutex);
+
+    if (begin >= list->numEntries) break;
+    size_t end = begin + FILE_META_PREFETCH_BLOCK;
+    if (end > list->numEntries) end = list->numEntries;
+
+    size_t i;
+    for (i = begin; i < end; ++i) {
+      pdirEntry entry = &list->entries[i];
+      fileSystemUtils_getMeta(list->fd, entry->name, &entry->meta);
     }
   }
 
-  // If we made it this far, an error occurred
-  fprintf(stderr, "Error opening %s for reading\n", dirName);
   return NULL;
 }
+
+// Stats every entry of the list. On a high latency filesystem the time is
+// spent waiting rather than working, so a large directory is split between
+// several threads.
+static void _fileSystemUtils_statEntries(pdirList list)
+{
+  int numThreads = scpOptions_get()->statThreads;
+  if (numThreads > 1 && list->numEntries >= FILE_META_PREFETCH_MIN_ENTRIES) {
+    metaPrefetch prefetch;
+    prefetch.list = list;
+    prefetch.next = 0;
+    pthread_mutex_init(&prefetch.mutex, NULL);
+
+    pthread_t* threads = malloc(numThreads * sizeof(pthread_t));
+    int started = 0;
+    while (threads && started < numThreads &&
+           scpOptions_startThread(&threads[started],
+                                  _fileSystemUtils_prefetchMeta,
+                                  &prefetch) == 0)
+      started++;
+
+    // Whatever the threads haven't claimed is stat'ed here, so this also
+    // covers threads that failed to start
+    _fileSystemUtils_prefetchMeta(&prefetch);
+
+    int i;
+    for (i = 0; i < started; ++i) pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_mutex_destroy(&prefetch.mutex);
+    return;
+  }
+
+  size_t i;
+  for (i = 0; i < list->numEntries; ++i) {
+    pdirEntry entry = &list->entries[i];
+    fileSystemUtils_getMeta(list->fd, entry->name, &entry->meta);
+  }
+}
+
+pdirList fileSystemUtils_D_readDir(int parentFd, const char* name)
+{
+  int fd = openat(parentFd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "Error opening %s for reading\n", name);
+    return NULL;
+  }
+
+  pdirList list = calloc(1, sizeof(dirList));
+  DIR* dir = NULL;
+  if (list) {
+    // The DIR takes over fd, so the list keeps its own copy
+    list->fd = dup(fd);
+    if (list->fd >= 0) dir = fdopendir(fd);
+  }
+
+  if (!dir) {
+    fprintf(stderr, "Error opening %s for reading\n", name);
+    if (list && list->fd >= 0) close(list->fd);
+    free(list);
+    close(fd);
+    return NULL;
+  }
+
+  size_t capacity = 0;
+  size_t arenaUsed = 0;
+  size_t arenaCapacity = 0;
+  bool success = true;
+  struct dirent* ent;
+
+  errno = 0;
+  while ((ent = readdir(dir)) != NULL) {
+    // Skip . and ..
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+      continue;
+
+    size_t len = strlen(ent->d_name) + 1;
+    if (!_fileSystemUtils_growDirList(list, &capacity, arenaUsed,
+                                      &arenaCapacity, len)) {
+      fprintf(stderr, "Error allocating memory in %s\n", __FUNCTION__);
+      success = false;
+      break;
+    }
+
+    pdirEntry entry = &list->entries[list->numEntries++];
+    memcpy(list->arena + arenaUsed, ent->d_name, len);
+    // The arena may still move, so only the offset is kept for now
+    entry->name = (const char*)(uintptr_t)arenaUsed;
+    arenaUsed += len;
+
+    entry->dType = ent->d_type;
+    errno = 0;
+  }
+
+  if (success && errno != 0) {
+    fprintf(stderr, "Error reading %s\n", name);
+    success = false;
+  }
+  closedir(dir);
+
+  if (!success) {
+    fileSystemUtils_freeDirList(list);
+    return NULL;
+  }
+
+  size_t i;
+  for (i = 0; i < list->numEntries; ++i)
+    list->entries[i].name = list->arena + (uintptr_t)list->entries[i].name;
+
+  _fileSystemUtils_statEntries(list);
+  return list;
+}
+
+void fileSystemUtils_freeDirList(pdirList list)
+{
+  if (!list) return;
+  close(list->fd);
+  free(list->entries);
+  free(list->arena);
+  free(list);
+}
+
+// Walks the directory name in parentFd (whose full path is path and whose
+// path relative to the root is relPath). Both path and relPath are PATH_MAX
+// buffers that are appended to and then restored, so no memory needs to be
+// allocated per file.
+static bool _walkDir(int parentFd, const char* name, char* path,
+                     char* relPath, fileSystemUtils_walkCallback callback,
+                     void* userData)
+{
+  pdirList list = fileSystemUtils_D_readDir(parentFd, name);
+  if (!list) return false;
+
+  size_t pathLen = strlen(path);
+  size_t relPathLen = strlen(relPath);
+  bool success = true;
+  size_t i;
+
+  for (i = 0; success && i < list->numEntries; ++i) {
+    pdirEntry entry = &list->entries[i];
+    int pathRc = snprintf(path + pathLen, PATH_MAX - pathLen, "/%s",
+                          entry->name);
+    int relPathRc = snprintf(relPath + relPathLen, PATH_MAX - relPathLen,
+                             "%s%s", relPathLen ? "/" : "", entry->name);
+    if (pathRc < 0 || (size_t)pathRc >= PATH_MAX - pathLen ||
+        relPathRc < 0 || (size_t)relPathRc >= PATH_MAX - relPathLen) {
+      path[pathLen] = '\0';
+      fprintf(stderr, "Error: path too long in %s/%s\n", path, entry->name);
+      success = false;
+      break;
+    }
+
+    if (!callback(path, relPath, &entry->meta, userData))
+      success = false;
+    else if (entry->meta.type == FILE_IS_DIR)
+      success = _walkDir(list->fd, entry->name, path, relPath, callback,
+                         userData);
+
+    path[pathLen] = '\0';
+    relPath[relPathLen] = '\0';
+  }
+
+  fileSystemUtils_freeDirList(list);
+  return success;
+}
+
+bool fileSystemUtils_walkTree(const char* root,
+                              fileSystemUtils_walkCallback callback,
+                              void* userData)
+{
+  char path[PATH_MAX];
+  char relPath[PATH_MAX] = "";
+  snprintf(path, PATH_MAX, "%s", root);
+
+  // Remove a trailing '/' so that paths don't end up with "//" in them
+  size_t len = strlen(path);
+  if (len > 1 && path[len - 1] == '/') path[len - 1] = '\0';
+
+  fileMeta meta;
+  if (!fileSystemUtils_getMeta(AT_FDCWD, path, &meta)) {
+    fprintf(stderr, "Error reading %s in %s\n", path, __FUNCTION__);
+    return false;
+  }
+
+  if (!callback(path, relPath, &meta, userData)) return false;
+  if (meta.type != FILE_IS_DIR) return true;
+
+  return _walkDir(AT_FDCWD, path, path, relPath, callback, userData);
+}
@@ -0,0 +1,773 @@
+/**********************************************************************
+  incrementalSync.c - Source code for incremental copies of directories,
+                      which skip the files that the other end already has
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <checksum.h>
+#include <fileSystemUtils.h>
+#include <incrementalSync.h>
+#include <remoteExec.h>
+#include <scp.h>
+#include <scpOptions.h>
+
+// A path may grow up to four times when it is quoted for the shell
+#define SYNC_QUOTED_SIZE (4 * PATH_MAX + 3)
+#define SYNC_COMMAND_SIZE (2 * SYNC_QUOTED_SIZE + 256)
+// The first line of a manifest, followed by its key
+#define SYNC_MANIFEST_HEADER "scp-sync-manifest 1"
+// The size of an MD5 digest written out in hex
+#define SYNC_HEX_SIZE (2 * CHECKSUM_MD5_SIZE)
+
+// The size and modification time of a file on one end
+typedef struct {
+  size_t size;
+  time_t mtime;
+} syncStamp;
+
+// A file or directory, relative to the top of the copy. In a manifest,
+// stamp is the source and dstStamp is the destination.
+typedef struct {
+  char* path;
+  int type;
+  syncStamp stamp;
+  syncStamp dstStamp;
+  bool needsCopy;
+  // The file is known to be the same on both ends (rather than guessed
+  // from the modification times), so it may go in the manifest
+  bool isVerified;
+} syncEntry;
+
+typedef struct {
+  syncEntry* entries;
+  size_t numEntries;
+  size_t capacity;
+} syncList;
+
+// Everything that is known about both ends
+typedef struct {
+  ssh_session session;
+  // The source and destination, sorted by path
+  syncList src;
+  syncList dst;
+  syncList manifest;
+  char manifestPath[PATH_MAX];
+  char manifestKey[3 * PATH_MAX];
+  // The local directory, and the remote one as the server's pwd printed
+  // it (empty if it doesn't exist)
+  char localRoot[PATH_MAX];
+  char remoteRoot[PATH_MAX];
+  bool isUpload;
+  size_t numFiles;
+  size_t numChangedFiles;
+  // Files and directories
+  size_t numToCopy;
+} syncPlan;
+
+// Returns a pointer to the last component of a path
+static const char* _incrementalSync_baseName(const char* path)
+{
+  const char* p = strrchr(path, '/');
+  return p ? p + 1 : path;
+}
+
+/*****************************************************************************
+ * Lists of files
+ *****************************************************************************/
+
+static syncEntry* _incrementalSync_add(syncList* list, const char* path,
+                                       int type, size_t size, time_t mtime)
+{
+  if (list->numEntries == list->capacity) {
+    size_t newCapacity = list->capacity ? list->capacity * 2 : 256;
+    syncEntry* entries = realloc(list->entries,
+                                 newCapacity * sizeof(syncEntry));
+    if (!entries) return NULL;
+    list->entries = entries;
+    list->capacity = newCapacity;
+  }
+
+  syncEntry* entry = &list->entries[list->numEntries];
+  memset(entry, 0, sizeof(syncEntry));
+  entry->path = strdup(path);
+  if (!entry->path) return NULL;
+  entry->type = type;
+  entry->stamp.size = size;
+  entry->stamp.mtime = mtime;
+
+  list->numEntries++;
+  return entry;
+}
+
+static void _incrementalSync_freeList(syncList* list)
+{
+  size_t i;
+  for (i = 0; i < list->numEntries; ++i) free(list->entries[i].path);
+  free(list->entries);
+  memset(list, 0, sizeof(syncList));
+}
+
+static int _incrementalSync_compare(const void* a, const void* b)
+{
+  return strcmp(((const syncEntry*)a)->path, ((const syncEntry*)b)->path);
+}
+
+static void _incrementalSync_sort(syncList* list)
+{
+  if (list->numEntries > 1)
+    qsort(list->entries, list->numEntries, sizeof(syncEntry),
+          _incrementalSync_compare);
+}
+
+static syncEntry* _incrementalSync_find(const syncList* list,
+                                        const char* path)
+{
+  if (list->numEntries == 0) return NULL;
+  syncEntry key;
+  key.path = (char*)path;
+  return bsearch(&key, list->entries, list->numEntries, sizeof(syncEntry),
+                 _incrementalSync_compare);
+}
+
+static bool _incrementalSync_addLocal(const char* path, const char* relPath,
+                                      const fileMeta* meta, void* userData)
+{
+  (void)path;
+  // The top of the copy itself isn't listed
+  if (relPath[0] == '\0') return true;
+  if (meta->type != FILE_IS_REG && meta->type != FILE_IS_DIR) return true;
+
+  if (!_incrementalSync_add(userData, relPath, meta->type, meta->size,
+                            meta->mtime)) {
+    fprintf(stderr, "Error allocating memory in %s\n", __FUNCTION__);
+    return false;
+  }
+  return true;
+}
+
+// Lists the local directory, which may not exist yet
+static bool _incrementalSync_listLocal(const char* root, syncList* list)
+{
+  if (fileSystemUtils_getFileType(root) == FILE_IS_DIR &&
+      !fileSystemUtils_walkTree(root, _incrementalSync_addLocal, list))
+    return false;
+  _incrementalSync_sort(list);
+  return true;
+}
+
+// Lists the remote directory $d, where prefix sets d. The first line of
+// the output is the directory's absolute path, and then each entry is
+// "<type> <size> <mtime> <path>\0". Nothing is printed if it doesn't exist.
+static bool _incrementalSync_listRemote(syncPlan* plan, const char* prefix,
+                                        syncList* list)
+{
+  char command[SYNC_COMMAND_SIZE];
+  snprintf(command, sizeof(command),
+           "%s if [ -d \"$d\" ]; then cd \"$d\" && pwd && "
+           "exec find -L . -mindepth 1 \\( -type f -o -type d \\) "
+           "-printf '%%Y %%s %%T@ %%P\\0'; fi", prefix);
+
+  size_t len;
+  char* output = remoteExec_D_run(plan->session, command, &len);
+  if (!output) {
+    fprintf(stderr, "Error listing the remote directory\n");
+    return false;
+  }
+
+  plan->remoteRoot[0] = '\0';
+  char* end = output + len;
+  char* p = memchr(output, '\n', len);
+  bool success = true;
+  if (p) {
+    *p = '\0';
+    snprintf(plan->remoteRoot, PATH_MAX, "%s", output);
+    p++;
+  }
+  else p = end;
+
+  while (success && p < end) {
+    char* record = p;
+    char* recordEnd = memchr(p, '\0', end - p);
+    if (!recordEnd) recordEnd = end;
+    p = recordEnd + 1;
+
+    // The modification time has a fraction, which is dropped
+    char* field;
+    int type = record[0] == 'd' ? FILE_IS_DIR : FILE_IS_REG;
+    unsigned long long size = strtoull(record + 1, &field, 10);
+    long long mtime = strtoll(field, &field, 10);
+    field = strchr(field, ' ');
+    if (!field || field >= recordEnd || field[1] == '\0') {
+      fprintf(stderr, "Error: could not read the remote listing\n");
+      success = false;
+      break;
+    }
+
+    if (!_incrementalSync_add(list, field + 1, type, size, mtime)) {
+      fprintf(stderr, "Error allocating memory in %s\n", __FUNCTION__);
+      success = false;
+    }
+  }
+
+  free(output);
+  _incrementalSync_sort(list);
+  return success;
+}
+
+/*****************************************************************************
+ * The manifest
+ *****************************************************************************/
+
+static bool _incrementalSync_setManifestPath(syncPlan* plan, psshInfo info,
+                                             const char* remotePath)
+{
+  // The local directory may not exist until after the first copy, but its
+  // parent does
+  char parent[PATH_MAX];
+  char localPath[PATH_MAX];
+  snprintf(parent, PATH_MAX, "%s", plan->localRoot);
+  char* slash = strrchr(parent, '/');
+  if (slash == parent) slash[1] = '\0';
+  else if (slash) *slash = '\0';
+  else snprintf(parent, PATH_MAX, ".");
+  if (!realpath(parent, localPath))
+    snprintf(localPath, PATH_MAX, "%s", parent);
+
+  snprintf(plan->manifestKey, sizeof(plan->manifestKey),
+           "%s %s@%s:%i %s %s/%s", plan->isUpload ? "up" : "down",
+           info->user, info->host, info->port, remotePath, localPath,
+           _incrementalSync_baseName(plan->localRoot));
+
+  char dir[PATH_MAX];
+  if (!fileSystemUtils_getCacheDir(dir)) return false;
+
+  unsigned char digest[CHECKSUM_MD5_SIZE];
+  char name[SYNC_HEX_SIZE + 1];
+  checksum_md5(plan->manifestKey, strlen(plan->manifestKey), digest);
+  int i;
+  for (i = 0; i < CHECKSUM_MD5_SIZE; ++i)
+    sprintf(name + 2 * i, "%02x", digest[i]);
+
+  return snprintf(plan->manifestPath, PATH_MAX, "%s/sync-%s", dir, name) <
+         PATH_MAX;
+}
+
+// Reads the manifest, if there is one. Each record is
+// "<src size> <src mtime> <dst size> <dst mtime> <path>\0".
+static void _incrementalSync_loadManifest(syncPlan* plan)
+{
+  if (!plan->manifestPath[0]) return;
+  FILE* f = fopen(plan->manifestPath, "r");
+  if (!f) return;
+
+  // A different key means the file names collided, and it isn't ours
+  char header[sizeof(plan->manifestKey) + sizeof(SYNC_MANIFEST_HEADER) + 2];
+  char expected[sizeof(header)];
+  snprintf(expected, sizeof(expected), "%s %s\n", SYNC_MANIFEST_HEADER,
+           plan->manifestKey);
+  if (!fgets(header, sizeof(header), f) || strcmp(header, expected) != 0) {
+    fclose(f);
+    return;
+  }
+
+  char* record = NULL;
+  size_t recordSize = 0;
+  ssize_t len;
+  while ((len = getdelim(&record, &recordSize, '\0', f)) > 0) {
+    unsigned long long srcSize;
+    long long srcMtime;
+    unsigned long long dstSize;
+    long long dstMtime;
+    int pathStart;
+    if (sscanf(record, "%llu %lld %llu %lld %n", &srcSize, &srcMtime,
+               &dstSize, &dstMtime, &pathStart) != 4 ||
+        record[pathStart] == '\0')
+      break;
+
+    syncEntry* entry = _incrementalSync_add(&plan->manifest,
+                                            record + pathStart, FILE_IS_REG,
+                                            srcSize, srcMtime);
+    if (!entry) break;
+    entry->dstStamp.size = dstSize;
+    entry->dstStamp.mtime = dstMtime;
+  }
+
+  free(record);
+  fclose(f);
+  _incrementalSync_sort(&plan->manifest);
+}
+
+// Writes out the files that are now the same on both ends
+static void _incrementalSync_saveManifest(syncPlan* plan,
+                                          const syncList* records)
+{
+  if (!plan->manifestPath[0]) return;
+
+  char tempPath[PATH_MAX + 8];
+  snprintf(tempPath, sizeof(tempPath), "%s.XXXXXX", plan->manifestPath);
+  int fd = mkstemp(tempPath);
+  FILE* f = fd >= 0 ? fdopen(fd, "w") : NULL;
+  if (!f) {
+    fprintf(stderr, "Warning: could not write the sync manifest %s\n",
+            tempPath);
+    if (fd >= 0) close(fd);
+    return;
+  }
+
+  bool success = fprintf(f, "%s %s\n", SYNC_MANIFEST_HEADER,
+                         plan->manifestKey) > 0;
+  size_t i;
+  for (i = 0; success && i < records->numEntries; ++i) {
+    const syncEntry* entry = &records->entries[i];
+    success = fprintf(f, "%llu %lld %llu %lld %s%c",
+                      (unsigned long long)entry->stamp.size,
+                      (long long)entry->stamp.mtime,
+                      (unsigned long long)entry->dstStamp.size,
+                      (long long)entry->dstStamp.mtime, entry->path, 0) > 0;
+  }
+
+  if (fclose(f) != 0) success = false;
+  if (!success || rename(tempPath, plan->manifestPath) != 0) {
+    fprintf(stderr, "Warning: could not write the sync manifest %s\n",
+            plan->manifestPath);
+    unlink(tempPath);
+  }
+}
+
+static bool _incrementalSync_record(syncList* records, const syncEntry* src,
+                                    const syncStamp* dstStamp)
+{
+  syncEntry* entry = _incrementalSync_add(records, src->path, FILE_IS_REG,
+                                          src->stamp.size, src->stamp.mtime);
+  if (!entry) return false;
+  entry->dstStamp = *dstStamp;
+  return true;
+}
+
+/*****************************************************************************
+ * Comparing
+ *****************************************************************************/
+
+static bool _incrementalSync_hashLocal(const char* path, char* hex)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+
+  size_t bufferSize = scpOptions_get()->chunkSize;
+  char* buffer = malloc(bufferSize);
+  if (!buffer) {
+    close(fd);
+    return false;
+  }
+
+  md5Context ctx;
+  checksum_md5Init(&ctx);
+  ssize_t n;
+  while ((n = read(fd, buffer, bufferSize)) != 0) {
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) break;
+    checksum_md5Update(&ctx, buffer, n);
+  }
+  free(buffer);
+  close(fd);
+  if (n != 0) return false;
+
+  unsigned char digest[CHECKSUM_MD5_SIZE];
+  checksum_md5Final(&ctx, digest);
+  int i;
+  for (i = 0; i < CHECKSUM_MD5_SIZE; ++i) sprintf(hex + 2 * i, "%02x", digest[i]);
+  return true;
+}
+
+// Hashes the candidates on the server in a single command. Its output has
+// one line per file, in order, that starts with the digest, or is "-" if
+// the file couldn't be read.
+static char* _incrementalSync_D_hashRemote(syncPlan* plan,
+                                           syncEntry** candidates,
+                                           size_t numCandidates)
+{
+  char quotedRoot[SYNC_QUOTED_SIZE];
+  char command[SYNC_COMMAND_SIZE];
+  if (!remoteExec_quote(plan->remoteRoot, quotedRoot, sizeof(quotedRoot)))
+    return NULL;
+  // md5sum of a missing file prints nothing, which would throw the lines
+  // out of step with the candidates, so each file gets a line of its own
+  snprintf(command, sizeof(command), "cd %s && exec xargs -0 sh -c 'for f; "
+           "do md5sum < \"$f\" 2>/dev/null || echo -; done' sh", quotedRoot);
+
+  // The names are passed to xargs separated by NULs
+  size_t inputLen = 0;
+  size_t i;
+  for (i = 0; i < numCandidates; ++i)
+    inputLen += strlen(candidates[i]->path) + 1;
+  char* input = malloc(inputLen);
+  if (!input) {
+    fprintf(stderr, "Error allocating memory in %s\n", __FUNCTION__);
+    return NULL;
+  }
+  char* p = input;
+  for (i = 0; i < numCandidates; ++i) {
+    size_t len = strlen(candidates[i]->path) + 1;
+    memcpy(p, candidates[i]->path, len);
+    p += len;
+  }
+
+  char* output = remoteExec_D_runWithInput(plan->session, command, input,
+                                           inputLen, NULL);
+  free(input);
+  if (!output) fprintf(stderr, "Error computing the digests on the server\n");
+  return output;
+}
+
+// Compares the digests of the files whose sizes match but that can't be
+// told apart otherwise. Those that match are not copied.
+static void _incrementalSync_compareDigests(syncPlan* plan,
+                                            syncEntry** candidates,
+                                            size_t numCandidates)
+{
+  if (numCandidates == 0) return;
+
+  char* output = _incrementalSync_D_hashRemote(plan, candidates,
+                                               numCandidates);
+  if (!output) return;
+
+  char* line = output;
+  size_t i;
+  for (i = 0; i < numCandidates && *line; ++i) {
+    char* next = strchr(line, '\n');
+    if (next) *next++ = '\0';
+    else next = line + strlen(line);
+
+    char localPath[PATH_MAX];
+    char hex[SYNC_HEX_SIZE + 1];
+    if (strlen(line) >= SYNC_HEX_SIZE &&
+        snprintf(localPath, PATH_MAX, "%s/%s", plan->localRoot,
+                 candidates[i]->path) < PATH_MAX &&
+        _incrementalSync_hashLocal(localPath, hex) &&
+        strncmp(line, hex, SYNC_HEX_SIZE) == 0) {
+      candidates[i]->needsCopy = false;
+      candidates[i]->isVerified = true;
+    }
+
+    line = next;
+  }
+
+  free(output);
+}
+
+// Marks every directory above path as needing to be copied
+static void _incrementalSync_markParents(syncPlan* plan, const char* path)
+{
+  char parent[PATH_MAX];
+  snprintf(parent, PATH_MAX, "%s", path);
+
+  char* slash;
+  while ((slash = strrchr(parent, '/')) != NULL) {
+    *slash = '\0';
+    syncEntry* dir = _incrementalSync_find(&plan->src, parent);
+    if (!dir || dir->needsCopy) break;
+    dir->needsCopy = true;
+  }
+}
+
+// Decides what needs to be copied
+static bool _incrementalSync_plan(syncPlan* plan)
+{
+  bool compareChecksums = scpOptions_get()->compareChecksums;
+  syncEntry** candidates = NULL;
+  size_t numCandidates = 0;
+  if (compareChecksums && plan->remoteRoot[0]) {
+    candidates = malloc((plan->src.numEntries + 1) * sizeof(syncEntry*));
+    if (!candidates) {
+      fprintf(stderr, "Error allocating memory in %s\n", __FUNCTION__);
+      return false;
+    }
+  }
+
+  size_t i;
+  for (i = 0; i < plan->src.numEntries; ++i) {
+    syncEntry* src = &plan->src.entries[i];
+    syncEntry* dst = _incrementalSync_find(&plan->dst, src->path);
+
+    src->needsCopy = !dst || dst->type != src->type;
+    if (src->type != FILE_IS_REG) continue;
+    plan->numFiles++;
+    if (src->needsCopy || dst->stamp.size != src->stamp.size) {
+      src->needsCopy = true;
+      continue;
+    }
+
+    syncEntry* record = _incrementalSync_find(&plan->manifest, src->path);
+    if (record) {
+      // Both ends are as they were right after they were synced
+      src->needsCopy =
+        record->stamp.size != src->stamp.size ||
+        record->stamp.mtime != src->stamp.mtime ||
+        record->dstStamp.size != dst->stamp.size ||
+        record->dstStamp.mtime != dst->stamp.mtime;
+      src->isVerified = !src->needsCopy;
+    }
+    else src->needsCopy = dst->stamp.mtime < src->stamp.mtime;
+
+    if (candidates && (src->needsCopy || !record)) {
+      src->needsCopy = true;
+      candidates[numCandidates++] = src;
+    }
+  }
+
+  if (candidates) {
+    _incrementalSync_compareDigests(plan, candidates, numCandidates);
+    free(candidates);
+  }
+
+  for (i = 0; i < plan->src.numEntries; ++i) {
+    syncEntry* src = &plan->src.entries[i];
+    if (!src->needsCopy) continue;
+    if (src->type == FILE_IS_REG) {
+      plan->numChangedFiles++;
+      _incrementalSync_markParents(plan, src->path);
+    }
+  }
+  for (i = 0; i < plan->src.numEntries; ++i)
+    if (plan->src.entries[i].needsCopy) plan->numToCopy++;
+
+  printf("Incremental: %zu of %zu files unchanged\n",
+         plan->numFiles - plan->numChangedFiles, plan->numFiles);
+  return true;
+}
+
+static bool _incrementalSync_filter(const char* relPath, const fileMeta* meta,
+                                    void* userData)
+{
+  (void)meta;
+  syncEntry* entry = _incrementalSync_find(userData, relPath);
+  // Anything that appeared since the listing is copied too
+  return !entry || entry->needsCopy;
+}
+
+static void _incrementalSync_freePlan(syncPlan* plan)
+{
+  _incrementalSync_freeList(&plan->src);
+  _incrementalSync_freeList(&plan->dst);
+  _incrementalSync_freeList(&plan->manifest);
+}
+
+/*****************************************************************************
+ * Copying
+ *****************************************************************************/
+
+int incrementalSync_copyToServer(ssh_session session, psshInfo info,
+                                 char* from, char* to)
+{
+  // If from ends in '/', the base name would be empty
+  size_t len = strlen(from);
+  if (len > 1 && from[len - 1] == '/') from[len - 1] = '\0';
+  if (fileSystemUtils_getFileType(from) != FILE_IS_DIR)
+    return INCREMENTAL_SYNC_UNAVAILABLE;
+
+  syncPlan plan;
+  memset(&plan, 0, sizeof(plan));
+  plan.session = session;
+  plan.isUpload = true;
+  snprintf(plan.localRoot, PATH_MAX, "%s", from);
+
+  // Like scp, copy into the destination if it is a directory that exists,
+  // and otherwise create the destination as the copy of from
+  char quotedTo[SYNC_QUOTED_SIZE];
+  char quotedBase[SYNC_QUOTED_SIZE];
+  char prefix[SYNC_COMMAND_SIZE];
+  if (!remoteExec_quote(to, quotedTo, sizeof(quotedTo)) ||
+      !remoteExec_quote(_incrementalSync_baseName(from), quotedBase,
+                        sizeof(quotedBase))) {
+    fprintf(stderr, "Error: path too long in %s\n", __FUNCTION__);
+    return INCREMENTAL_SYNC_FAILED;
+  }
+  snprintf(prefix, sizeof(prefix),
+           "d=%s; if [ -d \"$d\" ]; then d=\"$d\"/%s; fi;", quotedTo,
+           quotedBase);
+
+  if (!_incrementalSync_setManifestPath(&plan, info, to))
+    plan.manifestPath[0] = '\0';
+  _incrementalSync_loadManifest(&plan);
+
+  if (!_incrementalSync_listRemote(&plan, prefix, &plan.dst) ||
+      !_incrementalSync_listLocal(from, &plan.src) ||
+      !_incrementalSync_plan(&plan)) {
+    _incrementalSync_freePlan(&plan);
+    return INCREMENTAL_SYNC_FAILED;
+  }
+
+  bool success = true;
+  syncList copied;
+  memset(&copied, 0, sizeof(copied));
+  if (plan.numToCopy > 0 || !plan.remoteRoot[0]) {
+    success = scp_copyToServerFiltered(session, from, to, true,
+                                       _incrementalSync_filter,
+                                       &plan.src) == SSH_OK;
+
+    // The new modification times on the server are needed for the
+    // manifest
+    if (success && !_incrementalSync_listRemote(&plan, prefix, &copied))
+      _incrementalSync_freeList(&copied);
+  }
+
+  // Record what is now known to be the same on both ends. If the copy
+  // failed, that is only the files that were left alone.
+  syncList records;
+  memset(&records, 0, sizeof(records));
+  size_t i;
+  for (i = 0; i < plan.src.numEntries; ++i) {
+    syncEntry* src = &plan.src.entries[i];
+    if (src->type != FILE_IS_REG || (!src->needsCopy && !src->isVerified))
+      continue;
+
+    syncEntry* dst = src->needsCopy ?
+                     _incrementalSync_find(&copied, src->path) :
+                     _incrementalSync_find(&plan.dst, src->path);
+    if (dst && dst->stamp.size == src->stamp.size &&
+        !_incrementalSync_record(&records, src, &dst->stamp))
+      break;
+  }
+  _incrementalSync_saveManifest(&plan, &records);
+
+  _incrementalSync_freeList(&records);
+  _incrementalSync_freeList(&copied);
+  _incrementalSync_freePlan(&plan);
+  return success ? INCREMENTAL_SYNC_OK : INCREMENTAL_SYNC_FAILED;
+}
+
+// Pulls each changed file on its own
+static bool _incrementalSync_pullChanged(syncPlan* plan)
+{
+  size_t i;
+  for (i = 0; i < plan->src.numEntries; ++i) {
+    syncEntry* src = &plan->src.entries[i];
+    if (!src->needsCopy) continue;
+
+    char remotePath[PATH_MAX];
+    char localPath[PATH_MAX];
+    if (snprintf(remotePath, PATH_MAX, "%s/%s", plan->remoteRoot,
+                 src->path) >= PATH_MAX ||
+        snprintf(localPath, PATH_MAX, "%s/%s", plan->localRoot,
+                 src->path) >= PATH_MAX) {
+      fprintf(stderr, "Error: path too long for %s\n", src->path);
+      return false;
+    }
+
+    // Parents come before their children in the sorted list
+    if (src->type == FILE_IS_DIR) {
+      if (!fileSystemUtils_mkdirIfNeeded(localPath)) {
+        fprintf(stderr, "Error creating %s\n", localPath);
+        return false;
+      }
+    }
+    else if (scp_copyFromServer(plan->session, remotePath, localPath,
+                                false) != SSH_OK)
+      return false;
+  }
+  return true;
+}
+
+int incrementalSync_copyFromServer(ssh_session session, psshInfo info,
+                                   char* from, char* to)
+{
+  size_t len = strlen(from);
+  if (len > 1 && from[len - 1] == '/') from[len - 1] = '\0';
+
+  syncPlan plan;
+  memset(&plan, 0, sizeof(plan));
+  plan.session = session;
+  plan.isUpload = false;
+
+  // scp_copyFromServer() always creates the directory under to, making to
+  // first if it doesn't exist, so that is where the tree is compared and
+  // where the whole tree goes when it is copied at once
+  if (snprintf(plan.localRoot, PATH_MAX, "%s/%s", to,
+               _incrementalSync_baseName(from)) >= PATH_MAX) {
+    fprintf(stderr, "Error: path too long for %s\n", to);
+    return INCREMENTAL_SYNC_FAILED;
+  }
+
+  char quotedFrom[SYNC_QUOTED_SIZE];
+  char prefix[SYNC_COMMAND_SIZE];
+  if (!remoteExec_quote(from, quotedFrom, sizeof(quotedFrom))) {
+    fprintf(stderr, "Error: path too long in %s\n", __FUNCTION__);
+    return INCREMENTAL_SYNC_FAILED;
+  }
+  snprintf(prefix, sizeof(prefix), "d=%s;", quotedFrom);
+
+  if (!_incrementalSync_listRemote(&plan, prefix, &plan.src)) {
+    _incrementalSync_freePlan(&plan);
+    return INCREMENTAL_SYNC_FAILED;
+  }
+
+  // A single file (or something missing) is copied as usual
+  if (!plan.remoteRoot[0]) {
+    _incrementalSync_freePlan(&plan);
+    return INCREMENTAL_SYNC_UNAVAILABLE;
+  }
+
+  if (!_incrementalSync_setManifestPath(&plan, info, from))
+    plan.manifestPath[0] = '\0';
+  _incrementalSync_loadManifest(&plan);
+
+  if (!_incrementalSync_listLocal(plan.localRoot, &plan.dst) ||
+      !_incrementalSync_plan(&plan)) {
+    _incrementalSync_freePlan(&plan);
+    return INCREMENTAL_SYNC_FAILED;
+  }
+
+  bool success = true;
+  bool copiedAll = fileSystemUtils_getFileType(plan.localRoot) != FILE_IS_DIR ||
+                   plan.numChangedFiles > plan.numFiles / 2;
+  if (copiedAll)
+    success = scp_copyFromServer(session, from, to, true) == SSH_OK;
+  else if (plan.numToCopy > 0)
+    success = _incrementalSync_pullChanged(&plan);
+
+  // Record what is now known to be the same on both ends, as it is found
+  // on the disk
+  syncList records;
+  memset(&records, 0, sizeof(records));
+  size_t i;
+  for (i = 0; success && i < plan.src.numEntries; ++i) {
+    syncEntry* src = &plan.src.entries[i];
+    if (src->type != FILE_IS_REG ||
+        (!copiedAll && !src->needsCopy && !src->isVerified))
+      continue;
+
+    char localPath[PATH_MAX];
+    fileMeta meta;
+    if (snprintf(localPath, PATH_MAX, "%s/%s", plan.localRoot, src->path)
+          >= PATH_MAX ||
+        !fileSystemUtils_getMeta(AT_FDCWD, localPath, &meta) ||
+        meta.type != FILE_IS_REG || meta.size != src->stamp.size)
+      continue;
+
+    syncStamp dstStamp = { meta.size, meta.mtime };
+    if (!_incrementalSync_record(&records, src, &dstStamp)) break;
+  }
+  if (success) _incrementalSync_saveManifest(&plan, &records);
+
+  _incrementalSync_freeList(&records);
+  _incrementalSync_freePlan(&plan);
+  return success ? INCREMENTAL_SYNC_OK : INCREMENTAL_SYNC_FAILED;
+}
@@ -0,0 +1,502 @@
+/**********************************************************************
+  libscp.c - Source code for running copies as jobs from a program that
+             links the scp library
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libscp.h>
+#include <localCopy.h>
+#include <mux.h>
+#include <progress.h>
+#include <relay.h>
+#include <sessionPool.h>
+#include <sshUtils.h>
+#include <trace.h>
+#include <transfer.h>
+
+// A copy that was submitted. It is in the queue until a thread takes it,
+// and then in the list of running jobs until it ends.
+typedef struct libscpJob {
+  uint64_t id;
+  char* from;
+  char* to;
+  scpOptions options;
+  libscpCallbacks callbacks;
+  // Counted into by the copy, through options.progress
+  pprogress progress;
+  // The bytes that the last progress callback was given
+  uint64_t bytesReported;
+  // Set atomically by libscp_cancel(), and read by the copy through
+  // options.jobCanceled
+  bool isCanceled;
+  struct libscpJob* next;
+} libscpJob;
+
+// A progress callback that is due, copied out of its job
+typedef struct {
+  libscpProgressCallback onProgress;
+  uint64_t jobId;
+  progressSnapshot snapshot;
+  void* userData;
+} progressReport;
+
+struct libscpPool {
+  pthread_mutex_t mutex;
+  // Signaled when a job is queued or the pool is stopping
+  pthread_cond_t jobCond;
+  // Signaled when a job has ended
+  pthread_cond_t doneCond;
+  // Signaled when the pool is stopping
+  pthread_cond_t stopCond;
+  // Held while any callback runs, so that they never overlap
+  pthread_mutex_t callbackMutex;
+
+  libscpJob* queueHead;
+  libscpJob* queueTail;
+  libscpJob* running;
+  uint64_t nextId;
+  bool isStopping;
+  bool canPrompt;
+
+  // The jobs that are queued, running, or being called back about
+  size_t numUnfinished;
+  libscpStats stats;
+  // The bytes of the jobs that have ended
+  uint64_t bytesDone;
+
+  psessionPool sessions;
+  pthread_t* threads;
+  int numThreads;
+  pthread_t timerThread;
+  bool hasTimer;
+  // Only used by the timer thread. There is room for every running job.
+  progressReport* reports;
+};
+
+static void _libscp_freeJob(libscpJob* job)
+{
+  free(job->from);
+  free(job->to);
+  progress_free(job->progress);
+  free(job);
+}
+
+// Copies between two servers, with a session to each
+static int _libscp_relay(plibscpPool pool, psshInfo fromInfo,
+                         psshInfo toInfo)
+{
+  ssh_session fromSession = sessionPool_acquire(pool->sessions, fromInfo);
+  if (!fromSession) {
+    fprintf(stderr, "Error connecting the session to %s\n", fromInfo->host);
+    return LIBSCP_CONNECT_FAILED;
+  }
+
+  ssh_session toSession = sessionPool_acquire(pool->sessions, toInfo);
+  if (!toSession) {
+    fprintf(stderr, "Error connecting the session to %s\n", toInfo->host);
+    sessionPool_release(pool->sessions, fromSession, true);
+    return LIBSCP_CONNECT_FAILED;
+  }
+
+  int rc = relay_copy(fromSession, fromInfo->filePath, toSession,
+                      toInfo->filePath);
+
+  sessionPool_release(pool->sessions, toSession, rc == SSH_OK);
+  sessionPool_release(pool->sessions, fromSession, rc == SSH_OK);
+  if (rc != SSH_OK) {
+    fprintf(stderr, "Error executing relay_copy()\n");
+    return LIBSCP_FAILED;
+  }
+  return LIBSCP_OK;
+}
+
+// Copies the files of a job on this thread, without the mux daemon
+static int _libscp_copy(plibscpPool pool, libscpJob* job, psshInfo fromInfo,
+                        psshInfo toInfo)
+{
+  // If both are local, copy without going through ssh at all
+  if (fromInfo->isLocal && toInfo->isLocal) {
+    if (!localCopy_copy(job->from, job->to)) {
+      fprintf(stderr, "Error executing localCopy_copy()\n");
+      return LIBSCP_FAILED;
+    }
+    return LIBSCP_OK;
+  }
+
+  if (!fromInfo->isLocal && !toInfo->isLocal)
+    return _libscp_relay(pool, fromInfo, toInfo);
+
+  bool isDownload = !fromInfo->isLocal;
+  psshInfo info = isDownload ? fromInfo : toInfo;
+  ssh_session session = sessionPool_acquire(pool->sessions, info);
+  if (!session) {
+    fprintf(stderr, "Error connecting the session to %s\n", info->host);
+    return LIBSCP_CONNECT_FAILED;
+  }
+
+  int rc = isDownload ?
+           transfer_copyFromServer(session, info, fromInfo->filePath,
+                                   job->to) :
+           transfer_copyToServer(session, info, fromInfo->filePath,
+                                 toInfo->filePath);
+
+  sessionPool_release(pool->sessions, session, rc == SSH_OK);
+  if (rc != SSH_OK) {
+    fprintf(stderr, "Error executing %s\n", isDownload ?
+            "scp_copyFromServer()" : "scp_copyToServer()");
+    return LIBSCP_FAILED;
+  }
+  return LIBSCP_OK;
+}
+
+// Runs a job on this thread, which has been given the job's options
+static int _libscp_runJob(plibscpPool pool, libscpJob* job)
+{
+  sshInfo fromInfo;
+  sshInfo toInfo;
+
+  // Set all the info from the 'from' and 'to' character
+  // arrays. It automatically determines if they are local or not
+  if (!sshUtils_setSSHInfo(job->from, &fromInfo) ||
+      !sshUtils_setSSHInfo(job->to, &toInfo)) {
+    fprintf(stderr, "Error reading arguments\n");
+    return LIBSCP_FAILED;
+  }
+  fromInfo.noPrompt = !pool->canPrompt;
+  toInfo.noPrompt = !pool->canPrompt;
+
+  // The daemon writes the trace of a copy that it runs itself
+  if (job->options.useMux && fromInfo.isLocal != toInfo.isLocal) {
+    int rc = fromInfo.isLocal ?
+             mux_copyToServer(&toInfo, fromInfo.filePath, toInfo.filePath) :
+             mux_copyFromServer(&fromInfo, fromInfo.filePath, job->to);
+    if (rc == MUX_FAILED) return LIBSCP_FAILED;
+    if (rc == MUX_OK) return LIBSCP_OK;
+    // Otherwise, connect directly
+  }
+
+  if (!job->options.traceFile)
+    return _libscp_copy(pool, job, &fromInfo, &toInfo);
+
+  // Each job writes its own trace, which is finished once every thread of
+  // the copy has ended
+  job->options.tracer = trace_D_start(job->options.traceFile);
+  if (!job->options.tracer) return LIBSCP_FAILED;
+
+  int status = _libscp_copy(pool, job, &fromInfo, &toInfo);
+  trace_finish(job->options.tracer);
+  job->options.tracer = NULL;
+  return status;
+}
+
+// Calls back the progress of every running job that has copied something
+// since the last time
+static void _libscp_reportProgress(plibscpPool pool)
+{
+  pthread_mutex_lock(&pool->callbackMutex);
+
+  int numReports = 0;
+  pthread_mutex_lock(&pool->mutex);
+  libscpJob* job;
+  for (job = pool->running; job; job = job->next) {
+    if (!job->callbacks.onProgress) continue;
+    uint64_t bytes = progress_getBytes(job->progress);
+    if (bytes == job->bytesReported) continue;
+
+    progressReport* report = &pool->reports[numReports++];
+    report->onProgress = job->callbacks.onProgress;
+    report->jobId = job->id;
+    progress_getSnapshot(job->progress, &report->snapshot);
+    report->userData = job->callbacks.userData;
+    job->bytesReported = report->snapshot.bytes;
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  // A job that ends meanwhile waits for the callback mutex, so these still
+  // come before its done callback
+  int i;
+  for (i = 0; i < numReports; ++i) {
+    progressReport* report = &pool->reports[i];
+    report->onProgress(report->jobId, &report->snapshot, report->userData);
+  }
+
+  pthread_mutex_unlock(&pool->callbackMutex);
+}
+
+// Reports progress, and closes idle sessions once a second
+static void* _libscp_runTimer(void* arg)
+{
+  plibscpPool pool = arg;
+  int ticks = 0;
+
+  pthread_mutex_lock(&pool->mutex);
+  while (!pool->isStopping) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += LIBSCP_PROGRESS_INTERVAL * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&pool->stopCond, &pool->mutex, &deadline);
+    if (pool->isStopping) break;
+    pthread_mutex_unlock(&pool->mutex);
+
+    _libscp_reportProgress(pool);
+    int numSessions = -1;
+    if (++ticks % (1000 / LIBSCP_PROGRESS_INTERVAL) == 0)
+      numSessions = sessionPool_closeIdle(pool->sessions);
+
+    pthread_mutex_lock(&pool->mutex);
+    if (numSessions >= 0) pool->stats.numSessions = numSessions;
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return NULL;
+}
+
+static void* _libscp_runWorker(void* arg)
+{
+  plibscpPool pool = arg;
+
+  pthread_mutex_lock(&pool->mutex);
+  while (true) {
+    while (!pool->queueHead && !pool->isStopping)
+      pthread_cond_wait(&pool->jobCond, &pool->mutex);
+
+    // The pool only stops once the queue is empty, since every job is
+    // called back about
+    libscpJob* job = pool->queueHead;
+    if (!job) break;
+
+    pool->queueHead = job->next;
+    if (!pool->queueHead) pool->queueTail = NULL;
+    job->next = pool->running;
+    pool->running = job;
+    pool->stats.numQueued--;
+    pool->stats.numRunning++;
+    pthread_mutex_unlock(&pool->mutex);
+
+    int status = LIBSCP_CANCELED;
+    if (!__atomic_load_n(&job->isCanceled, __ATOMIC_RELAXED)) {
+      scpOptions_setForThread(&job->options);
+      status = _libscp_runJob(pool, job);
+      scpOptions_setForThread(NULL);
+      if (__atomic_load_n(&job->isCanceled, __ATOMIC_RELAXED))
+        status = LIBSCP_CANCELED;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    libscpJob** link = &pool->running;
+    while (*link != job) link = &(*link)->next;
+    *link = job->next;
+    pool->stats.numRunning--;
+    uint64_t bytes = progress_getBytes(job->progress);
+    pool->bytesDone += bytes;
+    if (status == LIBSCP_OK) pool->stats.numSucceeded++;
+    else if (status == LIBSCP_CANCELED) pool->stats.numCanceled++;
+    else pool->stats.numFailed++;
+    // The timer no longer sees the job, so whatever it copied since the
+    // last report is reported here
+    bool needsReport = job->callbacks.onProgress &&
+                       bytes != job->bytesReported;
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (needsReport || job->callbacks.onDone) {
+      pthread_mutex_lock(&pool->callbackMutex);
+      if (needsReport) {
+        progressSnapshot snapshot;
+        progress_getSnapshot(job->progress, &snapshot);
+        job->callbacks.onProgress(job->id, &snapshot,
+                                  job->callbacks.userData);
+      }
+      if (job->callbacks.onDone)
+        job->callbacks.onDone(job->id, status, job->callbacks.userData);
+      pthread_mutex_unlock(&pool->callbackMutex);
+    }
+    _libscp_freeJob(job);
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->numUnfinished--;
+    pthread_cond_broadcast(&pool->doneCond);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return NULL;
+}
+
+plibscpPool libscp_D_newPool(int numThreads, int idleTimeout, bool canPrompt)
+{
+  if (numThreads < 1) numThreads = 1;
+
+  plibscpPool pool = calloc(1, sizeof(libscpPool));
+  if (!pool) return NULL;
+
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->jobCond, NULL);
+  pthread_cond_init(&pool->doneCond, NULL);
+  pthread_cond_init(&pool->stopCond, NULL);
+  pthread_mutex_init(&pool->callbackMutex, NULL);
+  pool->nextId = 1;
+  pool->canPrompt = canPrompt;
+
+  pool->sessions = sessionPool_D_new(idleTimeout);
+  pool->threads = calloc(numThreads, sizeof(pthread_t));
+  pool->reports = calloc(numThreads, sizeof(progressReport));
+  if (!pool->sessions || !pool->threads || !pool->reports) {
+    fprintf(stderr, "Error allocating the pool in %s\n", __FUNCTION__);
+    libscp_freePool(pool);
+    return NULL;
+  }
+
+  int i;
+  for (i = 0; i < numThreads; ++i) {
+    if (pthread_create(&pool->threads[i], NULL, _libscp_runWorker,
+                       pool) != 0)
+      break;
+    pool->numThreads++;
+  }
+  if (pool->numThreads == 0) {
+    fprintf(stderr, "Error starting the threads in %s\n", __FUNCTION__);
+    libscp_freePool(pool);
+    return NULL;
+  }
+
+  // Without the timer, jobs still run, but there is no progress to report
+  pool->hasTimer = pthread_create(&pool->timerThread, NULL, _libscp_runTimer,
+                                  pool) == 0;
+  return pool;
+}
+
+void libscp_freePool(plibscpPool pool)
+{
+  if (!pool) return;
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->isStopping = true;
+  libscpJob* job;
+  for (job = pool->queueHead; job; job = job->next)
+    __atomic_store_n(&job->isCanceled, true, __ATOMIC_RELAXED);
+  for (job = pool->running; job; job = job->next)
+    __atomic_store_n(&job->isCanceled, true, __ATOMIC_RELAXED);
+  pthread_cond_broadcast(&pool->jobCond);
+  pthread_cond_broadcast(&pool->stopCond);
+  pthread_mutex_unlock(&pool->mutex);
+
+  int i;
+  for (i = 0; i < pool->numThreads; ++i)
+    pthread_join(pool->threads[i], NULL);
+  if (pool->hasTimer) pthread_join(pool->timerThread, NULL);
+
+  sessionPool_free(pool->sessions);
+  pthread_mutex_destroy(&pool->mutex);
+  pthread_cond_destroy(&pool->jobCond);
+  pthread_cond_destroy(&pool->doneCond);
+  pthread_cond_destroy(&pool->stopCond);
+  pthread_mutex_destroy(&pool->callbackMutex);
+  free(pool->threads);
+  free(pool->reports);
+  free(pool);
+}
+
+uint64_t libscp_submit(plibscpPool pool, const char* from, const char* to,
+                       const scpOptions* options,
+                       const libscpCallbacks* callbacks)
+{
+  libscpJob* job = calloc(1, sizeof(libscpJob));
+  if (!job) return 0;
+
+  job->from = strdup(from);
+  job->to = strdup(to);
+  if (!job->from || !job->to) {
+    _libscp_freeJob(job);
+    return 0;
+  }
+
+  if (options) job->options = *options;
+  else scpOptions_setDefaults(&job->options);
+  // A job is always a copy
+  job->options.runMuxDaemon = false;
+  job->options.batchFile = NULL;
+  job->options.batchResultsFile = NULL;
+  job->options.deltaReceive = false;
+  job->options.deltaSend = false;
+  job->options.verifyHash = false;
+  job->options.printCipherProbe = false;
+  job->options.jobCanceled = &job->isCanceled;
+  // Each job counts and traces on its own
+  job->progress = progress_D_new();
+  job->options.progress = job->progress;
+  job->options.tracer = NULL;
+  if (!job->progress || !scpOptions_check(&job->options)) {
+    _libscp_freeJob(job);
+    return 0;
+  }
+  if (callbacks) job->callbacks = *callbacks;
+
+  pthread_mutex_lock(&pool->mutex);
+  if (pool->isStopping) {
+    pthread_mutex_unlock(&pool->mutex);
+    _libscp_freeJob(job);
+    return 0;
+  }
+
+  job->id = pool->nextId++;
+  if (pool->queueTail) pool->queueTail->next = job;
+  else pool->queueHead = job;
+  pool->queueTail = job;
+  pool->stats.numQueued++;
+  pool->numUnfinished++;
+  uint64_t id = job->id;
+  pthread_cond_signal(&pool->jobCond);
+  pthread_mutex_unlock(&pool->mutex);
+
+  return id;
+}
+
+bool libscp_cancel(plibscpPool pool, uint64_t jobId)
+{
+  pthread_mutex_lock(&pool->mutex);
+  libscpJob* job = pool->queueHead;
+  while (job && job->id != jobId) job = job->next;
+  if (!job) {
+    job = pool->running;
+    while (job && job->id != jobId) job = job->next;
+  }
+  if (job) __atomic_store_n(&job->isCanceled, true, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&pool->mutex);
+
+  return job != NULL;
+}
+
+void libscp_wait(plibscpPool pool)
+{
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->numUnfinished > 0)
+    pthread_cond_wait(&pool->doneCond, &pool->mutex);
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+void libscp_getStats(plibscpPool pool, libscpStats* stats)
+{
+  pthread_mutex_lock(&pool->mutex);
+  *stats = pool->stats;
+  stats->bytesCopied = pool->bytesDone;
+  libscpJob* job;
+  for (job = pool->running; job; job = job->next)
+    stats->bytesCopied += progress_getBytes(job->progress);
+  pthread_mutex_unlock(&pool->mutex);
+}
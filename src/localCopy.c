@@ -0,0 +1,388 @@
+/**********************************************************************
+  localCopy.c - Source code for copying files and directories when both
+                ends are on the local machine
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+// For copy_file_range()
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fileSystemUtils.h>
+#include <localCopy.h>
+#include <progress.h>
+#include <scpOptions.h>
+#include <workQueue.h>
+
+// The most that is asked of copy_file_range() and sendfile() at once
+#define LOCAL_COPY_MAX_REQUEST (1 << 30)
+
+// A single file to be copied
+typedef struct {
+  char* from;
+  char* to;
+} copyJob;
+
+// The list of files that is built while walking the tree
+typedef struct {
+  copyJob* jobs;
+  size_t numJobs;
+  size_t capacity;
+  // The root of the destination tree
+  char destRoot[PATH_MAX];
+} copyJobList;
+
+// The state of one worker thread
+typedef struct {
+  int id;
+  pworkQueue queue;
+  pthread_t thread;
+  bool success;
+} copyWorker;
+
+// Returns a pointer to the last component of a path
+static const char* _localCopy_baseName(const char* path)
+{
+  const char* p = strrchr(path, '/');
+  return p ? p + 1 : path;
+}
+
+// The errors that mean a method doesn't work for these files, rather than
+// that the copy failed
+static bool _localCopy_isUnsupported(int err)
+{
+  return err == ENOSYS || err == EXDEV || err == EINVAL ||
+         err == EOPNOTSUPP || err == EBADF;
+}
+
+// Copies everything from the start of in, which is size bytes long, to the
+// end of the file. Each method picks up where the last one left off.
+static bool _localCopy_copyData(int in, int out, size_t size)
+{
+  // A reflink shares the blocks instead of copying them
+  if (ioctl(out, FICLONE, in) == 0) {
+    progress_update(size);
+    return true;
+  }
+
+  // copy_file_range() stays in the kernel, and some filesystems turn it
+  // into a reflink or a server side copy
+  ssize_t n;
+  while ((n = copy_file_range(in, NULL, out, NULL, LOCAL_COPY_MAX_REQUEST,
+                              0)) != 0) {
+    if (n > 0) {
+      progress_update(n);
+      continue;
+    }
+    if (errno == EINTR) continue;
+    if (!_localCopy_isUnsupported(errno)) return false;
+    break;
+  }
+  if (n == 0) return true;
+
+  // sendfile() also stays in the kernel, and works across filesystems on
+  // older kernels
+  while ((n = sendfile(out, in, NULL, LOCAL_COPY_MAX_REQUEST)) != 0) {
+    if (n > 0) {
+      progress_update(n);
+      continue;
+    }
+    if (errno == EINTR) continue;
+    if (!_localCopy_isUnsupported(errno)) return false;
+    break;
+  }
+  if (n == 0) return true;
+
+  size_t bufferSize = scpOptions_get()->chunkSize;
+  char* buffer = malloc(bufferSize);
+  if (!buffer) return false;
+
+  bool success = true;
+  while (success && (n = read(in, buffer, bufferSize)) != 0) {
+    if (n < 0) {
+      if (errno != EINTR) success = false;
+      continue;
+    }
+
+    char* p = buffer;
+    while (n > 0) {
+      ssize_t written = write(out, p, n);
+      if (written < 0 && errno == EINTR) continue;
+      if (written <= 0) {
+        success = false;
+        break;
+      }
+      p += written;
+      n -= written;
+      progress_update(written);
+    }
+  }
+
+  free(buffer);
+  return success;
+}
+
+static bool _localCopy_copyFile(const char* from, const char* to)
+{
+  int in = open(from, O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    fprintf(stderr, "Error while opening %s for reading: %s\n", from,
+            strerror(errno));
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(in, &st) != 0) {
+    fprintf(stderr, "Error reading %s: %s\n", from, strerror(errno));
+    close(in);
+    return false;
+  }
+
+  // Don't truncate until we know it isn't the file we are reading
+  int out = open(to, O_WRONLY | O_CREAT | O_CLOEXEC,
+                 st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO));
+  if (out < 0) {
+    fprintf(stderr, "Error opening %s for writing: %s\n", to,
+            strerror(errno));
+    close(in);
+    return false;
+  }
+
+  struct stat outSt;
+  if (fstat(out, &outSt) != 0 ||
+      (outSt.st_dev == st.st_dev && outSt.st_ino == st.st_ino) ||
+      ftruncate(out, 0) != 0) {
+    fprintf(stderr, "Error: cannot copy %s onto %s\n", from, to);
+    close(in);
+    close(out);
+    return false;
+  }
+
+  bool success = _localCopy_copyData(in, out, st.st_size);
+  if (!success)
+    fprintf(stderr, "Error copying %s to %s: %s\n", from, to,
+            strerror(errno));
+
+  close(in);
+  if (close(out) != 0) success = false;
+  return success;
+}
+
+static bool _localCopy_addJob(copyJobList* list, const char* from,
+                              const char* to)
+{
+  if (list->numJobs == list->capacity) {
+    size_t newCapacity = list->capacity ? list->capacity * 2 : 256;
+    copyJob* jobs = realloc(list->jobs, newCapacity * sizeof(copyJob));
+    if (!jobs) return false;
+    list->jobs = jobs;
+    list->capacity = newCapacity;
+  }
+
+  copyJob* job = &list->jobs[list->numJobs];
+  job->from = strdup(from);
+  job->to = strdup(to);
+  if (!job->from || !job->to) {
+    free(job->from);
+    free(job->to);
+    return false;
+  }
+
+  list->numJobs++;
+  return true;
+}
+
+static void _localCopy_freeJobs(copyJobList* list)
+{
+  size_t i;
+  for (i = 0; i < list->numJobs; i++) {
+    free(list->jobs[i].from);
+    free(list->jobs[i].to);
+  }
+  free(list->jobs);
+}
+
+// Called for every file and directory. Directories are created right away,
+// since the walk visits parents before children.
+static bool _localCopy_addPath(const char* path, const char* relPath,
+                               const fileMeta* meta, void* userData)
+{
+  copyJobList* list = userData;
+  char dest[PATH_MAX];
+
+  if (snprintf(dest, PATH_MAX, "%s%s%s", list->destRoot,
+               relPath[0] ? "/" : "", relPath) >= PATH_MAX) {
+    fprintf(stderr, "Error: path too long for %s\n", relPath);
+    return false;
+  }
+
+  if (meta->type == FILE_IS_DIR) {
+    if (!fileSystemUtils_mkdirIfNeeded(dest)) {
+      fprintf(stderr, "fileSystemUtils_mkdirIfNeeded() failed.\n");
+      return false;
+    }
+    return true;
+  }
+  else if (meta->type == FILE_IS_REG) {
+    return _localCopy_addJob(list, path, dest);
+  }
+
+  fprintf(stderr, "Warning: %s is not a regular file or directory\n", path);
+  return true;
+}
+
+static void* _localCopy_runWorker(void* arg)
+{
+  copyWorker* w = arg;
+
+  copyJob* job;
+  while ((job = workQueue_pop(w->queue, w->id)) != NULL) {
+    if (!_localCopy_copyFile(job->from, job->to)) {
+      w->success = false;
+      // Stop everyone, as a single thread would
+      workQueue_cancel(w->queue);
+    }
+  }
+
+  return NULL;
+}
+
+// Copies the files in the list, across several threads if there are enough
+static bool _localCopy_run(copyJobList* list)
+{
+  int numThreads = scpOptions_get()->numJobs;
+  if (numThreads < 2) numThreads = LOCAL_COPY_DEFAULT_THREADS;
+
+  if (list->numJobs < LOCAL_COPY_PARALLEL_MIN_FILES) {
+    size_t i;
+    for (i = 0; i < list->numJobs; i++) {
+      if (!_localCopy_copyFile(list->jobs[i].from, list->jobs[i].to))
+        return false;
+    }
+    return true;
+  }
+
+  pworkQueue queue = workQueue_D_new(numThreads);
+  copyWorker* workers = calloc(numThreads, sizeof(copyWorker));
+  void** jobs = malloc(list->numJobs * sizeof(void*));
+  if (!queue || !workers || !jobs) {
+    fprintf(stderr, "Error allocating workers in %s\n", __FUNCTION__);
+    workQueue_free(queue);
+    free(workers);
+    free(jobs);
+    return false;
+  }
+
+  size_t i;
+  for (i = 0; i < list->numJobs; i++) jobs[i] = &list->jobs[i];
+  workQueue_pushAll(queue, jobs, list->numJobs);
+  free(jobs);
+
+  int j;
+  int started = 0;
+  for (j = 0; j < numThreads; j++) {
+    workers[j].id = j;
+    workers[j].queue = queue;
+    workers[j].success = true;
+    if (scpOptions_startThread(&workers[j].thread, _localCopy_runWorker,
+                               &workers[j]) != 0) {
+      fprintf(stderr, "Warning: could not start worker %i\n", j);
+      break;
+    }
+    started++;
+  }
+
+  // The files of any worker that didn't start are stolen by the others
+  bool success = started > 0;
+  for (j = 0; j < started; j++) {
+    pthread_join(workers[j].thread, NULL);
+    if (!workers[j].success) success = false;
+  }
+
+  workQueue_free(queue);
+  free(workers);
+  return success;
+}
+
+// Refuses to copy a directory into itself, which would never finish. path
+// may not exist yet, so the closest of its parents that does is checked.
+static bool _localCopy_isInside(const char* dir, const char* path)
+{
+  char realDir[PATH_MAX];
+  char realPath[PATH_MAX];
+  if (!realpath(dir, realDir)) return false;
+
+  char existing[PATH_MAX];
+  snprintf(existing, PATH_MAX, "%s", path);
+  while (!realpath(existing, realPath)) {
+    if (errno != ENOENT || strcmp(existing, ".") == 0) return false;
+    char* slash = strrchr(existing, '/');
+    if (!slash) snprintf(existing, PATH_MAX, ".");
+    else if (slash == existing) slash[1] = '\0';
+    else *slash = '\0';
+  }
+
+  size_t len = strlen(realDir);
+  return strncmp(realDir, realPath, len) == 0 &&
+         (realPath[len] == '\0' || realPath[len] == '/');
+}
+
+bool localCopy_copy(const char* from, const char* to)
+{
+  int type = fileSystemUtils_getFileType(from);
+  if (type != FILE_IS_REG && type != FILE_IS_DIR) {
+    fprintf(stderr, "Error: %s is not a regular file or directory\n", from);
+    return false;
+  }
+
+  // If from ends in '/', the base name would be empty
+  char source[PATH_MAX];
+  snprintf(source, PATH_MAX, "%s", from);
+  size_t len = strlen(source);
+  if (len > 1 && source[len - 1] == '/') source[len - 1] = '\0';
+
+  copyJobList list;
+  memset(&list, 0, sizeof(list));
+
+  // Like scp, copy into the destination if it is a directory that exists,
+  // and otherwise create the destination as the copy of from
+  bool toIsDir = fileSystemUtils_getFileType(to) == FILE_IS_DIR;
+  if (toIsDir)
+    snprintf(list.destRoot, PATH_MAX, "%s/%s", to, _localCopy_baseName(source));
+  else
+    snprintf(list.destRoot, PATH_MAX, "%s", to);
+
+  if (type == FILE_IS_REG) return _localCopy_copyFile(source, list.destRoot);
+
+  if (_localCopy_isInside(source, list.destRoot)) {
+    fprintf(stderr, "Error: cannot copy %s into itself\n", source);
+    return false;
+  }
+
+  bool success = fileSystemUtils_walkTree(source, _localCopy_addPath, &list) &&
+                 _localCopy_run(&list);
+
+  _localCopy_freeJobs(&list);
+  return success;
+}
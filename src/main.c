@@ -12,101 +12,286 @@
   limitations under the License.
  ***********************************************************************/
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
 
-#include <passwordPrompt.h>
-#include <scp.h>
-#include <sshUtils.h>
-#include <connectSSH.h>
+#include <batch.h>
+#include <libscp.h>
+#include <mux.h>
+#include <scpOptions.h>
+#include <delta.h>
+#include <verify.h>
+#include <cipherProbe.h>
+#include <progress.h>
 
-int main(int argc, char* argv[])
+// How often the progress of a batch is redrawn, in milliseconds. A single
+// copy is redrawn as often as libscp reports it.
+#define MAIN_PROGRESS_INTERVAL 100
+
+// How much each redraw moves the throughput of the whole copy towards the
+// throughput since the last one. Smaller is smoother.
+#define MAIN_PROGRESS_SMOOTHING 0.1
+
+// The progress line, which is only drawn on one thread at a time
+static uint64_t _main_start;
+static uint64_t _main_lastTime;
+static uint64_t _main_lastBytes;
+static double _main_rate = 0;
+static progressSnapshot _main_last;
+
+// The thread that redraws the progress of a batch
+static pthread_mutex_t _main_progressMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _main_progressCond = PTHREAD_COND_INITIALIZER;
+static bool _main_isStopping = false;
+
+static uint64_t _main_now()
 {
-  if (argc != 3) {
-    printf("Usage: scp <from> <to>\n");
-    return -1;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Writes a size such as "512B", "12.3K" or "1.2G"
+static void _main_formatSize(double bytes, char* str, size_t len)
+{
+  static const char units[] = "BKMGTP";
+  int i = 0;
+  while (bytes >= 1024 && i < (int)sizeof(units) - 2) {
+    bytes /= 1024;
+    i++;
   }
+  snprintf(str, len, i == 0 ? "%.0f%c" : "%.1f%c", bytes, units[i]);
+}
 
-  char* from = argv[1];
-  char* to = argv[2];
+// Writes a number of seconds as "m:ss" or "h:mm:ss"
+static void _main_formatTime(double seconds, char* str, size_t len)
+{
+  unsigned long s = seconds > 0 ? (unsigned long)(seconds + 0.5) : 0;
+  if (s >= 3600)
+    snprintf(str, len, "%lu:%02lu:%02lu", s / 3600, s / 60 % 60, s % 60);
+  else
+    snprintf(str, len, "%lu:%02lu", s / 60, s % 60);
+}
 
-  sshInfo fromInfo;
-  sshInfo toInfo;
+static int _main_getWidth()
+{
+  struct winsize ws;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 20)
+    return ws.ws_col;
+  return 80;
+}
 
-  psshInfo pfromInfo = &fromInfo;
-  psshInfo ptoInfo = &toInfo;
+static void _main_startProgress()
+{
+  _main_start = _main_now();
+  _main_lastTime = _main_start;
+}
 
-  // Set all the info from the 'from' and 'to' character
-  // arrays. It automatically determines if they are local or not
-  // If the reading fails for some reason, they will return false
-  if (!sshUtils_setSSHInfo(from, pfromInfo) ||
-      !sshUtils_setSSHInfo(to, ptoInfo)) {
-    fprintf(stderr, "Error reading arguments");
-    return -1;
+// Redraws the progress line: the file being copied with its percent and
+// throughput, and the whole copy with its throughput, ETA and the number of
+// files left
+static void _main_drawProgress(const progressSnapshot* p)
+{
+  _main_last = *p;
+  uint64_t now = _main_now();
+
+  double interval = (now - _main_lastTime) / 1e9;
+  if (interval > 0) {
+    double rate = (p->bytes - _main_lastBytes) / interval;
+    _main_rate = _main_lastTime == _main_start ?
+                 rate :
+                 _main_rate + MAIN_PROGRESS_SMOOTHING * (rate - _main_rate);
+    _main_lastTime = now;
+    _main_lastBytes = p->bytes;
   }
 
-  // If both are local, just perform a regular cp...
-  // TODO: make it compatible with Windows
-  if (fromInfo.isLocal && toInfo.isLocal) {
-    size_t size = sizeof(char) * (strlen(from) + strlen(to)) + 5;
-    char* cp = malloc(size);
-    snprintf(cp, size, "cp %s %s", from, to);
+  // The whole copy
+  char done[16];
+  char total[16];
+  char rate[16];
+  char right[128];
+  _main_formatSize(p->bytes, done, sizeof(done));
+  _main_formatSize(_main_rate, rate, sizeof(rate));
+  if (p->isTotalKnown) {
+    char eta[16] = "-:--";
+    if (_main_rate > 0 && p->bytes <= p->totalBytes)
+      _main_formatTime((p->totalBytes - p->bytes) / _main_rate, eta,
+                       sizeof(eta));
+    size_t filesLeft = p->totalFiles > p->filesDone ?
+                       p->totalFiles - p->filesDone : 0;
+    _main_formatSize(p->totalBytes, total, sizeof(total));
+    snprintf(right, sizeof(right), "%s/%s %s/s ETA %s, %zu files left",
+             done, total, rate, eta, filesLeft);
+  }
+  else {
+    snprintf(right, sizeof(right), "%s %s/s, %zu files done", done, rate,
+             p->filesDone);
+  }
 
-    int ret = system(cp);
+  char left[64] = "";
+  const char* name = "";
+  if (p->hasFile) {
+    char fileRate[16];
+    _main_formatSize(p->fileSeconds > 0 ? p->fileBytes / p->fileSeconds : 0,
+                     fileRate, sizeof(fileRate));
+    int percent = p->fileSize > 0 ?
+                  (int)(100.0 * p->fileBytes / p->fileSize) : 100;
+    if (percent > 100) percent = 100;
+    snprintf(left, sizeof(left), " %3d%% %s/s | ", percent, fileRate);
 
-    free(cp);
-    return ret;
+    // The name gets whatever is left of the line, and loses its start if
+    // it doesn't fit
+    int nameWidth = _main_getWidth() - 1 - strlen(left) - strlen(right);
+    if (nameWidth < 0) nameWidth = 0;
+    name = p->fileName;
+    if ((int)strlen(name) > nameWidth) name += strlen(name) - nameWidth;
   }
 
-  // We are copying from the server...
-  else if (!fromInfo.isLocal && toInfo.isLocal) {
-    ssh_session session = connectSSH_getConnectedSession(pfromInfo);
-    if (!session) {
-      fprintf(stderr, "Error connecting the session: %s\n",
-              ssh_get_error(session));
-      return -1;
-    }
+  printf("\r%s%s%s\033[K", name, left, right);
+  fflush(stdout);
+}
+
+// Replaces the progress line with the totals of the whole copy
+static void _main_finishProgress()
+{
+  double elapsed = (_main_now() - _main_start) / 1e9;
+  char done[16];
+  char rate[16];
+  char time[16];
+  _main_formatSize(_main_last.bytes, done, sizeof(done));
+  _main_formatSize(elapsed > 0 ? _main_last.bytes / elapsed : 0, rate,
+                   sizeof(rate));
+  _main_formatTime(elapsed, time, sizeof(time));
+  printf("\r\033[K%zu files, %s in %s (%s/s)\n", _main_last.filesDone, done,
+         time, rate);
+  fflush(stdout);
+}
 
-    // Let's just turn recursive mode on...
-    bool isRecursive = true;
-    if (scp_copyFromServer(session, pfromInfo->filePath, to, isRecursive)
-        != SSH_OK) {
-      fprintf(stderr, "Error executing scp_copyFromServer()\n");
-      connectSSH_disconnectSession(&session);
-      return -1;
+static void _main_onProgress(uint64_t jobId, const progressSnapshot* progress,
+                             void* userData)
+{
+  (void)jobId;
+  (void)userData;
+  _main_drawProgress(progress);
+}
+
+static void _main_onDone(uint64_t jobId, int status, void* userData)
+{
+  (void)jobId;
+  *(int*)userData = status;
+}
+
+// Redraws the progress of a batch until it is stopped
+static void* _main_runProgress(void* arg)
+{
+  pprogress p = arg;
+  progressSnapshot snapshot;
+
+  pthread_mutex_lock(&_main_progressMutex);
+  while (!_main_isStopping) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += MAIN_PROGRESS_INTERVAL * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
     }
-    connectSSH_disconnectSession(&session);
+    pthread_cond_timedwait(&_main_progressCond, &_main_progressMutex,
+                           &deadline);
+    progress_getSnapshot(p, &snapshot);
+    _main_drawProgress(&snapshot);
   }
+  pthread_mutex_unlock(&_main_progressMutex);
+  return NULL;
+}
 
-  // We are copying to the server...
-  else if (fromInfo.isLocal && !toInfo.isLocal) {
-    ssh_session session = connectSSH_getConnectedSession(ptoInfo);
-    if (!session) {
-      fprintf(stderr, "Error connecting the session: %s\n",
-              ssh_get_error(session));
-      return -1;
-    }
+// The batch runs on this thread with the global options, so its progress
+// is counted into them and drawn from a thread of our own
+static int _main_runBatch(pscpOptions options, bool showProgress)
+{
+  pthread_t thread;
+  bool isDrawing = false;
+  if (showProgress) {
+    _main_startProgress();
+    options->progress = progress_D_new();
+    isDrawing = options->progress &&
+                pthread_create(&thread, NULL, _main_runProgress,
+                               options->progress) == 0;
+  }
 
-    // Let's just turn recursive mode on...
-    bool isRecursive = true;
-    if (scp_copyToServer(session, pfromInfo->filePath, ptoInfo->filePath,
-                        isRecursive) != SSH_OK) {
-      fprintf(stderr, "Error executing scp_copyFromServer()\n");
-      connectSSH_disconnectSession(&session);
-      return -1;
-    }
-    connectSSH_disconnectSession(&session);
+  int rc = batch_run(options->batchFile, options->batchResultsFile);
+
+  if (isDrawing) {
+    pthread_mutex_lock(&_main_progressMutex);
+    _main_isStopping = true;
+    pthread_cond_signal(&_main_progressCond);
+    pthread_mutex_unlock(&_main_progressMutex);
+    pthread_join(thread, NULL);
+    _main_finishProgress();
   }
+  progress_free(options->progress);
+  options->progress = NULL;
+  return rc;
+}
 
-  else {
-    fprintf(stderr, "%s%s\n", "Copying from one remote location to another ",
-            "remote location has not yet been set up");
+int main(int argc, char* argv[])
+{
+  pscpOptions options = scpOptions_get();
+  int firstArg = scpOptions_parseArgs(argc, argv, options);
+  if (firstArg >= 0 && options->runMuxDaemon && argc == firstArg)
+    return mux_runDaemon(options->muxIdleTime);
+
+  // The progress is only drawn on a terminal, and the totals are only
+  // counted for it
+  bool showProgress = isatty(STDOUT_FILENO);
+  options->countTotals = showProgress;
+
+  if (firstArg >= 0 && options->batchFile && argc == firstArg)
+    return _main_runBatch(options, showProgress);
+  if (firstArg >= 0 && options->printCipherProbe && argc == firstArg)
+    return cipherProbe_printTable(stdout) ? 0 : -1;
+
+  // The server's end of a delta transfer (see delta.h)
+  if (firstArg >= 0 && options->deltaReceive && argc - firstArg == 1)
+    return delta_serveReceive(argv[firstArg]);
+  if (firstArg >= 0 && options->deltaSend && argc - firstArg == 1)
+    return delta_serveSend(argv[firstArg]);
+  // The server's end of verify mode (see verify.h)
+  if (firstArg >= 0 && options->verifyHash && argc == firstArg)
+    return verify_serveHash();
+
+  if (firstArg < 0 || argc - firstArg != 2) {
+    scpOptions_printUsage(stdout);
     return -1;
   }
 
+  // The daemon is forked before the pool starts its threads. If it doesn't
+  // start, the copy connects directly.
+  if (options->useMux) mux_startDaemon(options->muxIdleTime);
+
+  // The copy runs as the only job of a pool (see libscp.h)
+  plibscpPool pool = libscp_D_newPool(1, 0, true);
+  if (!pool) return -1;
+
+  int status = LIBSCP_FAILED;
+  libscpCallbacks callbacks = { _main_onDone, NULL, &status };
+  if (showProgress) {
+    _main_startProgress();
+    callbacks.onProgress = _main_onProgress;
+  }
+  if (libscp_submit(pool, argv[firstArg], argv[firstArg + 1], options,
+                    &callbacks) != 0)
+    libscp_wait(pool);
+  libscp_freePool(pool);
+  if (showProgress) _main_finishProgress();
+  if (status != LIBSCP_OK) return -1;
+
   fprintf(stdout, "scp complete!\n");
   return 0;
 }
-
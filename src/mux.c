@@ -0,0 +1,572 @@
+/**********************************************************************
+  mux.c - Source code for the mux daemon, which keeps authenticated
+          sessions open so that later copies can skip the ssh handshake
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+// For struct ucred and SO_PEERCRED
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <mux.h>
+#include <passwordPrompt.h>
+#include <scpOptions.h>
+#include <sessionPool.h>
+#include <trace.h>
+#include <transfer.h>
+
+// "SCPM"
+#define MUX_MAGIC 0x5343504d
+
+// How long mux_startDaemon() waits for the daemon to begin listening
+#define MUX_START_TIMEOUT_MS 2000
+
+// The longest lists of ciphers and MACs that can be sent to the daemon
+#define MUX_LIST_SIZE 512
+
+// The replies that the daemon sends
+enum mux_reply_e {
+  MUX_REPLY_OK = 0,
+  MUX_REPLY_COPY_FAILED,
+  MUX_REPLY_CONNECT_FAILED
+};
+
+// A copy that a client asks the daemon to run. Both ends are the same
+// executable, so the struct is sent as it is. size guards against a daemon
+// that was started by a different build. The pointers in options are
+// cleared before it is sent, and the strings that they point to are sent
+// in the fields after it instead.
+typedef struct {
+  uint32_t magic;
+  uint32_t size;
+  int32_t isDownload;
+  char user[USER_SIZE];
+  char host[HOST_SIZE];
+  char pass[PASS_SIZE];
+  int32_t port;
+  char from[PATH_MAX];
+  char to[PATH_MAX];
+  scpOptions options;
+  char deltaHelper[PATH_MAX];
+  char ciphers[MUX_LIST_SIZE];
+  char macs[MUX_LIST_SIZE];
+  char traceFile[PATH_MAX];
+} muxRequest;
+
+// The state that the daemon's threads share
+typedef struct {
+  psessionPool pool;
+  pthread_mutex_t lock;
+  // The clients that are being served, and when the last one finished
+  int numClients;
+  time_t lastActive;
+} muxDaemon;
+
+// A client that is served on a thread of its own
+typedef struct {
+  muxDaemon* daemon;
+  int fd;
+} muxClient;
+
+typedef struct {
+  uint32_t magic;
+  int32_t status;
+} muxReply;
+
+// Sets path to $XDG_RUNTIME_DIR/scp-mux.sock, or to a socket in a private
+// directory in /tmp if that isn't set
+static bool _mux_getSocketPath(char* path, size_t size)
+{
+  const char* runtimeDir = getenv("XDG_RUNTIME_DIR");
+  if (runtimeDir && *runtimeDir) {
+    if ((size_t)snprintf(path, size, "%s/scp-mux.sock", runtimeDir) >= size) {
+      fprintf(stderr, "Error: XDG_RUNTIME_DIR is too long for a socket\n");
+      return false;
+    }
+    return true;
+  }
+
+  char dir[64];
+  snprintf(dir, sizeof(dir), "/tmp/scp-mux-%u", (unsigned)getuid());
+  if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+    fprintf(stderr, "Error creating %s: %s\n", dir, strerror(errno));
+    return false;
+  }
+
+  // Don't trust a directory that somebody else could have made
+  struct stat st;
+  if (lstat(dir, &st) != 0 || !S_ISDIR(st.st_mode) ||
+      st.st_uid != getuid() || (st.st_mode & 077) != 0) {
+    fprintf(stderr, "Error: %s is not a private directory\n", dir);
+    return false;
+  }
+
+  snprintf(path, size, "%s/mux.sock", dir);
+  return true;
+}
+
+static bool _mux_setAddress(struct sockaddr_un* addr)
+{
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  return _mux_getSocketPath(addr->sun_path, sizeof(addr->sun_path));
+}
+
+// Returns a socket connected to the daemon, or -1 if it isn't running
+static int _mux_connect(const struct sockaddr_un* addr)
+{
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+
+  if (connect(fd, (const struct sockaddr*)addr, sizeof(*addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static bool _mux_readAll(int fd, void* buf, size_t len)
+{
+  char* p = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool _mux_writeAll(int fd, const void* buf, size_t len)
+{
+  const char* p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Binds and listens on the socket at addr. A socket file that is left over
+// from a daemon that died is removed, but a running daemon is left alone.
+static int _mux_listen(const struct sockaddr_un* addr)
+{
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    fprintf(stderr, "Error creating the mux socket: %s\n", strerror(errno));
+    return -1;
+  }
+
+  mode_t oldMask = umask(077);
+  int rc = bind(fd, (const struct sockaddr*)addr, sizeof(*addr));
+  if (rc != 0 && errno == EADDRINUSE) {
+    int running = _mux_connect(addr);
+    if (running >= 0) {
+      close(running);
+      umask(oldMask);
+      close(fd);
+      fprintf(stderr, "The mux daemon is already running\n");
+      return -1;
+    }
+    unlink(addr->sun_path);
+    rc = bind(fd, (const struct sockaddr*)addr, sizeof(*addr));
+  }
+  umask(oldMask);
+
+  if (rc != 0 || listen(fd, 16) != 0) {
+    fprintf(stderr, "Error listening on %s: %s\n", addr->sun_path,
+            strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Runs one copy for the client on fd
+static void _mux_serveClient(psessionPool pool, int fd)
+{
+  // Only the user that owns the daemon may use it
+  struct ucred cred;
+  socklen_t credLen = sizeof(cred);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credLen) != 0 ||
+      cred.uid != getuid())
+    return;
+
+  muxRequest* request = malloc(sizeof(muxRequest));
+  if (!request) return;
+
+  if (!_mux_readAll(fd, request, sizeof(muxRequest)) ||
+      request->magic != MUX_MAGIC || request->size != sizeof(muxRequest)) {
+    free(request);
+    return;
+  }
+
+  // Don't trust the client to have terminated the strings
+  request->user[USER_SIZE - 1] = '\0';
+  request->host[HOST_SIZE - 1] = '\0';
+  request->pass[PASS_SIZE - 1] = '\0';
+  request->from[PATH_MAX - 1] = '\0';
+  request->to[PATH_MAX - 1] = '\0';
+  request->deltaHelper[PATH_MAX - 1] = '\0';
+  request->ciphers[MUX_LIST_SIZE - 1] = '\0';
+  request->macs[MUX_LIST_SIZE - 1] = '\0';
+  request->traceFile[PATH_MAX - 1] = '\0';
+
+  sshInfo info;
+  memset(&info, 0, sizeof(sshInfo));
+  memcpy(info.user, request->user, USER_SIZE);
+  memcpy(info.host, request->host, HOST_SIZE);
+  memcpy(info.pass, request->pass, PASS_SIZE);
+  info.port = request->port;
+  // There is nobody to prompt for a password here
+  info.noPrompt = true;
+
+  // The copy is run on this thread with the options of the client. Its
+  // pointers were cleared, so only the strings that were sent are used.
+  // There is nobody to show the progress to.
+  pscpOptions options = &request->options;
+  options->useMux = false;
+  options->runMuxDaemon = false;
+  options->batchFile = NULL;
+  options->batchResultsFile = NULL;
+  options->deltaHelper = request->deltaHelper[0] ? request->deltaHelper : NULL;
+  options->ciphers = request->ciphers[0] ? request->ciphers : NULL;
+  options->macs = request->macs[0] ? request->macs : NULL;
+  options->traceFile = request->traceFile[0] ? request->traceFile : NULL;
+  options->progress = NULL;
+  options->tracer = NULL;
+  options->jobCanceled = NULL;
+  scpOptions_setForThread(options);
+
+  // The client left the trace to us. If we can't write it, the copy fails
+  // like it would have there.
+  muxReply reply = { MUX_MAGIC, MUX_REPLY_OK };
+  if (options->traceFile) {
+    options->tracer = trace_D_start(options->traceFile);
+    if (!options->tracer) reply.status = MUX_REPLY_COPY_FAILED;
+  }
+
+  ssh_session session = NULL;
+  if (reply.status == MUX_REPLY_OK) {
+    session = sessionPool_acquire(pool, &info);
+    if (!session) reply.status = MUX_REPLY_CONNECT_FAILED;
+  }
+  if (session) {
+    int rc = request->isDownload ?
+             transfer_copyFromServer(session, &info, request->from,
+                                     request->to) :
+             transfer_copyToServer(session, &info, request->from,
+                                   request->to);
+
+    if (rc != SSH_OK) reply.status = MUX_REPLY_COPY_FAILED;
+    sessionPool_release(pool, session, rc == SSH_OK);
+  }
+
+  trace_finish(options->tracer);
+  scpOptions_setForThread(NULL);
+  memset(request->pass, 0, PASS_SIZE);
+  memset(info.pass, 0, PASS_SIZE);
+  free(request);
+  _mux_writeAll(fd, &reply, sizeof(muxReply));
+}
+
+static void* _mux_runClient(void* arg)
+{
+  muxClient* client = arg;
+  muxDaemon* daemon = client->daemon;
+
+  _mux_serveClient(daemon->pool, client->fd);
+  close(client->fd);
+  free(client);
+
+  pthread_mutex_lock(&daemon->lock);
+  daemon->numClients--;
+  daemon->lastActive = time(NULL);
+  pthread_mutex_unlock(&daemon->lock);
+  return NULL;
+}
+
+// Serves a client on a thread of its own, so that a long copy doesn't hold
+// up the clients behind it. If no thread can be started, it is served here.
+static void _mux_startClient(muxDaemon* daemon, int fd)
+{
+  muxClient* client = malloc(sizeof(muxClient));
+  if (!client) {
+    close(fd);
+    return;
+  }
+  client->daemon = daemon;
+  client->fd = fd;
+
+  pthread_mutex_lock(&daemon->lock);
+  daemon->numClients++;
+  pthread_mutex_unlock(&daemon->lock);
+
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int rc = pthread_create(&thread, &attr, _mux_runClient, client);
+  pthread_attr_destroy(&attr);
+  if (rc != 0) _mux_runClient(client);
+}
+
+int mux_runDaemon(int idleTime)
+{
+  struct sockaddr_un addr;
+  if (!_mux_setAddress(&addr)) return -1;
+
+  int listenFd = _mux_listen(&addr);
+  if (listenFd < 0) return -1;
+
+  muxDaemon daemon;
+  daemon.pool = sessionPool_D_new(idleTime);
+  if (!daemon.pool) {
+    close(listenFd);
+    unlink(addr.sun_path);
+    return -1;
+  }
+  pthread_mutex_init(&daemon.lock, NULL);
+  daemon.numClients = 0;
+  daemon.lastActive = time(NULL);
+
+  // A client that goes away mid-copy must not kill the daemon
+  signal(SIGPIPE, SIG_IGN);
+
+  while (true) {
+    struct pollfd pfd = { listenFd, POLLIN, 0 };
+    int rc = poll(&pfd, 1, 1000);
+    if (rc < 0 && errno != EINTR) break;
+
+    if (rc > 0) {
+      int clientFd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+      if (clientFd >= 0) _mux_startClient(&daemon, clientFd);
+      continue;
+    }
+
+    pthread_mutex_lock(&daemon.lock);
+    bool isIdle = daemon.numClients == 0 &&
+                  time(NULL) - daemon.lastActive >= idleTime;
+    pthread_mutex_unlock(&daemon.lock);
+    if (sessionPool_closeIdle(daemon.pool) == 0 && isIdle) break;
+  }
+
+  // Let the copies that are still running finish before their sessions go
+  unlink(addr.sun_path);
+  close(listenFd);
+  while (true) {
+    pthread_mutex_lock(&daemon.lock);
+    int numClients = daemon.numClients;
+    pthread_mutex_unlock(&daemon.lock);
+    if (numClients == 0) break;
+    usleep(100 * 1000);
+  }
+
+  sessionPool_free(daemon.pool);
+  pthread_mutex_destroy(&daemon.lock);
+  return 0;
+}
+
+bool mux_startDaemon(int idleTime)
+{
+  struct sockaddr_un addr;
+  if (!_mux_setAddress(&addr)) return false;
+
+  int fd = _mux_connect(&addr);
+  if (fd >= 0) {
+    close(fd);
+    return true;
+  }
+
+  // Don't let the child flush our buffered output a second time
+  fflush(NULL);
+
+  pid_t pid = fork();
+  if (pid < 0) return false;
+  if (pid == 0) {
+    setsid();
+    if (chdir("/") != 0) _exit(1);
+
+    int devNull = open("/dev/null", O_RDWR);
+    if (devNull >= 0) {
+      dup2(devNull, STDIN_FILENO);
+      dup2(devNull, STDOUT_FILENO);
+      dup2(devNull, STDERR_FILENO);
+      if (devNull > STDERR_FILENO) close(devNull);
+    }
+
+    _exit(mux_runDaemon(idleTime) == 0 ? 0 : 1);
+  }
+
+  int waited;
+  for (waited = 0; waited < MUX_START_TIMEOUT_MS; waited += 20) {
+    usleep(20 * 1000);
+    fd = _mux_connect(&addr);
+    if (fd >= 0) {
+      close(fd);
+      return true;
+    }
+  }
+
+  fprintf(stderr, "Error: the mux daemon did not start\n");
+  return false;
+}
+
+// Returns a socket connected to the daemon, or -1 if it isn't running. It
+// is never started from here, since the copy may be running on one of many
+// threads, and a child forked from those could inherit locks that are held.
+static int _mux_getConnection()
+{
+  struct sockaddr_un addr;
+  if (!_mux_setAddress(&addr)) return -1;
+  return _mux_connect(&addr);
+}
+
+// Sends a request to the daemon and waits for the copy to finish. Returns
+// a mux_reply_e, or -1 if the daemon could not be reached.
+static int _mux_sendRequest(muxRequest* request)
+{
+  int fd = _mux_getConnection();
+  if (fd < 0) return -1;
+
+  muxReply reply;
+  bool success = _mux_writeAll(fd, request, sizeof(muxRequest)) &&
+                 _mux_readAll(fd, &reply, sizeof(muxReply)) &&
+                 reply.magic == MUX_MAGIC;
+  close(fd);
+
+  return success ? reply.status : -1;
+}
+
+// The daemon does not run in our working directory, so relative local
+// paths are made absolute
+static bool _mux_setLocalPath(char* dest, const char* path)
+{
+  if (path[0] == '/') {
+    if (strlen(path) >= PATH_MAX) return false;
+    strcpy(dest, path);
+    return true;
+  }
+
+  char cwd[PATH_MAX];
+  if (!getcwd(cwd, PATH_MAX)) return false;
+  return (size_t)snprintf(dest, PATH_MAX, "%s/%s", cwd, path) < PATH_MAX;
+}
+
+static int _mux_copy(psshInfo info, bool isDownload, char* from, char* to)
+{
+  muxRequest* request = calloc(1, sizeof(muxRequest));
+  if (!request) return MUX_UNAVAILABLE;
+
+  request->magic = MUX_MAGIC;
+  request->size = sizeof(muxRequest);
+  request->isDownload = isDownload;
+  memcpy(request->user, info->user, USER_SIZE);
+  memcpy(request->host, info->host, HOST_SIZE);
+  memcpy(request->pass, info->pass, PASS_SIZE);
+  request->port = info->port;
+
+  // The daemon can't follow our pointers, so the strings are sent instead
+  pscpOptions options = scpOptions_get();
+  request->options = *options;
+  request->options.batchFile = NULL;
+  request->options.batchResultsFile = NULL;
+  request->options.deltaHelper = NULL;
+  request->options.ciphers = NULL;
+  request->options.macs = NULL;
+  request->options.traceFile = NULL;
+  request->options.progress = NULL;
+  request->options.tracer = NULL;
+  request->options.jobCanceled = NULL;
+  if ((options->deltaHelper &&
+       strlen(options->deltaHelper) >= sizeof(request->deltaHelper)) ||
+      (options->ciphers &&
+       strlen(options->ciphers) >= sizeof(request->ciphers)) ||
+      (options->macs && strlen(options->macs) >= sizeof(request->macs)) ||
+      (options->traceFile &&
+       !_mux_setLocalPath(request->traceFile, options->traceFile))) {
+    fprintf(stderr, "Error: an option is too long for the mux daemon\n");
+    free(request);
+    return MUX_UNAVAILABLE;
+  }
+  if (options->deltaHelper) strcpy(request->deltaHelper, options->deltaHelper);
+  if (options->ciphers) strcpy(request->ciphers, options->ciphers);
+  if (options->macs) strcpy(request->macs, options->macs);
+
+  char* localPath = isDownload ? request->to : request->from;
+  char* remotePath = isDownload ? request->from : request->to;
+  if (!_mux_setLocalPath(localPath, isDownload ? to : from) ||
+      strlen(isDownload ? from : to) >= PATH_MAX) {
+    fprintf(stderr, "Error: path too long for the mux daemon\n");
+    free(request);
+    return MUX_UNAVAILABLE;
+  }
+  strcpy(remotePath, isDownload ? from : to);
+
+  int status = _mux_sendRequest(request);
+
+  // The daemon can't prompt for a password, so ask for it here and try
+  // again. The password is kept in info in case we have to connect directly.
+  // If we can't prompt either, connecting directly fails the same way that
+  // it would have without the daemon.
+  if (status == MUX_REPLY_CONNECT_FAILED && info->pass[0] == '\0' &&
+      !info->noPrompt) {
+    char prompt[sizeof(char) * (34 + USER_SIZE + HOST_SIZE)];
+    snprintf(prompt, sizeof(prompt), "Please enter the password for %s@%s ",
+             info->user, info->host);
+    snprintf(info->pass, PASS_SIZE, "%s", passwordPrompt_getPassword(prompt));
+    memcpy(request->pass, info->pass, PASS_SIZE);
+    status = _mux_sendRequest(request);
+  }
+
+  memset(request->pass, 0, PASS_SIZE);
+  free(request);
+
+  switch (status) {
+    case MUX_REPLY_OK:
+      return MUX_OK;
+    case MUX_REPLY_COPY_FAILED:
+      fprintf(stderr, "Error: the copy failed in the mux daemon\n");
+      return MUX_FAILED;
+    default:
+      return MUX_UNAVAILABLE;
+  }
+}
+
+int mux_copyFromServer(psshInfo info, char* from, char* to)
+{
+  return _mux_copy(info, true, from, to);
+}
+
+int mux_copyToServer(psshInfo info, char* from, char* to)
+{
+  return _mux_copy(info, false, from, to);
+}
@@ -0,0 +1,441 @@
+/**********************************************************************
+  parallelScp.c - Source code for the functions that copy a directory
+                  tree or a large file over several ssh sessions
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <connectSSH.h>
+#include <eventEngine.h>
+#include <fileSystemUtils.h>
+#include <parallelScp.h>
+#include <scp.h>
+#include <scpOptions.h>
+#include <sftpUtils.h>
+#include <stripe.h>
+#include <workQueue.h>
+
+// A single file to be copied. For downloads, to is the local file. For
+// uploads it is the remote directory that the file is copied into. The
+// event loop takes the same jobs.
+typedef engineJob fileJob;
+
+// The list of files that is built while walking the tree
+typedef struct {
+  fileJob* jobs;
+  size_t numJobs;
+  size_t capacity;
+
+  // The root of the destination tree
+  char destRoot[PATH_MAX];
+
+  // Only used for uploads, to create the remote directories
+  sftp_session sftp;
+} jobList;
+
+// The state of one worker thread
+typedef struct {
+  int id;
+  bool isDownload;
+  pworkQueue queue;
+  sshInfo info;
+  // The first worker uses the session that was passed in. The others
+  // open their own.
+  ssh_session session;
+  // The root of the remote tree of an upload, where its lane starts
+  const char* remoteRoot;
+  pthread_t thread;
+  bool success;
+} worker;
+
+// Returns a pointer to the last component of a path
+static const char* _parallelScp_baseName(const char* path)
+{
+  const char* p = strrchr(path, '/');
+  return p ? p + 1 : path;
+}
+
+static bool _parallelScp_addJob(jobList* list, const char* from,
+                                const char* to)
+{
+  if (list->numJobs == list->capacity) {
+    size_t newCapacity = list->capacity ? list->capacity * 2 : 256;
+    fileJob* jobs = realloc(list->jobs, newCapacity * sizeof(fileJob));
+    if (!jobs) return false;
+    list->jobs = jobs;
+    list->capacity = newCapacity;
+  }
+
+  fileJob* job = &list->jobs[list->numJobs];
+  job->from = strdup(from);
+  job->to = strdup(to);
+  if (!job->from || !job->to) {
+    free(job->from);
+    free(job->to);
+    return false;
+  }
+
+  list->numJobs++;
+  return true;
+}
+
+static void _parallelScp_freeJobs(jobList* list)
+{
+  size_t i;
+  for (i = 0; i < list->numJobs; i++) {
+    free(list->jobs[i].from);
+    free(list->jobs[i].to);
+  }
+  free(list->jobs);
+}
+
+// Called for every remote file and directory. Directories are created
+// locally right away, since the walk visits parents before children.
+static bool _parallelScp_addDownload(const char* path, const char* relPath,
+                                     const fileMeta* meta, void* userData)
+{
+  jobList* list = userData;
+  char dest[PATH_MAX];
+
+  if (snprintf(dest, PATH_MAX, "%s%s%s", list->destRoot,
+               relPath[0] ? "/" : "", relPath) >= PATH_MAX) {
+    fprintf(stderr, "Error: path too long for %s\n", relPath);
+    return false;
+  }
+
+  if (meta->type == FILE_IS_DIR) {
+    if (!fileSystemUtils_mkdirIfNeeded(dest)) {
+      fprintf(stderr, "fileSystemUtils_mkdirIfNeeded() failed.\n");
+      return false;
+    }
+    return true;
+  }
+  else if (meta->type == FILE_IS_REG) {
+    return _parallelScp_addJob(list, path, dest);
+  }
+
+  fprintf(stderr, "Warning: %s is not a regular file or directory\n", path);
+  return true;
+}
+
+// Called for every local file and directory. Directories are created on the
+// server right away, since the walk visits parents before children.
+static bool _parallelScp_addUpload(const char* path, const char* relPath,
+                                   const fileMeta* meta, void* userData)
+{
+  jobList* list = userData;
+  char dest[PATH_MAX];
+
+  if (meta->type == FILE_IS_DIR) {
+    if (snprintf(dest, PATH_MAX, "%s%s%s", list->destRoot,
+                 relPath[0] ? "/" : "", relPath) >= PATH_MAX) {
+      fprintf(stderr, "Error: path too long for %s\n", relPath);
+      return false;
+    }
+    return sftpUtils_mkdirIfNeeded(list->sftp, dest, meta->permissions);
+  }
+  else if (meta->type == FILE_IS_REG) {
+    // The file is pushed into the remote directory that matches its parent
+    const char* name = _parallelScp_baseName(relPath);
+    if (snprintf(dest, PATH_MAX, "%s%s%.*s", list->destRoot,
+                 name != relPath ? "/" : "",
+                 name != relPath ? (int)(name - relPath - 1) : 0,
+                 relPath) >= PATH_MAX) {
+      fprintf(stderr, "Error: path too long for %s\n", relPath);
+      return false;
+    }
+    return _parallelScp_addJob(list, path, dest);
+  }
+
+  fprintf(stderr, "Warning: %s is not a regular file or directory\n", path);
+  return true;
+}
+
+static void* _parallelScp_runWorker(void* arg)
+{
+  worker* w = arg;
+
+  if (!w->session) {
+    w->session = connectSSH_getConnectedSession(&w->info);
+    // The other workers will steal this worker's files
+    if (!w->session) {
+      fprintf(stderr, "Warning: worker %i could not connect: continuing "
+                      "with fewer sessions\n", w->id);
+      return NULL;
+    }
+  }
+
+  // Every file of the worker goes down one lane (see scp.h). Deltas and
+  // sftp copy file by file.
+  pscpOptions options = scpOptions_get();
+  pscpLane lane = NULL;
+  if (options->backend == SCP_BACKEND_SCP && !options->deltaHelper)
+    lane = scp_D_openLane(w->session, w->remoteRoot, w->isDownload);
+
+  fileJob* job;
+  while ((job = workQueue_pop(w->queue, w->id)) != NULL) {
+    int rc;
+    if (scpOptions_isCanceled())
+      rc = SSH_ERROR;
+    else if (lane)
+      rc = scp_laneCopy(lane, job->from, job->to) ? SSH_OK : SSH_ERROR;
+    else if (w->isDownload)
+      rc = scp_copyFromServer(w->session, job->from, job->to, false);
+    else
+      rc = scp_copyToServer(w->session, job->from, job->to, false);
+
+    if (rc != SSH_OK) {
+      fprintf(stderr, "Error copying %s\n", job->from);
+      w->success = false;
+      // Stop everyone, as a single session would
+      workQueue_cancel(w->queue);
+    }
+  }
+
+  if (lane && !scp_closeLane(lane, w->success)) w->success = false;
+
+  if (w->id != 0) connectSSH_disconnectSession(&w->session);
+  return NULL;
+}
+
+// Spreads the jobs across numJobs workers (or numJobs sessions of the
+// event loop) and waits for them to finish
+static int _parallelScp_run(ssh_session session, psshInfo info,
+                            jobList* list, int numJobs, bool isDownload)
+{
+  if (list->numJobs == 0) return SSH_OK;
+
+  // One thread runs every session
+  if (scpOptions_get()->useEventLoop)
+    return eventEngine_run(session, info, list->jobs, list->numJobs, numJobs,
+                           isDownload);
+
+  // There is no point in having more sessions than files
+  if ((size_t)numJobs > list->numJobs) numJobs = list->numJobs;
+
+  pworkQueue queue = workQueue_D_new(numJobs);
+  worker* workers = calloc(numJobs, sizeof(worker));
+  void** jobs = malloc(list->numJobs * sizeof(void*));
+  if (!queue || !workers || !jobs) {
+    fprintf(stderr, "Error allocating workers in %s\n", __FUNCTION__);
+    workQueue_free(queue);
+    free(workers);
+    free(jobs);
+    return SSH_ERROR;
+  }
+
+  size_t i;
+  for (i = 0; i < list->numJobs; i++) jobs[i] = &list->jobs[i];
+  // Files that are next to each other in the tree start on the same worker
+  workQueue_pushAll(queue, jobs, list->numJobs);
+  free(jobs);
+
+  int j;
+  int started = 0;
+  for (j = 0; j < numJobs; j++) {
+    workers[j].id = j;
+    workers[j].isDownload = isDownload;
+    workers[j].queue = queue;
+    // Each worker gets its own copy so that they don't share the password.
+    // Only the first worker runs without one.
+    if (info) workers[j].info = *info;
+    workers[j].session = j == 0 ? session : NULL;
+    workers[j].remoteRoot = list->destRoot;
+    workers[j].success = true;
+    if (scpOptions_startThread(&workers[j].thread, _parallelScp_runWorker,
+                               &workers[j]) != 0) {
+      fprintf(stderr, "Warning: could not start worker %i\n", j);
+      break;
+    }
+    started++;
+  }
+
+  bool success = started > 0;
+  for (j = 0; j < started; j++) {
+    pthread_join(workers[j].thread, NULL);
+    if (!workers[j].success) success = false;
+  }
+
+  // Every worker that connected empties the queue before it stops, so if
+  // anything is left then nobody could take it
+  if (success && workQueue_pop(queue, 0) != NULL) {
+    fprintf(stderr, "Error: not every file was copied\n");
+    success = false;
+  }
+
+  workQueue_free(queue);
+  free(workers);
+  return success ? SSH_OK : SSH_ERROR;
+}
+
+// Walks the directory from on the server and copies its files over
+// numSessions sessions. sftp is freed once the walk is done, so that it
+// doesn't hold a channel during the copy.
+static int _parallelScp_copyDirFromServer(ssh_session session, psshInfo info,
+                                          sftp_session sftp, char* from,
+                                          char* to, int numSessions)
+{
+  jobList list;
+  memset(&list, 0, sizeof(list));
+  snprintf(list.destRoot, PATH_MAX, "%s/%s", to, _parallelScp_baseName(from));
+
+  bool walked = sftpUtils_walkTree(sftp, from, _parallelScp_addDownload,
+                                   &list);
+  sftp_free(sftp);
+
+  int rc = SSH_ERROR;
+  if (walked)
+    rc = _parallelScp_run(session, info, &list, numSessions, true);
+
+  _parallelScp_freeJobs(&list);
+  return rc;
+}
+
+// Walks the local directory from and copies its files over numSessions
+// sessions. sftp is used to create the directories and is freed once the
+// walk is done, as with _parallelScp_copyDirFromServer().
+static int _parallelScp_copyDirToServer(ssh_session session, psshInfo info,
+                                        sftp_session sftp, char* from,
+                                        char* to, int numSessions)
+{
+  jobList list;
+  memset(&list, 0, sizeof(list));
+  list.sftp = sftp;
+
+  // Like scp, copy into the destination if it is a directory that exists,
+  // and otherwise create the destination as the copy of from
+  if (sftpUtils_getFileType(list.sftp, to, NULL) == FILE_IS_DIR)
+    snprintf(list.destRoot, PATH_MAX, "%s/%s", to,
+             _parallelScp_baseName(from));
+  else
+    snprintf(list.destRoot, PATH_MAX, "%s", to);
+
+  bool walked = fileSystemUtils_walkTree(from, _parallelScp_addUpload, &list);
+  sftp_free(list.sftp);
+
+  int rc = SSH_ERROR;
+  if (walked)
+    rc = _parallelScp_run(session, info, &list, numSessions, false);
+
+  _parallelScp_freeJobs(&list);
+  return rc;
+}
+
+int parallelScp_copyFromServer(ssh_session session, psshInfo info,
+                               char* from, char* to)
+{
+  pscpOptions options = scpOptions_get();
+
+  // If from ends in '/', the base name would be empty
+  size_t len = strlen(from);
+  if (len > 1 && from[len - 1] == '/') from[len - 1] = '\0';
+
+  // Without sftp, the files can't be listed or sized ahead of the copy
+  sftp_session sftp = sftpUtils_D_openSession(session);
+  if (!sftp) {
+    fprintf(stderr, "Warning: sftp is not available on the server: "
+                    "copying with scp instead\n");
+    return scp_copyFromServer(session, from, to, true);
+  }
+
+  size_t size = 0;
+  int type = sftpUtils_getFileType(sftp, from, &size);
+
+  // A single large file is split into byte ranges across sessions
+  if (type == FILE_IS_REG && stripe_isWorthwhile(size, options->numStripes)) {
+    sftp_free(sftp);
+    return stripe_copyFromServer(session, info, from, size, to,
+                                 options->numStripes);
+  }
+
+  if (type != FILE_IS_DIR ||
+      (options->numJobs < 2 && !options->useEventLoop)) {
+    sftp_free(sftp);
+    return scp_copyFromServer(session, from, to, true);
+  }
+
+  return _parallelScp_copyDirFromServer(session, info, sftp, from, to,
+                                        options->numJobs);
+}
+
+int parallelScp_copyToServer(ssh_session session, psshInfo info,
+                             char* from, char* to)
+{
+  pscpOptions options = scpOptions_get();
+
+  // If from ends in '/', the base name would be empty
+  size_t len = strlen(from);
+  if (len > 1 && from[len - 1] == '/') from[len - 1] = '\0';
+
+  fileMeta meta;
+  fileSystemUtils_getMeta(AT_FDCWD, from, &meta);
+
+  // A single large file is split into byte ranges across sessions
+  if (meta.type == FILE_IS_REG &&
+      stripe_isWorthwhile(meta.size, options->numStripes))
+    return stripe_copyToServer(session, info, from, to, options->numStripes);
+
+  if (meta.type != FILE_IS_DIR ||
+      (options->numJobs < 2 && !options->useEventLoop))
+    return scp_copyToServer(session, from, to, true);
+
+  sftp_session sftp = sftpUtils_D_openSession(session);
+  if (!sftp) {
+    fprintf(stderr, "Warning: sftp is not available on the server: "
+                    "copying with scp instead\n");
+    return scp_copyToServer(session, from, to, true);
+  }
+
+  return _parallelScp_copyDirToServer(session, info, sftp, from, to,
+                                      options->numJobs);
+}
+
+int parallelScp_copyDirFromServer(ssh_session session, char* from, char* to)
+{
+  // If from ends in '/', the base name would be empty
+  size_t len = strlen(from);
+  if (len > 1 && from[len - 1] == '/') from[len - 1] = '\0';
+
+  sftp_session sftp = sftpUtils_D_openSession(session);
+  if (!sftp) return PARALLEL_SCP_UNAVAILABLE;
+
+  if (sftpUtils_getFileType(sftp, from, NULL) != FILE_IS_DIR) {
+    sftp_free(sftp);
+    return PARALLEL_SCP_UNAVAILABLE;
+  }
+
+  int rc = _parallelScp_copyDirFromServer(session, NULL, sftp, from, to, 1);
+  return rc == SSH_OK ? PARALLEL_SCP_OK : PARALLEL_SCP_FAILED;
+}
+
+int parallelScp_copyDirToServer(ssh_session session, char* from, char* to)
+{
+  // If from ends in '/', the base name would be empty
+  size_t len = strlen(from);
+  if (len > 1 && from[len - 1] == '/') from[len - 1] = '\0';
+
+  if (fileSystemUtils_getFileType(from) != FILE_IS_DIR)
+    return PARALLEL_SCP_UNAVAILABLE;
+
+  sftp_session sftp = sftpUtils_D_openSession(session);
+  if (!sftp) return PARALLEL_SCP_UNAVAILABLE;
+
+  int rc = _parallelScp_copyDirToServer(session, NULL, sftp, from, to, 1);
+  return rc == SSH_OK ? PARALLEL_SCP_OK : PARALLEL_SCP_FAILED;
+}
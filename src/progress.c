@@ -0,0 +1,265 @@
+/**********************************************************************
+  progress.c - Source code for counting the progress of a copy
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fileSystemUtils.h>
+#include <progress.h>
+#include <remoteExec.h>
+#include <scpOptions.h>
+
+// The most files that are kept at once. Any more are only counted.
+#define PROGRESS_MAX_FILES 64
+
+// A path may grow up to four times when it is quoted for the shell
+#define PROGRESS_QUOTED_SIZE (4 * PATH_MAX + 3)
+#define PROGRESS_COMMAND_SIZE (PROGRESS_QUOTED_SIZE + 128)
+
+struct progressFile {
+  bool isUsed;
+  char name[PROGRESS_NAME_SIZE];
+  size_t size;
+  // Added to atomically by the copy loops
+  size_t bytes;
+  uint64_t start;
+  // Which file was begun most recently, to show that one
+  size_t order;
+};
+
+struct progress {
+  pthread_mutex_t mutex;
+  progressFile files[PROGRESS_MAX_FILES];
+  // The file of the threads that didn't get a slot. It is counted, not
+  // shown.
+  progressFile overflow;
+  // Added to atomically by the copy loops
+  uint64_t bytes;
+  // The rest are guarded by the mutex
+  size_t numBegun;
+  size_t filesDone;
+  size_t totalFiles;
+  uint64_t totalBytes;
+  // Whether the totals cover every copy. If the total of a copy couldn't
+  // be counted, they never do again.
+  bool isTotalKnown;
+  bool isTotalLost;
+};
+
+// The current file of this thread, and the progress that it belongs to
+static __thread pprogressFile _progress_current = NULL;
+static __thread pprogress _progress_currentOwner = NULL;
+
+static uint64_t _progress_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+pprogress progress_D_new()
+{
+  pprogress p = calloc(1, sizeof(progress));
+  if (!p) return NULL;
+
+  pthread_mutex_init(&p->mutex, NULL);
+  return p;
+}
+
+void progress_free(pprogress p)
+{
+  if (!p) return;
+
+  // A copy that failed may not have ended its file
+  if (_progress_currentOwner == p) {
+    _progress_current = NULL;
+    _progress_currentOwner = NULL;
+  }
+  pthread_mutex_destroy(&p->mutex);
+  free(p);
+}
+
+void progress_getSnapshot(pprogress p, progressSnapshot* snapshot)
+{
+  memset(snapshot, 0, sizeof(progressSnapshot));
+  uint64_t now = _progress_now();
+
+  pthread_mutex_lock(&p->mutex);
+  snapshot->bytes = __atomic_load_n(&p->bytes, __ATOMIC_RELAXED);
+  snapshot->filesDone = p->filesDone;
+  snapshot->isTotalKnown = p->isTotalKnown;
+  if (p->isTotalKnown) {
+    snapshot->totalFiles = p->totalFiles;
+    snapshot->totalBytes = p->totalBytes;
+  }
+
+  // The file that was begun most recently
+  pprogressFile file = NULL;
+  int i;
+  for (i = 0; i < PROGRESS_MAX_FILES; ++i)
+    if (p->files[i].isUsed && (!file || p->files[i].order > file->order))
+      file = &p->files[i];
+
+  if (file) {
+    snapshot->hasFile = true;
+    memcpy(snapshot->fileName, file->name, PROGRESS_NAME_SIZE);
+    snapshot->fileSize = file->size;
+    snapshot->fileBytes = __atomic_load_n(&file->bytes, __ATOMIC_RELAXED);
+    snapshot->fileSeconds = (now - file->start) / 1e9;
+  }
+  pthread_mutex_unlock(&p->mutex);
+}
+
+uint64_t progress_getBytes(pprogress p)
+{
+  return __atomic_load_n(&p->bytes, __ATOMIC_RELAXED);
+}
+
+pprogressFile progress_beginFile(const char* name, size_t size)
+{
+  pprogress p = scpOptions_get()->progress;
+  if (!p) return NULL;
+
+  pthread_mutex_lock(&p->mutex);
+  pprogressFile file = &p->overflow;
+  int i;
+  for (i = 0; i < PROGRESS_MAX_FILES; ++i) {
+    if (!p->files[i].isUsed) {
+      file = &p->files[i];
+      break;
+    }
+  }
+  if (file != &p->overflow) {
+    size_t len = strlen(name);
+    if (len >= PROGRESS_NAME_SIZE) name += len - (PROGRESS_NAME_SIZE - 1);
+    snprintf(file->name, PROGRESS_NAME_SIZE, "%s", name);
+    file->isUsed = true;
+    file->size = size;
+    file->bytes = 0;
+    file->start = _progress_now();
+    file->order = p->numBegun;
+  }
+  p->numBegun++;
+  pthread_mutex_unlock(&p->mutex);
+
+  _progress_current = file;
+  _progress_currentOwner = p;
+  return file;
+}
+
+void progress_shareFile(pprogressFile file)
+{
+  _progress_current = file;
+  _progress_currentOwner = file ? scpOptions_get()->progress : NULL;
+}
+
+void progress_update(size_t bytes)
+{
+  pprogress p = scpOptions_get()->progress;
+  if (!p) return;
+
+  __atomic_fetch_add(&p->bytes, bytes, __ATOMIC_RELAXED);
+  if (_progress_current && _progress_currentOwner == p)
+    __atomic_fetch_add(&_progress_current->bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void progress_endFile()
+{
+  pprogress p = scpOptions_get()->progress;
+  if (!p || !_progress_current || _progress_currentOwner != p) return;
+
+  pthread_mutex_lock(&p->mutex);
+  _progress_current->isUsed = false;
+  p->filesDone++;
+  pthread_mutex_unlock(&p->mutex);
+  _progress_current = NULL;
+  _progress_currentOwner = NULL;
+}
+
+void progress_addTotal(size_t numFiles, size_t numBytes)
+{
+  pprogress p = scpOptions_get()->progress;
+  if (!p) return;
+
+  pthread_mutex_lock(&p->mutex);
+  p->totalFiles += numFiles;
+  p->totalBytes += numBytes;
+  pthread_mutex_unlock(&p->mutex);
+}
+
+// Records whether the total of a copy was counted
+static void _progress_setTotalKnown(pprogress p, bool isKnown)
+{
+  pthread_mutex_lock(&p->mutex);
+  if (!isKnown) p->isTotalLost = true;
+  p->isTotalKnown = !p->isTotalLost;
+  pthread_mutex_unlock(&p->mutex);
+}
+
+static bool _progress_countFile(const char* path, const char* relPath,
+                                const fileMeta* meta, void* userData)
+{
+  (void)path;
+  (void)relPath;
+  (void)userData;
+  if (meta->type == FILE_IS_REG) progress_addTotal(1, meta->size);
+  return true;
+}
+
+void progress_addLocalTotal(const char* path)
+{
+  pscpOptions options = scpOptions_get();
+  if (!options->progress || !options->countTotals) return;
+
+  fileMeta meta;
+  bool isCounted = fileSystemUtils_getMeta(AT_FDCWD, path, &meta);
+  if (isCounted && meta.type == FILE_IS_DIR)
+    isCounted = fileSystemUtils_walkTree(path, _progress_countFile, NULL);
+  else if (isCounted)
+    _progress_countFile(path, "", &meta, NULL);
+  _progress_setTotalKnown(options->progress, isCounted);
+}
+
+void progress_addRemoteTotal(ssh_session session, const char* path)
+{
+  pscpOptions options = scpOptions_get();
+  if (!options->progress || !options->countTotals) return;
+
+  // ls -ln is the portable way to get the sizes. A path that starts with a
+  // '-' would be taken for an option by find.
+  char quoted[PROGRESS_QUOTED_SIZE];
+  char command[PROGRESS_COMMAND_SIZE];
+  char* output = NULL;
+  if (remoteExec_quote(path, quoted, sizeof(quoted))) {
+    snprintf(command, sizeof(command),
+             "find %s%s -type f -exec ls -ln {} + 2>/dev/null | "
+             "awk '{ n++; s += $5 } END { printf \"%%d %%.0f\\n\", n, s }'",
+             path[0] == '-' ? "./" : "", quoted);
+    output = remoteExec_D_run(session, command, NULL);
+  }
+
+  unsigned long long numFiles;
+  unsigned long long numBytes;
+  bool isCounted = output &&
+                   sscanf(output, "%llu %llu", &numFiles, &numBytes) == 2;
+  if (isCounted) progress_addTotal(numFiles, numBytes);
+  _progress_setTotalKnown(options->progress, isCounted);
+  free(output);
+}
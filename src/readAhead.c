@@ -0,0 +1,126 @@
+/**********************************************************************
+  readAhead.c - Source code for the read-ahead thread that reads a file
+                from the disk in chunks while the chunks before it are
+                being sent over the network
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <readAhead.h>
+#include <scpOptions.h>
+
+struct readAhead {
+  int fd;
+  pchunkQueue queue;
+  pthread_t thread;
+  // True once the whole file has been handed to the consumer
+  bool reachedEnd;
+};
+
+// The producer. Fills chunks until the end of the file, an error, or until
+// the consumer aborts the queue.
+static void* _readAhead_run(void* arg)
+{
+  preadAhead reader = arg;
+  size_t chunkSize = chunkQueue_getChunkSize(reader->queue);
+  bool success = true;
+
+  while (true) {
+    pchunk c = chunkQueue_acquireFree(reader->queue);
+    // The consumer gave up
+    if (!c) break;
+
+    // Fill the whole chunk unless we hit the end of the file
+    while (c->len < chunkSize) {
+      ssize_t rc = read(reader->fd, c->data + c->len, chunkSize - c->len);
+      if (rc < 0 && errno == EINTR) continue;
+      if (rc < 0) {
+        fprintf(stderr, "Error reading file in %s: %s\n", __FUNCTION__,
+                strerror(errno));
+        success = false;
+        break;
+      }
+      if (rc == 0) break;
+      c->len += rc;
+    }
+
+    // A short chunk means we are at the end of the file (or an error)
+    bool done = !success || c->len < chunkSize;
+
+    if (c->len > 0) chunkQueue_pushFull(reader->queue, c);
+    else chunkQueue_releaseFree(reader->queue, c);
+
+    if (done) break;
+  }
+
+  chunkQueue_finish(reader->queue, success);
+  return NULL;
+}
+
+preadAhead readAhead_D_start(int fd, size_t chunkSize, size_t queueDepth)
+{
+  preadAhead reader = calloc(1, sizeof(readAhead));
+  if (!reader) return NULL;
+
+  reader->fd = fd;
+  reader->queue = chunkQueue_D_new(chunkSize, queueDepth);
+  if (!reader->queue) {
+    fprintf(stderr, "Error allocating read-ahead queue in %s\n",
+            __FUNCTION__);
+    free(reader);
+    return NULL;
+  }
+
+  // Let the kernel know we will read this sequentially
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  if (scpOptions_startThread(&reader->thread, _readAhead_run, reader) != 0) {
+    fprintf(stderr, "Error starting read-ahead thread in %s\n", __FUNCTION__);
+    chunkQueue_free(reader->queue);
+    free(reader);
+    return NULL;
+  }
+
+  return reader;
+}
+
+pchunk readAhead_next(preadAhead reader)
+{
+  pchunk c = chunkQueue_popFull(reader->queue);
+  if (!c) reader->reachedEnd = chunkQueue_succeeded(reader->queue);
+  return c;
+}
+
+void readAhead_release(preadAhead reader, pchunk c)
+{
+  chunkQueue_releaseFree(reader->queue, c);
+}
+
+bool readAhead_finish(preadAhead reader)
+{
+  // If the consumer stopped early, make the producer stop too
+  if (!reader->reachedEnd) chunkQueue_abort(reader->queue);
+
+  pthread_join(reader->thread, NULL);
+
+  bool success = reader->reachedEnd;
+  chunkQueue_free(reader->queue);
+  free(reader);
+  return success;
+}
@@ -0,0 +1,218 @@
+/**********************************************************************
+  recvSink.c - Source code for the sink that writes a received file to
+               the disk in large blocks
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+// Needed for fallocate()
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <bufferPool.h>
+#include <recvSink.h>
+
+struct recvSink {
+  int fd;
+  char path[PATH_MAX];
+  size_t size;
+  // The number of bytes that have been committed
+  size_t received;
+  bool success;
+
+  // mmap mode
+  char* map;
+
+  // pwrite mode
+  char* block;
+  // The size of block, which is the same for every file so that the pool
+  // can hand it out again. Only blockSize bytes of it are used.
+  size_t bufferSize;
+  size_t blockSize;
+  size_t blockUsed;
+  // The offset in the file of the start of block
+  size_t blockOffset;
+};
+
+// Writes the staging block to the disk and empties it
+static bool _recvSink_flush(precvSink sink)
+{
+  size_t written = 0;
+  while (written < sink->blockUsed) {
+    ssize_t rc = pwrite(sink->fd, sink->block + written,
+                        sink->blockUsed - written,
+                        sink->blockOffset + written);
+    if (rc < 0 && errno == EINTR) continue;
+    if (rc < 0) {
+      fprintf(stderr, "Error writing %s: %s\n", sink->path, strerror(errno));
+      return false;
+    }
+    written += rc;
+  }
+
+  sink->blockOffset += sink->blockUsed;
+  sink->blockUsed = 0;
+  return true;
+}
+
+precvSink recvSink_D_open(const char* path, size_t size, bool useMmap,
+                          size_t blockSize)
+{
+  return recvSink_D_openAt(path, size, 0, useMmap, blockSize);
+}
+
+precvSink recvSink_D_openAt(const char* path, size_t size, size_t offset,
+                            bool useMmap, size_t blockSize)
+{
+  precvSink sink = calloc(1, sizeof(recvSink));
+  if (!sink) return NULL;
+
+  snprintf(sink->path, sizeof(sink->path), "%s", path);
+  sink->size = size;
+  sink->received = offset;
+  sink->blockOffset = offset;
+  sink->success = true;
+
+  // mmap() needs the file to be readable as well as writable. The bytes
+  // before offset are kept.
+  int flags = (useMmap ? O_RDWR : O_WRONLY) | O_CREAT;
+  if (offset == 0) flags |= O_TRUNC;
+  sink->fd = open(path, flags, 0666);
+  if (sink->fd < 0) {
+    free(sink);
+    return NULL;
+  }
+
+  if (size > 0) {
+    // Reserve the space for the whole file up front. Not every file system
+    // supports this, and that is fine.
+    if (fallocate(sink->fd, 0, 0, size) != 0 &&
+        errno != EOPNOTSUPP && errno != ENOSYS) {
+      fprintf(stderr, "Error allocating %zu bytes for %s: %s\n",
+              size, path, strerror(errno));
+      close(sink->fd);
+      free(sink);
+      return NULL;
+    }
+  }
+
+  if (useMmap && size > 0) {
+    // The mapping can only cover the length of the file, and fallocate()
+    // may not have been able to set it
+    if (ftruncate(sink->fd, size) == 0)
+      sink->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       sink->fd, 0);
+    if (!sink->map || sink->map == MAP_FAILED) {
+      fprintf(stderr, "Error mapping %s: %s\n", path, strerror(errno));
+      close(sink->fd);
+      free(sink);
+      return NULL;
+    }
+    madvise(sink->map, size, MADV_SEQUENTIAL);
+    return sink;
+  }
+
+  // Never use a block bigger than what is left of the file
+  sink->blockSize = blockSize < size - offset ? blockSize : size - offset;
+  if (sink->blockSize == 0) sink->blockSize = 1;
+
+  // The block is aligned so the kernel can copy whole pages
+  sink->bufferSize = blockSize > sink->blockSize ? blockSize : sink->blockSize;
+  sink->block = bufferPool_D_get(sink->bufferSize);
+  if (!sink->block) {
+    fprintf(stderr, "Error allocating buffer for %s\n", path);
+    close(sink->fd);
+    free(sink);
+    return NULL;
+  }
+
+  return sink;
+}
+
+char* recvSink_getBuffer(precvSink sink, size_t* len)
+{
+  size_t left = sink->size - sink->received;
+
+  if (sink->map) {
+    *len = left;
+    return sink->map + sink->received;
+  }
+
+  *len = sink->blockSize - sink->blockUsed;
+  if (*len > left) *len = left;
+  return sink->block + sink->blockUsed;
+}
+
+bool recvSink_commit(precvSink sink, size_t len)
+{
+  sink->received += len;
+  if (sink->map) return true;
+
+  sink->blockUsed += len;
+  if (sink->blockUsed == sink->blockSize && !_recvSink_flush(sink))
+    sink->success = false;
+
+  return sink->success;
+}
+
+bool recvSink_sync(precvSink sink)
+{
+  if (sink->map) {
+    if (sink->received > 0 && msync(sink->map, sink->received, MS_SYNC) != 0)
+      sink->success = false;
+  }
+  else if (sink->blockUsed > 0 && !_recvSink_flush(sink)) {
+    sink->success = false;
+  }
+
+  if (sink->success && fdatasync(sink->fd) != 0) {
+    fprintf(stderr, "Error syncing %s: %s\n", sink->path, strerror(errno));
+    sink->success = false;
+  }
+
+  return sink->success;
+}
+
+bool recvSink_close(precvSink sink)
+{
+  bool success = sink->success;
+
+  if (sink->map) {
+    munmap(sink->map, sink->size);
+  }
+  else {
+    if (sink->blockUsed > 0 && !_recvSink_flush(sink)) success = false;
+    bufferPool_put(sink->block, sink->bufferSize);
+  }
+
+  // If we did not receive everything, don't leave the preallocated tail
+  // behind looking like data
+  if (sink->received < sink->size) {
+    if (ftruncate(sink->fd, sink->received) != 0) success = false;
+  }
+
+  if (close(sink->fd) != 0) {
+    fprintf(stderr, "Error closing %s: %s\n", sink->path, strerror(errno));
+    success = false;
+  }
+
+  free(sink);
+  return success;
+}
@@ -0,0 +1,274 @@
+/**********************************************************************
+  relay.c - Source code for copying from one remote computer to another
+            without going through the local disk
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chunkQueue.h>
+#include <chunkSizer.h>
+#include <progress.h>
+#include <relay.h>
+#include <scpOptions.h>
+
+// Both ends of the relay
+typedef struct {
+  ssh_session fromSession;
+  ssh_scp from;
+  ssh_session toSession;
+  ssh_scp to;
+  pscpOptions options;
+  // Sizes the reads from the source. Only the reading thread uses it.
+  chunkSizer readSizer;
+} relayInfo;
+
+typedef relayInfo* prelayInfo;
+
+// What the reading thread needs for one file
+typedef struct {
+  prelayInfo info;
+  pchunkQueue queue;
+  size_t size;
+} relayReader;
+
+static bool _relay_handlePullRequest(prelayInfo info, int pullRequestRet);
+
+// Reads len bytes of the current file from the source into c
+static bool _relay_fillChunk(prelayInfo info, pchunk c, size_t len)
+{
+  c->len = 0;
+  while (c->len < len) {
+    size_t want = len - c->len;
+    if (want > chunkSizer_get(&info->readSizer))
+      want = chunkSizer_get(&info->readSizer);
+
+    int rc = ssh_scp_read(info->from, c->data + c->len, want);
+    if (rc == SSH_ERROR || rc == 0) {
+      fprintf(stderr, "Error reading file: %s\n",
+              ssh_get_error(info->fromSession));
+      return false;
+    }
+    chunkSizer_record(&info->readSizer, want, rc);
+    c->len += rc;
+  }
+  return true;
+}
+
+static bool _relay_writeChunk(prelayInfo info, pchunk c)
+{
+  if (ssh_scp_write(info->to, c->data, c->len) != SSH_OK) {
+    fprintf(stderr, "Can't write to remote file: %s\n",
+            ssh_get_error(info->toSession));
+    return false;
+  }
+  return true;
+}
+
+// The thread that reads the file from the source while the previous
+// chunks are written to the destination
+static void* _relay_readFile(void* arg)
+{
+  relayReader* reader = arg;
+  size_t chunkSize = chunkQueue_getChunkSize(reader->queue);
+  size_t remaining = reader->size;
+  bool success = true;
+
+  while (remaining > 0) {
+    pchunk c = chunkQueue_acquireFree(reader->queue);
+    // The writer gave up
+    if (!c) {
+      success = false;
+      break;
+    }
+
+    size_t len = remaining < chunkSize ? remaining : chunkSize;
+    if (!_relay_fillChunk(reader->info, c, len)) {
+      chunkQueue_releaseFree(reader->queue, c);
+      success = false;
+      break;
+    }
+
+    remaining -= len;
+    chunkQueue_pushFull(reader->queue, c);
+  }
+
+  chunkQueue_finish(reader->queue, success);
+  return NULL;
+}
+
+// Relays the file that the source just announced. The request has not been
+// accepted yet.
+static bool _relay_copyFile(prelayInfo info)
+{
+  size_t size = ssh_scp_request_get_size(info->from);
+  int permissions = ssh_scp_request_get_permissions(info->from);
+  char name[PATH_MAX];
+  snprintf(name, PATH_MAX, "%s", ssh_scp_request_get_filename(info->from));
+
+  if (ssh_scp_push_file(info->to, name, size, permissions) != SSH_OK) {
+    fprintf(stderr, "Can't open remote file: %s\n",
+            ssh_get_error(info->toSession));
+    return false;
+  }
+
+  if (ssh_scp_accept_request(info->from) != SSH_OK) {
+    fprintf(stderr, "Error accepting scp request: %s\n",
+            ssh_get_error(info->fromSession));
+    return false;
+  }
+
+  // Both ends still need to be told that the file is done
+  if (size == 0) {
+    char buffer[1];
+    ssh_scp_read(info->from, buffer, sizeof(buffer));
+    return ssh_scp_write(info->to, buffer, 0) == SSH_OK;
+  }
+  progress_beginFile(name, size);
+  chunkSizer_restart(&info->readSizer);
+
+  // Two chunks at the least, so one can be read while the other is written
+  size_t depth = info->options->queueDepth;
+  if (depth < 2) depth = 2;
+
+  pchunkQueue queue = chunkQueue_D_new(info->options->chunkSize, depth);
+  if (!queue) {
+    fprintf(stderr, "Error allocating relay queue in %s\n", __FUNCTION__);
+    return false;
+  }
+
+  relayReader reader = { info, queue, size };
+  pthread_t thread;
+  if (scpOptions_startThread(&thread, _relay_readFile, &reader) != 0) {
+    fprintf(stderr, "Error starting relay thread in %s\n", __FUNCTION__);
+    chunkQueue_free(queue);
+    return false;
+  }
+
+  size_t bytesWritten = 0;
+  bool success = true;
+  pchunk c;
+  while ((c = chunkQueue_popFull(queue)) != NULL) {
+    if (success) success = _relay_writeChunk(info, c);
+    if (success) bytesWritten += c->len;
+    chunkQueue_releaseFree(queue, c);
+
+    if (!success) {
+      // Stop the reader, and then drain whatever it already pushed
+      chunkQueue_abort(queue);
+      continue;
+    }
+
+    progress_update(c->len);
+  }
+
+  pthread_join(thread, NULL);
+  progress_endFile();
+  success = success && chunkQueue_succeeded(queue) && bytesWritten == size;
+  chunkQueue_free(queue);
+  return success;
+}
+
+// Relays the directory that the source just announced, and everything in
+// it. The request has not been accepted yet.
+static bool _relay_copyDir(prelayInfo info)
+{
+  int permissions = ssh_scp_request_get_permissions(info->from);
+  char name[PATH_MAX];
+  snprintf(name, PATH_MAX, "%s", ssh_scp_request_get_filename(info->from));
+
+  if (ssh_scp_push_directory(info->to, name, permissions) != SSH_OK) {
+    fprintf(stderr, "Can't create remote directory: %s\n",
+            ssh_get_error(info->toSession));
+    return false;
+  }
+
+  if (ssh_scp_accept_request(info->from) != SSH_OK) {
+    fprintf(stderr, "Error accepting scp request: %s\n",
+            ssh_get_error(info->fromSession));
+    return false;
+  }
+
+  // Keep looping through the contents of the directory until we reach
+  // the end of the directory
+  int rc = ssh_scp_pull_request(info->from);
+  while (rc != SSH_SCP_REQUEST_ENDDIR) {
+    if (!_relay_handlePullRequest(info, rc)) return false;
+    rc = ssh_scp_pull_request(info->from);
+  }
+
+  return ssh_scp_leave_directory(info->to) == SSH_OK;
+}
+
+static bool _relay_handlePullRequest(prelayInfo info, int pullRequestRet)
+{
+  switch (pullRequestRet) {
+    case SSH_SCP_REQUEST_NEWDIR:
+      return _relay_copyDir(info);
+    case SSH_SCP_REQUEST_NEWFILE:
+      return _relay_copyFile(info);
+    // A warning is not fatal. Move on to the next request.
+    case SSH_SCP_REQUEST_WARNING:
+      fprintf(stderr, "Warning from the source: %s\n",
+              ssh_scp_request_get_warning(info->from));
+      return _relay_handlePullRequest(info, ssh_scp_pull_request(info->from));
+    case SSH_ERROR:
+      fprintf(stderr, "ssh_scp_pull_request() returned with an error: %s\n",
+              ssh_get_error(info->fromSession));
+      return false;
+    default:
+      fprintf(stderr, "ssh_scp_pull_request() returned an unexpected "
+                      "value: %i\n", pullRequestRet);
+      return false;
+  }
+}
+
+int relay_copy(ssh_session fromSession, char* from,
+               ssh_session toSession, char* to)
+{
+  relayInfo info;
+  info.fromSession = fromSession;
+  info.toSession = toSession;
+  info.options = scpOptions_get();
+  chunkSizer_init(&info.readSizer, TRACE_CHANNEL_READ);
+
+  info.from = ssh_scp_new(fromSession, SSH_SCP_READ | SSH_SCP_RECURSIVE, from);
+  if (!info.from || ssh_scp_init(info.from) != SSH_OK) {
+    fprintf(stderr, "Error initializing scp session: %s\n",
+            ssh_get_error(fromSession));
+    if (info.from) ssh_scp_free(info.from);
+    return SSH_ERROR;
+  }
+
+  info.to = ssh_scp_new(toSession, SSH_SCP_WRITE | SSH_SCP_RECURSIVE, to);
+  if (!info.to || ssh_scp_init(info.to) != SSH_OK) {
+    fprintf(stderr, "Error initializing scp session: %s\n",
+            ssh_get_error(toSession));
+    if (info.to) ssh_scp_free(info.to);
+    ssh_scp_close(info.from);
+    ssh_scp_free(info.from);
+    return SSH_ERROR;
+  }
+
+  bool success = _relay_handlePullRequest(&info,
+                                          ssh_scp_pull_request(info.from));
+
+  ssh_scp_close(info.to);
+  ssh_scp_free(info.to);
+  ssh_scp_close(info.from);
+  ssh_scp_free(info.from);
+  return success ? SSH_OK : SSH_ERROR;
+}
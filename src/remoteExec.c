@@ -0,0 +1,184 @@
+/**********************************************************************
+  remoteExec.c - Source code for running commands on the remote computer
+                 over an exec channel
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <remoteExec.h>
+
+#define REMOTE_EXEC_READ_SIZE 16384
+
+bool remoteExec_quote(const char* arg, char* out, size_t outSize)
+{
+  // Everything is literal inside single quotes except for the single quote
+  // itself, which becomes '\''
+  size_t len = 0;
+  if (outSize < 3) return false;
+  out[len++] = '\'';
+
+  const char* p;
+  for (p = arg; *p; ++p) {
+    if (*p == '\'') {
+      if (len + 4 >= outSize) return false;
+      memcpy(out + len, "'\\''", 4);
+      len += 4;
+    }
+    else {
+      if (len + 1 >= outSize) return false;
+      out[len++] = *p;
+    }
+  }
+
+  if (len + 2 > outSize) return false;
+  out[len++] = '\'';
+  out[len] = '\0';
+  return true;
+}
+
+ssh_channel remoteExec_D_open(ssh_session session, const char* command)
+{
+  ssh_channel channel = ssh_channel_new(session);
+  if (!channel) {
+    fprintf(stderr, "Error allocating channel: %s\n", ssh_get_error(session));
+    return NULL;
+  }
+
+  if (ssh_channel_open_session(channel) != SSH_OK) {
+    fprintf(stderr, "Error opening channel: %s\n", ssh_get_error(session));
+    ssh_channel_free(channel);
+    return NULL;
+  }
+
+  if (ssh_channel_request_exec(channel, command) != SSH_OK) {
+    fprintf(stderr, "Error running '%s' on the server: %s\n", command,
+            ssh_get_error(session));
+    ssh_channel_close(channel);
+    ssh_channel_free(channel);
+    return NULL;
+  }
+
+  return channel;
+}
+
+void remoteExec_forwardStderr(ssh_channel channel)
+{
+  char buffer[1024];
+  int n;
+  while ((n = ssh_channel_read_nonblocking(channel, buffer, sizeof(buffer),
+                                           1)) > 0)
+    fwrite(buffer, 1, n, stderr);
+}
+
+int remoteExec_close(ssh_channel channel)
+{
+  if (!channel) return -1;
+
+  ssh_channel_send_eof(channel);
+
+  // The exit status only arrives after the command's output, so read
+  // until the end
+  char buffer[REMOTE_EXEC_READ_SIZE];
+  while (ssh_channel_read(channel, buffer, sizeof(buffer), 0) > 0);
+  int n;
+  while ((n = ssh_channel_read(channel, buffer, sizeof(buffer), 1)) > 0)
+    fwrite(buffer, 1, n, stderr);
+
+  int status = ssh_channel_get_exit_status(channel);
+  ssh_channel_close(channel);
+  ssh_channel_free(channel);
+  return status;
+}
+
+// Appends what the command has written to its stdout to output. If block is
+// false, this returns as soon as nothing more is waiting. Otherwise, it reads
+// until the end.
+static bool _remoteExec_readOutput(ssh_channel channel, char** output,
+                                   size_t* len, size_t* capacity, bool block)
+{
+  for (;;) {
+    if (*capacity - *len < REMOTE_EXEC_READ_SIZE + 1) {
+      size_t newCapacity = *capacity ? *capacity * 2 : REMOTE_EXEC_READ_SIZE * 2;
+      char* grown = realloc(*output, newCapacity);
+      if (!grown) {
+        fprintf(stderr, "Error allocating memory in %s\n", __FUNCTION__);
+        return false;
+      }
+      *output = grown;
+      *capacity = newCapacity;
+    }
+
+    int n = block ?
+            ssh_channel_read(channel, *output + *len, REMOTE_EXEC_READ_SIZE,
+                             0) :
+            ssh_channel_read_nonblocking(channel, *output + *len,
+                                         REMOTE_EXEC_READ_SIZE, 0);
+    if (n < 0) return false;
+    if (n == 0) return true;
+    *len += n;
+    remoteExec_forwardStderr(channel);
+  }
+}
+
+char* remoteExec_D_run(ssh_session session, const char* command,
+                       size_t* outputLen)
+{
+  return remoteExec_D_runWithInput(session, command, NULL, 0, outputLen);
+}
+
+char* remoteExec_D_runWithInput(ssh_session session, const char* command,
+                                const char* input, size_t inputLen,
+                                size_t* outputLen)
+{
+  ssh_channel channel = remoteExec_D_open(session, command);
+  if (!channel) return NULL;
+
+  size_t len = 0;
+  size_t capacity = 0;
+  char* output = NULL;
+  bool success = true;
+
+  // Read as we write, so that the command never waits on a full channel
+  // while we wait for it to read its input
+  size_t sent = 0;
+  while (success && sent < inputLen) {
+    size_t n = inputLen - sent;
+    if (n > REMOTE_EXEC_READ_SIZE) n = REMOTE_EXEC_READ_SIZE;
+    int rc = ssh_channel_write(channel, input + sent, n);
+    if (rc == SSH_ERROR) success = false;
+    else sent += rc;
+    success = success &&
+              _remoteExec_readOutput(channel, &output, &len, &capacity,
+                                     false);
+  }
+
+  ssh_channel_send_eof(channel);
+  if (success)
+    success = _remoteExec_readOutput(channel, &output, &len, &capacity, true);
+  if (!success)
+    fprintf(stderr, "Error running '%s' on the server: %s\n", command,
+            ssh_get_error(session));
+
+  if (remoteExec_close(channel) != 0) success = false;
+
+  if (!success) {
+    free(output);
+    return NULL;
+  }
+
+  output[len] = '\0';
+  if (outputLen) *outputLen = len;
+  return output;
+}
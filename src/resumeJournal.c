@@ -0,0 +1,297 @@
+/**********************************************************************
+  resumeJournal.c - Source code for the journal that lets an interrupted
+                    copy carry on where it stopped
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#include <errno.h>
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <checksum.h>
+#include <resumeJournal.h>
+
+// The first line of a journal, followed by its key
+#define RESUME_JOURNAL_HEADER "scp-resume-journal 1"
+#define RESUME_KEY_SIZE (3 * PATH_MAX + 128)
+
+// What the last run recorded about a file
+typedef struct {
+  char* path;
+  size_t size;
+  time_t mtime;
+  size_t offset;
+  bool isDone;
+  // The position of the record in the journal. Later records win.
+  size_t order;
+} resumeRecord;
+
+struct resumeJournal {
+  FILE* file;
+  char path[PATH_MAX];
+  char key[RESUME_KEY_SIZE];
+  // The records that were read when the journal was opened, sorted by path
+  // with one record per path
+  resumeRecord* records;
+  size_t numRecords;
+  // The destination that the last run resolved to (see
+  // resumeJournal_getRoot())
+  char* root;
+};
+
+static int _resumeJournal_compareByPath(const void* a, const void* b)
+{
+  return strcmp(((const resumeRecord*)a)->path,
+                ((const resumeRecord*)b)->path);
+}
+
+static int _resumeJournal_compare(const void* a, const void* b)
+{
+  int rc = _resumeJournal_compareByPath(a, b);
+  if (rc != 0) return rc;
+  const resumeRecord* ra = a;
+  const resumeRecord* rb = b;
+  return ra->order < rb->order ? -1 : ra->order > rb->order;
+}
+
+static bool _resumeJournal_setPath(presumeJournal journal, psshInfo info,
+                                   bool isUpload, const char* from,
+                                   const char* to)
+{
+  char cwd[PATH_MAX];
+  if (!getcwd(cwd, sizeof(cwd))) cwd[0] = '\0';
+
+  snprintf(journal->key, sizeof(journal->key), "%s %s@%s:%i %s %s %s",
+           isUpload ? "up" : "down", info->user, info->host, info->port,
+           cwd, from, to);
+
+  char dir[PATH_MAX];
+  if (!fileSystemUtils_getCacheDir(dir)) return false;
+
+  unsigned char digest[CHECKSUM_MD5_SIZE];
+  char name[2 * CHECKSUM_MD5_SIZE + 1];
+  checksum_md5(journal->key, strlen(journal->key), digest);
+  int i;
+  for (i = 0; i < CHECKSUM_MD5_SIZE; ++i)
+    sprintf(name + 2 * i, "%02x", digest[i]);
+
+  return snprintf(journal->path, PATH_MAX, "%s/resume-%s", dir, name) <
+         PATH_MAX;
+}
+
+// Reads the records of an earlier run. Each record is either
+// "P <size> <mtime> <offset> <path>\0", "D <size> <mtime> <path>\0" or
+// "R <root>\0".
+// Returns false if there is no journal of this copy.
+static bool _resumeJournal_load(presumeJournal journal)
+{
+  FILE* f = fopen(journal->path, "r");
+  if (!f) return false;
+
+  // A different key means the file names collided, and it isn't ours
+  char header[RESUME_KEY_SIZE + sizeof(RESUME_JOURNAL_HEADER) + 2];
+  char expected[sizeof(header)];
+  snprintf(expected, sizeof(expected), "%s %s\n", RESUME_JOURNAL_HEADER,
+           journal->key);
+  if (!fgets(header, sizeof(header), f) || strcmp(header, expected) != 0) {
+    fclose(f);
+    return false;
+  }
+
+  // The end of the last whole record, where the next one is appended
+  long goodEnd = ftell(f);
+  size_t capacity = 0;
+  char* line = NULL;
+  size_t lineSize = 0;
+  ssize_t lineLen;
+  while ((lineLen = getdelim(&line, &lineSize, '\0', f)) > 0) {
+    // The last record may have been cut off before its terminator
+    if (line[lineLen - 1] != '\0') break;
+
+    resumeRecord record;
+    unsigned long long size;
+    long long mtime;
+    unsigned long long offset = 0;
+    int pathStart = 0;
+    if (line[0] == 'P' &&
+        sscanf(line, "P %llu %lld %llu %n", &size, &mtime, &offset,
+               &pathStart) == 3)
+      record.isDone = false;
+    else if (line[0] == 'D' &&
+             sscanf(line, "D %llu %lld %n", &size, &mtime, &pathStart) == 2)
+      record.isDone = true;
+    else if (line[0] == 'R' && line[1] == ' ' && line[2] != '\0') {
+      free(journal->root);
+      journal->root = strdup(line + 2);
+      goodEnd = ftell(f);
+      continue;
+    }
+    else break;
+    if (line[pathStart] == '\0') break;
+
+    if (journal->numRecords == capacity) {
+      size_t newCapacity = capacity ? 2 * capacity : 64;
+      resumeRecord* records = realloc(journal->records,
+                                      newCapacity * sizeof(resumeRecord));
+      if (!records) break;
+      journal->records = records;
+      capacity = newCapacity;
+    }
+
+    record.path = strdup(line + pathStart);
+    if (!record.path) break;
+    record.size = size;
+    record.mtime = mtime;
+    record.offset = offset;
+    record.order = journal->numRecords;
+    journal->records[journal->numRecords++] = record;
+    goodEnd = ftell(f);
+  }
+
+  free(line);
+  fclose(f);
+
+  // Drop whatever follows the last whole record, or the records appended
+  // after it would be read as part of it and be lost with it
+  if (goodEnd < 0 || truncate(journal->path, goodEnd) != 0) {
+    size_t i;
+    for (i = 0; i < journal->numRecords; ++i) free(journal->records[i].path);
+    journal->numRecords = 0;
+    free(journal->root);
+    journal->root = NULL;
+    return false;
+  }
+
+  // Keep only the last record of each path
+  qsort(journal->records, journal->numRecords, sizeof(resumeRecord),
+        _resumeJournal_compare);
+  size_t i;
+  size_t kept = 0;
+  for (i = 0; i < journal->numRecords; ++i) {
+    if (i + 1 < journal->numRecords &&
+        strcmp(journal->records[i].path, journal->records[i + 1].path) == 0) {
+      free(journal->records[i].path);
+      continue;
+    }
+    journal->records[kept++] = journal->records[i];
+  }
+  journal->numRecords = kept;
+  return true;
+}
+
+presumeJournal resumeJournal_D_open(psshInfo info, bool isUpload,
+                                    const char* from, const char* to)
+{
+  presumeJournal journal = calloc(1, sizeof(resumeJournal));
+  if (!journal) return NULL;
+
+  if (!_resumeJournal_setPath(journal, info, isUpload, from, to)) {
+    fprintf(stderr, "Error: there is nowhere to keep the resume journal\n");
+    free(journal);
+    return NULL;
+  }
+
+  // Carry on with the journal of an earlier run, or start a new one
+  bool isResumed = _resumeJournal_load(journal);
+  journal->file = fopen(journal->path, isResumed ? "a" : "w");
+  if (!journal->file ||
+      (!isResumed && (fprintf(journal->file, "%s %s\n", RESUME_JOURNAL_HEADER,
+                              journal->key) < 0 ||
+                      fflush(journal->file) != 0))) {
+    fprintf(stderr, "Error opening the resume journal %s: %s\n",
+            journal->path, strerror(errno));
+    resumeJournal_close(journal, false);
+    return NULL;
+  }
+
+  if (isResumed && journal->numRecords > 0)
+    printf("Resuming the copy from %s\n", journal->path);
+  return journal;
+}
+
+size_t resumeJournal_getOffset(presumeJournal journal, const char* dest,
+                               const fileMeta* src, bool* isDone)
+{
+  *isDone = false;
+
+  resumeRecord key;
+  key.path = (char*)dest;
+  key.order = 0;
+  resumeRecord* record = bsearch(&key, journal->records, journal->numRecords,
+                                 sizeof(resumeRecord),
+                                 _resumeJournal_compareByPath);
+  if (!record || record->size != src->size || record->mtime != src->mtime)
+    return 0;
+
+  *isDone = record->isDone;
+  return record->offset;
+}
+
+bool resumeJournal_recordOffset(presumeJournal journal, const char* dest,
+                                const fileMeta* src, size_t offset)
+{
+  // The part file was synced before this, and the record is synced too, so
+  // that the journal never runs ahead of the data
+  if (fprintf(journal->file, "P %llu %lld %llu %s%c",
+              (unsigned long long)src->size, (long long)src->mtime,
+              (unsigned long long)offset, dest, 0) < 0 ||
+      fflush(journal->file) != 0 || fdatasync(fileno(journal->file)) != 0) {
+    fprintf(stderr, "Error writing the resume journal %s\n", journal->path);
+    return false;
+  }
+  return true;
+}
+
+bool resumeJournal_recordDone(presumeJournal journal, const char* dest,
+                              const fileMeta* src)
+{
+  if (fprintf(journal->file, "D %llu %lld %s%c",
+              (unsigned long long)src->size, (long long)src->mtime, dest,
+              0) < 0 ||
+      fflush(journal->file) != 0) {
+    fprintf(stderr, "Error writing the resume journal %s\n", journal->path);
+    return false;
+  }
+  return true;
+}
+
+const char* resumeJournal_getRoot(presumeJournal journal)
+{
+  return journal->root;
+}
+
+bool resumeJournal_recordRoot(presumeJournal journal, const char* root)
+{
+  if (fprintf(journal->file, "R %s%c", root, 0) < 0 ||
+      fflush(journal->file) != 0) {
+    fprintf(stderr, "Error writing the resume journal %s\n", journal->path);
+    return false;
+  }
+  return true;
+}
+
+void resumeJournal_close(presumeJournal journal, bool isFinished)
+{
+  if (!journal) return;
+
+  if (journal->file) fclose(journal->file);
+  if (isFinished) unlink(journal->path);
+
+  size_t i;
+  for (i = 0; i < journal->numRecords; ++i) free(journal->records[i].path);
+  free(journal->records);
+  free(journal->root);
+  free(journal);
+}
@@ -12,17 +12,23 @@
   limitations under the License.
  ***********************************************************************/
 
+#include <fcntl.h>
 #include <linux/limits.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <scp.h>
-#include <loadBar.h>
+#include <delta.h>
 #include <fileSystemUtils.h>
-
-#define LIBSSH_BUFFER_SIZE 16384
+#include <parallelScp.h>
+#include <progress.h>
+#include <readAhead.h>
+#include <recvSink.h>
+#include <sftpTransfer.h>
+#include <trace.h>
 
 // Define this macro to produce more debug output
 //#define SCP_DEBUG
@@ -30,6 +36,24 @@
 int scp_copyFromServer(ssh_session session, char* from,
                        char* destination, bool isRecursive)
 {
+  // If there is a large old copy here, only the changes are sent
+  int deltaResult = delta_copyFromServer(session, from, destination);
+  if (deltaResult != DELTA_UNAVAILABLE)
+    return deltaResult == DELTA_OK ? SSH_OK : SSH_ERROR;
+
+  // The sftp backend keeps many requests in flight instead
+  if (scpOptions_get()->backend == SCP_BACKEND_SFTP)
+    return sftpTransfer_copyFromServer(session, from, destination,
+                                       isRecursive);
+
+  // With the event loop, the files of a directory are spread over several
+  // channels of this session instead of going down one
+  if (isRecursive && scpOptions_get()->useEventLoop) {
+    int result = parallelScp_copyDirFromServer(session, from, destination);
+    if (result != PARALLEL_SCP_UNAVAILABLE)
+      return result == PARALLEL_SCP_OK ? SSH_OK : SSH_ERROR;
+  }
+
   // First, just make the initial preparations for scp...
   ssh_scp scp;
   int rc;
@@ -50,7 +74,9 @@ int scp_copyFromServer(ssh_session session, char* from,
     return rc;
   }
 
+  uint64_t start = trace_begin();
   rc = ssh_scp_pull_request(scp);
+  trace_end(TRACE_REQUEST, start, 0);
 
   // Set up the scp info
   scpInfo scpinfo;
@@ -58,6 +84,12 @@ int scp_copyFromServer(ssh_session session, char* from,
   scpinfo.scp = scp;
   snprintf(scpinfo.from, PATH_MAX, "%s", from);
   scpinfo.isRecursive = isRecursive;
+  scpinfo.options = scpOptions_get();
+  scpinfo.filter = NULL;
+  scpinfo.filterData = NULL;
+  scpinfo.verifier = verify_D_start(session);
+  scpinfo.remotePath[0] = '\0';
+  chunkSizer_init(&scpinfo.readSizer, TRACE_CHANNEL_READ);
 
   // A single file was requested...
   if (rc == SSH_SCP_REQUEST_NEWFILE) scpinfo.isRecursive = false;
@@ -68,12 +100,24 @@ int scp_copyFromServer(ssh_session session, char* from,
   if (!_scp_handlePullRequest(scp_info, destination, rc)) {
     fprintf(stderr, "Error in %s: _scp_hanldePullRequest() failed!\n",
             __FUNCTION__);
+    verify_finish(scpinfo.verifier, false);
     return SSH_ERROR;
   }
 
   ssh_scp_close(scp);
   ssh_scp_free(scp);
-  return SSH_OK;
+  return verify_finish(scpinfo.verifier, true) ? SSH_OK : SSH_ERROR;
+}
+
+// Writes the path on the server of the file or directory that the server
+// has just announced
+static void _scp_getRemotePath(pscpInfo scp_info, char* path)
+{
+  if (scp_info->remotePath[0])
+    snprintf(path, PATH_MAX, "%s/%s", scp_info->remotePath,
+             ssh_scp_request_get_filename(scp_info->scp));
+  else
+    snprintf(path, PATH_MAX, "%s", scp_info->from);
 }
 
 // rc is the return from the pull request
@@ -108,7 +152,13 @@ bool _scp_handlePullRequest(pscpInfo scp_info, const char* destination,
           break;
         }
 
+        char parentPath[PATH_MAX];
+        snprintf(parentPath, PATH_MAX, "%s", scp_info->remotePath);
+        _scp_getRemotePath(scp_info, scp_info->remotePath);
+
         success = _scp_copyDirFromServer(scp_info, newDest);
+
+        snprintf(scp_info->remotePath, PATH_MAX, "%s", parentPath);
       }
       break;
     // Requested a file!
@@ -172,48 +222,78 @@ bool _scp_copyFileFromServer(pscpInfo scp_info, const char* destination)
   int rc = SSH_ERROR;
   size_t fileSize = ssh_scp_request_get_size(scp_info->scp);
   size_t bytesRead = 0;
-  char buffer[LIBSSH_BUFFER_SIZE];
+  traceFile trace;
+  trace_beginFile(&trace);
 
-  FILE *fp = fopen(destination, "w+");
+  // The sink preallocates the file and writes it in large blocks (or maps
+  // it so that ssh_scp_read() writes straight into the file)
+  precvSink sink = recvSink_D_open(destination, fileSize,
+                                   scp_info->options->useMmap,
+                                   scp_info->options->chunkSize);
 
-  if (fp == NULL) {
+  if (sink == NULL) {
     fprintf(stderr, "Error opening %s for writing\n", destination);
-    return -1;
+    return false;
+  }
+
+  if (scp_info->verifier) {
+    char remotePath[PATH_MAX];
+    _scp_getRemotePath(scp_info, remotePath);
+    verify_beginFile(scp_info->verifier, destination, remotePath);
   }
+  progress_beginFile(destination, fileSize);
+  chunkSizer_restart(&scp_info->readSizer);
 
   // If the fileSize is zero, just return true. No copying needed
   if (fileSize == 0) {
     // This is needed to refresh the state of the scp
+    char buffer[1];
     rc = ssh_scp_read(scp_info->scp, buffer, sizeof(buffer));
-    fclose(fp);
-    return true;
+    verify_endFile(scp_info->verifier);
+    progress_endFile();
+    trace_endFile(&trace, destination, 0);
+    return recvSink_close(sink);
   }
 
   do {
-    rc = ssh_scp_read(scp_info->scp, buffer, sizeof(buffer));
+    size_t len;
+    char* buffer = recvSink_getBuffer(sink, &len);
+    if (len > chunkSizer_get(&scp_info->readSizer))
+      len = chunkSizer_get(&scp_info->readSizer);
+
+    uint64_t start = trace_begin();
+    rc = ssh_scp_read(scp_info->scp, buffer, len);
+    trace_end(TRACE_CHANNEL_READ, start, rc > 0 ? rc : 0);
     if (rc == SSH_ERROR) {
       fprintf(stderr, "Error reading file: %s\n",
               ssh_get_error(scp_info->session));
-      return -1;
+      recvSink_close(sink);
+      return false;
     }
 
     // rc is equal to the number of bytes read if it is not an error...
     bytesRead += rc;
-
-    // We want the loadBar() to print every time it is called, so we set
-    // the resolution to be the fileSize
-    loadBar_loadBar(bytesRead, fileSize, fileSize, 20, destination);
-
-    // rc is set to the number of bytes transferred
-    // With the way this is set up, we will print exactly rc bytes
-    // from the buffer to the file pointer
-    fprintf(fp, "%.*s", rc, buffer);
+    chunkSizer_record(&scp_info->readSizer, len, rc);
+    verify_update(scp_info->verifier, buffer, rc);
+    progress_update(rc);
+
+    // The bytes are already in place. This writes them out once a whole
+    // block has been received.
+    start = trace_begin();
+    bool isCommitted = recvSink_commit(sink, rc);
+    trace_end(TRACE_DISK_WRITE, start, rc);
+    if (!isCommitted || scpOptions_isCanceled()) {
+      recvSink_close(sink);
+      return false;
+    }
   }
   while (bytesRead < fileSize);
 
-  fclose(fp);
-
-  return true;
+  verify_endFile(scp_info->verifier);
+  progress_endFile();
+  bool success = recvSink_close(sink);
+  trace_endFile(&trace, destination, fileSize);
+  return success;
 }
 
 // This is recursive if more directories exist
@@ -226,13 +306,17 @@ bool _scp_copyDirFromServer(pscpInfo scp_info, const char* destination)
   printf("scp_info->from is %s\n", scp_info->from);
   printf("destination is %s\n", destination);
 #endif
+  uint64_t start = trace_begin();
   int rc = ssh_scp_pull_request(scp_info->scp);
+  trace_end(TRACE_REQUEST, start, 0);
 
   // Keep looping through the contents of the directory until we reach
   // the end of the directory
   while (rc != SSH_SCP_REQUEST_ENDDIR) {
     if (!_scp_handlePullRequest(scp_info, destination, rc)) return false;
+    start = trace_begin();
     rc = ssh_scp_pull_request(scp_info->scp);
+    trace_end(TRACE_REQUEST, start, 0);
   }
 
   return true;
@@ -245,16 +329,44 @@ int scp_copyToServer(ssh_session session, char* from,
   printf("scp_copyToServer() called with from = '%s' and to = '%s'\n",
          from, to);
 #endif
+  // If the server has an old copy of a large file, only the changes are sent
+  int deltaResult = delta_copyToServer(session, from, to);
+  if (deltaResult != DELTA_UNAVAILABLE)
+    return deltaResult == DELTA_OK ? SSH_OK : SSH_ERROR;
+
+  // The sftp backend keeps many requests in flight instead
+  if (scpOptions_get()->backend == SCP_BACKEND_SFTP)
+    return sftpTransfer_copyToServer(session, from, to, isRecursive);
+
+  // With the event loop, the files of a directory are spread over several
+  // channels of this session instead of going down one
+  if (isRecursive && scpOptions_get()->useEventLoop) {
+    int result = parallelScp_copyDirToServer(session, from, to);
+    if (result != PARALLEL_SCP_UNAVAILABLE)
+      return result == PARALLEL_SCP_OK ? SSH_OK : SSH_ERROR;
+  }
+
+  return scp_copyToServerFiltered(session, from, to, isRecursive, NULL, NULL);
+}
+
+int scp_copyToServerFiltered(ssh_session session, char* from, char* to,
+                             bool isRecursive, scpFilter filter,
+                             void* filterData)
+{
   // If to ends in '/', this causes confusion for the server, so just replace it
   if (from[strlen(from) - 1] == '/') from[strlen(from) - 1] = '\0';
 
+  // Stat it once. The size and permissions are passed along from here.
+  fileMeta meta;
+  fileSystemUtils_getMeta(AT_FDCWD, from, &meta);
+
   // If we're not in recursive mode and it's a directory, return with an error
-  if (!isRecursive && fileSystemUtils_getFileType(from) == FILE_IS_DIR) {
+  if (!isRecursive && meta.type == FILE_IS_DIR) {
     fprintf(stderr, "%s is a directory!\n", from);
     return SSH_ERROR;
   }
   // If we are in recursive mode and it's a file, just turn it off
-  else if (isRecursive && fileSystemUtils_getFileType(from) == FILE_IS_REG)
+  else if (isRecursive && meta.type == FILE_IS_REG)
     isRecursive = false;
 
   // Make the initial preparations for scp...
@@ -285,134 +397,399 @@ int scp_copyToServer(ssh_session session, char* from,
   snprintf(scpinfo.from, PATH_MAX, "%s", from);
 
   scpinfo.isRecursive = isRecursive;
+  scpinfo.options = scpOptions_get();
+  scpinfo.filter = filter;
+  scpinfo.filterData = filterData;
+  chunkSizer_init(&scpinfo.writeSizer, TRACE_CHANNEL_WRITE);
+
+  // The server decides where the copy goes, so ask it before the copy
+  // changes the answer
+  scpinfo.verifier = verify_D_start(session);
+  if (scpinfo.verifier &&
+      !verify_getRemoteDest(session, from, to, scpinfo.remotePath)) {
+    fprintf(stderr, "Warning: can't find %s on the server to verify it\n",
+            to);
+    verify_finish(scpinfo.verifier, false);
+    scpinfo.verifier = NULL;
+  }
 
   pscpInfo scp_info = &scpinfo;
 
-  if (fileSystemUtils_getFileType(from) == FILE_IS_REG) {
-    if (!_scp_copyFileToServer(scp_info, from)) return SSH_ERROR;
-  }
-  else if (fileSystemUtils_getFileType(from) == FILE_IS_DIR) {
-    if (!_scp_copyDirToServer(scp_info, from)) return SSH_ERROR;
+  bool success = true;
+  if (meta.type == FILE_IS_REG)
+    success = _scp_copyFileToServer(scp_info, AT_FDCWD, from, &meta, "");
+  else if (meta.type == FILE_IS_DIR)
+    success = _scp_copyDirToServer(scp_info, AT_FDCWD, from, &meta, "");
+
+  if (!success) {
+    verify_finish(scpinfo.verifier, false);
+    return SSH_ERROR;
   }
 
   ssh_scp_close(scp);
   ssh_scp_free(scp);
-  return SSH_OK;
+  return verify_finish(scpinfo.verifier, true) ? SSH_OK : SSH_ERROR;
 }
 
 // Push files to server
-bool _scp_copyFileToServer(pscpInfo scp_info, const char* file)
+bool _scp_copyFileToServer(pscpInfo scp_info, int dirFd, const char* file,
+                           const fileMeta* meta, const char* relPath)
 {
 #ifdef SCP_DEBUG
   printf("scp_copyFileToServer() called with file = '%s'\n", file);
 #endif
   int rc;
 
-  size_t size = fileSystemUtils_getFileSize(file);
-
-  FILE* fp = fopen(file, "r");
-  if (fp == NULL) {
+  int fd = openat(dirFd, file, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
     fprintf(stderr, "Error while opening %s for reading\n", file);
     return false;
   }
+  size_t size = meta->size;
+  traceFile trace;
+  trace_beginFile(&trace);
 
   // Use the same permissions for the server as for local
-  int permissions = fileSystemUtils_getFilePermissions(file);
-
-  rc = ssh_scp_push_file(scp_info->scp, file, size, permissions);
+  uint64_t start = trace_begin();
+  rc = ssh_scp_push_file(scp_info->scp, file, size, meta->permissions);
+  trace_end(TRACE_REQUEST, start, 0);
   if (rc != SSH_OK) {
     fprintf(stderr, "Can't open remote file: %s\n",
             ssh_get_error(scp_info->session));
-    fclose(fp);
+    close(fd);
     return false;
   }
 
-  size_t bytesRead = 0;
-  // TODO: it'd be nice to find a way to copy over the file in segments
-  // to allow for a loading bar and to prevent having really large files
-  // being copied into memory
-  char* buffer = malloc(sizeof(char) * size);
+  char localPath[PATH_MAX];
+  snprintf(localPath, PATH_MAX, "%s%s%s", scp_info->from,
+           relPath[0] ? "/" : "", relPath);
+  if (scp_info->verifier) {
+    char remotePath[PATH_MAX];
+    snprintf(remotePath, PATH_MAX, "%s%s%s", scp_info->remotePath,
+             relPath[0] ? "/" : "", relPath);
+    verify_beginFile(scp_info->verifier, localPath, remotePath);
+  }
+  progress_beginFile(localPath, size);
+  chunkSizer_restart(&scp_info->writeSizer);
+
+  // Nothing to send, but libssh only finishes the file on a write
+  if (size == 0) {
+    close(fd);
+    char buffer[1];
+    if (ssh_scp_write(scp_info->scp, buffer, 0) != SSH_OK) {
+      fprintf(stderr, "Can't write to remote file: %s\n",
+              ssh_get_error(scp_info->session));
+      return false;
+    }
+    verify_endFile(scp_info->verifier);
+    progress_endFile();
+    trace_endFile(&trace, localPath, 0);
+    return true;
+  }
 
-  fread(buffer, size, 1, fp);
+  // The file is read from the disk by another thread while we write to the
+  // network, so only chunkSize * queueDepth bytes are in memory at once
+  preadAhead reader = readAhead_D_start(fd, scp_info->options->chunkSize,
+                                        scp_info->options->queueDepth);
+  if (!reader) {
+    close(fd);
+    return false;
+  }
 
-  rc = ssh_scp_write(scp_info->scp, buffer, size);
+  size_t bytesWritten = 0;
+  pchunk c;
+  while (bytesWritten < size) {
+    // This only waits if the disk can't keep up with the network
+    start = trace_begin();
+    c = readAhead_next(reader);
+    if (!c) break;
+    trace_end(TRACE_DISK_READ, start, c->len);
+
+    // The file may have grown since we sent its size. Only send what
+    // we promised.
+    size_t len = c->len;
+    if (len > size - bytesWritten) len = size - bytesWritten;
+
+    // The chunk goes out in writes that are sized for the network rather
+    // than for the disk
+    size_t offset = 0;
+    rc = SSH_OK;
+    while (rc == SSH_OK && offset < len) {
+      size_t n = len - offset;
+      if (n > chunkSizer_get(&scp_info->writeSizer))
+        n = chunkSizer_get(&scp_info->writeSizer);
+
+      start = trace_begin();
+      rc = ssh_scp_write(scp_info->scp, c->data + offset, n);
+      trace_end(TRACE_CHANNEL_WRITE, start, n);
+      if (rc == SSH_OK) chunkSizer_record(&scp_info->writeSizer, n, n);
+      offset += n;
+    }
+    verify_update(scp_info->verifier, c->data, len);
+    readAhead_release(reader, c);
 
-  if (rc != SSH_OK) {
-    fprintf(stderr, "Can't write to remote file: %s\n",
-            ssh_get_error(scp_info->session));
-    free(buffer);
-    fclose(fp);
+    if (rc != SSH_OK) {
+      fprintf(stderr, "Can't write to remote file: %s\n",
+              ssh_get_error(scp_info->session));
+      readAhead_finish(reader);
+      close(fd);
+      return false;
+    }
+
+    bytesWritten += len;
+    progress_update(len);
+
+    if (scpOptions_isCanceled()) {
+      readAhead_finish(reader);
+      close(fd);
+      return false;
+    }
+  }
+
+  readAhead_finish(reader);
+  close(fd);
+
+  // If the file shrank or could not be read, the remote side is still
+  // waiting for the rest of it
+  if (bytesWritten < size) {
+    fprintf(stderr, "Error: only %zu of %zu bytes of %s could be read\n",
+            bytesWritten, size, file);
     return false;
   }
-  bytesRead += LIBSSH_BUFFER_SIZE;
-  free(buffer);
-  fclose(fp);
 
+  verify_endFile(scp_info->verifier);
+  progress_endFile();
+  trace_endFile(&trace, localPath, size);
   return true;
 }
 
-bool _scp_copyDirToServer(pscpInfo scp_info, const char* dirName)
+bool _scp_copyDirToServer(pscpInfo scp_info, int dirFd, const char* dirName,
+                          const fileMeta* meta, const char* relPath)
 {
 #ifdef SCP_DEBUG
   printf("_scp_copyDirToServer() was called for %s\n", dirName);
 #endif
-  // Use the same permissions for the remote file as for the local file
-  int permissions = fileSystemUtils_getFilePermissions(dirName);
+  pdirList list = fileSystemUtils_D_readDir(dirFd, dirName);
+  if (!list) return false;
 
-  int rc = ssh_scp_push_directory(scp_info->scp, dirName, permissions);
+  // Use the same permissions for the remote dir as for the local dir
+  uint64_t start = trace_begin();
+  int rc = ssh_scp_push_directory(scp_info->scp, dirName, meta->permissions);
+  trace_end(TRACE_REQUEST, start, 0);
   if (rc != SSH_OK) {
     fprintf(stderr, "Can't create remote directory: %s\n",
             ssh_get_error(scp_info->session));
+    fileSystemUtils_freeDirList(list);
     return false;
   }
-  int type = FILE_IS_REG;
-  char* fileList = fileSystemUtils_D_getDelimitedFileList(dirName);
-
-  // Save the cwd and restore it later
-  char oldPath[PATH_MAX];
-  fileSystemUtils_getCWD(oldPath);
 
-  // Move the process's working directory to the directory of interest
-  fileSystemUtils_chdir(dirName);
-
-  // This list is delimited by commas, so tokenize it with commas
-  // This function is recursive, so use strtok_r()
-  char* saveptr;
-  char* tok = strtok_r(fileList, ",", &saveptr);
+  // Everything in the directory is opened relative to it, so the working
+  // directory never changes
   bool success = true;
-  while (tok != NULL) {
-    // Skip . and ..
-    if (strcmp(tok, "..") == 0 || strcmp(tok, ".") == 0) {
-      tok = strtok_r(NULL, ",", &saveptr);
+  size_t i;
+  for (i = 0; success && i < list->numEntries; ++i) {
+    pdirEntry entry = &list->entries[i];
+
+    char entryPath[PATH_MAX];
+    if (snprintf(entryPath, PATH_MAX, "%s%s%s", relPath, relPath[0] ? "/" : "",
+                 entry->name) >= PATH_MAX) {
+      fprintf(stderr, "Error: path too long for %s\n", entry->name);
+      success = false;
+      break;
+    }
+    if (scp_info->filter &&
+        !scp_info->filter(entryPath, &entry->meta, scp_info->filterData))
       continue;
+
+    if (entry->meta.type == FILE_IS_DIR)
+      success = _scp_copyDirToServer(scp_info, list->fd, entry->name,
+                                     &entry->meta, entryPath);
+    else if (entry->meta.type == FILE_IS_REG)
+      success = _scp_copyFileToServer(scp_info, list->fd, entry->name,
+                                      &entry->meta, entryPath);
+    else fprintf(stderr, "Warning: %s is not a regular file or directory\n",
+                 entry->name);
+  }
+
+  fileSystemUtils_freeDirList(list);
+  ssh_scp_leave_directory(scp_info->scp);
+
+  return success;
+}
+
+struct scpLane {
+  bool isDownload;
+  // The session, verifier and sizers of every file. For uploads, scp is
+  // the recursive "scp -t". For downloads, it is the "scp -f" of the file
+  // being copied.
+  scpInfo info;
+  // The directory that the upload scp is at, and where it is now relative
+  // to it (empty at the top)
+  char remoteRoot[PATH_MAX];
+  char remoteDir[PATH_MAX];
+};
+
+pscpLane scp_D_openLane(ssh_session session, const char* remoteRoot,
+                        bool isDownload)
+{
+  pscpLane lane = calloc(1, sizeof(scpLane));
+  if (!lane) return NULL;
+
+  lane->isDownload = isDownload;
+  lane->info.session = session;
+  lane->info.options = scpOptions_get();
+  chunkSizer_init(&lane->info.readSizer, TRACE_CHANNEL_READ);
+  chunkSizer_init(&lane->info.writeSizer, TRACE_CHANNEL_WRITE);
+
+  // A download opens an scp for each file as it comes to it
+  if (!isDownload) {
+    snprintf(lane->remoteRoot, PATH_MAX, "%s", remoteRoot);
+    lane->info.scp = ssh_scp_new(session, SSH_SCP_WRITE | SSH_SCP_RECURSIVE,
+                                 remoteRoot);
+    if (!lane->info.scp || ssh_scp_init(lane->info.scp) != SSH_OK) {
+      fprintf(stderr, "Error initializing scp session: %s\n",
+              ssh_get_error(session));
+      if (lane->info.scp) ssh_scp_free(lane->info.scp);
+      free(lane);
+      return NULL;
     }
-    // Get the file type
-    type = fileSystemUtils_getFileType(tok);
+  }
 
-    if (type == FILE_IS_DIR) {
-      if (!_scp_copyDirToServer(scp_info, tok)) {
-        success = false;
-        break;
-      }
+  lane->info.verifier = verify_D_start(session);
+  return lane;
+}
+
+// Counts the components of a relative path
+static int _scp_countComponents(const char* path)
+{
+  if (!path[0]) return 0;
+  int count = 1;
+  for (; *path; ++path) {
+    if (*path == '/') count++;
+  }
+  return count;
+}
+
+// Moves the upload scp of a lane from the directory it is in to dir, which
+// is relative to the lane's remoteRoot. Only the directories that differ
+// are left and entered. They exist already, so their modes are kept.
+static bool _scp_laneEnterDir(pscpLane lane, const char* dir)
+{
+  const char* cur = lane->remoteDir;
+
+  // The length of the leading components that both have in common
+  size_t common = 0;
+  size_t i;
+  for (i = 0; ; i++) {
+    if ((cur[i] == '\0' || cur[i] == '/') && (dir[i] == '\0' || dir[i] == '/'))
+      common = i;
+    if (cur[i] == '\0' || cur[i] != dir[i]) break;
+  }
+
+  const char* toLeave = cur + common;
+  if (*toLeave == '/') toLeave++;
+  int numToLeave = _scp_countComponents(toLeave);
+  for (; numToLeave > 0; numToLeave--) {
+    if (ssh_scp_leave_directory(lane->info.scp) != SSH_OK) {
+      fprintf(stderr, "Can't leave remote directory: %s\n",
+              ssh_get_error(lane->info.session));
+      return false;
     }
-    else if (type == FILE_IS_REG) {
-      if (!_scp_copyFileToServer(scp_info, tok)) {
-        success = false;
-        break;
-      }
+  }
+
+  const char* toEnter = dir + common;
+  while (*toEnter) {
+    if (*toEnter == '/') toEnter++;
+    size_t len = strcspn(toEnter, "/");
+    char name[PATH_MAX];
+    snprintf(name, PATH_MAX, "%.*s", (int)len, toEnter);
+    uint64_t start = trace_begin();
+    int rc = ssh_scp_push_directory(lane->info.scp, name, 0755);
+    trace_end(TRACE_REQUEST, start, 0);
+    if (rc != SSH_OK) {
+      fprintf(stderr, "Can't enter remote directory: %s\n",
+              ssh_get_error(lane->info.session));
+      return false;
     }
-    else fprintf(stderr, "Warning: %s is not a regular file or directory\n",
-                 tok);
+    toEnter += len;
+  }
+
+  snprintf(lane->remoteDir, PATH_MAX, "%s", dir);
+  return true;
+}
 
-    tok = strtok_r(NULL, ",", &saveptr);
+// Sends a local file down the upload scp of a lane, into the remote
+// directory to
+static bool _scp_laneCopyToServer(pscpLane lane, char* from, char* to)
+{
+  size_t rootLen = strlen(lane->remoteRoot);
+  if (strncmp(to, lane->remoteRoot, rootLen) != 0 ||
+      (to[rootLen] != '\0' && to[rootLen] != '/')) {
+    fprintf(stderr, "Error: %s is not in %s\n", to, lane->remoteRoot);
+    return false;
   }
-  // fileSystemUtils_D_getDelimitedFileList() returns a character array that
-  // must be freed
-  free(fileList);
 
-  // restore old cwd
-  fileSystemUtils_chdir(oldPath);
-  ssh_scp_leave_directory(scp_info->scp);
+  const char* dir = to + rootLen;
+  if (*dir == '/') dir++;
+  if (!_scp_laneEnterDir(lane, dir)) return false;
+
+  fileMeta meta;
+  if (!fileSystemUtils_getMeta(AT_FDCWD, from, &meta) ||
+      meta.type != FILE_IS_REG) {
+    fprintf(stderr, "%s is not a regular file!\n", from);
+    return false;
+  }
+
+  // libssh sends the base name of from, so this is where it ends up
+  const char* name = strrchr(from, '/');
+  name = name ? name + 1 : from;
+  snprintf(lane->info.from, PATH_MAX, "%s", from);
+  snprintf(lane->info.remotePath, PATH_MAX, "%s/%s", to, name);
+  return _scp_copyFileToServer(&lane->info, AT_FDCWD, from, &meta, "");
+}
+
+// Receives the remote file from into the local file to, with an scp of its
+// own on the lane's session
+static bool _scp_laneCopyFromServer(pscpLane lane, char* from, char* to)
+{
+  ssh_scp scp = ssh_scp_new(lane->info.session, SSH_SCP_READ, from);
+  if (!scp || ssh_scp_init(scp) != SSH_OK) {
+    fprintf(stderr, "Error initializing scp session: %s\n",
+            ssh_get_error(lane->info.session));
+    if (scp) ssh_scp_free(scp);
+    return false;
+  }
+
+  lane->info.scp = scp;
+  lane->info.isRecursive = false;
+  snprintf(lane->info.from, PATH_MAX, "%s", from);
+  lane->info.remotePath[0] = '\0';
+
+  uint64_t start = trace_begin();
+  int rc = ssh_scp_pull_request(scp);
+  trace_end(TRACE_REQUEST, start, 0);
+
+  bool success = _scp_handlePullRequest(&lane->info, to, rc);
+  if (success) ssh_scp_close(scp);
+  ssh_scp_free(scp);
+  lane->info.scp = NULL;
+  return success;
+}
+
+bool scp_laneCopy(pscpLane lane, char* from, char* to)
+{
+  if (lane->isDownload) return _scp_laneCopyFromServer(lane, from, to);
+  return _scp_laneCopyToServer(lane, from, to);
+}
+
+bool scp_closeLane(pscpLane lane, bool success)
+{
+  if (!lane->isDownload) {
+    if (success) ssh_scp_close(lane->info.scp);
+    ssh_scp_free(lane->info.scp);
+  }
 
+  success = verify_finish(lane->info.verifier, success) && success;
+  free(lane);
   return success;
 }
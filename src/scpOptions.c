@@ -0,0 +1,492 @@
+/**********************************************************************
+  scpOptions.c - Source code for the options that tune how the scp
+                 functions perform a transfer
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <scpOptions.h>
+
+// The options used by the scp functions. They are set to the defaults the
+// first time scpOptions_get() is called.
+static scpOptions _globalOptions;
+static bool _globalOptionsSet = false;
+// The options of a thread that was given its own
+static __thread pscpOptions _threadOptions = NULL;
+
+// What scpOptions_startThread() hands to the new thread
+typedef struct {
+  void* (*run)(void*);
+  void* arg;
+  pscpOptions options;
+} threadStart;
+
+// Values for the options that only have a long form
+enum {
+  _OPT_MUX = 256,
+  _OPT_MUX_DAEMON,
+  _OPT_MUX_IDLE,
+  _OPT_BATCH,
+  _OPT_BATCH_RESULTS,
+  _OPT_STAT_THREADS,
+  _OPT_TAR,
+  _OPT_TAR_THRESHOLD,
+  _OPT_COMPRESS,
+  _OPT_COMPRESS_LEVEL,
+  _OPT_DELTA_HELPER,
+  _OPT_DELTA_RECEIVE,
+  _OPT_DELTA_SEND,
+  _OPT_INCREMENTAL,
+  _OPT_CHECKSUM,
+  _OPT_RESUME,
+  _OPT_VERIFY,
+  _OPT_VERIFY_HASH,
+  _OPT_CIPHERS,
+  _OPT_MACS,
+  _OPT_CIPHER_PROBE,
+  _OPT_TRACE,
+  _OPT_EVENT_LOOP,
+  _OPT_CHANNELS
+};
+
+void scpOptions_setDefaults(pscpOptions options)
+{
+  options->chunkSize = DEFAULT_CHUNK_SIZE;
+  options->queueDepth = DEFAULT_QUEUE_DEPTH;
+  options->useMmap = false;
+  options->numJobs = 1;
+  options->numStripes = 1;
+  options->backend = SCP_BACKEND_SCP;
+  options->pipelineDepth = DEFAULT_PIPELINE_DEPTH;
+  options->useMux = false;
+  options->runMuxDaemon = false;
+  options->muxIdleTime = DEFAULT_MUX_IDLE_TIME;
+  options->batchFile = NULL;
+  options->batchResultsFile = NULL;
+  options->statThreads = 1;
+  options->useTar = false;
+  options->tarThreshold = DEFAULT_TAR_THRESHOLD;
+  options->compress = false;
+  options->compressLevel = DEFAULT_COMPRESS_LEVEL;
+  options->deltaHelper = NULL;
+  options->deltaReceive = false;
+  options->deltaSend = false;
+  options->incremental = false;
+  options->compareChecksums = false;
+  options->resume = false;
+  options->verify = false;
+  options->verifyHash = false;
+  options->ciphers = NULL;
+  options->macs = NULL;
+  options->printCipherProbe = false;
+  options->traceFile = NULL;
+  options->useEventLoop = false;
+  options->channelsPerSession = DEFAULT_CHANNELS_PER_SESSION;
+  options->progress = NULL;
+  options->tracer = NULL;
+  options->countTotals = false;
+  options->jobCanceled = NULL;
+}
+
+pscpOptions scpOptions_get()
+{
+  if (_threadOptions) return _threadOptions;
+  if (!_globalOptionsSet) {
+    scpOptions_setDefaults(&_globalOptions);
+    _globalOptionsSet = true;
+  }
+  return &_globalOptions;
+}
+
+void scpOptions_setForThread(pscpOptions options)
+{
+  _threadOptions = options;
+}
+
+static void* _scpOptions_runThread(void* arg)
+{
+  threadStart start = *(threadStart*)arg;
+  free(arg);
+  _threadOptions = start.options;
+  return start.run(start.arg);
+}
+
+int scpOptions_startThread(pthread_t* thread, void* (*run)(void*), void* arg)
+{
+  threadStart* start = malloc(sizeof(threadStart));
+  if (!start) return ENOMEM;
+  start->run = run;
+  start->arg = arg;
+  start->options = _threadOptions;
+
+  int rc = pthread_create(thread, NULL, _scpOptions_runThread, start);
+  if (rc != 0) free(start);
+  return rc;
+}
+
+bool scpOptions_isCanceled()
+{
+  bool* isCanceled = scpOptions_get()->jobCanceled;
+  return isCanceled && __atomic_load_n(isCanceled, __ATOMIC_RELAXED);
+}
+
+// Reads a size such as "65536", "64K", "1M" or "1G" into result
+static bool _scpOptions_readSize(const char* str, size_t* result)
+{
+  char* end;
+  unsigned long long value = strtoull(str, &end, 10);
+  if (end == str) return false;
+
+  switch (*end) {
+    case 'g': case 'G': value *= 1024;
+    // fall through
+    case 'm': case 'M': value *= 1024;
+    // fall through
+    case 'k': case 'K': value *= 1024;
+      end++;
+      break;
+    default:
+      break;
+  }
+
+  if (*end != '\0') return false;
+  *result = value;
+  return true;
+}
+
+int scpOptions_parseArgs(int argc, char* argv[], pscpOptions options)
+{
+  static struct option longOptions[] = {
+    { "chunk-size",  required_argument, NULL, 'c' },
+    { "queue-depth", required_argument, NULL, 'q' },
+    { "mmap",        no_argument,       NULL, 'm' },
+    { "jobs",        required_argument, NULL, 'j' },
+    { "stripes",     required_argument, NULL, 's' },
+    { "backend",     required_argument, NULL, 'b' },
+    { "pipeline-depth", required_argument, NULL, 'p' },
+    { "mux",         no_argument,       NULL, _OPT_MUX },
+    { "mux-daemon",  no_argument,       NULL, _OPT_MUX_DAEMON },
+    { "mux-idle",    required_argument, NULL, _OPT_MUX_IDLE },
+    { "batch",       required_argument, NULL, _OPT_BATCH },
+    { "batch-results", required_argument, NULL, _OPT_BATCH_RESULTS },
+    { "stat-threads", required_argument, NULL, _OPT_STAT_THREADS },
+    { "tar",         no_argument,       NULL, _OPT_TAR },
+    { "tar-threshold", required_argument, NULL, _OPT_TAR_THRESHOLD },
+    { "compress",    no_argument,       NULL, _OPT_COMPRESS },
+    { "compress-level", required_argument, NULL, _OPT_COMPRESS_LEVEL },
+    { "delta-helper", required_argument, NULL, _OPT_DELTA_HELPER },
+    { "delta-receive", no_argument,     NULL, _OPT_DELTA_RECEIVE },
+    { "delta-send",  no_argument,       NULL, _OPT_DELTA_SEND },
+    { "incremental", no_argument,       NULL, _OPT_INCREMENTAL },
+    { "checksum",    no_argument,       NULL, _OPT_CHECKSUM },
+    { "resume",      no_argument,       NULL, _OPT_RESUME },
+    { "verify",      no_argument,       NULL, _OPT_VERIFY },
+    { "verify-hash", no_argument,       NULL, _OPT_VERIFY_HASH },
+    { "ciphers",     required_argument, NULL, _OPT_CIPHERS },
+    { "macs",        required_argument, NULL, _OPT_MACS },
+    { "cipher-probe", no_argument,      NULL, _OPT_CIPHER_PROBE },
+    { "trace",       required_argument, NULL, _OPT_TRACE },
+    { "event-loop",  no_argument,       NULL, _OPT_EVENT_LOOP },
+    { "channels",    required_argument, NULL, _OPT_CHANNELS },
+    { "help",        no_argument,       NULL, 'h' },
+    { NULL,          0,                 NULL, 0   }
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "c:q:mj:s:b:p:h", longOptions, NULL)) != -1) {
+    switch (opt) {
+      case 'c':
+        if (!_scpOptions_readSize(optarg, &options->chunkSize) ||
+            options->chunkSize == 0) {
+          fprintf(stderr, "Invalid chunk size: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case 'q':
+        if (!_scpOptions_readSize(optarg, &options->queueDepth) ||
+            options->queueDepth == 0) {
+          fprintf(stderr, "Invalid queue depth: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case 'm':
+        options->useMmap = true;
+        break;
+      case 'j':
+        options->numJobs = atoi(optarg);
+        if (options->numJobs < 1) {
+          fprintf(stderr, "Invalid number of jobs: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case 's':
+        options->numStripes = atoi(optarg);
+        if (options->numStripes < 1) {
+          fprintf(stderr, "Invalid number of stripes: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case 'b':
+        if (strcmp(optarg, "scp") == 0) options->backend = SCP_BACKEND_SCP;
+        else if (strcmp(optarg, "sftp") == 0)
+          options->backend = SCP_BACKEND_SFTP;
+        else {
+          fprintf(stderr, "Invalid backend: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case 'p':
+        if (!_scpOptions_readSize(optarg, &options->pipelineDepth) ||
+            options->pipelineDepth == 0) {
+          fprintf(stderr, "Invalid pipeline depth: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case _OPT_MUX:
+        options->useMux = true;
+        break;
+      case _OPT_MUX_DAEMON:
+        options->runMuxDaemon = true;
+        break;
+      case _OPT_MUX_IDLE:
+        options->muxIdleTime = atoi(optarg);
+        if (options->muxIdleTime < 1) {
+          fprintf(stderr, "Invalid mux idle time: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case _OPT_BATCH:
+        options->batchFile = optarg;
+        break;
+      case _OPT_BATCH_RESULTS:
+        options->batchResultsFile = optarg;
+        break;
+      case _OPT_STAT_THREADS:
+        options->statThreads = atoi(optarg);
+        if (options->statThreads < 1) {
+          fprintf(stderr, "Invalid number of stat threads: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case _OPT_TAR:
+        options->useTar = true;
+        break;
+      case _OPT_TAR_THRESHOLD:
+        if (!_scpOptions_readSize(optarg, &options->tarThreshold) ||
+            options->tarThreshold == 0) {
+          fprintf(stderr, "Invalid tar threshold: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case _OPT_COMPRESS:
+        options->compress = true;
+        break;
+      case _OPT_COMPRESS_LEVEL:
+        options->compressLevel = atoi(optarg);
+        if (options->compressLevel < 1 || options->compressLevel > 19) {
+          fprintf(stderr, "Invalid compression level: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case _OPT_DELTA_HELPER:
+        options->deltaHelper = optarg;
+        break;
+      case _OPT_DELTA_RECEIVE:
+        options->deltaReceive = true;
+        break;
+      case _OPT_DELTA_SEND:
+        options->deltaSend = true;
+        break;
+      case _OPT_INCREMENTAL:
+        options->incremental = true;
+        break;
+      case _OPT_CHECKSUM:
+        options->incremental = true;
+        options->compareChecksums = true;
+        break;
+      case _OPT_RESUME:
+        options->resume = true;
+        break;
+      case _OPT_VERIFY:
+        options->verify = true;
+        break;
+      case _OPT_VERIFY_HASH:
+        options->verifyHash = true;
+        break;
+      case _OPT_CIPHERS:
+        options->ciphers = optarg;
+        break;
+      case _OPT_MACS:
+        options->macs = optarg;
+        break;
+      case _OPT_CIPHER_PROBE:
+        options->printCipherProbe = true;
+        break;
+      case _OPT_TRACE:
+        options->traceFile = optarg;
+        break;
+      case _OPT_EVENT_LOOP:
+        options->useEventLoop = true;
+        break;
+      case _OPT_CHANNELS:
+        options->channelsPerSession = atoi(optarg);
+        if (options->channelsPerSession < 1) {
+          fprintf(stderr, "Invalid number of channels: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case 'h':
+        scpOptions_printUsage(stdout);
+        exit(0);
+      default:
+        return -1;
+    }
+  }
+
+  if (!scpOptions_check(options)) return -1;
+  return optind;
+}
+
+bool scpOptions_check(const scpOptions* options)
+{
+  if (!options->verify) return true;
+
+  // These copy whole trees without hashing anything, so the check would
+  // never happen
+  const char* unverified = NULL;
+  if (options->useTar) unverified = "--tar";
+#ifdef SCP_HAVE_ZSTD
+  else if (options->compress) unverified = "--compress";
+#endif
+  else if (options->useEventLoop) unverified = "--event-loop";
+
+  if (unverified) {
+    fprintf(stderr, "Error: --verify can't check copies made with %s\n",
+            unverified);
+    return false;
+  }
+  return true;
+}
+
+void scpOptions_printUsage(FILE* stream)
+{
+  fprintf(stream, "Usage: scp [options] <from> <to>\n");
+  fprintf(stream, "   or: scp [options] --batch=FILE\n");
+  fprintf(stream, "Format of <from> or <to> is [[user@]host:]/path/to/file\n");
+  fprintf(stream, "\nOptions:\n");
+  fprintf(stream, "  -c, --chunk-size=SIZE   Read and write files on the "
+                  "disk in chunks of SIZE bytes\n"
+                  "                          (K, M and G suffixes are "
+                  "allowed. Default is 1M)\n");
+  fprintf(stream, "  -q, --queue-depth=N     Read at most N chunks ahead of "
+                  "the network (default 4)\n");
+  fprintf(stream, "  -m, --mmap              Receive downloads directly into "
+                  "a memory mapping\n"
+                  "                          of the destination file\n");
+  fprintf(stream, "  -j, --jobs=N            Copy directories over N sessions "
+                  "at once (default 1)\n");
+  fprintf(stream, "  -s, --stripes=N         Split a single large file into byte "
+                  "ranges over N\n"
+                  "                          sessions at once (default 1)\n");
+  fprintf(stream, "  -b, --backend=NAME      Transfer files with NAME, which is "
+                  "scp or sftp\n"
+                  "                          (default scp)\n");
+  fprintf(stream, "  -p, --pipeline-depth=N  Keep N sftp requests in flight "
+                  "at once (default 64)\n");
+  fprintf(stream, "      --mux               Reuse sessions that are kept open by "
+                  "the mux daemon,\n"
+                  "                          starting it if it is not running\n");
+  fprintf(stream, "      --mux-daemon        Run the mux daemon in the "
+                  "foreground\n");
+  fprintf(stream, "      --mux-idle=SECONDS  Close sessions that have been idle "
+                  "for SECONDS, and\n"
+                  "                          stop the daemon when none are left "
+                  "(default 600)\n");
+  fprintf(stream, "      --batch=FILE        Run every copy listed in FILE (- for "
+                  "stdin). Each line\n"
+                  "                          holds <from> and <to>, separated "
+                  "by a tab or spaces\n");
+  fprintf(stream, "      --batch-results=FILE\n"
+                  "                          Write the status and time of each "
+                  "batch copy to FILE\n");
+  fprintf(stream, "      --stat-threads=N    Read the metadata of large local "
+                  "directories with N\n"
+                  "                          threads, for slow filesystems "
+                  "such as NFS (default 1)\n");
+  fprintf(stream, "      --tar               Send the small files of a "
+                  "directory as one tar stream\n"
+                  "                          (needs tar on the server)\n");
+  fprintf(stream, "      --tar-threshold=SIZE\n"
+                  "                          Only files smaller than SIZE "
+                  "go through the tar stream\n"
+                  "                          (default 1M)\n");
+  fprintf(stream, "      --compress          Compress directories and "
+                  "downloads with zstd as a tar\n"
+                  "                          stream, skipping chunks that "
+                  "don't compress (needs zstd\n"
+                  "                          on the server). Without zstd, "
+                  "use ssh compression\n");
+  fprintf(stream, "      --compress-level=N  Compress with zstd level N "
+                  "(default 1)\n");
+  fprintf(stream, "      --delta-helper=PATH Send only the changed blocks "
+                  "of large files that the\n"
+                  "                          other end has an old copy of. "
+                  "PATH is this program\n"
+                  "                          on the server\n");
+  fprintf(stream, "      --incremental       Only copy the files of a "
+                  "directory that differ in size\n"
+                  "                          or are newer than the "
+                  "destination's copy, using a\n"
+                  "                          manifest of the last copy "
+                  "(needs GNU find on the server)\n");
+  fprintf(stream, "      --checksum          Like --incremental, but "
+                  "compare MD5 digests when the\n"
+                  "                          manifest doesn't tell "
+                  "(needs md5sum on the server)\n");
+  fprintf(stream, "      --resume            Copy over sftp so that "
+                  "running the same copy again\n"
+                  "                          after it fails carries on "
+                  "where it stopped\n");
+  fprintf(stream, "      --verify            Check each copied file against "
+                  "the server's copy with a\n"
+                  "                          hash taken during the copy "
+                  "(XXH64 with --delta-helper,\n"
+                  "                          otherwise MD5, which needs "
+                  "md5sum on the server).\n"
+                  "                          Can't be used with --tar, "
+                  "--compress or --event-loop\n");
+  fprintf(stream, "      --ciphers=LIST      Offer the ciphers in LIST, "
+                  "separated by commas, instead\n"
+                  "                          of the fastest ones on this "
+                  "machine first\n");
+  fprintf(stream, "      --macs=LIST         Offer the MACs in LIST instead "
+                  "of the fastest ones first\n");
+  fprintf(stream, "      --cipher-probe      Measure the ciphers and MACs "
+                  "on this machine and print\n"
+                  "                          how fast each one is\n");
+  fprintf(stream, "      --trace=FILE        Time each phase of the copy, "
+                  "write the times to FILE\n"
+                  "                          as Chrome trace events and "
+                  "print a summary\n");
+  fprintf(stream, "      --event-loop        Copy the files of a directory "
+                  "over many channels of\n"
+                  "                          each of the -j sessions, all "
+                  "run by one thread\n");
+  fprintf(stream, "      --channels=N        Open at most N channels on "
+                  "each session with\n"
+                  "                          --event-loop (default 8)\n");
+  fprintf(stream, "  -h, --help              Print this message\n");
+}
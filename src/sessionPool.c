@@ -0,0 +1,167 @@
+/**********************************************************************
+  sessionPool.c - Source code for a pool of connected ssh sessions that
+                  are kept open so they can be reused
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <connectSSH.h>
+#include <sessionPool.h>
+
+// Large enough for "user@host:port"
+#define POOL_KEY_SIZE (USER_SIZE + HOST_SIZE + 16)
+
+// A session in the pool. They are kept in a singly linked list.
+typedef struct pooledSession {
+  char key[POOL_KEY_SIZE];
+  ssh_session session;
+  bool inUse;
+  time_t lastUsed;
+  struct pooledSession* next;
+} pooledSession;
+
+struct sessionPool {
+  pthread_mutex_t lock;
+  pooledSession* head;
+  int idleTimeout;
+};
+
+static void _sessionPool_getKey(psshInfo info, char* key)
+{
+  snprintf(key, POOL_KEY_SIZE, "%s@%s:%i", info->user, info->host,
+           info->port);
+}
+
+psessionPool sessionPool_D_new(int idleTimeout)
+{
+  psessionPool pool = calloc(1, sizeof(sessionPool));
+  if (!pool) return NULL;
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pool->idleTimeout = idleTimeout;
+  return pool;
+}
+
+void sessionPool_free(psessionPool pool)
+{
+  if (!pool) return;
+
+  pooledSession* entry = pool->head;
+  while (entry) {
+    pooledSession* next = entry->next;
+    connectSSH_disconnectSession(&entry->session);
+    free(entry);
+    entry = next;
+  }
+
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
+
+ssh_session sessionPool_acquire(psessionPool pool, psshInfo info)
+{
+  char key[POOL_KEY_SIZE];
+  _sessionPool_getKey(info, key);
+
+  pthread_mutex_lock(&pool->lock);
+  pooledSession* entry;
+  for (entry = pool->head; entry; entry = entry->next) {
+    if (!entry->inUse && strcmp(entry->key, key) == 0 &&
+        ssh_is_connected(entry->session)) {
+      entry->inUse = true;
+      pthread_mutex_unlock(&pool->lock);
+      return entry->session;
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  // Connecting takes a while, so don't hold the lock for it
+  entry = calloc(1, sizeof(pooledSession));
+  if (!entry) return NULL;
+
+  entry->session = connectSSH_getConnectedSession(info);
+  if (!entry->session) {
+    free(entry);
+    return NULL;
+  }
+  snprintf(entry->key, POOL_KEY_SIZE, "%s", key);
+  entry->inUse = true;
+
+  pthread_mutex_lock(&pool->lock);
+  entry->next = pool->head;
+  pool->head = entry;
+  pthread_mutex_unlock(&pool->lock);
+
+  return entry->session;
+}
+
+void sessionPool_release(psessionPool pool, ssh_session session,
+                         bool reusable)
+{
+  pthread_mutex_lock(&pool->lock);
+  pooledSession** link = &pool->head;
+  while (*link && (*link)->session != session) link = &(*link)->next;
+
+  pooledSession* entry = *link;
+  if (entry) {
+    if (reusable && ssh_is_connected(session)) {
+      entry->inUse = false;
+      entry->lastUsed = time(NULL);
+      entry = NULL;
+    }
+    // Take it out of the list to be disconnected below
+    else *link = entry->next;
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  if (entry) {
+    connectSSH_disconnectSession(&entry->session);
+    free(entry);
+  }
+}
+
+int sessionPool_closeIdle(psessionPool pool)
+{
+  time_t now = time(NULL);
+  pooledSession* expired = NULL;
+  int remaining = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  pooledSession** link = &pool->head;
+  while (*link) {
+    pooledSession* entry = *link;
+    if (!entry->inUse && now - entry->lastUsed >= pool->idleTimeout) {
+      *link = entry->next;
+      entry->next = expired;
+      expired = entry;
+    }
+    else {
+      remaining++;
+      link = &entry->next;
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  while (expired) {
+    pooledSession* next = expired->next;
+    connectSSH_disconnectSession(&expired->session);
+    free(expired);
+    expired = next;
+  }
+
+  return remaining;
+}
@@ -0,0 +1,700 @@
+/**********************************************************************
+  sftpTransfer.c - Source code for the sftp transfer backend, which keeps
+                   many read or write requests in flight at once
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <bufferPool.h>
+#include <fileSystemUtils.h>
+#include <progress.h>
+#include <recvSink.h>
+#include <resumeJournal.h>
+#include <scpOptions.h>
+#include <sftpTransfer.h>
+#include <sftpUtils.h>
+#include <verify.h>
+
+// libssh 0.11 added sftp_aio, which can pipeline writes as well as reads.
+// Older versions can only pipeline reads.
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0, 11, 0)
+#define SFTP_HAVE_AIO
+#endif
+
+// A request that has been sent but whose reply has not been read yet
+typedef struct {
+#ifdef SFTP_HAVE_AIO
+  sftp_aio aio;
+#else
+  uint32_t id;
+#endif
+  size_t offset;
+  size_t len;
+} pendingRequest;
+
+// The state of a single file download
+typedef struct {
+  precvSink sink;
+  const char* name;
+  size_t size;
+  size_t received;
+  pverifier verifier;
+} downloadState;
+
+// The state of a whole tree upload or download
+typedef struct {
+  sftp_session sftp;
+  // The root of the destination tree
+  char destRoot[PATH_MAX];
+  // Set if the copy can be resumed (see resumeJournal.h)
+  presumeJournal journal;
+  // Set in verify mode (see verify.h)
+  pverifier verifier;
+} treeState;
+
+// Returns a pointer to the last component of a path
+static const char* _sftpTransfer_baseName(const char* path)
+{
+  const char* p = strrchr(path, '/');
+  return p ? p + 1 : path;
+}
+
+static bool _sftpTransfer_beginRead(sftp_file file, pendingRequest* r)
+{
+#ifdef SFTP_HAVE_AIO
+  return sftp_aio_begin_read(file, r->len, &r->aio) != SSH_ERROR;
+#else
+  int id = sftp_async_read_begin(file, r->len);
+  if (id < 0) return false;
+  r->id = id;
+  return true;
+#endif
+}
+
+// Returns the number of bytes read into buffer, 0 at the end of the file,
+// or a negative number on an error
+static ssize_t _sftpTransfer_waitRead(sftp_file file, pendingRequest* r,
+                                      char* buffer)
+{
+#ifdef SFTP_HAVE_AIO
+  (void)file;
+  return sftp_aio_wait_read(&r->aio, buffer, r->len);
+#else
+  return sftp_async_read(file, buffer, r->len, r->id);
+#endif
+}
+
+// Reads part of the file with plain blocking reads. This is only needed when
+// the server returns fewer bytes than were asked for. Afterwards, the file
+// position is moved to resume so that new requests carry on from there.
+static bool _sftpTransfer_readGap(sftp_file file, char* buffer,
+                                  size_t offset, size_t len, size_t resume,
+                                  sftpTransfer_dataCallback callback,
+                                  void* userData)
+{
+  if (sftp_seek64(file, offset) < 0) return false;
+
+  while (len > 0) {
+    ssize_t rc = sftp_read(file, buffer,
+                           len < SFTP_REQUEST_SIZE ? len : SFTP_REQUEST_SIZE);
+    if (rc <= 0) return false;
+    if (!callback(buffer, rc, offset, userData)) return false;
+    offset += rc;
+    len -= rc;
+  }
+
+  return sftp_seek64(file, resume) == 0;
+}
+
+bool sftpTransfer_readRange(sftp_file file, size_t offset, size_t length,
+                            sftpTransfer_dataCallback callback,
+                            void* userData)
+{
+  size_t depth = scpOptions_get()->pipelineDepth;
+  pendingRequest* ring = calloc(depth, sizeof(pendingRequest));
+  char* buffer = bufferPool_D_get(SFTP_REQUEST_SIZE);
+  if (!ring || !buffer) {
+    fprintf(stderr, "Error allocating sftp pipeline in %s\n", __FUNCTION__);
+    free(ring);
+    bufferPool_put(buffer, SFTP_REQUEST_SIZE);
+    return false;
+  }
+
+  bool success = sftp_seek64(file, offset) == 0;
+  size_t issued = 0;
+  size_t done = 0;
+  size_t head = 0;
+  size_t inFlight = 0;
+
+  while (success && done < length) {
+    // Keep the pipeline full
+    while (inFlight < depth && issued < length) {
+      pendingRequest* r = &ring[(head + inFlight) % depth];
+      r->offset = offset + issued;
+      r->len = length - issued;
+      if (r->len > SFTP_REQUEST_SIZE) r->len = SFTP_REQUEST_SIZE;
+      if (!_sftpTransfer_beginRead(file, r)) {
+        success = false;
+        break;
+      }
+      issued += r->len;
+      inFlight++;
+    }
+    if (!success) break;
+
+    // Replies are read in the order the requests were sent, so the data
+    // reaches the callback in order
+    pendingRequest* r = &ring[head];
+    head = (head + 1) % depth;
+    inFlight--;
+
+    ssize_t rc = _sftpTransfer_waitRead(file, r, buffer);
+    if (rc <= 0) {
+      fprintf(stderr, "Error reading remote file at offset %zu\n", r->offset);
+      success = false;
+      break;
+    }
+
+    if (!callback(buffer, rc, r->offset, userData)) {
+      success = false;
+      break;
+    }
+    done += rc;
+
+    // A short read leaves a gap before the next request's data
+    if ((size_t)rc < r->len) {
+      if (!_sftpTransfer_readGap(file, buffer, r->offset + rc, r->len - rc,
+                                 offset + issued, callback, userData)) {
+        fprintf(stderr, "Error reading remote file at offset %zu\n",
+                r->offset + rc);
+        success = false;
+        break;
+      }
+      done += r->len - rc;
+    }
+  }
+
+  // Collect the replies to anything still in flight so that they don't
+  // confuse whatever uses the session next
+  while (inFlight > 0) {
+    _sftpTransfer_waitRead(file, &ring[head], buffer);
+    head = (head + 1) % depth;
+    inFlight--;
+  }
+
+  free(ring);
+  bufferPool_put(buffer, SFTP_REQUEST_SIZE);
+  return success;
+}
+
+bool sftpTransfer_writeRange(sftp_file file, int fd, size_t offset,
+                             size_t length, pverifier verifier)
+{
+  size_t chunkSize = scpOptions_get()->chunkSize;
+  // Each chunk read from the disk is sent as a whole number of requests
+  if (chunkSize < SFTP_REQUEST_SIZE) chunkSize = SFTP_REQUEST_SIZE;
+
+  char* buffer = bufferPool_D_get(chunkSize);
+#ifdef SFTP_HAVE_AIO
+  size_t depth = scpOptions_get()->pipelineDepth;
+  pendingRequest* ring = calloc(depth, sizeof(pendingRequest));
+  size_t head = 0;
+  size_t inFlight = 0;
+  if (!ring) {
+    bufferPool_put(buffer, chunkSize);
+    buffer = NULL;
+  }
+#endif
+  if (!buffer) {
+    fprintf(stderr, "Error allocating sftp pipeline in %s\n", __FUNCTION__);
+    return false;
+  }
+
+  bool success = sftp_seek64(file, offset) == 0;
+  size_t done = 0;
+
+  while (success && done < length) {
+    size_t want = length - done;
+    if (want > chunkSize) want = chunkSize;
+
+    ssize_t rc = pread(fd, buffer, want, offset + done);
+    if (rc < 0 && errno == EINTR) continue;
+    if (rc <= 0) {
+      fprintf(stderr, "Error reading local file at offset %zu\n",
+              offset + done);
+      success = false;
+      break;
+    }
+    verify_update(verifier, buffer, rc);
+
+    progress_update(rc);
+    if (scpOptions_isCanceled()) {
+      success = false;
+      break;
+    }
+
+    size_t sent = 0;
+    while (success && sent < (size_t)rc) {
+      size_t len = rc - sent;
+      if (len > SFTP_REQUEST_SIZE) len = SFTP_REQUEST_SIZE;
+#ifdef SFTP_HAVE_AIO
+      // Wait for the oldest write only when the pipeline is full. The data
+      // is copied when a request is sent, so the buffer may be reused.
+      if (inFlight == depth) {
+        pendingRequest* r = &ring[head];
+        head = (head + 1) % depth;
+        inFlight--;
+        if (sftp_aio_wait_write(&r->aio) != (ssize_t)r->len) {
+          success = false;
+          break;
+        }
+      }
+      pendingRequest* r = &ring[(head + inFlight) % depth];
+      r->offset = offset + done + sent;
+      r->len = len;
+      if (sftp_aio_begin_write(file, buffer + sent, len, &r->aio) < 0) {
+        success = false;
+        break;
+      }
+      inFlight++;
+      sent += len;
+#else
+      ssize_t wc = sftp_write(file, buffer + sent, len);
+      if (wc <= 0) {
+        success = false;
+        break;
+      }
+      sent += wc;
+#endif
+    }
+    done += rc;
+  }
+
+#ifdef SFTP_HAVE_AIO
+  while (inFlight > 0) {
+    if (sftp_aio_wait_write(&ring[head].aio) != (ssize_t)ring[head].len)
+      success = false;
+    head = (head + 1) % depth;
+    inFlight--;
+  }
+  free(ring);
+#endif
+
+  if (!success)
+    fprintf(stderr, "Error writing remote file at offset %zu\n",
+            offset + done);
+
+  bufferPool_put(buffer, chunkSize);
+  return success;
+}
+
+// Hands received data to the sink of a single file download
+static bool _sftpTransfer_receive(const char* data, size_t len,
+                                  size_t offset, void* userData)
+{
+  (void)offset;
+  downloadState* state = userData;
+  verify_update(state->verifier, data, len);
+
+  while (len > 0) {
+    size_t available;
+    char* buffer = recvSink_getBuffer(state->sink, &available);
+    // The file is bigger than it was when we looked at its size
+    if (available == 0) return false;
+    if (available > len) available = len;
+
+    memcpy(buffer, data, available);
+    if (!recvSink_commit(state->sink, available)) return false;
+
+    data += available;
+    len -= available;
+    state->received += available;
+    progress_update(available);
+  }
+
+  return !scpOptions_isCanceled();
+}
+
+// Writes the first size bytes of a remote file into a sink, syncing the sink
+// and recording the progress in the journal at every checkpoint
+static bool _sftpTransfer_readToSink(sftp_file file, downloadState* state,
+                                     presumeJournal journal,
+                                     const fileMeta* meta)
+{
+  size_t offset = state->received;
+  while (offset < state->size) {
+    size_t len = state->size - offset;
+    if (journal && len > RESUME_CHECKPOINT_SIZE) len = RESUME_CHECKPOINT_SIZE;
+
+    if (!sftpTransfer_readRange(file, offset, len, _sftpTransfer_receive,
+                                state))
+      return false;
+    offset += len;
+
+    if (journal && offset < state->size &&
+        (!recvSink_sync(state->sink) ||
+         !resumeJournal_recordOffset(journal, state->name, meta, offset)))
+      return false;
+  }
+  return true;
+}
+
+// Adds the first len bytes of a local file to the verifier's current file
+static bool _sftpTransfer_verifyPrefix(pverifier verifier, const char* path,
+                                       size_t len)
+{
+  int fd = open(path, O_RDONLY);
+  bool success = fd >= 0 && verify_updateFromFile(verifier, fd, len);
+  if (fd >= 0) close(fd);
+  if (!success) fprintf(stderr, "Error reading %s to verify it\n", path);
+  return success;
+}
+
+// Hashes the whole of a local file for a file that an earlier run copied
+static bool _sftpTransfer_verifyLocal(pverifier verifier,
+                                      const char* localPath,
+                                      const char* remotePath, size_t size)
+{
+  if (!verifier) return true;
+
+  verify_beginFile(verifier, localPath, remotePath);
+  if (!_sftpTransfer_verifyPrefix(verifier, localPath, size)) return false;
+  verify_endFile(verifier);
+  return true;
+}
+
+static bool _sftpTransfer_downloadFile(sftp_session sftp,
+                                       presumeJournal journal,
+                                       pverifier verifier,
+                                       const char* from, const char* to,
+                                       const fileMeta* meta)
+{
+  pscpOptions options = scpOptions_get();
+  size_t offset = 0;
+  char partPath[PATH_MAX + sizeof(RESUME_PART_SUFFIX)];
+  const char* path = to;
+
+  // A resumable copy writes to a part file, and the destination only
+  // appears once it is complete
+  if (journal) {
+    bool isDone;
+    offset = resumeJournal_getOffset(journal, to, meta, &isDone);
+    fileMeta destMeta;
+    if (isDone && fileSystemUtils_getMeta(AT_FDCWD, to, &destMeta) &&
+        destMeta.type == FILE_IS_REG && destMeta.size == meta->size) {
+      printf("Skipping %s, which was already copied\n", to);
+      return _sftpTransfer_verifyLocal(verifier, to, from, meta->size);
+    }
+
+    snprintf(partPath, sizeof(partPath), "%s%s", to, RESUME_PART_SUFFIX);
+    path = partPath;
+    if (isDone || (offset > 0 &&
+                   (!fileSystemUtils_getMeta(AT_FDCWD, partPath, &destMeta) ||
+                    destMeta.type != FILE_IS_REG ||
+                    destMeta.size < offset)))
+      offset = 0;
+  }
+
+  // What an earlier run wrote is hashed from the part file
+  verify_beginFile(verifier, to, from);
+  progress_beginFile(to, meta->size - offset);
+  if (offset > 0 &&
+      !_sftpTransfer_verifyPrefix(verifier, partPath, offset))
+    return false;
+
+  sftp_file file = sftp_open(sftp, from, O_RDONLY, 0);
+  if (!file) {
+    fprintf(stderr, "Error opening remote file %s for reading\n", from);
+    return false;
+  }
+
+  downloadState state;
+  state.sink = recvSink_D_openAt(path, meta->size, offset, options->useMmap,
+                                 options->chunkSize);
+  state.name = to;
+  state.size = meta->size;
+  state.received = offset;
+  state.verifier = verifier;
+  if (!state.sink) {
+    fprintf(stderr, "Error opening %s for writing\n", path);
+    sftp_close(file);
+    return false;
+  }
+
+  bool success = _sftpTransfer_readToSink(file, &state, journal, meta);
+
+  if (!recvSink_close(state.sink)) success = false;
+  sftp_close(file);
+
+  if (success && journal) {
+    if (rename(partPath, to) != 0) {
+      fprintf(stderr, "Error renaming %s to %s: %s\n", partPath, to,
+              strerror(errno));
+      return false;
+    }
+    resumeJournal_recordDone(journal, to, meta);
+  }
+  if (success) verify_endFile(verifier);
+  progress_endFile();
+  return success;
+}
+
+// Renames a remote file over another one. Servers that speak version 3 of
+// the protocol refuse to replace a file that exists, so it is removed first.
+static bool _sftpTransfer_rename(sftp_session sftp, const char* from,
+                                 const char* to)
+{
+  if (sftp_rename(sftp, from, to) == SSH_OK) return true;
+  if (sftp_unlink(sftp, to) == SSH_OK && sftp_rename(sftp, from, to) == SSH_OK)
+    return true;
+
+  fprintf(stderr, "Error renaming remote file %s to %s\n", from, to);
+  return false;
+}
+
+static bool _sftpTransfer_uploadFile(sftp_session sftp, presumeJournal journal,
+                                     pverifier verifier, const char* from,
+                                     const fileMeta* meta, const char* to)
+{
+  size_t size = meta->size;
+  size_t offset = 0;
+  char partPath[PATH_MAX + sizeof(RESUME_PART_SUFFIX)];
+  const char* path = to;
+
+  if (journal) {
+    bool isDone;
+    offset = resumeJournal_getOffset(journal, to, meta, &isDone);
+    fileMeta destMeta;
+    if (isDone && sftpUtils_getMeta(sftp, to, &destMeta) &&
+        destMeta.type == FILE_IS_REG && destMeta.size == size) {
+      printf("Skipping %s, which was already copied\n", from);
+      return _sftpTransfer_verifyLocal(verifier, from, to, size);
+    }
+
+    snprintf(partPath, sizeof(partPath), "%s%s", to, RESUME_PART_SUFFIX);
+    path = partPath;
+    if (isDone || (offset > 0 &&
+                   (!sftpUtils_getMeta(sftp, partPath, &destMeta) ||
+                    destMeta.type != FILE_IS_REG ||
+                    destMeta.size < offset || destMeta.size > size)))
+      offset = 0;
+  }
+
+  int fd = open(from, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Error while opening %s for reading\n", from);
+    return false;
+  }
+
+  // Use the same permissions for the server as for local. What is already
+  // in a part file is kept.
+  int flags = O_WRONLY | O_CREAT;
+  if (offset == 0) flags |= O_TRUNC;
+  sftp_file file = sftp_open(sftp, path, flags, meta->permissions);
+  if (!file) {
+    fprintf(stderr, "Can't open remote file: %s\n", path);
+    close(fd);
+    return false;
+  }
+
+  posix_fadvise(fd, offset, 0, POSIX_FADV_SEQUENTIAL);
+  verify_beginFile(verifier, from, to);
+  progress_beginFile(from, size - offset);
+  bool success = verify_updateFromFile(verifier, fd, offset);
+  while (success && offset < size) {
+    size_t len = size - offset;
+    if (journal && len > RESUME_CHECKPOINT_SIZE) len = RESUME_CHECKPOINT_SIZE;
+
+    // Every write up to here has been acknowledged by the server
+    success = sftpTransfer_writeRange(file, fd, offset, len, verifier);
+    offset += len;
+    if (success && journal && offset < size)
+      success = resumeJournal_recordOffset(journal, to, meta, offset);
+  }
+
+  if (sftp_close(file) != SSH_OK) success = false;
+  close(fd);
+
+  if (success && journal) {
+    success = _sftpTransfer_rename(sftp, partPath, to);
+    if (success) resumeJournal_recordDone(journal, to, meta);
+  }
+  if (success) verify_endFile(verifier);
+  progress_endFile();
+  return success;
+}
+
+// Called for every remote file and directory in a recursive download
+static bool _sftpTransfer_downloadEntry(const char* path, const char* relPath,
+                                        const fileMeta* meta, void* userData)
+{
+  treeState* state = userData;
+  char dest[PATH_MAX];
+
+  if (snprintf(dest, PATH_MAX, "%s%s%s", state->destRoot,
+               relPath[0] ? "/" : "", relPath) >= PATH_MAX) {
+    fprintf(stderr, "Error: path too long for %s\n", relPath);
+    return false;
+  }
+
+  if (meta->type == FILE_IS_DIR) {
+    if (!fileSystemUtils_mkdirIfNeeded(dest)) {
+      fprintf(stderr, "fileSystemUtils_mkdirIfNeeded() failed.\n");
+      return false;
+    }
+    return true;
+  }
+  else if (meta->type == FILE_IS_REG) {
+    return _sftpTransfer_downloadFile(state->sftp, state->journal,
+                                      state->verifier, path, dest, meta);
+  }
+
+  fprintf(stderr, "Warning: %s is not a regular file or directory\n", path);
+  return true;
+}
+
+// Called for every local file and directory in a recursive upload
+static bool _sftpTransfer_uploadEntry(const char* path, const char* relPath,
+                                      const fileMeta* meta, void* userData)
+{
+  treeState* state = userData;
+  char dest[PATH_MAX];
+
+  if (snprintf(dest, PATH_MAX, "%s%s%s", state->destRoot,
+               relPath[0] ? "/" : "", relPath) >= PATH_MAX) {
+    fprintf(stderr, "Error: path too long for %s\n", relPath);
+    return false;
+  }
+
+  if (meta->type == FILE_IS_DIR)
+    return sftpUtils_mkdirIfNeeded(state->sftp, dest, meta->permissions);
+  else if (meta->type == FILE_IS_REG)
+    return _sftpTransfer_uploadFile(state->sftp, state->journal,
+                                    state->verifier, path, meta, dest);
+
+  fprintf(stderr, "Warning: %s is not a regular file or directory\n", path);
+  return true;
+}
+
+int sftpTransfer_copyFromServer(ssh_session session, char* from,
+                                char* to, bool isRecursive)
+{
+  return sftpTransfer_resumeFromServer(session, NULL, from, to, isRecursive);
+}
+
+int sftpTransfer_resumeFromServer(ssh_session session, presumeJournal journal,
+                                  char* from, char* to, bool isRecursive)
+{
+  // If from ends in '/', the base name would be empty
+  size_t len = strlen(from);
+  if (len > 1 && from[len - 1] == '/') from[len - 1] = '\0';
+
+  treeState state;
+  state.journal = journal;
+  state.sftp = sftpUtils_D_openSession(session);
+  if (!state.sftp) return SSH_ERROR;
+  state.verifier = verify_D_start(session);
+
+  fileMeta meta;
+  sftpUtils_getMeta(state.sftp, from, &meta);
+  bool success = false;
+
+  if (meta.type == FILE_IS_DIR) {
+    if (!isRecursive) fprintf(stderr, "%s is a directory!\n", from);
+    else {
+      snprintf(state.destRoot, PATH_MAX, "%s/%s", to,
+               _sftpTransfer_baseName(from));
+      success = sftpUtils_walkTree(state.sftp, from,
+                                   _sftpTransfer_downloadEntry, &state);
+    }
+  }
+  else if (meta.type == FILE_IS_REG) {
+    // If the destination is a dir, copy the file into it
+    char dest[PATH_MAX];
+    if (fileSystemUtils_getFileType(to) == FILE_IS_DIR)
+      snprintf(dest, PATH_MAX, "%s/%s", to, _sftpTransfer_baseName(from));
+    else
+      snprintf(dest, PATH_MAX, "%s", to);
+    success = _sftpTransfer_downloadFile(state.sftp, journal,
+                                         state.verifier, from, dest, &meta);
+  }
+  else {
+    fprintf(stderr, "Error: %s is not a regular file or directory\n", from);
+  }
+
+  sftp_free(state.sftp);
+  if (!verify_finish(state.verifier, success)) success = false;
+  return success ? SSH_OK : SSH_ERROR;
+}
+
+int sftpTransfer_copyToServer(ssh_session session, char* from,
+                              char* to, bool isRecursive)
+{
+  return sftpTransfer_resumeToServer(session, NULL, from, to, isRecursive);
+}
+
+int sftpTransfer_resumeToServer(ssh_session session, presumeJournal journal,
+                                char* from, char* to, bool isRecursive)
+{
+  // If from ends in '/', the base name would be empty
+  size_t len = strlen(from);
+  if (len > 1 && from[len - 1] == '/') from[len - 1] = '\0';
+
+  fileMeta meta;
+  fileSystemUtils_getMeta(AT_FDCWD, from, &meta);
+  if (meta.type == FILE_IS_DIR && !isRecursive) {
+    fprintf(stderr, "%s is a directory!\n", from);
+    return SSH_ERROR;
+  }
+  if (meta.type != FILE_IS_DIR && meta.type != FILE_IS_REG) {
+    fprintf(stderr, "Error: %s is not a regular file or directory\n", from);
+    return SSH_ERROR;
+  }
+
+  treeState state;
+  state.journal = journal;
+  state.sftp = sftpUtils_D_openSession(session);
+  if (!state.sftp) return SSH_ERROR;
+  state.verifier = verify_D_start(session);
+
+  // Like scp, copy into the destination if it is a directory that exists,
+  // and otherwise create the destination as the copy of from. A resumed
+  // copy has already created it, so it uses what the last run decided.
+  if (journal && resumeJournal_getRoot(journal))
+    snprintf(state.destRoot, PATH_MAX, "%s", resumeJournal_getRoot(journal));
+  else if (sftpUtils_getFileType(state.sftp, to, NULL) == FILE_IS_DIR)
+    snprintf(state.destRoot, PATH_MAX, "%s/%s", to,
+             _sftpTransfer_baseName(from));
+  else
+    snprintf(state.destRoot, PATH_MAX, "%s", to);
+  if (journal && !resumeJournal_getRoot(journal))
+    resumeJournal_recordRoot(journal, state.destRoot);
+
+  bool success;
+  if (meta.type == FILE_IS_DIR)
+    success = fileSystemUtils_walkTree(from, _sftpTransfer_uploadEntry,
+                                       &state);
+  else
+    success = _sftpTransfer_uploadFile(state.sftp, journal, state.verifier,
+                                       from, &meta, state.destRoot);
+
+  sftp_free(state.sftp);
+  if (!verify_finish(state.verifier, success)) success = false;
+  return success ? SSH_OK : SSH_ERROR;
+}
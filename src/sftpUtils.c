@@ -0,0 +1,196 @@
+/**********************************************************************
+  sftpUtils.c - Source code for some sftp utility functions that are used
+                to inspect and prepare the remote file system
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#include <linux/limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <sftpUtils.h>
+
+sftp_session sftpUtils_D_openSession(ssh_session session)
+{
+  sftp_session sftp = sftp_new(session);
+  if (!sftp) {
+    fprintf(stderr, "Error allocating sftp session: %s\n",
+            ssh_get_error(session));
+    return NULL;
+  }
+
+  if (sftp_init(sftp) != SSH_OK) {
+    fprintf(stderr, "Error initializing sftp session: %i\n",
+            sftp_get_error(sftp));
+    sftp_free(sftp);
+    return NULL;
+  }
+
+  return sftp;
+}
+
+// Converts the type in a set of sftp attributes to an identify_file_type_e
+static int _sftpUtils_getType(sftp_attributes attr)
+{
+  switch (attr->type) {
+    case SSH_FILEXFER_TYPE_REGULAR:
+      return FILE_IS_REG;
+    case SSH_FILEXFER_TYPE_DIRECTORY:
+      return FILE_IS_DIR;
+    default:
+      return UNKNOWN_FILE_TYPE;
+  }
+}
+
+// Fills in a fileMeta from a set of sftp attributes
+static void _sftpUtils_fillMeta(sftp_attributes attr, pfileMeta meta)
+{
+  meta->type = _sftpUtils_getType(attr);
+  meta->size = attr->size;
+  meta->permissions = attr->permissions & 0777;
+  meta->mtime = attr->mtime;
+}
+
+int sftpUtils_getFileType(sftp_session sftp, const char* path, size_t* size)
+{
+  sftp_attributes attr = sftp_stat(sftp, path);
+  if (!attr) {
+    if (sftp_get_error(sftp) == SSH_FX_NO_SUCH_FILE) return DOES_NOT_EXIST;
+    return READ_ERROR;
+  }
+
+  int type = _sftpUtils_getType(attr);
+  if (size) *size = attr->size;
+  sftp_attributes_free(attr);
+  return type;
+}
+
+bool sftpUtils_getMeta(sftp_session sftp, const char* path, pfileMeta meta)
+{
+  sftp_attributes attr = sftp_stat(sftp, path);
+  if (!attr) {
+    meta->type = sftp_get_error(sftp) == SSH_FX_NO_SUCH_FILE ?
+                 DOES_NOT_EXIST : READ_ERROR;
+    return false;
+  }
+
+  _sftpUtils_fillMeta(attr, meta);
+  sftp_attributes_free(attr);
+  return true;
+}
+
+bool sftpUtils_mkdirIfNeeded(sftp_session sftp, const char* path,
+                             int permissions)
+{
+  if (sftp_mkdir(sftp, path, permissions) == SSH_OK) return true;
+
+  // Most servers do not tell us why mkdir failed, so check whether the
+  // directory is already there
+  if (sftpUtils_getFileType(sftp, path, NULL) == FILE_IS_DIR) return true;
+
+  fprintf(stderr, "Error creating remote directory %s\n", path);
+  return false;
+}
+
+// Walks the remote directory at path (whose path relative to the root is
+// relPath). Both are PATH_MAX buffers that are appended to and restored.
+static bool _sftpUtils_walkDir(sftp_session sftp, char* path, char* relPath,
+                               fileSystemUtils_walkCallback callback,
+                               void* userData)
+{
+  sftp_dir dir = sftp_opendir(sftp, path);
+  if (!dir) {
+    fprintf(stderr, "Error opening remote directory %s for reading\n", path);
+    return false;
+  }
+
+  size_t pathLen = strlen(path);
+  size_t relPathLen = strlen(relPath);
+  bool success = true;
+  sftp_attributes attr;
+
+  while (success && (attr = sftp_readdir(sftp, dir)) != NULL) {
+    // Skip . and ..
+    if (strcmp(attr->name, ".") == 0 || strcmp(attr->name, "..") == 0) {
+      sftp_attributes_free(attr);
+      continue;
+    }
+
+    int pathRc = snprintf(path + pathLen, PATH_MAX - pathLen, "/%s",
+                          attr->name);
+    int relPathRc = snprintf(relPath + relPathLen, PATH_MAX - relPathLen,
+                             "%s%s", relPathLen ? "/" : "", attr->name);
+    if (pathRc < 0 || (size_t)pathRc >= PATH_MAX - pathLen ||
+        relPathRc < 0 || (size_t)relPathRc >= PATH_MAX - relPathLen) {
+      fprintf(stderr, "Error: path too long in %s/%s\n", path, attr->name);
+      sftp_attributes_free(attr);
+      success = false;
+      break;
+    }
+
+    // readdir does not follow links, but scp does
+    if (attr->type == SSH_FILEXFER_TYPE_SYMLINK) {
+      sftp_attributes target = sftp_stat(sftp, path);
+      if (target) {
+        sftp_attributes_free(attr);
+        attr = target;
+      }
+    }
+
+    fileMeta meta;
+    _sftpUtils_fillMeta(attr, &meta);
+    if (!callback(path, relPath, &meta, userData)) success = false;
+    else if (meta.type == FILE_IS_DIR)
+      success = _sftpUtils_walkDir(sftp, path, relPath, callback, userData);
+
+    sftp_attributes_free(attr);
+    path[pathLen] = '\0';
+    relPath[relPathLen] = '\0';
+  }
+
+  if (success && !sftp_dir_eof(dir)) {
+    fprintf(stderr, "Error reading remote directory %s\n", path);
+    success = false;
+  }
+
+  sftp_closedir(dir);
+  return success;
+}
+
+bool sftpUtils_walkTree(sftp_session sftp, const char* root,
+                        fileSystemUtils_walkCallback callback,
+                        void* userData)
+{
+  char path[PATH_MAX];
+  char relPath[PATH_MAX] = "";
+  snprintf(path, PATH_MAX, "%s", root);
+
+  // Remove a trailing '/' so that paths don't end up with "//" in them
+  size_t len = strlen(path);
+  if (len > 1 && path[len - 1] == '/') path[len - 1] = '\0';
+
+  sftp_attributes attr = sftp_stat(sftp, path);
+  if (!attr) {
+    fprintf(stderr, "Error reading remote file %s in %s\n", path,
+            __FUNCTION__);
+    return false;
+  }
+
+  fileMeta meta;
+  _sftpUtils_fillMeta(attr, &meta);
+  sftp_attributes_free(attr);
+
+  if (!callback(path, relPath, &meta, userData)) return false;
+  if (meta.type != FILE_IS_DIR) return true;
+
+  return _sftpUtils_walkDir(sftp, path, relPath, callback, userData);
+}
@@ -29,6 +29,10 @@ bool sshUtils_fileIsLocal(const char* path)
 // info->host will be NULL if no host was found...
 bool sshUtils_setSSHInfo(char* input, psshInfo info)
 {
+  // Start with everything empty. In particular, the password is only set
+  // once it has been prompted for.
+  memset(info, 0, sizeof(sshInfo));
+
   // First, check to see if it is local
   if(sshUtils_fileIsLocal(input)) {
     snprintf(info->filePath, FILE_PATH_SIZE, "%s", input);
@@ -0,0 +1,328 @@
+/**********************************************************************
+  stripe.c - Source code for the functions that copy a single large file
+             as byte ranges over several ssh sessions at once
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+// Needed for fallocate()
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <connectSSH.h>
+#include <fileSystemUtils.h>
+#include <progress.h>
+#include <scpOptions.h>
+#include <sftpTransfer.h>
+#include <sftpUtils.h>
+#include <stripe.h>
+#include <verify.h>
+#include <workQueue.h>
+
+// Each stripe is split into this many ranges so that a fast session can
+// steal ranges from a slow one
+#define RANGES_PER_STRIPE 4
+
+// A range of bytes in the file
+typedef struct {
+  size_t offset;
+  size_t length;
+} byteRange;
+
+// The state of one stripe's thread
+typedef struct {
+  int id;
+  bool isDownload;
+  pworkQueue queue;
+  sshInfo info;
+  // The first stripe uses the session that was passed in. The others
+  // open their own.
+  ssh_session session;
+  const char* remotePath;
+  // The local file. pread() and pwrite() may be used on it from every
+  // thread at once.
+  int fd;
+  pthread_t thread;
+  bool success;
+  // Every stripe adds to the progress of the same file
+  pprogressFile progress;
+} stripeWorker;
+
+bool stripe_isWorthwhile(size_t size, int numStripes)
+{
+  return numStripes > 1 && size >= (size_t)numStripes * STRIPE_MIN_RANGE_SIZE;
+}
+
+// Returns a pointer to the last component of a path
+static const char* _stripe_baseName(const char* path)
+{
+  const char* p = strrchr(path, '/');
+  return p ? p + 1 : path;
+}
+
+// Writes data that was read from the remote file to the same offset in the
+// local file
+static bool _stripe_writeLocal(const char* data, size_t len, size_t offset,
+                               void* userData)
+{
+  stripeWorker* w = userData;
+
+  size_t written = 0;
+  while (written < len) {
+    ssize_t rc = pwrite(w->fd, data + written, len - written,
+                        offset + written);
+    if (rc < 0 && errno == EINTR) continue;
+    if (rc < 0) {
+      fprintf(stderr, "Error writing local file: %s\n", strerror(errno));
+      return false;
+    }
+    written += rc;
+  }
+
+  progress_update(len);
+  return true;
+}
+
+static void* _stripe_runWorker(void* arg)
+{
+  stripeWorker* w = arg;
+  progress_shareFile(w->progress);
+
+  if (!w->session) {
+    w->session = connectSSH_getConnectedSession(&w->info);
+    // The other stripes will steal this stripe's ranges
+    if (!w->session) {
+      fprintf(stderr, "Warning: stripe %i could not connect: continuing "
+                      "with fewer stripes\n", w->id);
+      return NULL;
+    }
+  }
+
+  sftp_session sftp = sftpUtils_D_openSession(w->session);
+  sftp_file file = NULL;
+
+  if (sftp) {
+    file = sftp_open(sftp, w->remotePath,
+                     w->isDownload ? O_RDONLY : O_WRONLY, 0);
+    if (!file)
+      fprintf(stderr, "Error opening remote file %s: %s\n", w->remotePath,
+              ssh_get_error(w->session));
+  }
+
+  // If this stripe can't do anything, leave its ranges to the others.
+  // Each range is pipelined the same way as the sftp backend.
+  if (file) {
+    byteRange* range;
+    while ((range = workQueue_pop(w->queue, w->id)) != NULL) {
+      bool ok = w->isDownload ?
+                sftpTransfer_readRange(file, range->offset, range->length,
+                                       _stripe_writeLocal, w) :
+                sftpTransfer_writeRange(file, w->fd, range->offset,
+                                        range->length, NULL);
+      if (!ok) {
+        w->success = false;
+        workQueue_cancel(w->queue);
+      }
+    }
+  }
+
+  if (file) sftp_close(file);
+  if (sftp) sftp_free(sftp);
+  if (w->id != 0) connectSSH_disconnectSession(&w->session);
+  return NULL;
+}
+
+// Splits the file into ranges and copies them over numStripes sessions
+static int _stripe_run(ssh_session session, psshInfo info,
+                       const char* remotePath, int fd, size_t size,
+                       int numStripes, bool isDownload)
+{
+  pprogressFile progress = progress_beginFile(remotePath, size);
+  size_t chunkSize = scpOptions_get()->chunkSize;
+
+  // Ranges are a whole number of chunks so that every read is full-sized
+  size_t numRanges = (size_t)numStripes * RANGES_PER_STRIPE;
+  size_t rangeSize = (size + numRanges - 1) / numRanges;
+  rangeSize = (rangeSize + chunkSize - 1) / chunkSize * chunkSize;
+  numRanges = (size + rangeSize - 1) / rangeSize;
+
+  byteRange* ranges = calloc(numRanges, sizeof(byteRange));
+  void** jobs = calloc(numRanges, sizeof(void*));
+  stripeWorker* workers = calloc(numStripes, sizeof(stripeWorker));
+  pworkQueue queue = workQueue_D_new(numStripes);
+  if (!ranges || !jobs || !workers || !queue) {
+    fprintf(stderr, "Error allocating stripes in %s\n", __FUNCTION__);
+    free(ranges);
+    free(jobs);
+    free(workers);
+    workQueue_free(queue);
+    return SSH_ERROR;
+  }
+
+  size_t i;
+  for (i = 0; i < numRanges; i++) {
+    ranges[i].offset = i * rangeSize;
+    ranges[i].length = size - ranges[i].offset < rangeSize ?
+                       size - ranges[i].offset : rangeSize;
+    jobs[i] = &ranges[i];
+  }
+  // Each stripe starts with a contiguous part of the file
+  workQueue_pushAll(queue, jobs, numRanges);
+  free(jobs);
+
+  int j;
+  int started = 0;
+  for (j = 0; j < numStripes; j++) {
+    workers[j].id = j;
+    workers[j].isDownload = isDownload;
+    workers[j].queue = queue;
+    workers[j].info = *info;
+    workers[j].session = j == 0 ? session : NULL;
+    workers[j].remotePath = remotePath;
+    workers[j].fd = fd;
+    workers[j].success = true;
+    workers[j].progress = progress;
+    if (scpOptions_startThread(&workers[j].thread, _stripe_runWorker,
+                               &workers[j]) != 0) {
+      fprintf(stderr, "Warning: could not start stripe %i\n", j);
+      break;
+    }
+    started++;
+  }
+
+  bool success = started > 0;
+  for (j = 0; j < started; j++) {
+    pthread_join(workers[j].thread, NULL);
+    if (!workers[j].success) success = false;
+  }
+
+  // If no stripe could open the file, the ranges are still there
+  if (success && workQueue_pop(queue, 0) != NULL) {
+    fprintf(stderr, "Error: not every range of %s was copied\n", remotePath);
+    success = false;
+  }
+
+  progress_endFile();
+  workQueue_free(queue);
+  free(workers);
+  free(ranges);
+  return success ? SSH_OK : SSH_ERROR;
+}
+
+int stripe_copyFromServer(ssh_session session, psshInfo info,
+                          const char* from, size_t size, const char* to,
+                          int numStripes)
+{
+  char dest[PATH_MAX];
+  if (fileSystemUtils_getFileType(to) == FILE_IS_DIR)
+    snprintf(dest, PATH_MAX, "%s/%s", to, _stripe_baseName(from));
+  else
+    snprintf(dest, PATH_MAX, "%s", to);
+
+  // The ranges are written into a file next to dest, which only replaces
+  // it once every stripe has succeeded. Otherwise a failed copy would leave
+  // a file of the full size with holes where the missing ranges are.
+  char tempPath[PATH_MAX];
+  if (snprintf(tempPath, PATH_MAX, "%s.stripe.%d", dest, (int)getpid())
+        >= PATH_MAX) {
+    fprintf(stderr, "Error: path too long for %s\n", dest);
+    return SSH_ERROR;
+  }
+
+  int fd = open(tempPath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    fprintf(stderr, "Error opening %s for writing: %s\n", tempPath,
+            strerror(errno));
+    return SSH_ERROR;
+  }
+
+  // The ranges are written in place, so the file needs its full size first
+  int rc = SSH_OK;
+  if (fallocate(fd, 0, 0, size) != 0 && ftruncate(fd, size) != 0) {
+    fprintf(stderr, "Error allocating %zu bytes for %s: %s\n", size, dest,
+            strerror(errno));
+    rc = SSH_ERROR;
+  }
+
+  if (rc == SSH_OK)
+    rc = _stripe_run(session, info, from, fd, size, numStripes, true);
+
+  if (close(fd) != 0) rc = SSH_ERROR;
+
+  if (rc == SSH_OK && rename(tempPath, dest) != 0) {
+    fprintf(stderr, "Error renaming %s to %s: %s\n", tempPath, dest,
+            strerror(errno));
+    rc = SSH_ERROR;
+  }
+  if (rc != SSH_OK) unlink(tempPath);
+
+  // The stripes aren't hashed as they go, so the whole file is checked after
+  if (rc == SSH_OK && !verify_checkFile(session, dest, from)) rc = SSH_ERROR;
+  return rc;
+}
+
+int stripe_copyToServer(ssh_session session, psshInfo info,
+                        const char* from, const char* to, int numStripes)
+{
+  int fd = open(from, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Error while opening %s for reading\n", from);
+    return SSH_ERROR;
+  }
+
+  fileMeta meta;
+  if (!fileSystemUtils_getMeta(AT_FDCWD, from, &meta)) {
+    fprintf(stderr, "Error reading %s\n", from);
+    close(fd);
+    return SSH_ERROR;
+  }
+  size_t size = meta.size;
+
+  sftp_session sftp = sftpUtils_D_openSession(session);
+  if (!sftp) {
+    close(fd);
+    return SSH_ERROR;
+  }
+
+  char dest[PATH_MAX];
+  if (sftpUtils_getFileType(sftp, to, NULL) == FILE_IS_DIR)
+    snprintf(dest, PATH_MAX, "%s/%s", to, _stripe_baseName(from));
+  else
+    snprintf(dest, PATH_MAX, "%s", to);
+
+  // Create (or empty) the remote file once. The stripes then write their
+  // ranges into it without truncating it.
+  sftp_file file = sftp_open(sftp, dest, O_WRONLY | O_CREAT | O_TRUNC,
+                             meta.permissions);
+  if (!file) {
+    fprintf(stderr, "Can't open remote file %s: %s\n", dest,
+            ssh_get_error(session));
+    sftp_free(sftp);
+    close(fd);
+    return SSH_ERROR;
+  }
+  sftp_close(file);
+  sftp_free(sftp);
+
+  int rc = _stripe_run(session, info, dest, fd, size, numStripes, false);
+
+  close(fd);
+  if (rc == SSH_OK && !verify_checkFile(session, from, dest)) rc = SSH_ERROR;
+  return rc;
+}
@@ -0,0 +1,1071 @@
+/**********************************************************************
+  tarStream.c - Source code for copying directory trees as a single tar
+                stream over an exec channel
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <compress.h>
+#include <fileSystemUtils.h>
+#include <remoteExec.h>
+#include <scp.h>
+#include <scpOptions.h>
+#include <tarStream.h>
+
+#define TAR_BLOCK_SIZE 512
+// The size field of a header holds 11 octal digits
+#define TAR_MAX_SIZE 077777777777ULL
+// The largest pax extended header that we read
+#define TAR_MAX_PAX_SIZE 65536
+// A path may grow up to four times when it is quoted for the shell
+#define TAR_QUOTED_SIZE (4 * PATH_MAX + 3)
+#define TAR_COMMAND_SIZE (3 * TAR_QUOTED_SIZE + 256)
+
+// A ustar header block
+typedef struct {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char checksum[8];
+  char typeflag;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char padding[12];
+} tarHeader;
+
+// A file that is too large for the stream and is copied on its own
+typedef struct {
+  char* path;
+  char* relPath;
+} tarFile;
+
+typedef struct {
+  tarFile* files;
+  size_t numFiles;
+  size_t capacity;
+} tarFileList;
+
+// The state of an upload. The stream is built up in buffer and written to
+// the channel (or to fd, if there is no channel) whenever it is full.
+typedef struct {
+  ssh_session session;
+  ssh_channel channel;
+  int fd;
+  // If set, every name is put under base, as "tar -c base" names them.
+  // Otherwise the names are relative to the top of the tree.
+  const char* base;
+  char* buffer;
+  size_t len;
+  size_t size;
+  size_t threshold;
+  tarFileList largeFiles;
+  bool failed;
+#ifdef SCP_HAVE_ZSTD
+  // Set if the stream is compressed
+  pcompressEncoder encoder;
+#endif
+} tarWriter;
+
+// The state of a download. buffer holds what has been read from the
+// channel (or from fd, if there is no channel) and not used yet, from pos
+// to len.
+typedef struct {
+  ssh_session session;
+  ssh_channel channel;
+  int fd;
+  char* buffer;
+  size_t pos;
+  size_t len;
+  size_t size;
+  char destRoot[PATH_MAX];
+  const char* base;
+  bool failed;
+#ifdef SCP_HAVE_ZSTD
+  // Set if the stream is compressed. What has been read from the channel
+  // and not decoded yet is in input, from inputPos to inputLen.
+  pcompressDecoder decoder;
+  char* input;
+  size_t inputPos;
+  size_t inputLen;
+  size_t inputSize;
+  // The last decode filled the buffer, so the decoder may have more
+  // without reading anything else
+  bool decoderFull;
+#endif
+} tarReader;
+
+static bool _tarStream_addFile(tarFileList* list, const char* path,
+                               const char* relPath)
+{
+  if (list->numFiles == list->capacity) {
+    size_t newCapacity = list->capacity ? list->capacity * 2 : 64;
+    tarFile* files = realloc(list->files, newCapacity * sizeof(tarFile));
+    if (!files) return false;
+    list->files = files;
+    list->capacity = newCapacity;
+  }
+
+  tarFile* file = &list->files[list->numFiles];
+  file->path = strdup(path);
+  file->relPath = strdup(relPath);
+  if (!file->path || !file->relPath) {
+    free(file->path);
+    free(file->relPath);
+    return false;
+  }
+
+  list->numFiles++;
+  return true;
+}
+
+static void _tarStream_freeFiles(tarFileList* list)
+{
+  size_t i;
+  for (i = 0; i < list->numFiles; ++i) {
+    free(list->files[i].path);
+    free(list->files[i].relPath);
+  }
+  free(list->files);
+}
+
+static double _tarStream_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#ifdef SCP_HAVE_ZSTD
+static bool _tarStream_serverHasZstd(ssh_session session)
+{
+  char* output = remoteExec_D_run(session, "command -v zstd", NULL);
+  if (!output) {
+    fprintf(stderr, "Warning: zstd was not found on the server, so the "
+                    "stream will not be compressed\n");
+    return false;
+  }
+  free(output);
+  return true;
+}
+#endif
+
+// Returns a pointer to the last component of a path
+static const char* _tarStream_baseName(const char* path)
+{
+  const char* p = strrchr(path, '/');
+  return p ? p + 1 : path;
+}
+
+// The checksum is the sum of the bytes of the header, with the checksum
+// field itself counted as spaces
+static unsigned int _tarStream_checksum(const tarHeader* h)
+{
+  const unsigned char* p = (const unsigned char*)h;
+  unsigned int sum = 0;
+  size_t i;
+  for (i = 0; i < sizeof(tarHeader); ++i) sum += p[i];
+
+  for (i = 0; i < sizeof(h->checksum); ++i)
+    sum += ' ' - (unsigned char)h->checksum[i];
+  return sum;
+}
+
+/*****************************************************************************
+ * Writing
+ *****************************************************************************/
+
+static bool _tarStream_send(tarWriter* w, const char* data, size_t len)
+{
+  size_t sent = 0;
+  while (!w->channel && sent < len) {
+    ssize_t n = write(w->fd, data + sent, len - sent);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      fprintf(stderr, "Error writing the tar stream: %s\n", strerror(errno));
+      return false;
+    }
+    sent += n;
+  }
+
+  while (sent < len) {
+    int n = ssh_channel_write(w->channel, data + sent, len - sent);
+    if (n == SSH_ERROR) {
+      fprintf(stderr, "Error writing the tar stream: %s\n",
+              ssh_get_error(w->session));
+      return false;
+    }
+    sent += n;
+  }
+  return true;
+}
+
+static bool _tarStream_flush(tarWriter* w)
+{
+  if (w->len == 0) return true;
+
+#ifdef SCP_HAVE_ZSTD
+  if (w->encoder) {
+    size_t len;
+    const char* frame = compress_encode(w->encoder, w->buffer, w->len, &len);
+    double start = _tarStream_now();
+    if (!frame || !_tarStream_send(w, frame, len)) return false;
+    compress_addSendTime(w->encoder, len, _tarStream_now() - start);
+  }
+  else
+#endif
+  if (!_tarStream_send(w, w->buffer, w->len)) return false;
+  w->len = 0;
+
+  // Don't let tar block on a full stderr while we wait for it to read
+  if (w->channel) remoteExec_forwardStderr(w->channel);
+  return true;
+}
+
+// Appends data to the stream, or zeros if data is NULL
+static bool _tarStream_append(tarWriter* w, const void* data, size_t len)
+{
+  while (len > 0) {
+    if (w->len == w->size && !_tarStream_flush(w)) return false;
+
+    size_t n = w->size - w->len;
+    if (n > len) n = len;
+    if (data) {
+      memcpy(w->buffer + w->len, data, n);
+      data = (const char*)data + n;
+    }
+    else memset(w->buffer + w->len, 0, n);
+
+    w->len += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Pads the data of an entry of the given size to a whole block
+static bool _tarStream_pad(tarWriter* w, size_t size)
+{
+  size_t rem = size % TAR_BLOCK_SIZE;
+  return rem == 0 || _tarStream_append(w, NULL, TAR_BLOCK_SIZE - rem);
+}
+
+// Splits a name that is too long for the name field into the prefix and
+// name fields, at a '/'. Returns false if it cannot be split.
+static bool _tarStream_splitName(tarHeader* h, const char* name)
+{
+  size_t len = strlen(name);
+  const char* p;
+  for (p = strchr(name, '/'); p; p = strchr(p + 1, '/')) {
+    size_t prefixLen = p - name;
+    if (prefixLen > sizeof(h->prefix)) return false;
+    if (len - prefixLen - 1 <= sizeof(h->name) && len - prefixLen - 1 > 0) {
+      memcpy(h->prefix, name, prefixLen);
+      memcpy(h->name, p + 1, len - prefixLen - 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool _tarStream_writeBlock(tarWriter* w, const char* name,
+                                  char typeflag, size_t size, int mode,
+                                  time_t mtime)
+{
+  tarHeader h;
+  memset(&h, 0, sizeof(h));
+
+  size_t len = strlen(name);
+  if (len <= sizeof(h.name)) memcpy(h.name, name, len);
+  else if (!_tarStream_splitName(&h, name))
+    // Only used for the name of a pax header, which is ignored
+    memcpy(h.name, name, sizeof(h.name));
+
+  snprintf(h.mode, sizeof(h.mode), "%07o", mode & 07777);
+  snprintf(h.uid, sizeof(h.uid), "%07o", 0);
+  snprintf(h.gid, sizeof(h.gid), "%07o", 0);
+  snprintf(h.size, sizeof(h.size), "%011llo", (unsigned long long)size);
+  snprintf(h.mtime, sizeof(h.mtime), "%011llo",
+           mtime > 0 ? (unsigned long long)mtime & TAR_MAX_SIZE : 0ULL);
+  h.typeflag = typeflag;
+  memcpy(h.magic, "ustar", 6);
+  memcpy(h.version, "00", 2);
+
+  snprintf(h.checksum, sizeof(h.checksum), "%06o", _tarStream_checksum(&h));
+  h.checksum[7] = ' ';
+
+  return _tarStream_append(w, &h, sizeof(h));
+}
+
+// Writes the header of an entry. A name that does not fit in the header
+// is put in a pax extended header first.
+static bool _tarStream_writeHeader(tarWriter* w, const char* name,
+                                   char typeflag, size_t size, int mode,
+                                   time_t mtime)
+{
+  tarHeader h;
+  memset(&h, 0, sizeof(h));
+  size_t len = strlen(name);
+
+  if (len > sizeof(h.name) && !_tarStream_splitName(&h, name)) {
+    // A record is "<length> path=<name>\n", where the length counts its
+    // own digits
+    char record[PATH_MAX + 32];
+    size_t recordLen = len + strlen(" path=\n");
+    size_t digits = snprintf(NULL, 0, "%zu", recordLen);
+    if (snprintf(NULL, 0, "%zu", recordLen + digits) > (int)digits) digits++;
+    recordLen += digits;
+    snprintf(record, sizeof(record), "%zu path=%s\n", recordLen, name);
+
+    if (!_tarStream_writeBlock(w, "././@PaxHeader", 'x', recordLen, 0644,
+                               mtime) ||
+        !_tarStream_append(w, record, recordLen) ||
+        !_tarStream_pad(w, recordLen))
+      return false;
+
+    char shortName[101];
+    snprintf(shortName, sizeof(shortName), "%s", name);
+    return _tarStream_writeBlock(w, shortName, typeflag, size, mode, mtime);
+  }
+
+  return _tarStream_writeBlock(w, name, typeflag, size, mode, mtime);
+}
+
+// Writes the header and contents of a file. The contents are read straight
+// into the stream's buffer.
+static bool _tarStream_writeFile(tarWriter* w, const char* path,
+                                 const char* name, const fileMeta* meta)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "Error while opening %s for reading\n", path);
+    return false;
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  if (!_tarStream_writeHeader(w, name, '0', meta->size, meta->permissions,
+                              meta->mtime)) {
+    close(fd);
+    return false;
+  }
+
+  size_t remaining = meta->size;
+  while (remaining > 0) {
+    if (w->len == w->size && !_tarStream_flush(w)) {
+      close(fd);
+      return false;
+    }
+
+    size_t want = w->size - w->len;
+    if (want > remaining) want = remaining;
+    ssize_t n = read(fd, w->buffer + w->len, want);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+
+    w->len += n;
+    remaining -= n;
+  }
+  close(fd);
+
+  // The header promised the full size, so send zeros in place of whatever
+  // could not be read to keep the rest of the stream intact
+  if (remaining > 0) {
+    fprintf(stderr, "Error: only %zu of %zu bytes of %s could be read\n",
+            meta->size - remaining, meta->size, path);
+    w->failed = true;
+    if (!_tarStream_append(w, NULL, remaining)) return false;
+  }
+
+  return _tarStream_pad(w, meta->size);
+}
+
+// Called for every local file and directory
+static bool _tarStream_addUpload(const char* path, const char* relPath,
+                                 const fileMeta* meta, void* userData)
+{
+  tarWriter* w = userData;
+
+  // Without a base, the root is the directory that tar runs in on the server
+  if (relPath[0] == '\0' && !w->base) return true;
+
+  char name[PATH_MAX + 1];
+  if (!w->base) snprintf(name, sizeof(name), "%s", relPath);
+  else if (snprintf(name, sizeof(name), "%s%s%s", w->base,
+                    relPath[0] ? "/" : "", relPath) >= PATH_MAX) {
+    fprintf(stderr, "Error: path too long for %s\n", relPath);
+    return false;
+  }
+
+  if (meta->type == FILE_IS_DIR) {
+    strcat(name, "/");
+    return _tarStream_writeHeader(w, name, '5', 0, meta->permissions,
+                                  meta->mtime);
+  }
+  else if (meta->type == FILE_IS_REG) {
+    if (meta->size >= w->threshold)
+      return _tarStream_addFile(&w->largeFiles, path, relPath);
+    return _tarStream_writeFile(w, path, name, meta);
+  }
+
+  fprintf(stderr, "Warning: %s is not a regular file or directory\n", path);
+  return true;
+}
+
+// Reads what the server's shell printed before it started tar
+static bool _tarStream_readOutput(tarWriter* w, char* output, size_t size)
+{
+  size_t len = 0;
+  int n;
+  while (len < size - 1 &&
+         (n = ssh_channel_read(w->channel, output + len, size - 1 - len,
+                               0)) > 0)
+    len += n;
+  output[len] = '\0';
+
+  if (len > 0 && output[len - 1] == '\n') output[--len] = '\0';
+  return len > 0;
+}
+
+// Works out where a single file goes on the server, the way scp would:
+// into to if that is a directory, and as to otherwise. tar can't rename what
+// it unpacks, so the stream names the file for where it goes.
+static bool _tarStream_getFileDest(ssh_session session, const char* from,
+                                   const char* to, const char* quotedTo,
+                                   char* dir, char* name)
+{
+  char command[TAR_COMMAND_SIZE];
+  snprintf(command, sizeof(command), "if [ -d %s ]; then echo dir; fi",
+           quotedTo);
+  char* output = remoteExec_D_run(session, command, NULL);
+  if (!output) return false;
+  bool isDir = strncmp(output, "dir", 3) == 0;
+  free(output);
+
+  if (isDir) {
+    snprintf(dir, PATH_MAX, "%s", to);
+    snprintf(name, PATH_MAX, "%s", _tarStream_baseName(from));
+    return true;
+  }
+
+  const char* base = _tarStream_baseName(to);
+  snprintf(name, PATH_MAX, "%s", base);
+  if (base == to) snprintf(dir, PATH_MAX, ".");
+  else if (base == to + 1) snprintf(dir, PATH_MAX, "/");
+  else snprintf(dir, PATH_MAX, "%.*s", (int)(base - to - 1), to);
+  return name[0] != '\0';
+}
+
+int tarStream_copyToServer(ssh_session session, char* from, char* to)
+{
+  pscpOptions options = scpOptions_get();
+
+  // If from ends in '/', the base name would be empty
+  size_t len = strlen(from);
+  if (len > 1 && from[len - 1] == '/') from[len - 1] = '\0';
+
+  char quotedTo[TAR_QUOTED_SIZE];
+  char quotedBase[TAR_QUOTED_SIZE];
+  char command[TAR_COMMAND_SIZE];
+  if (!remoteExec_quote(to, quotedTo, sizeof(quotedTo)) ||
+      !remoteExec_quote(_tarStream_baseName(from), quotedBase,
+                        sizeof(quotedBase))) {
+    fprintf(stderr, "Error: path too long in %s\n", __FUNCTION__);
+    return SSH_ERROR;
+  }
+
+  tarWriter w;
+  memset(&w, 0, sizeof(w));
+  w.session = session;
+  w.size = options->chunkSize;
+  w.threshold = options->tarThreshold;
+
+  bool isFile = fileSystemUtils_getFileType(from) == FILE_IS_REG;
+  bool isCompressed = false;
+  const char* unpack = "exec tar -xf -";
+#ifdef SCP_HAVE_ZSTD
+  if (options->compress && _tarStream_serverHasZstd(session)) {
+    w.encoder = compress_D_newEncoder(options->compressLevel, w.size);
+    if (!w.encoder) return SSH_ERROR;
+    unpack = "zstd -dcq | tar -xf -";
+    // Chunks that don't compress are sent as they are, so large files may
+    // as well go through the stream too
+    w.threshold = TAR_MAX_SIZE;
+    isCompressed = true;
+  }
+#endif
+  if (w.threshold > TAR_MAX_SIZE) w.threshold = TAR_MAX_SIZE;
+
+  // A single file only gains from the stream if it is compressed
+  if (isFile && !isCompressed)
+    return scp_copyToServer(session, from, to, false);
+
+  char name[PATH_MAX];
+  if (isFile) {
+    char dir[PATH_MAX];
+    char quotedDir[TAR_QUOTED_SIZE];
+    if (!_tarStream_getFileDest(session, from, to, quotedTo, dir, name) ||
+        !remoteExec_quote(dir, quotedDir, sizeof(quotedDir))) {
+      fprintf(stderr, "Error finding where %s goes on the server\n", to);
+#ifdef SCP_HAVE_ZSTD
+      compress_freeEncoder(w.encoder);
+#endif
+      return SSH_ERROR;
+    }
+    w.base = name;
+    snprintf(command, sizeof(command), "cd %s && pwd && %s", quotedDir,
+             unpack);
+  }
+  else {
+    // Like scp, copy into the destination if it is a directory that
+    // exists, and otherwise create the destination as the copy of from.
+    // pwd tells us which one it was, for the large files.
+    snprintf(command, sizeof(command),
+             "d=%s; if [ -d \"$d\" ]; then d=\"$d\"/%s; fi; "
+             "mkdir -p \"$d\" && cd \"$d\" && pwd && %s",
+             quotedTo, quotedBase, unpack);
+  }
+
+  w.buffer = malloc(w.size);
+  if (w.buffer) w.channel = remoteExec_D_open(session, command);
+  if (!w.buffer || !w.channel) {
+    if (!w.buffer)
+      fprintf(stderr, "Error allocating memory in %s\n", __FUNCTION__);
+    free(w.buffer);
+#ifdef SCP_HAVE_ZSTD
+    compress_freeEncoder(w.encoder);
+#endif
+    return SSH_ERROR;
+  }
+  double start = _tarStream_now();
+
+  // Two zero blocks end the archive
+  bool success = fileSystemUtils_walkTree(from, _tarStream_addUpload, &w) &&
+                 _tarStream_append(&w, NULL, 2 * TAR_BLOCK_SIZE) &&
+                 _tarStream_flush(&w);
+  free(w.buffer);
+
+  char remoteRoot[PATH_MAX];
+  ssh_channel_send_eof(w.channel);
+  if (!_tarStream_readOutput(&w, remoteRoot, sizeof(remoteRoot)))
+    success = false;
+
+  int status = remoteExec_close(w.channel);
+  if (status != 0) {
+    fprintf(stderr, "Error: tar on the server exited with status %i\n",
+            status);
+    success = false;
+  }
+
+#ifdef SCP_HAVE_ZSTD
+  if (w.encoder) {
+    compress_printStats(compress_getEncoderStats(w.encoder),
+                        _tarStream_now() - start);
+    compress_freeEncoder(w.encoder);
+  }
+#else
+  (void)start;
+#endif
+
+  size_t i;
+  for (i = 0; success && i < w.largeFiles.numFiles; ++i) {
+    char dest[PATH_MAX];
+    tarFile* file = &w.largeFiles.files[i];
+    // A single file is its own root, so it has no relative path
+    const char* relPath = file->relPath[0] ? file->relPath : w.base;
+    if (snprintf(dest, PATH_MAX, "%s/%s", remoteRoot, relPath) >= PATH_MAX) {
+      fprintf(stderr, "Error: path too long for %s\n", file->relPath);
+      success = false;
+      break;
+    }
+    success = scp_copyToServer(session, file->path, dest, false) == SSH_OK;
+  }
+
+  _tarStream_freeFiles(&w.largeFiles);
+  return success && !w.failed ? SSH_OK : SSH_ERROR;
+}
+
+/*****************************************************************************
+ * Reading
+ *****************************************************************************/
+
+static int _tarStream_readChannel(tarReader* r, char* buffer, size_t size)
+{
+  if (!r->channel) {
+    ssize_t n;
+    while ((n = read(r->fd, buffer, size)) < 0 && errno == EINTR);
+    if (n < 0) {
+      fprintf(stderr, "Error reading the tar stream: %s\n", strerror(errno));
+      r->failed = true;
+    }
+    return n;
+  }
+
+  int n = ssh_channel_read(r->channel, buffer, size, 0);
+  if (n < 0) {
+    fprintf(stderr, "Error reading the tar stream: %s\n",
+            ssh_get_error(r->session));
+    r->failed = true;
+  }
+  remoteExec_forwardStderr(r->channel);
+  return n;
+}
+
+#ifdef SCP_HAVE_ZSTD
+static bool _tarStream_fillDecoded(tarReader* r)
+{
+  while (r->len == 0) {
+    if (r->inputPos == r->inputLen && !r->decoderFull) {
+      int n = _tarStream_readChannel(r, r->input, r->inputSize);
+      if (n <= 0) return false;
+      r->inputPos = 0;
+      r->inputLen = n;
+    }
+
+    size_t used;
+    if (!compress_decode(r->decoder, r->input + r->inputPos,
+                         r->inputLen - r->inputPos, &used, r->buffer,
+                         r->size, &r->len)) {
+      r->failed = true;
+      return false;
+    }
+    r->inputPos += used;
+    r->decoderFull = r->len == r->size;
+  }
+  return true;
+}
+#endif
+
+// Makes at least one byte of the stream available. Returns false at the
+// end of the stream or on an error (which sets failed).
+static bool _tarStream_fill(tarReader* r)
+{
+  if (r->pos < r->len) return true;
+
+  r->pos = 0;
+  r->len = 0;
+#ifdef SCP_HAVE_ZSTD
+  if (r->decoder) return _tarStream_fillDecoded(r);
+#endif
+
+  int n = _tarStream_readChannel(r, r->buffer, r->size);
+  if (n <= 0) return false;
+
+  r->len = n;
+  return true;
+}
+
+// Reads exactly len bytes, or skips them if data is NULL
+static bool _tarStream_read(tarReader* r, void* data, size_t len)
+{
+  while (len > 0) {
+    if (!_tarStream_fill(r)) return false;
+
+    size_t n = r->len - r->pos;
+    if (n > len) n = len;
+    if (data) {
+      memcpy(data, r->buffer + r->pos, n);
+      data = (char*)data + n;
+    }
+
+    r->pos += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Writes the next len bytes of the stream to fd
+static bool _tarStream_readToFd(tarReader* r, int fd, size_t len)
+{
+  while (len > 0) {
+    if (!_tarStream_fill(r)) return false;
+
+    size_t n = r->len - r->pos;
+    if (n > len) n = len;
+
+    ssize_t written = write(fd, r->buffer + r->pos, n);
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) return false;
+
+    r->pos += written;
+    len -= written;
+  }
+  return true;
+}
+
+// Reads a numeric field, which is octal, or base-256 if the high bit of
+// the first byte is set (GNU tar uses it for sizes of 8G and up)
+static unsigned long long _tarStream_readNumber(const char* field,
+                                                size_t len)
+{
+  unsigned long long value = 0;
+  size_t i;
+
+  if ((unsigned char)field[0] & 0x80) {
+    value = (unsigned char)field[0] & 0x7f;
+    for (i = 1; i < len; ++i) value = (value << 8) | (unsigned char)field[i];
+    return value;
+  }
+
+  for (i = 0; i < len && field[i] == ' '; ++i);
+  for (; i < len && field[i] >= '0' && field[i] <= '7'; ++i)
+    value = value * 8 + (field[i] - '0');
+  return value;
+}
+
+// Finds the path in the records of a pax extended header
+static bool _tarStream_readPaxPath(const char* data, size_t len, char* path)
+{
+  const char* p = data;
+  while (p < data + len) {
+    char* end;
+    unsigned long recordLen = strtoul(p, &end, 10);
+    if (end == p || *end != ' ' || recordLen == 0 ||
+        recordLen > (size_t)(data + len - p))
+      return false;
+
+    const char* key = end + 1;
+    const char* recordEnd = p + recordLen - 1;
+    if (strncmp(key, "path=", 5) == 0) {
+      size_t pathLen = recordEnd - (key + 5);
+      if (pathLen >= PATH_MAX) return false;
+      memcpy(path, key + 5, pathLen);
+      path[pathLen] = '\0';
+      return true;
+    }
+    p += recordLen;
+  }
+  return false;
+}
+
+// Works out where an entry of the archive goes. Every entry must be the
+// base name of from or be inside it, and may not climb out with "..".
+static bool _tarStream_getDest(tarReader* r, const char* name, char* dest)
+{
+  if (strncmp(name, "./", 2) == 0) name += 2;
+
+  size_t baseLen = strlen(r->base);
+  if (strncmp(name, r->base, baseLen) != 0 ||
+      (name[baseLen] != '\0' && name[baseLen] != '/'))
+    return false;
+
+  const char* rel = name + baseLen;
+  const char* p;
+  for (p = strstr(rel, ".."); p; p = strstr(p + 1, "..")) {
+    if (p[-1] == '/' && (p[2] == '/' || p[2] == '\0')) return false;
+  }
+
+  if (snprintf(dest, PATH_MAX, "%s%s", r->destRoot, rel) >= PATH_MAX)
+    return false;
+
+  // Directories end in '/'
+  size_t len = strlen(dest);
+  while (len > 1 && dest[len - 1] == '/') dest[--len] = '\0';
+  return true;
+}
+
+static bool _tarStream_extractFile(tarReader* r, const char* dest,
+                                   size_t size, int mode)
+{
+  int fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode & 0777);
+  if (fd < 0) {
+    fprintf(stderr, "Error opening %s for writing: %s\n", dest,
+            strerror(errno));
+    return false;
+  }
+
+  bool success = _tarStream_readToFd(r, fd, size);
+  if (!success && !r->failed)
+    fprintf(stderr, "Error writing %s: %s\n", dest, strerror(errno));
+  if (close(fd) != 0) success = false;
+  return success;
+}
+
+// Unpacks the archive as it arrives
+static bool _tarStream_extract(tarReader* r)
+{
+  char longName[PATH_MAX];
+  bool haveLongName = false;
+  tarHeader h;
+
+  while (_tarStream_read(r, &h, sizeof(h))) {
+    // The archive ends with zero blocks
+    if (h.name[0] == '\0' && _tarStream_checksum(&h) == 8 * ' ') return true;
+
+    if (_tarStream_readNumber(h.checksum, sizeof(h.checksum)) !=
+        _tarStream_checksum(&h)) {
+      fprintf(stderr, "Error: bad header in the tar stream\n");
+      return false;
+    }
+
+    size_t size = _tarStream_readNumber(h.size, sizeof(h.size));
+    size_t padding = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) %
+                     TAR_BLOCK_SIZE;
+
+    // GNU tar's long names and pax headers describe the next entry
+    if (h.typeflag == 'L' || h.typeflag == 'x') {
+      char* data = size < TAR_MAX_PAX_SIZE ? malloc(size + 1) : NULL;
+      if (!data || !_tarStream_read(r, data, size) ||
+          !_tarStream_read(r, NULL, padding)) {
+        fprintf(stderr, "Error reading a long name in the tar stream\n");
+        free(data);
+        return false;
+      }
+      data[size] = '\0';
+
+      if (h.typeflag == 'L') {
+        snprintf(longName, PATH_MAX, "%s", data);
+        haveLongName = true;
+      }
+      else if (_tarStream_readPaxPath(data, size, longName))
+        haveLongName = true;
+      free(data);
+      continue;
+    }
+
+    char name[PATH_MAX];
+    if (haveLongName)
+      snprintf(name, PATH_MAX, "%s", longName);
+    // Only POSIX archives have a prefix. GNU ones put other things there.
+    else if (memcmp(h.magic, "ustar", 6) == 0 && h.prefix[0] != '\0')
+      snprintf(name, PATH_MAX, "%.155s/%.100s", h.prefix, h.name);
+    else
+      snprintf(name, PATH_MAX, "%.100s", h.name);
+    haveLongName = false;
+
+    char dest[PATH_MAX];
+    bool isEntry = h.typeflag == '5' || h.typeflag == '0' ||
+                   h.typeflag == '\0' || h.typeflag == '7';
+    if (isEntry && !_tarStream_getDest(r, name, dest)) {
+      fprintf(stderr, "Error: unexpected path in the tar stream: %s\n", name);
+      return false;
+    }
+
+    bool success;
+    if (h.typeflag == '5') {
+      success = fileSystemUtils_mkdirIfNeeded(dest) &&
+                _tarStream_read(r, NULL, size);
+      if (!success) fprintf(stderr, "Error creating directory %s\n", dest);
+    }
+    else if (isEntry) {
+      success = _tarStream_extractFile(
+        r, dest, size, _tarStream_readNumber(h.mode, sizeof(h.mode)));
+    }
+    else {
+      fprintf(stderr, "Warning: %s is not a regular file or directory\n",
+              name);
+      success = _tarStream_read(r, NULL, size);
+    }
+
+    if (!success || !_tarStream_read(r, NULL, padding)) return false;
+  }
+
+  // The stream ended before the end of the archive
+  fprintf(stderr, "Error: the tar stream ended early\n");
+  return false;
+}
+
+int tarStream_copyFromServer(ssh_session session, char* from, char* to)
+{
+  pscpOptions options = scpOptions_get();
+
+  // If from ends in '/', the base name would be empty
+  size_t len = strlen(from);
+  if (len > 1 && from[len - 1] == '/') from[len - 1] = '\0';
+
+  // tar runs in the parent of from, so that the archive is named after it
+  char parent[PATH_MAX];
+  const char* base = _tarStream_baseName(from);
+  if (base == from) snprintf(parent, PATH_MAX, ".");
+  else if (base == from + 1) snprintf(parent, PATH_MAX, "/");
+  else snprintf(parent, PATH_MAX, "%.*s", (int)(base - from - 1), from);
+
+  char quotedParent[TAR_QUOTED_SIZE];
+  char quotedBase[TAR_QUOTED_SIZE];
+  char command[TAR_COMMAND_SIZE];
+  if (!remoteExec_quote(parent, quotedParent, sizeof(quotedParent)) ||
+      !remoteExec_quote(base, quotedBase, sizeof(quotedBase))) {
+    fprintf(stderr, "Error: path too long in %s\n", __FUNCTION__);
+    return SSH_ERROR;
+  }
+
+  tarReader r;
+  memset(&r, 0, sizeof(r));
+  r.session = session;
+  r.base = base;
+  r.size = options->chunkSize;
+
+  // Like scp, copy into the destination if it is a directory that exists,
+  // and otherwise create the destination as the copy of from
+  if (fileSystemUtils_getFileType(to) == FILE_IS_DIR)
+    snprintf(r.destRoot, PATH_MAX, "%s/%s", to, base);
+  else
+    snprintf(r.destRoot, PATH_MAX, "%s", to);
+
+  size_t threshold = options->tarThreshold;
+  char compressCommand[64] = "";
+#ifdef SCP_HAVE_ZSTD
+  if (options->compress && _tarStream_serverHasZstd(session)) {
+    r.decoder = compress_D_newDecoder();
+    r.inputSize = r.size;
+    r.input = malloc(r.inputSize);
+    if (!r.decoder || !r.input) {
+      compress_freeDecoder(r.decoder);
+      free(r.input);
+      return SSH_ERROR;
+    }
+    // zstd stores the blocks that don't compress as they are
+    snprintf(compressCommand, sizeof(compressCommand), " | zstd -cq -%i -T0",
+             options->compressLevel);
+    threshold = TAR_MAX_SIZE;
+  }
+#endif
+
+  // Links are followed, as they are by scp. The test makes a missing from
+  // an error, rather than an empty archive.
+  snprintf(command, sizeof(command),
+           "cd %s && [ -e %s ] && find -L %s \\( -type d -o -type f "
+           "-size -%zuc \\) -print0 | "
+           "tar -c -h -f - --null --no-recursion -T -%s",
+           quotedParent, quotedBase, quotedBase, threshold, compressCommand);
+
+  r.buffer = malloc(r.size);
+  if (r.buffer) r.channel = remoteExec_D_open(session, command);
+
+  bool success = false;
+  double start = _tarStream_now();
+  if (!r.buffer)
+    fprintf(stderr, "Error allocating memory in %s\n", __FUNCTION__);
+  else if (r.channel)
+    success = _tarStream_extract(&r);
+  free(r.buffer);
+
+#ifdef SCP_HAVE_ZSTD
+  if (r.decoder) {
+    if (success)
+      compress_printStats(compress_getDecoderStats(r.decoder),
+                          _tarStream_now() - start);
+    compress_freeDecoder(r.decoder);
+    free(r.input);
+  }
+#else
+  (void)start;
+#endif
+  if (!r.channel) return SSH_ERROR;
+
+  int status = remoteExec_close(r.channel);
+  if (status != 0) {
+    fprintf(stderr, "Error: tar on the server exited with status %i\n",
+            status);
+    success = false;
+  }
+  if (!success) return SSH_ERROR;
+
+  // The large files are copied on their own, now that their directories
+  // exist
+  snprintf(command, sizeof(command),
+           "cd %s && find -L %s -type f ! -size -%zuc -print0",
+           quotedParent, quotedBase, threshold);
+
+  size_t listLen;
+  char* list = remoteExec_D_run(session, command, &listLen);
+  if (!list) return SSH_ERROR;
+
+  const char* name;
+  for (name = list; success && name < list + listLen;
+       name += strlen(name) + 1) {
+    char remotePath[PATH_MAX];
+    char dest[PATH_MAX];
+    if (snprintf(remotePath, PATH_MAX, "%s/%s", parent, name) >= PATH_MAX ||
+        !_tarStream_getDest(&r, name, dest)) {
+      fprintf(stderr, "Error: unexpected path from the server: %s\n", name);
+      success = false;
+      break;
+    }
+    success = scp_copyFromServer(session, remotePath, dest, false) == SSH_OK;
+  }
+
+  free(list);
+  return success ? SSH_OK : SSH_ERROR;
+}
+
+/*****************************************************************************
+ * Without a channel
+ *****************************************************************************/
+
+bool tarStream_write(char* from, int fd)
+{
+  // If from ends in '/', the base name would be empty
+  size_t len = strlen(from);
+  if (len > 1 && from[len - 1] == '/') from[len - 1] = '\0';
+
+  tarWriter w;
+  memset(&w, 0, sizeof(w));
+  w.fd = fd;
+  w.base = _tarStream_baseName(from);
+  w.size = scpOptions_get()->chunkSize;
+  w.threshold = TAR_MAX_SIZE;
+  w.buffer = malloc(w.size);
+  if (!w.buffer) {
+    fprintf(stderr, "Error allocating memory in %s\n", __FUNCTION__);
+    return false;
+  }
+
+  // Two zero blocks end the archive
+  bool success = fileSystemUtils_walkTree(from, _tarStream_addUpload, &w) &&
+                 _tarStream_append(&w, NULL, 2 * TAR_BLOCK_SIZE) &&
+                 _tarStream_flush(&w);
+  free(w.buffer);
+
+  // Every file fits in the stream, so largeFiles is empty
+  _tarStream_freeFiles(&w.largeFiles);
+  return success && !w.failed;
+}
+
+bool tarStream_extract(int fd, const char* base, const char* to)
+{
+  tarReader r;
+  memset(&r, 0, sizeof(r));
+  r.fd = fd;
+  r.base = base;
+  r.size = scpOptions_get()->chunkSize;
+
+  if (fileSystemUtils_getFileType(to) == FILE_IS_DIR)
+    snprintf(r.destRoot, PATH_MAX, "%s/%s", to, base);
+  else
+    snprintf(r.destRoot, PATH_MAX, "%s", to);
+
+  r.buffer = malloc(r.size);
+  if (!r.buffer) {
+    fprintf(stderr, "Error allocating memory in %s\n", __FUNCTION__);
+    return false;
+  }
+
+  bool success = _tarStream_extract(&r);
+  free(r.buffer);
+  return success;
+}
@@ -0,0 +1,380 @@
+/**********************************************************************
+  trace.c - Source code for timing the phases of a copy
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <scpOptions.h>
+#include <trace.h>
+
+// A thread writes its events to the file once this much has built up
+#define TRACE_BUFFER_SIZE (64 * 1024)
+
+static const char* _trace_phaseNames[TRACE_NUM_PHASES] = {
+  "connect",
+  "key exchange",
+  "host key",
+  "auth",
+  "request",
+  "disk read",
+  "disk write",
+  "channel read",
+  "channel write"
+};
+
+// Only these phases are written as events of their own. The others are
+// added up into the events of the files.
+static const bool _trace_isWritten[TRACE_NUM_PHASES] = {
+  true, true, true, true, true, false, false, false, false
+};
+
+typedef struct {
+  uint64_t time;
+  uint64_t bytes;
+  size_t count;
+  // The sizes that the calls were made with, if they were recorded
+  size_t minSize;
+  size_t maxSize;
+  size_t lastSize;
+} tracePhaseTotal;
+
+struct tracer {
+  pthread_mutex_t mutex;
+  // The rest are guarded by the mutex
+  FILE* file;
+  bool isFirstEvent;
+  uint64_t startTime;
+  tracePhaseTotal totals[TRACE_NUM_PHASES];
+  size_t numFiles;
+  uint64_t fileBytes;
+};
+
+// What a thread has traced since it was last added to its tracer. Only the
+// thread itself touches it, so the copy loops never wait for the mutex,
+// which is only taken once per file or per TRACE_BUFFER_SIZE of events.
+typedef struct {
+  // The tracer that the rest belongs to, or NULL if it is empty
+  ptracer owner;
+  tracePhaseTotal totals[TRACE_NUM_PHASES];
+  size_t numFiles;
+  uint64_t fileBytes;
+  // The events, each starting with ",\n"
+  char* events;
+  size_t eventsLen;
+  size_t eventsCapacity;
+} traceBuffer;
+
+// The buffer of each thread is added to its tracer when the thread exits
+static pthread_key_t _trace_bufferKey;
+static pthread_once_t _trace_bufferKeyOnce = PTHREAD_ONCE_INIT;
+static __thread traceBuffer* _trace_buffer = NULL;
+
+// The time that this thread has spent in each phase, for the file events
+static __thread uint64_t _trace_threadTimes[TRACE_NUM_PHASES];
+static __thread long _trace_tid = 0;
+
+static uint64_t _trace_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static long _trace_getTid()
+{
+  if (_trace_tid == 0) _trace_tid = syscall(SYS_gettid);
+  return _trace_tid;
+}
+
+// Adds the totals of a phase of one thread to those of another, or of the
+// whole trace
+static void _trace_addTotal(tracePhaseTotal* to, const tracePhaseTotal* from)
+{
+  to->time += from->time;
+  to->bytes += from->bytes;
+  to->count += from->count;
+  if (from->lastSize == 0) return;
+  if (to->lastSize == 0 || from->minSize < to->minSize)
+    to->minSize = from->minSize;
+  if (from->maxSize > to->maxSize) to->maxSize = from->maxSize;
+  to->lastSize = from->lastSize;
+}
+
+// Adds a thread's buffer to its tracer, and empties it
+static void _trace_flush(traceBuffer* b)
+{
+  ptracer t = b->owner;
+  if (!t) return;
+
+  pthread_mutex_lock(&t->mutex);
+  int i;
+  for (i = 0; i < TRACE_NUM_PHASES; ++i)
+    _trace_addTotal(&t->totals[i], &b->totals[i]);
+  t->numFiles += b->numFiles;
+  t->fileBytes += b->fileBytes;
+
+  // The first event of the file opens the array instead
+  if (b->eventsLen > 0) {
+    if (t->isFirstEvent) fputc('[', t->file);
+    fwrite(b->events + t->isFirstEvent, 1, b->eventsLen - t->isFirstEvent,
+           t->file);
+    t->isFirstEvent = false;
+  }
+  pthread_mutex_unlock(&t->mutex);
+
+  b->owner = NULL;
+  memset(b->totals, 0, sizeof(b->totals));
+  b->numFiles = 0;
+  b->fileBytes = 0;
+  b->eventsLen = 0;
+}
+
+static void _trace_freeBuffer(void* arg)
+{
+  traceBuffer* b = arg;
+  _trace_flush(b);
+  free(b->events);
+  free(b);
+}
+
+static void _trace_makeBufferKey()
+{
+  pthread_key_create(&_trace_bufferKey, _trace_freeBuffer);
+}
+
+// Returns the calling thread's buffer for a tracer, or NULL if it couldn't
+// be allocated. A thread of a pool may copy for several tracers in turn, so
+// what it has for another one is added to that one first.
+static traceBuffer* _trace_getBuffer(ptracer t)
+{
+  if (!_trace_buffer) {
+    pthread_once(&_trace_bufferKeyOnce, _trace_makeBufferKey);
+    _trace_buffer = calloc(1, sizeof(traceBuffer));
+    if (!_trace_buffer) return NULL;
+    pthread_setspecific(_trace_bufferKey, _trace_buffer);
+  }
+
+  if (_trace_buffer->owner != t) {
+    _trace_flush(_trace_buffer);
+    _trace_buffer->owner = t;
+  }
+  return _trace_buffer;
+}
+
+// Appends to the events of a buffer like printf(). The events are
+// truncated if the buffer can't grow.
+static void _trace_append(traceBuffer* b, const char* format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  size_t room = b->eventsCapacity - b->eventsLen;
+  int n = vsnprintf(b->events + b->eventsLen, room, format, args);
+  va_end(args);
+  if (n < 0) return;
+
+  if ((size_t)n >= room) {
+    size_t capacity = b->eventsCapacity ? b->eventsCapacity : 1024;
+    while (capacity - b->eventsLen <= (size_t)n) capacity *= 2;
+    char* events = realloc(b->events, capacity);
+    if (!events) return;
+    b->events = events;
+    b->eventsCapacity = capacity;
+
+    va_start(args, format);
+    vsnprintf(b->events + b->eventsLen, capacity - b->eventsLen, format,
+              args);
+    va_end(args);
+  }
+  b->eventsLen += n;
+}
+
+// Appends a string as a JSON string
+static void _trace_appendString(traceBuffer* b, const char* str)
+{
+  _trace_append(b, "\"");
+  for (; *str; ++str) {
+    unsigned char c = *str;
+    if (c == '"' || c == '\\') _trace_append(b, "\\%c", c);
+    else if (c < 0x20) _trace_append(b, "\\u%04x", c);
+    else _trace_append(b, "%c", c);
+  }
+  _trace_append(b, "\"");
+}
+
+// Appends the start of a complete event. The caller appends its args and
+// closes it.
+static void _trace_beginEvent(traceBuffer* b, const char* name,
+                              const char* category, uint64_t start,
+                              uint64_t end)
+{
+  _trace_append(b, ",\n{\"name\":");
+  _trace_appendString(b, name);
+  _trace_append(b, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+                   "\"dur\":%.3f,\"pid\":%ld,\"tid\":%ld,\"args\":{",
+                category, (start - b->owner->startTime) / 1e3,
+                (end - start) / 1e3, (long)getpid(), _trace_getTid());
+}
+
+static void _trace_printSummary(ptracer t)
+{
+  double elapsed = (_trace_now() - t->startTime) / 1e9;
+
+  fprintf(stderr, "\n%-14s %8s %10s %14s %10s\n", "Phase", "Count",
+          "Time (s)", "Bytes", "MB/s");
+  int i;
+  for (i = 0; i < TRACE_NUM_PHASES; ++i) {
+    tracePhaseTotal* total = &t->totals[i];
+    if (total->count == 0) continue;
+    double seconds = total->time / 1e9;
+    fprintf(stderr, "%-14s %8zu %10.3f %14llu", _trace_phaseNames[i],
+            total->count, seconds, (unsigned long long)total->bytes);
+    if (total->bytes > 0 && seconds > 0)
+      fprintf(stderr, " %10.1f", total->bytes / seconds / 1e6);
+    fprintf(stderr, "\n");
+  }
+  for (i = 0; i < TRACE_NUM_PHASES; ++i) {
+    tracePhaseTotal* total = &t->totals[i];
+    if (total->lastSize == 0) continue;
+    fprintf(stderr, "%s size: %zu to %zu bytes, %zu at the end\n",
+            _trace_phaseNames[i], total->minSize, total->maxSize,
+            total->lastSize);
+  }
+  fprintf(stderr, "%zu files, %llu bytes in %.3f s", t->numFiles,
+          (unsigned long long)t->fileBytes, elapsed);
+  if (elapsed > 0)
+    fprintf(stderr, " (%.1f MB/s)", t->fileBytes / elapsed / 1e6);
+  fprintf(stderr, "\n");
+}
+
+ptracer trace_D_start(const char* path)
+{
+  ptracer t = calloc(1, sizeof(tracer));
+  if (!t) return NULL;
+
+  t->file = fopen(path, "w");
+  if (!t->file) {
+    fprintf(stderr, "Error opening the trace file %s: %s\n", path,
+            strerror(errno));
+    free(t);
+    return NULL;
+  }
+
+  pthread_mutex_init(&t->mutex, NULL);
+  t->isFirstEvent = true;
+  t->startTime = _trace_now();
+  return t;
+}
+
+void trace_finish(ptracer t)
+{
+  if (!t) return;
+
+  // The other threads have added theirs as they exited
+  if (_trace_buffer && _trace_buffer->owner == t) _trace_flush(_trace_buffer);
+
+  fprintf(t->file, "%s]\n", t->isFirstEvent ? "[" : "\n");
+  fclose(t->file);
+  _trace_printSummary(t);
+  pthread_mutex_destroy(&t->mutex);
+  free(t);
+}
+
+uint64_t trace_begin()
+{
+  return scpOptions_get()->tracer ? _trace_now() : 0;
+}
+
+void trace_end(tracePhase phase, uint64_t start, size_t bytes)
+{
+  if (start == 0) return;
+
+  uint64_t end = _trace_now();
+  _trace_threadTimes[phase] += end - start;
+
+  ptracer t = scpOptions_get()->tracer;
+  traceBuffer* b = t ? _trace_getBuffer(t) : NULL;
+  if (!b) return;
+  b->totals[phase].time += end - start;
+  b->totals[phase].bytes += bytes;
+  b->totals[phase].count++;
+
+  if (_trace_isWritten[phase]) {
+    _trace_beginEvent(b, _trace_phaseNames[phase], _trace_phaseNames[phase],
+                      start, end);
+    _trace_append(b, "\"bytes\":%zu}}", bytes);
+    if (b->eventsLen >= TRACE_BUFFER_SIZE) _trace_flush(b);
+  }
+}
+
+void trace_beginFile(traceFile* file)
+{
+  file->start = trace_begin();
+  if (file->start == 0) return;
+  memcpy(file->phaseTimes, _trace_threadTimes, sizeof(file->phaseTimes));
+}
+
+void trace_endFile(traceFile* file, const char* name, size_t bytes)
+{
+  if (file->start == 0) return;
+
+  uint64_t end = _trace_now();
+  ptracer t = scpOptions_get()->tracer;
+  traceBuffer* b = t ? _trace_getBuffer(t) : NULL;
+  if (!b) return;
+  b->numFiles++;
+  b->fileBytes += bytes;
+
+  _trace_beginEvent(b, name, "file", file->start, end);
+  _trace_append(b, "\"bytes\":%zu", bytes);
+  int i;
+  for (i = 0; i < TRACE_NUM_PHASES; ++i) {
+    uint64_t time = _trace_threadTimes[i] - file->phaseTimes[i];
+    if (!_trace_isWritten[i] && time > 0)
+      _trace_append(b, ",\"%s (ms)\":%.3f", _trace_phaseNames[i],
+                    time / 1e6);
+  }
+  _trace_append(b, "}}");
+
+  // Each file is added to the trace as it ends, so that the totals are
+  // never far behind
+  _trace_flush(b);
+}
+
+void trace_chunkSize(tracePhase phase, size_t size)
+{
+  ptracer t = scpOptions_get()->tracer;
+  traceBuffer* b = t ? _trace_getBuffer(t) : NULL;
+  if (!b) return;
+  tracePhaseTotal* total = &b->totals[phase];
+  if (total->lastSize == 0 || size < total->minSize) total->minSize = size;
+  if (size > total->maxSize) total->maxSize = size;
+  total->lastSize = size;
+
+  // A counter event, which Chrome draws as a graph over time. Each thread
+  // has its own sizer, so each gets its own graph.
+  _trace_append(b, ",\n{\"name\":\"%s size\",\"ph\":\"C\",\"ts\":%.3f,"
+                   "\"pid\":%ld,\"id\":%ld,\"args\":{\"bytes\":%zu}}",
+                _trace_phaseNames[phase],
+                (_trace_now() - t->startTime) / 1e3, (long)getpid(),
+                _trace_getTid(), size);
+  if (b->eventsLen >= TRACE_BUFFER_SIZE) _trace_flush(b);
+}
@@ -0,0 +1,112 @@
+/**********************************************************************
+  transfer.c - Source code for the functions that pick how a copy is
+               carried out based upon the scpOptions
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#include <stdbool.h>
+
+#include <fileSystemUtils.h>
+#include <incrementalSync.h>
+#include <parallelScp.h>
+#include <progress.h>
+#include <resumeJournal.h>
+#include <scp.h>
+#include <scpOptions.h>
+#include <sftpTransfer.h>
+#include <tarStream.h>
+#include <transfer.h>
+
+// Compressed copies are also sent as a tar stream
+static bool _transfer_useTarStream()
+{
+  pscpOptions options = scpOptions_get();
+#ifdef SCP_HAVE_ZSTD
+  if (options->compress) return true;
+#endif
+  return options->useTar;
+}
+
+static bool _transfer_isParallel()
+{
+  pscpOptions options = scpOptions_get();
+  return options->numJobs > 1 || options->numStripes > 1 ||
+         options->useEventLoop;
+}
+
+// Resumable copies go through sftp, which can read and write at an offset
+static int _transfer_copyResumable(ssh_session session, psshInfo info,
+                                   char* from, char* to, bool isUpload)
+{
+  presumeJournal journal = resumeJournal_D_open(info, isUpload, from, to);
+  if (!journal) return SSH_ERROR;
+
+  int rc = isUpload ?
+           sftpTransfer_resumeToServer(session, journal, from, to, true) :
+           sftpTransfer_resumeFromServer(session, journal, from, to, true);
+
+  resumeJournal_close(journal, rc == SSH_OK);
+  return rc;
+}
+
+int transfer_copyFromServer(ssh_session session, psshInfo info,
+                            char* from, char* to)
+{
+  // The server counts what will be sent, so the progress can show an ETA
+  progress_addRemoteTotal(session, from);
+
+  if (scpOptions_get()->resume)
+    return _transfer_copyResumable(session, info, from, to, false);
+
+  if (scpOptions_get()->incremental) {
+    int rc = incrementalSync_copyFromServer(session, info, from, to);
+    if (rc != INCREMENTAL_SYNC_UNAVAILABLE)
+      return rc == INCREMENTAL_SYNC_OK ? SSH_OK : SSH_ERROR;
+  }
+
+  if (_transfer_useTarStream())
+    return tarStream_copyFromServer(session, from, to);
+
+  if (_transfer_isParallel())
+    return parallelScp_copyFromServer(session, info, from, to);
+
+  // Let's just turn recursive mode on...
+  return scp_copyFromServer(session, from, to, true);
+}
+
+int transfer_copyToServer(ssh_session session, psshInfo info,
+                          char* from, char* to)
+{
+  // What is sent is known up front, so the progress can show an ETA
+  progress_addLocalTotal(from);
+
+  if (scpOptions_get()->resume)
+    return _transfer_copyResumable(session, info, from, to, true);
+
+  if (scpOptions_get()->incremental) {
+    int rc = incrementalSync_copyToServer(session, info, from, to);
+    if (rc != INCREMENTAL_SYNC_UNAVAILABLE)
+      return rc == INCREMENTAL_SYNC_OK ? SSH_OK : SSH_ERROR;
+  }
+
+  // A single file only gains from the tar stream if it is compressed, which
+  // tarStream_copyToServer() works out once it has asked the server
+  if (_transfer_useTarStream() &&
+      (fileSystemUtils_getFileType(from) == FILE_IS_DIR ||
+       scpOptions_get()->compress))
+    return tarStream_copyToServer(session, from, to);
+
+  if (_transfer_isParallel())
+    return parallelScp_copyToServer(session, info, from, to);
+
+  return scp_copyToServer(session, from, to, true);
+}
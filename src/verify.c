@@ -0,0 +1,437 @@
+/**********************************************************************
+  verify.c - Source code for checking that the copies of files match
+             their sources from end to end
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <checksum.h>
+#include <chunkQueue.h>
+#include <remoteExec.h>
+#include <scpOptions.h>
+#include <verify.h>
+
+// A path may grow up to four times when it is quoted for the shell
+#define VERIFY_QUOTED_SIZE (4 * PATH_MAX + 3)
+#define VERIFY_COMMAND_SIZE (2 * VERIFY_QUOTED_SIZE + 128)
+// Room for the longest digest written out in hex
+#define VERIFY_HEX_SIZE (2 * CHECKSUM_MD5_SIZE + 1)
+
+// A file that is being hashed or has been hashed
+typedef struct {
+  char* localPath;
+  char* remotePath;
+  char hex[VERIFY_HEX_SIZE];
+} verifyFile;
+
+struct verifier {
+  ssh_session session;
+  // XXH64 (through the helper) or MD5 (through md5sum)
+  bool useXxh64;
+
+  // The bytes to be hashed go to the thread through the queue. An empty
+  // chunk ends the current file.
+  pchunkQueue queue;
+  pthread_t thread;
+  // The chunk that verify_update() is filling
+  pchunk current;
+
+  // The thread fills in the digests, so files are only added with the
+  // lock held
+  pthread_mutex_t lock;
+  verifyFile* files;
+  size_t numFiles;
+  size_t capacity;
+  bool hasOpenFile;
+};
+
+typedef struct {
+  md5Context md5;
+  xxh64Context xxh64;
+} verifyContext;
+
+static void _verify_init(pverifier v, verifyContext* ctx)
+{
+  if (v->useXxh64) checksum_xxh64Init(&ctx->xxh64);
+  else checksum_md5Init(&ctx->md5);
+}
+
+static void _verify_hash(pverifier v, verifyContext* ctx, const void* data,
+                         size_t len)
+{
+  if (v->useXxh64) checksum_xxh64Update(&ctx->xxh64, data, len);
+  else checksum_md5Update(&ctx->md5, data, len);
+}
+
+static void _verify_final(pverifier v, verifyContext* ctx, char* hex)
+{
+  unsigned char digest[CHECKSUM_MD5_SIZE];
+  size_t size = v->useXxh64 ? CHECKSUM_XXH64_SIZE : CHECKSUM_MD5_SIZE;
+  if (v->useXxh64) checksum_xxh64Final(&ctx->xxh64, digest);
+  else checksum_md5Final(&ctx->md5, digest);
+
+  size_t i;
+  for (i = 0; i < size; ++i) sprintf(hex + 2 * i, "%02x", digest[i]);
+}
+
+// The hashing thread
+static void* _verify_run(void* arg)
+{
+  pverifier v = arg;
+  verifyContext ctx;
+  size_t numHashed = 0;
+  _verify_init(v, &ctx);
+
+  pchunk c;
+  while ((c = chunkQueue_popFull(v->queue)) != NULL) {
+    if (c->len > 0) {
+      _verify_hash(v, &ctx, c->data, c->len);
+    }
+    else {
+      pthread_mutex_lock(&v->lock);
+      _verify_final(v, &ctx, v->files[numHashed++].hex);
+      pthread_mutex_unlock(&v->lock);
+      _verify_init(v, &ctx);
+    }
+    chunkQueue_releaseFree(v->queue, c);
+  }
+
+  return NULL;
+}
+
+pverifier verify_D_start(ssh_session session)
+{
+  pscpOptions options = scpOptions_get();
+  if (!options->verify) return NULL;
+
+  pverifier v = calloc(1, sizeof(verifier));
+  if (!v) return NULL;
+  v->session = session;
+  v->useXxh64 = options->deltaHelper != NULL;
+
+  // The queue holds as much as the read-ahead does. The hash only holds up
+  // the copy if it falls that far behind.
+  v->queue = chunkQueue_D_new(options->chunkSize, options->queueDepth);
+  if (!v->queue) {
+    fprintf(stderr, "Error allocating the verify queue in %s\n",
+            __FUNCTION__);
+    free(v);
+    return NULL;
+  }
+
+  pthread_mutex_init(&v->lock, NULL);
+  if (scpOptions_startThread(&v->thread, _verify_run, v) != 0) {
+    fprintf(stderr, "Error starting the verify thread in %s\n", __FUNCTION__);
+    pthread_mutex_destroy(&v->lock);
+    chunkQueue_free(v->queue);
+    free(v);
+    return NULL;
+  }
+
+  return v;
+}
+
+void verify_beginFile(pverifier v, const char* localPath,
+                      const char* remotePath)
+{
+  if (!v) return;
+
+  pthread_mutex_lock(&v->lock);
+  if (v->numFiles == v->capacity) {
+    size_t newCapacity = v->capacity ? 2 * v->capacity : 64;
+    verifyFile* files = realloc(v->files, newCapacity * sizeof(verifyFile));
+    if (files) {
+      v->files = files;
+      v->capacity = newCapacity;
+    }
+  }
+
+  verifyFile* file = v->numFiles < v->capacity ?
+                     &v->files[v->numFiles] : NULL;
+  if (file) {
+    file->localPath = strdup(localPath);
+    file->remotePath = strdup(remotePath);
+    file->hex[0] = '\0';
+  }
+  if (!file || !file->localPath || !file->remotePath) {
+    fprintf(stderr, "Error allocating memory in %s\n", __FUNCTION__);
+    if (file) {
+      free(file->localPath);
+      free(file->remotePath);
+    }
+  }
+  else {
+    v->numFiles++;
+    v->hasOpenFile = true;
+  }
+  pthread_mutex_unlock(&v->lock);
+}
+
+void verify_update(pverifier v, const void* data, size_t len)
+{
+  if (!v || !v->hasOpenFile) return;
+
+  size_t chunkSize = chunkQueue_getChunkSize(v->queue);
+  const char* p = data;
+  while (len > 0) {
+    if (!v->current) v->current = chunkQueue_acquireFree(v->queue);
+    if (!v->current) return;
+
+    size_t n = chunkSize - v->current->len;
+    if (n > len) n = len;
+    memcpy(v->current->data + v->current->len, p, n);
+    v->current->len += n;
+    p += n;
+    len -= n;
+
+    if (v->current->len == chunkSize) {
+      chunkQueue_pushFull(v->queue, v->current);
+      v->current = NULL;
+    }
+  }
+}
+
+bool verify_updateFromFile(pverifier v, int fd, size_t len)
+{
+  if (!v || len == 0) return true;
+
+  size_t bufferSize = chunkQueue_getChunkSize(v->queue);
+  char* buffer = malloc(bufferSize);
+  if (!buffer) return false;
+
+  size_t offset = 0;
+  while (offset < len) {
+    size_t want = len - offset < bufferSize ? len - offset : bufferSize;
+    ssize_t rc = pread(fd, buffer, want, offset);
+    if (rc < 0 && errno == EINTR) continue;
+    if (rc <= 0) break;
+    verify_update(v, buffer, rc);
+    offset += rc;
+  }
+
+  free(buffer);
+  return offset == len;
+}
+
+void verify_endFile(pverifier v)
+{
+  if (!v || !v->hasOpenFile) return;
+
+  if (v->current && v->current->len > 0) {
+    chunkQueue_pushFull(v->queue, v->current);
+    v->current = NULL;
+  }
+
+  // An empty chunk tells the thread that the file is finished
+  pchunk c = v->current ? v->current : chunkQueue_acquireFree(v->queue);
+  v->current = NULL;
+  if (c) chunkQueue_pushFull(v->queue, c);
+  v->hasOpenFile = false;
+}
+
+// Hashes the files on the server. The output has one line per file, in the
+// same order, that starts with the digest or is "-" if it couldn't be read.
+static char* _verify_D_hashRemote(pverifier v, size_t numFiles)
+{
+  pscpOptions options = scpOptions_get();
+  char command[VERIFY_COMMAND_SIZE];
+  if (v->useXxh64) {
+    char quotedHelper[VERIFY_QUOTED_SIZE];
+    if (!remoteExec_quote(options->deltaHelper, quotedHelper,
+                          sizeof(quotedHelper)))
+      return NULL;
+    snprintf(command, sizeof(command), "exec %s --verify-hash",
+             quotedHelper);
+  }
+  else {
+    // md5sum of a missing file prints nothing, which would throw the lines
+    // out of order, so each file gets a line of its own
+    snprintf(command, sizeof(command), "exec xargs -0 sh -c 'for f; do "
+             "md5sum < \"$f\" 2>/dev/null || echo -; done' sh");
+  }
+
+  // The names are passed separated by NULs
+  size_t inputLen = 0;
+  size_t i;
+  for (i = 0; i < numFiles; ++i)
+    inputLen += strlen(v->files[i].remotePath) + 1;
+  char* input = malloc(inputLen);
+  if (!input) return NULL;
+  char* p = input;
+  for (i = 0; i < numFiles; ++i) {
+    size_t len = strlen(v->files[i].remotePath) + 1;
+    memcpy(p, v->files[i].remotePath, len);
+    p += len;
+  }
+
+  char* output = remoteExec_D_runWithInput(v->session, command, input,
+                                           inputLen, NULL);
+  free(input);
+  return output;
+}
+
+// Compares the digests and reports every file that differs
+static bool _verify_compare(pverifier v, size_t numFiles)
+{
+  char* output = _verify_D_hashRemote(v, numFiles);
+  if (!output) {
+    fprintf(stderr, "Error computing the digests on the server\n");
+    return false;
+  }
+
+  size_t numFailed = 0;
+  char* line = output;
+  size_t i;
+  for (i = 0; i < numFiles; ++i) {
+    char* next = strchr(line, '\n');
+    if (next) *next++ = '\0';
+    else next = line + strlen(line);
+
+    const verifyFile* file = &v->files[i];
+    size_t hexLen = strlen(file->hex);
+    if (*line == '\0' || strcmp(line, "-") == 0) {
+      fprintf(stderr, "Verify failed: %s could not be read on the server\n",
+              file->remotePath);
+      numFailed++;
+    }
+    else if (strncmp(line, file->hex, hexLen) != 0 ||
+             (line[hexLen] != '\0' && line[hexLen] != ' ')) {
+      fprintf(stderr, "Verify failed: %s does not match %s on the server\n",
+              file->localPath, file->remotePath);
+      numFailed++;
+    }
+
+    line = next;
+  }
+  free(output);
+
+  if (numFailed > 0)
+    fprintf(stderr, "%zu of %zu files failed to verify\n", numFailed,
+            numFiles);
+  else
+    printf("Verified %zu files with %s\n", numFiles,
+           v->useXxh64 ? "XXH64" : "MD5");
+  return numFailed == 0;
+}
+
+bool verify_finish(pverifier v, bool check)
+{
+  if (!v) return true;
+
+  // A file that wasn't ended was not copied completely, so it isn't checked
+  size_t numFiles = v->numFiles;
+  if (v->hasOpenFile) numFiles--;
+  if (v->current) chunkQueue_releaseFree(v->queue, v->current);
+
+  chunkQueue_finish(v->queue, true);
+  pthread_join(v->thread, NULL);
+
+  bool success = !check || numFiles == 0 || _verify_compare(v, numFiles);
+
+  size_t i;
+  for (i = 0; i < v->numFiles; ++i) {
+    free(v->files[i].localPath);
+    free(v->files[i].remotePath);
+  }
+  free(v->files);
+  chunkQueue_free(v->queue);
+  pthread_mutex_destroy(&v->lock);
+  free(v);
+  return success;
+}
+
+bool verify_checkFile(ssh_session session, const char* localPath,
+                      const char* remotePath)
+{
+  pverifier v = verify_D_start(session);
+  if (!v) return true;
+
+  struct stat st;
+  int fd = open(localPath, O_RDONLY | O_CLOEXEC);
+  verify_beginFile(v, localPath, remotePath);
+  bool success = fd >= 0 && fstat(fd, &st) == 0 &&
+                 verify_updateFromFile(v, fd, st.st_size);
+  if (success) verify_endFile(v);
+  else fprintf(stderr, "Error reading %s to verify it\n", localPath);
+  if (fd >= 0) close(fd);
+
+  return verify_finish(v, success) && success;
+}
+
+bool verify_getRemoteDest(ssh_session session, const char* from,
+                          const char* to, char* dest)
+{
+  const char* base = strrchr(from, '/');
+  base = base ? base + 1 : from;
+
+  char quotedTo[VERIFY_QUOTED_SIZE];
+  char quotedBase[VERIFY_QUOTED_SIZE];
+  char command[VERIFY_COMMAND_SIZE];
+  if (!remoteExec_quote(to, quotedTo, sizeof(quotedTo)) ||
+      !remoteExec_quote(base, quotedBase, sizeof(quotedBase)))
+    return false;
+  snprintf(command, sizeof(command),
+           "d=%s; if [ -d \"$d\" ]; then d=\"$d\"/%s; fi; printf '%%s' \"$d\"",
+           quotedTo, quotedBase);
+
+  char* output = remoteExec_D_run(session, command, NULL);
+  if (!output) return false;
+  bool success = snprintf(dest, PATH_MAX, "%s", output) < PATH_MAX;
+  free(output);
+  return success;
+}
+
+int verify_serveHash()
+{
+  size_t bufferSize = scpOptions_get()->chunkSize;
+  char* buffer = malloc(bufferSize);
+  if (!buffer) return 1;
+
+  char* path = NULL;
+  size_t pathSize = 0;
+  while (getdelim(&path, &pathSize, '\0', stdin) > 0) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    xxh64Context ctx;
+    checksum_xxh64Init(&ctx);
+    ssize_t n = fd < 0 ? -1 : 0;
+    while (fd >= 0 && (n = read(fd, buffer, bufferSize)) != 0) {
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) break;
+      checksum_xxh64Update(&ctx, buffer, n);
+    }
+    if (fd >= 0) close(fd);
+
+    if (n != 0) {
+      printf("-\n");
+      continue;
+    }
+
+    unsigned char digest[CHECKSUM_XXH64_SIZE];
+    checksum_xxh64Final(&ctx, digest);
+    int i;
+    for (i = 0; i < CHECKSUM_XXH64_SIZE; ++i) printf("%02x", digest[i]);
+    printf("\n");
+  }
+
+  free(path);
+  free(buffer);
+  return fflush(stdout) == 0 ? 0 : 1;
+}
@@ -0,0 +1,180 @@
+/**********************************************************************
+  workQueue.c - Source code for a work-stealing queue that spreads a list
+                of jobs across a number of worker threads
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include <workQueue.h>
+
+// A growable ring of jobs with its own lock. The owner takes from the head
+// and thieves take from the tail, so they rarely want the same job.
+typedef struct {
+  pthread_mutex_t lock;
+  void** jobs;
+  size_t capacity;
+  size_t head;
+  size_t count;
+} deque;
+
+struct workQueue {
+  int numWorkers;
+  deque* deques;
+  // Only ever goes from false to true, so it is read and written
+  // atomically instead of under a lock
+  bool canceled;
+};
+
+pworkQueue workQueue_D_new(int numWorkers)
+{
+  if (numWorkers < 1) return NULL;
+
+  pworkQueue queue = calloc(1, sizeof(workQueue));
+  if (!queue) return NULL;
+
+  queue->deques = calloc(numWorkers, sizeof(deque));
+  if (!queue->deques) {
+    free(queue);
+    return NULL;
+  }
+
+  queue->numWorkers = numWorkers;
+  int i;
+  for (i = 0; i < numWorkers; i++)
+    pthread_mutex_init(&queue->deques[i].lock, NULL);
+
+  return queue;
+}
+
+void workQueue_free(pworkQueue queue)
+{
+  if (!queue) return;
+
+  int i;
+  for (i = 0; i < queue->numWorkers; i++) {
+    pthread_mutex_destroy(&queue->deques[i].lock);
+    free(queue->deques[i].jobs);
+  }
+  free(queue->deques);
+  free(queue);
+}
+
+bool workQueue_push(pworkQueue queue, int worker, void* job)
+{
+  deque* d = &queue->deques[worker % queue->numWorkers];
+  bool success = true;
+
+  pthread_mutex_lock(&d->lock);
+  if (d->count == d->capacity) {
+    // Double the capacity and unwrap the ring into the new array
+    size_t newCapacity = d->capacity ? d->capacity * 2 : 64;
+    void** jobs = malloc(newCapacity * sizeof(void*));
+    if (!jobs) success = false;
+    else {
+      size_t i;
+      for (i = 0; i < d->count; i++)
+        jobs[i] = d->jobs[(d->head + i) % d->capacity];
+      free(d->jobs);
+      d->jobs = jobs;
+      d->capacity = newCapacity;
+      d->head = 0;
+    }
+  }
+
+  if (success) {
+    d->jobs[(d->head + d->count) % d->capacity] = job;
+    d->count++;
+  }
+  pthread_mutex_unlock(&d->lock);
+
+  return success;
+}
+
+bool workQueue_pushAll(pworkQueue queue, void** jobs, size_t numJobs)
+{
+  size_t perWorker = (numJobs + queue->numWorkers - 1) / queue->numWorkers;
+  size_t i;
+  for (i = 0; i < numJobs; i++) {
+    if (!workQueue_push(queue, i / perWorker, jobs[i])) return false;
+  }
+  return true;
+}
+
+// Takes from the head of a deque. Returns NULL if it is empty.
+static void* _workQueue_takeHead(deque* d)
+{
+  void* job = NULL;
+  pthread_mutex_lock(&d->lock);
+  if (d->count > 0) {
+    job = d->jobs[d->head];
+    d->head = (d->head + 1) % d->capacity;
+    d->count--;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return job;
+}
+
+// Takes from the tail of a deque. Returns NULL if it is empty.
+static void* _workQueue_takeTail(deque* d)
+{
+  void* job = NULL;
+  pthread_mutex_lock(&d->lock);
+  if (d->count > 0) {
+    d->count--;
+    job = d->jobs[(d->head + d->count) % d->capacity];
+  }
+  pthread_mutex_unlock(&d->lock);
+  return job;
+}
+
+void* workQueue_pop(pworkQueue queue, int worker)
+{
+  if (__atomic_load_n(&queue->canceled, __ATOMIC_ACQUIRE)) return NULL;
+
+  void* job = _workQueue_takeHead(&queue->deques[worker % queue->numWorkers]);
+  if (job) return job;
+
+  // Our own deque is empty. Steal from whoever has the most left. Another
+  // thief may beat us to it, so retry until every deque really is empty.
+  while (!__atomic_load_n(&queue->canceled, __ATOMIC_ACQUIRE)) {
+    int victim = -1;
+    size_t most = 0;
+    int i;
+    for (i = 0; i < queue->numWorkers; i++) {
+      pthread_mutex_lock(&queue->deques[i].lock);
+      size_t count = queue->deques[i].count;
+      pthread_mutex_unlock(&queue->deques[i].lock);
+      if (count > most) {
+        most = count;
+        victim = i;
+      }
+    }
+    if (victim < 0) return NULL;
+
+    job = _workQueue_takeTail(&queue->deques[victim]);
+    if (job) return job;
+  }
+
+  return NULL;
+}
+
+void workQueue_cancel(pworkQueue queue)
+{
+  __atomic_store_n(&queue->canceled, true, __ATOMIC_RELEASE);
+}
+
+bool workQueue_isCanceled(pworkQueue queue)
+{
+  return __atomic_load_n(&queue->canceled, __ATOMIC_ACQUIRE);
+}
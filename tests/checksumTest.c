@@ -0,0 +1,206 @@
+/**********************************************************************
+  checksumTest.c - Checks the MD5 and XXH64 digests against known
+                   vectors, whole and fed in pieces
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <checksum.h>
+
+#include "test.h"
+
+typedef struct {
+  const char* data;
+  const char* digest;
+} checksumVector;
+
+// The test suite of RFC 1321
+static const checksumVector _checksumTest_md5Vectors[] = {
+  { "", "d41d8cd98f00b204e9800998ecf8427e" },
+  { "a", "0cc175b9c0f1b6a831c399e269772661" },
+  { "abc", "900150983cd24fb0d6963f7d28e17f72" },
+  { "message digest", "f96b697d7cb7938d525a2f31aaf161d0" },
+  { "abcdefghijklmnopqrstuvwxyz", "c3fcd3d76192e4007dfb496cca67e13b" },
+  { "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789",
+    "d174ab98d277d9f5a5611c2c9f419d9f" },
+  { "1234567890123456789012345678901234567890123456789012345678901234567890"
+    "1234567890", "57edf4a22be3c955ac49da2e2107b67a" }
+};
+
+// Lengths around the 64 byte block, where the padding spills into a
+// second block or doesn't, of the bytes (i * 7 + 3) & 0xff
+typedef struct {
+  size_t len;
+  const char* digest;
+} checksumLengthVector;
+
+static const checksumLengthVector _checksumTest_md5Lengths[] = {
+  { 55, "52c0e574e1198de5fe3f8f11440dcb1b" },
+  { 56, "46c9907fc908ee68b1e7b8e71286a518" },
+  { 63, "a62f6d59e837867693f042f5b8f5a236" },
+  { 64, "7160b8fb5e9e4023d549c3971fbaeead" },
+  { 65, "70bd662e7aefbda85a0f7244167b7897" },
+  { 1000000, "4e8560dbecc9d8178fccd03632c646cb" }
+};
+
+// The same strings, as xxhsum prints their XXH64 with a seed of 0
+static const checksumVector _checksumTest_xxh64Vectors[] = {
+  { "", "ef46db3751d8e999" },
+  { "a", "d24ec4f1a98c6e5b" },
+  { "abc", "44bc2cf5ad770999" },
+  { "message digest", "066ed728fceeb3be" },
+  { "abcdefghijklmnopqrstuvwxyz", "cfe1f278fa89835c" },
+  { "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789",
+    "aaa46907d3047814" },
+  { "1234567890123456789012345678901234567890123456789012345678901234567890"
+    "1234567890", "e04a477f19ee145d" }
+};
+
+// Lengths around the 32 byte stripe, and with tails of 8, 4 and 1 bytes
+static const checksumLengthVector _checksumTest_xxh64Lengths[] = {
+  { 3, "31d2363f52e564c9" },
+  { 4, "9bb64b7d66ee9fda" },
+  { 7, "9a7b149959ce60d8" },
+  { 8, "dab99d95c6f90092" },
+  { 31, "a2aa5f33cc4a6119" },
+  { 32, "23c3c17ef790fd97" },
+  { 33, "50a7cfc7ba588784" },
+  { 63, "5e3e54b431c7493c" },
+  { 64, "0eb64b3ef6eeb01f" },
+  { 100, "a61f8d4c170fe531" },
+  { 1000000, "b978085cc8e7010e" }
+};
+
+#define CHECKSUM_TEST_COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+// The digest of data, fed to the context step bytes at a time
+static void _checksumTest_md5Pieces(const unsigned char* data, size_t len,
+                                    size_t step, char* hex)
+{
+  md5Context ctx;
+  checksum_md5Init(&ctx);
+  size_t i;
+  for (i = 0; i < len; i += step)
+    checksum_md5Update(&ctx, data + i, len - i < step ? len - i : step);
+
+  unsigned char digest[CHECKSUM_MD5_SIZE];
+  checksum_md5Final(&ctx, digest);
+  test_toHex(digest, CHECKSUM_MD5_SIZE, hex);
+}
+
+static void _checksumTest_md5()
+{
+  char hex[2 * CHECKSUM_MD5_SIZE + 1];
+  unsigned char digest[CHECKSUM_MD5_SIZE];
+  size_t i;
+
+  for (i = 0; i < CHECKSUM_TEST_COUNT(_checksumTest_md5Vectors); i++) {
+    const checksumVector* v = &_checksumTest_md5Vectors[i];
+    checksum_md5(v->data, strlen(v->data), digest);
+    test_toHex(digest, CHECKSUM_MD5_SIZE, hex);
+    TEST_CHECK(strcmp(hex, v->digest) == 0);
+
+    _checksumTest_md5Pieces((const unsigned char*)v->data, strlen(v->data),
+                            1, hex);
+    TEST_CHECK(strcmp(hex, v->digest) == 0);
+  }
+
+  unsigned char* data = malloc(1000000);
+  if (!data) return;
+  for (i = 0; i < 1000000; i++) data[i] = (i * 7 + 3) & 0xff;
+
+  // Pieces that are smaller than a block, that straddle blocks and that
+  // are several blocks long must all give the same digest
+  size_t steps[] = { 1, 13, 64, 100, 4096 };
+  for (i = 0; i < CHECKSUM_TEST_COUNT(_checksumTest_md5Lengths); i++) {
+    const checksumLengthVector* v = &_checksumTest_md5Lengths[i];
+    checksum_md5(data, v->len, digest);
+    test_toHex(digest, CHECKSUM_MD5_SIZE, hex);
+    TEST_CHECK(strcmp(hex, v->digest) == 0);
+
+    size_t j;
+    for (j = 0; j < CHECKSUM_TEST_COUNT(steps); j++) {
+      _checksumTest_md5Pieces(data, v->len, steps[j], hex);
+      TEST_CHECK(strcmp(hex, v->digest) == 0);
+    }
+  }
+
+  // A million 'a's, which runs through many blocks of the same bytes
+  memset(data, 'a', 1000000);
+  checksum_md5(data, 1000000, digest);
+  test_toHex(digest, CHECKSUM_MD5_SIZE, hex);
+  TEST_CHECK(strcmp(hex, "7707d6ae4e027c70eea2a935c2296f21") == 0);
+
+  free(data);
+}
+
+static void _checksumTest_xxh64Pieces(const unsigned char* data, size_t len,
+                                      size_t step, char* hex)
+{
+  xxh64Context ctx;
+  checksum_xxh64Init(&ctx);
+  size_t i;
+  for (i = 0; i < len; i += step)
+    checksum_xxh64Update(&ctx, data + i, len - i < step ? len - i : step);
+
+  unsigned char digest[CHECKSUM_XXH64_SIZE];
+  checksum_xxh64Final(&ctx, digest);
+  test_toHex(digest, CHECKSUM_XXH64_SIZE, hex);
+}
+
+static void _checksumTest_xxh64()
+{
+  char hex[2 * CHECKSUM_XXH64_SIZE + 1];
+  size_t i;
+
+  for (i = 0; i < CHECKSUM_TEST_COUNT(_checksumTest_xxh64Vectors); i++) {
+    const checksumVector* v = &_checksumTest_xxh64Vectors[i];
+    _checksumTest_xxh64Pieces((const unsigned char*)v->data, strlen(v->data),
+                              strlen(v->data) + 1, hex);
+    TEST_CHECK(strcmp(hex, v->digest) == 0);
+
+    _checksumTest_xxh64Pieces((const unsigned char*)v->data, strlen(v->data),
+                              1, hex);
+    TEST_CHECK(strcmp(hex, v->digest) == 0);
+  }
+
+  unsigned char* data = malloc(1000000);
+  if (!data) return;
+  for (i = 0; i < 1000000; i++) data[i] = (i * 7 + 3) & 0xff;
+
+  // Pieces that are smaller than a stripe, that straddle stripes and that
+  // are several stripes long must all give the same digest
+  size_t steps[] = { 1, 5, 32, 100, 4096 };
+  for (i = 0; i < CHECKSUM_TEST_COUNT(_checksumTest_xxh64Lengths); i++) {
+    const checksumLengthVector* v = &_checksumTest_xxh64Lengths[i];
+    size_t j;
+    for (j = 0; j < CHECKSUM_TEST_COUNT(steps); j++) {
+      _checksumTest_xxh64Pieces(data, v->len, steps[j], hex);
+      TEST_CHECK(strcmp(hex, v->digest) == 0);
+    }
+  }
+
+  memset(data, 'a', 1000000);
+  _checksumTest_xxh64Pieces(data, 1000000, 1000000, hex);
+  TEST_CHECK(strcmp(hex, "dc483aaa9b4fdc40") == 0);
+
+  free(data);
+}
+
+int main()
+{
+  _checksumTest_md5();
+  _checksumTest_xxh64();
+  return test_finish("checksum");
+}
@@ -0,0 +1,94 @@
+/**********************************************************************
+  chunkSizerTest.c - Checks how the size of the writes to the channel
+                     follows a simulated link
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#include <stdint.h>
+#include <time.h>
+
+#include <chunkSizer.h>
+
+#include "test.h"
+
+// The number of calls in each window of the sizer
+#define CHUNK_SIZER_TEST_WINDOW 16
+
+static uint64_t _chunkSizerTest_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Makes numWindows windows of writes to a link that takes overhead
+// nanoseconds for each call, plus the time to send its bytes at
+// bytesPerNs. A write sends all of its bytes, as ssh_scp_write() does.
+static void _chunkSizerTest_write(chunkSizer* sizer, int numWindows,
+                                  uint64_t overhead, double bytesPerNs)
+{
+  int i;
+  for (i = 0; i < numWindows * CHUNK_SIZER_TEST_WINDOW; i++) {
+    size_t n = chunkSizer_get(sizer);
+    uint64_t end = _chunkSizerTest_now() + overhead + n / bytesPerNs;
+    while (_chunkSizerTest_now() < end);
+    chunkSizer_record(sizer, n, n);
+  }
+}
+
+// When each call costs more than its bytes, larger writes go faster, so
+// the size should climb all the way up
+static void _chunkSizerTest_checkWriteGrows()
+{
+  chunkSizer sizer;
+  chunkSizer_init(&sizer, TRACE_CHANNEL_WRITE);
+  TEST_CHECK(chunkSizer_get(&sizer) == CHUNK_SIZER_START);
+
+  _chunkSizerTest_write(&sizer, 30, 200 * 1000, 4.0);
+  TEST_CHECK(chunkSizer_get(&sizer) == CHUNK_SIZER_MAX);
+}
+
+// A write that blocks for longer than CHUNK_SIZER_MAX_LATENCY holds up
+// everything else, so the size should not grow, even though a larger
+// write would send more each time
+static void _chunkSizerTest_checkWriteLatency()
+{
+  chunkSizer sizer;
+  chunkSizer_init(&sizer, TRACE_CHANNEL_WRITE);
+
+  _chunkSizerTest_write(&sizer, 2, CHUNK_SIZER_MAX_LATENCY + 1000 * 1000,
+                        4.0);
+  TEST_CHECK(chunkSizer_get(&sizer) == CHUNK_SIZER_START);
+}
+
+// Reads that come back short shrink the size towards what they return,
+// which a write never does
+static void _chunkSizerTest_checkShortReads()
+{
+  chunkSizer sizer;
+  chunkSizer_init(&sizer, TRACE_CHANNEL_READ);
+
+  int i;
+  for (i = 0; i < 4 * CHUNK_SIZER_TEST_WINDOW; i++) {
+    size_t n = chunkSizer_get(&sizer);
+    chunkSizer_record(&sizer, n, n / 4);
+  }
+  TEST_CHECK(chunkSizer_get(&sizer) == CHUNK_SIZER_MIN);
+}
+
+int main()
+{
+  _chunkSizerTest_checkWriteGrows();
+  _chunkSizerTest_checkWriteLatency();
+  _chunkSizerTest_checkShortReads();
+  return test_finish("chunkSizer");
+}
@@ -0,0 +1,149 @@
+/**********************************************************************
+  compressTest.c - Checks the stored zstd frames byte for byte, and that
+                   a stream of stored and compressed frames decodes
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zstd.h>
+
+#include <compress.h>
+
+#include "test.h"
+
+#define COMPRESS_TEST_CHUNK_SIZE (300 * 1024)
+
+// A stored frame: the magic number, a header with a 128K window and no
+// content size, and the blocks
+static const unsigned char _compressTest_emptyFrame[] =
+  { 0x28, 0xb5, 0x2f, 0xfd, 0x00, 0x38,
+    // A last raw block of 0 bytes
+    0x01, 0x00, 0x00 };
+
+// Decodes a whole stream with a small output buffer, so that the decoder
+// has to stop part way through frames
+static bool _compressTest_decode(const unsigned char* in, size_t inLen,
+                                 unsigned char* out, size_t outSize,
+                                 size_t* outLen)
+{
+  pcompressDecoder d = compress_D_newDecoder();
+  if (!d) return false;
+
+  *outLen = 0;
+  bool success = true;
+  while (success) {
+    size_t used;
+    size_t n;
+    size_t room = outSize - *outLen < 1000 ? outSize - *outLen : 1000;
+    success = compress_decode(d, in, inLen, &used, out + *outLen, room, &n);
+    in += used;
+    inLen -= used;
+    *outLen += n;
+    if (inLen == 0 && n < room) break;
+    if (used == 0 && n == 0) success = false;
+  }
+
+  compress_freeDecoder(d);
+  return success;
+}
+
+int main()
+{
+  pcompressEncoder e = compress_D_newEncoder(1, COMPRESS_TEST_CHUNK_SIZE);
+  TEST_CHECK(e != NULL);
+  if (!e) return test_finish("compress");
+
+  // An empty chunk is a frame of one empty block
+  size_t len;
+  const unsigned char* frame = compress_encode(e, "", 0, &len);
+  TEST_CHECK(len == sizeof(_compressTest_emptyFrame) &&
+             memcmp(frame, _compressTest_emptyFrame, len) == 0);
+
+  // Random bytes don't compress, so they are stored as they are. 1000 is
+  // 0x3e8, and a block header is the size shifted by 3, with the low bit
+  // set on the last block.
+  unsigned char* raw = malloc(COMPRESS_TEST_CHUNK_SIZE);
+  unsigned char* stream = malloc(4 * COMPRESS_TEST_CHUNK_SIZE);
+  unsigned char* out = malloc(4 * COMPRESS_TEST_CHUNK_SIZE);
+  if (!raw || !stream || !out) return 1;
+  test_fillRandom(raw, COMPRESS_TEST_CHUNK_SIZE, 13);
+
+  frame = compress_encode(e, raw, 1000, &len);
+  TEST_CHECK(len == 6 + 3 + 1000);
+  TEST_CHECK(memcmp(frame, _compressTest_emptyFrame, 6) == 0);
+  TEST_CHECK(frame[6] == 0x41 && frame[7] == 0x1f && frame[8] == 0x00);
+  TEST_CHECK(memcmp(frame + 9, raw, 1000) == 0);
+  TEST_CHECK(ZSTD_decompress(out, 1000, frame, len) == 1000 &&
+             memcmp(out, raw, 1000) == 0);
+
+  // A chunk of more than 128K is split into several blocks, and only the
+  // last has the low bit set
+  frame = compress_encode(e, raw, COMPRESS_TEST_CHUNK_SIZE, &len);
+  TEST_CHECK(len == 6 + 3 * 3 + COMPRESS_TEST_CHUNK_SIZE);
+  TEST_CHECK(frame[6] == 0x00 && frame[7] == 0x00 && frame[8] == 0x10);
+  size_t lastBlock = 6 + 2 * (3 + 128 * 1024);
+  uint32_t header = frame[lastBlock] | frame[lastBlock + 1] << 8 |
+                    (uint32_t)frame[lastBlock + 2] << 16;
+  TEST_CHECK(header == ((COMPRESS_TEST_CHUNK_SIZE - 256 * 1024) << 3 | 1));
+  TEST_CHECK(ZSTD_decompress(out, COMPRESS_TEST_CHUNK_SIZE, frame, len) ==
+             COMPRESS_TEST_CHUNK_SIZE &&
+             memcmp(out, raw, COMPRESS_TEST_CHUNK_SIZE) == 0);
+
+  const compressStats* stats = compress_getEncoderStats(e);
+  TEST_CHECK(stats->storedChunks == 3 && stats->compressedChunks == 0);
+
+  // A stream of a compressed frame between two stored ones decodes to the
+  // chunks one after another
+  size_t streamLen = 0;
+  frame = compress_encode(e, raw, 5000, &len);
+  memcpy(stream + streamLen, frame, len);
+  streamLen += len;
+
+  unsigned char* text = malloc(COMPRESS_TEST_CHUNK_SIZE);
+  if (!text) return 1;
+  size_t i;
+  for (i = 0; i < COMPRESS_TEST_CHUNK_SIZE; i++)
+    text[i] = "the quick brown fox jumps over the lazy dog\n"[i % 44];
+  frame = compress_encode(e, text, COMPRESS_TEST_CHUNK_SIZE, &len);
+  TEST_CHECK(len < COMPRESS_TEST_CHUNK_SIZE / 10);
+  TEST_CHECK(stats->compressedChunks == 1);
+  memcpy(stream + streamLen, frame, len);
+  streamLen += len;
+
+  frame = compress_encode(e, raw + 5000, 7000, &len);
+  memcpy(stream + streamLen, frame, len);
+  streamLen += len;
+
+  size_t outLen;
+  TEST_CHECK(_compressTest_decode(stream, streamLen, out,
+                                  4 * COMPRESS_TEST_CHUNK_SIZE, &outLen));
+  TEST_CHECK(outLen == 5000 + COMPRESS_TEST_CHUNK_SIZE + 7000);
+  TEST_CHECK(memcmp(out, raw, 5000) == 0);
+  TEST_CHECK(memcmp(out + 5000, text, COMPRESS_TEST_CHUNK_SIZE) == 0);
+  TEST_CHECK(memcmp(out + 5000 + COMPRESS_TEST_CHUNK_SIZE, raw + 5000,
+                    7000) == 0);
+  TEST_CHECK(stats->rawBytes == 1000 + COMPRESS_TEST_CHUNK_SIZE + 5000 +
+                                COMPRESS_TEST_CHUNK_SIZE + 7000);
+
+  // Anything that isn't a zstd frame is an error
+  memset(stream, 0xab, 64);
+  TEST_CHECK(!_compressTest_decode(stream, 64, out, 1000, &outLen));
+
+  compress_freeEncoder(e);
+  free(raw);
+  free(text);
+  free(stream);
+  free(out);
+  return test_finish("compress");
+}
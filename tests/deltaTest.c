@@ -0,0 +1,149 @@
+/**********************************************************************
+  deltaTest.c - Checks the rolling checksum, and that a delta between
+                the two ends of a transfer rebuilds the new file
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#include <linux/limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <checksum.h>
+#include <delta.h>
+
+#include "test.h"
+
+#define DELTA_TEST_SIZE (3 * 1024 * 1024)
+
+// Runs one end of the transfer in a child, with its stdin and stdout on
+// the given pipes, as it would run over the exec channel
+static pid_t _deltaTest_startHelper(int (*serve)(const char*),
+                                    const char* path, int in, int out)
+{
+  pid_t pid = fork();
+  if (pid != 0) return pid;
+
+  dup2(in, STDIN_FILENO);
+  dup2(out, STDOUT_FILENO);
+  _exit(serve(path));
+}
+
+// Sends newPath as a delta against oldPath, which is replaced by it
+static bool _deltaTest_transfer(const char* oldPath, const char* newPath)
+{
+  int toSender[2];
+  int toReceiver[2];
+  if (pipe(toSender) != 0 || pipe(toReceiver) != 0) return false;
+
+  pid_t receiver = _deltaTest_startHelper(delta_serveReceive, oldPath,
+                                          toReceiver[0], toSender[1]);
+  pid_t sender = _deltaTest_startHelper(delta_serveSend, newPath,
+                                        toSender[0], toReceiver[1]);
+  close(toSender[0]);
+  close(toSender[1]);
+  close(toReceiver[0]);
+  close(toReceiver[1]);
+
+  int receiverStatus = -1;
+  int senderStatus = -1;
+  if (receiver > 0) waitpid(receiver, &receiverStatus, 0);
+  if (sender > 0) waitpid(sender, &senderStatus, 0);
+  return receiverStatus == 0 && senderStatus == 0;
+}
+
+static void _deltaTest_checkRolling()
+{
+  // rsync's weak checksum: the sum of the bytes, and the sum of those sums
+  TEST_CHECK(checksum_weak("", 0) == 0);
+  TEST_CHECK(checksum_weak("abcd", 4) == 0x03d4018a);
+  TEST_CHECK(checksum_weak("Wikipedia", 9) == 0x11dd0397);
+
+  // Rolling the window forward a byte at a time gives the same checksum as
+  // computing it again at every offset
+  unsigned char data[4096];
+  test_fillRandom(data, sizeof(data), 7);
+  size_t windows[] = { 1, 2, 700, 1024 };
+  size_t i;
+  for (i = 0; i < sizeof(windows) / sizeof(windows[0]); i++) {
+    size_t len = windows[i];
+    uint32_t weak = checksum_weak(data, len);
+    size_t offset;
+    bool matches = true;
+    for (offset = 1; offset + len <= sizeof(data); offset++) {
+      weak = checksum_roll(weak, data[offset - 1], data[offset + len - 1],
+                           len);
+      if (weak != checksum_weak(data + offset, len)) matches = false;
+    }
+    TEST_CHECK(matches);
+  }
+}
+
+int main()
+{
+  _deltaTest_checkRolling();
+
+  char dir[PATH_MAX];
+  if (!test_makeTempDir(dir)) return 1;
+
+  // The new file is the old one with a few bytes changed, a run inserted,
+  // a run removed and more added at the end, so that blocks match at
+  // offsets that aren't multiples of the block size
+  unsigned char* oldData = malloc(DELTA_TEST_SIZE);
+  unsigned char* newData = malloc(DELTA_TEST_SIZE + 8192);
+  if (!oldData || !newData) return 1;
+  test_fillRandom(oldData, DELTA_TEST_SIZE, 21);
+
+  size_t newLen = 0;
+  memcpy(newData, oldData, 500000);
+  newLen += 500000;
+  test_fillRandom(newData + newLen, 333, 22);
+  newLen += 333;
+  memcpy(newData + newLen, oldData + 500000, 1000000);
+  newLen += 1000000;
+  memcpy(newData + newLen, oldData + 1503000,
+         DELTA_TEST_SIZE - 1503000);
+  newLen += DELTA_TEST_SIZE - 1503000;
+  newData[2000000] ^= 0xff;
+  test_fillRandom(newData + newLen, 5000, 23);
+  newLen += 5000;
+
+  char oldPath[PATH_MAX];
+  char newPath[PATH_MAX];
+  snprintf(oldPath, PATH_MAX, "%s/old", dir);
+  snprintf(newPath, PATH_MAX, "%s/new", dir);
+  TEST_CHECK(test_writeFile(oldPath, oldData, DELTA_TEST_SIZE));
+  TEST_CHECK(test_writeFile(newPath, newData, newLen));
+
+  // The old copy is rebuilt into the new one
+  TEST_CHECK(_deltaTest_transfer(oldPath, newPath));
+  TEST_CHECK(test_fileEquals(oldPath, newData, newLen));
+
+  // Sending it again matches every block
+  TEST_CHECK(_deltaTest_transfer(oldPath, newPath));
+  TEST_CHECK(test_fileEquals(oldPath, newData, newLen));
+
+  // Without an old copy, everything is sent as literal data
+  char missingPath[PATH_MAX];
+  snprintf(missingPath, PATH_MAX, "%s/missing", dir);
+  TEST_CHECK(_deltaTest_transfer(missingPath, newPath));
+  TEST_CHECK(test_fileEquals(missingPath, newData, newLen));
+
+  // The sender says so if the new file isn't a regular file
+  TEST_CHECK(delta_serveSend(dir) == DELTA_EXIT_NOT_FILE);
+
+  free(oldData);
+  free(newData);
+  test_removeTree(dir);
+  return test_finish("delta");
+}
@@ -0,0 +1,140 @@
+/**********************************************************************
+  tarStreamTest.c - Packs a tree into a tar stream and unpacks it again,
+                    and checks the stream against the system's tar
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <tarStream.h>
+
+#include "test.h"
+
+// Long enough to need a ustar prefix, and with the rest a pax header
+#define TAR_TEST_LONG_DIR \
+  "a_directory_name_that_is_long_enough_to_spill_out_of_the_name_field"
+#define TAR_TEST_LONGER_NAME                                               \
+  "a_file_name_that_is_so_long_that_even_the_prefix_and_the_name_field_" \
+  "together_cannot_hold_the_whole_path_to_it_and_a_pax_header_is_needed"
+
+#define TAR_TEST_LARGE_SIZE (3 * 1024 * 1024 + 17)
+
+typedef struct {
+  const char* relPath;
+  size_t size;
+} tarTestFile;
+
+static const tarTestFile _tarTest_files[] = {
+  { "hello.txt", 6 },
+  { "empty", 0 },
+  { "sub/block", 512 },
+  { "sub/large.bin", TAR_TEST_LARGE_SIZE },
+  { TAR_TEST_LONG_DIR "/" TAR_TEST_LONG_DIR "/short", 1000 },
+  { TAR_TEST_LONG_DIR "/" TAR_TEST_LONG_DIR "/" TAR_TEST_LONGER_NAME, 1 }
+};
+
+#define TAR_TEST_NUM_FILES \
+  (sizeof(_tarTest_files) / sizeof(_tarTest_files[0]))
+
+// Checks that every file is under root with the contents that it was
+// written with
+static void _tarTest_checkTree(const char* root, const char* data)
+{
+  size_t i;
+  for (i = 0; i < TAR_TEST_NUM_FILES; i++) {
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/%s", root, _tarTest_files[i].relPath);
+    TEST_CHECK(test_fileEquals(path, data + i, _tarTest_files[i].size));
+  }
+}
+
+int main()
+{
+  char dir[PATH_MAX];
+  if (!test_makeTempDir(dir)) return 1;
+
+  char* data = malloc(TAR_TEST_LARGE_SIZE + TAR_TEST_NUM_FILES);
+  if (!data) return 1;
+  test_fillRandom(data, TAR_TEST_LARGE_SIZE + TAR_TEST_NUM_FILES, 12);
+
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, "%s/tree", dir);
+  mkdir(path, 0755);
+  snprintf(path, PATH_MAX, "%s/tree/sub", dir);
+  mkdir(path, 0755);
+  snprintf(path, PATH_MAX, "%s/tree/" TAR_TEST_LONG_DIR, dir);
+  mkdir(path, 0755);
+  snprintf(path, PATH_MAX, "%s/tree/" TAR_TEST_LONG_DIR "/" TAR_TEST_LONG_DIR,
+           dir);
+  mkdir(path, 0755);
+
+  // Each file starts at its own offset of data, so no two are the same
+  size_t i;
+  for (i = 0; i < TAR_TEST_NUM_FILES; i++) {
+    snprintf(path, PATH_MAX, "%s/tree/%s", dir, _tarTest_files[i].relPath);
+    TEST_CHECK(test_writeFile(path, data + i, _tarTest_files[i].size));
+  }
+
+  // Pack it...
+  char tree[PATH_MAX];
+  char archive[PATH_MAX];
+  snprintf(tree, PATH_MAX, "%s/tree", dir);
+  snprintf(archive, PATH_MAX, "%s/tree.tar", dir);
+  int fd = open(archive, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  TEST_CHECK(fd >= 0);
+  TEST_CHECK(tarStream_write(tree, fd));
+
+  // A tar stream is made of whole blocks
+  struct stat st;
+  TEST_CHECK(fstat(fd, &st) == 0 && st.st_size % 512 == 0);
+
+  // ...and unpack it under another name, which it must be given
+  char out[PATH_MAX];
+  snprintf(out, PATH_MAX, "%s/out", dir);
+  TEST_CHECK(lseek(fd, 0, SEEK_SET) == 0);
+  TEST_CHECK(tarStream_extract(fd, "tree", out));
+  _tarTest_checkTree(out, data);
+
+  // A stream that ends early is an error
+  TEST_CHECK(ftruncate(fd, st.st_size / 2) == 0);
+  TEST_CHECK(lseek(fd, 0, SEEK_SET) == 0);
+  snprintf(out, PATH_MAX, "%s/truncated", dir);
+  TEST_CHECK(!tarStream_extract(fd, "tree", out));
+  close(fd);
+
+  // The stream is unpacked by the server's tar, so check it with ours too
+  if (system("tar --version > /dev/null 2>&1") == 0) {
+    snprintf(out, PATH_MAX, "%s/system", dir);
+    mkdir(out, 0755);
+
+    // The archive was truncated above, so pack it again
+    fd = open(archive, O_WRONLY | O_TRUNC);
+    TEST_CHECK(fd >= 0 && tarStream_write(tree, fd));
+    if (fd >= 0) close(fd);
+
+    char command[3 * PATH_MAX];
+    snprintf(command, sizeof(command), "tar -xf '%s' -C '%s'", archive, out);
+    TEST_CHECK(system(command) == 0);
+    strcat(out, "/tree");
+    _tarTest_checkTree(out, data);
+  }
+  else printf("tar was not found, so the stream is only read back by us\n");
+
+  free(data);
+  test_removeTree(dir);
+  return test_finish("tarStream");
+}
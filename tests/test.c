@@ -0,0 +1,108 @@
+/**********************************************************************
+  test.c - Source code for the helpers that the tests share
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+// For mkdtemp() and nftw()
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <linux/limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test.h"
+
+int test_numFailures = 0;
+
+bool test_makeTempDir(char* dir)
+{
+  const char* tmp = getenv("TMPDIR");
+  snprintf(dir, PATH_MAX, "%s/scpTest.XXXXXX", tmp && *tmp ? tmp : "/tmp");
+  if (mkdtemp(dir)) return true;
+
+  perror("mkdtemp");
+  return false;
+}
+
+static int _test_removeEntry(const char* path, const struct stat* st,
+                             int type, struct FTW* ftw)
+{
+  (void)st;
+  (void)type;
+  (void)ftw;
+  remove(path);
+  return 0;
+}
+
+void test_removeTree(const char* dir)
+{
+  nftw(dir, _test_removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+bool test_writeFile(const char* path, const void* data, size_t len)
+{
+  FILE* f = fopen(path, "wb");
+  if (!f) return false;
+
+  bool success = fwrite(data, 1, len, f) == len;
+  if (fclose(f) != 0) success = false;
+  return success;
+}
+
+bool test_fileEquals(const char* path, const void* data, size_t len)
+{
+  FILE* f = fopen(path, "rb");
+  if (!f) return false;
+
+  char* contents = malloc(len + 1);
+  bool success = contents && fread(contents, 1, len + 1, f) == len &&
+                 memcmp(contents, data, len) == 0;
+  free(contents);
+  fclose(f);
+  return success;
+}
+
+void test_fillRandom(void* data, size_t len, unsigned int seed)
+{
+  // xorshift32, which never gets stuck at 0 as long as it doesn't start there
+  uint32_t x = seed ? seed : 1;
+  unsigned char* p = data;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    p[i] = x >> 24;
+  }
+}
+
+void test_toHex(const unsigned char* digest, size_t len, char* hex)
+{
+  size_t i;
+  for (i = 0; i < len; i++) sprintf(hex + 2 * i, "%02x", digest[i]);
+  hex[2 * len] = '\0';
+}
+
+int test_finish(const char* name)
+{
+  if (test_numFailures == 0) {
+    printf("%s: passed\n", name);
+    return 0;
+  }
+
+  printf("%s: %i checks failed\n", name, test_numFailures);
+  return 1;
+}
@@ -0,0 +1,101 @@
+/**********************************************************************
+  test.h - Header file for the helpers that the tests share
+
+  Copyright (C) 2015 by Patrick S. Avery
+
+  This source code is released under the New BSD License, (the "License").
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ ***********************************************************************/
+
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// The number of checks that have failed so far
+extern int test_numFailures;
+
+// Counts and reports a check that failed, but carries on with the test
+#define TEST_CHECK(cond)                                                 \
+  do {                                                                   \
+    if (!(cond)) {                                                       \
+      fprintf(stderr, "%s:%i: check failed: %s\n", __FILE__, __LINE__,   \
+              #cond);                                                    \
+      test_numFailures++;                                                \
+    }                                                                    \
+  } while (0)
+
+/*
+ * Creates an empty directory for a test to work in.
+ *
+ * @param dir Set to the path of the directory. It must be PATH_MAX long.
+ *
+ * @return Returns true if it was created.
+ */
+bool test_makeTempDir(char* dir);
+
+/*
+ * Removes a directory and everything in it.
+ *
+ * @param dir The directory.
+ */
+void test_removeTree(const char* dir);
+
+/*
+ * Writes a file, replacing it if it exists.
+ *
+ * @param path The path of the file.
+ * @param data What to write.
+ * @param len The length of data.
+ *
+ * @return Returns true if the whole file was written.
+ */
+bool test_writeFile(const char* path, const void* data, size_t len);
+
+/*
+ * Checks that a file holds exactly the given bytes.
+ *
+ * @param path The path of the file.
+ * @param data The bytes that it should hold.
+ * @param len The length of data.
+ *
+ * @return Returns true if it does.
+ */
+bool test_fileEquals(const char* path, const void* data, size_t len);
+
+/*
+ * Fills a buffer with bytes that don't compress or repeat, from a seed, so
+ * that a test gets the same bytes every time.
+ *
+ * @param data The buffer.
+ * @param len The length of the buffer.
+ * @param seed The seed.
+ */
+void test_fillRandom(void* data, size_t len, unsigned int seed);
+
+/*
+ * Formats a digest as lowercase hex, as md5sum and xxhsum print them.
+ *
+ * @param digest The digest.
+ * @param len The length of the digest.
+ * @param hex Set to the hex. It must be 2 * len + 1 long.
+ */
+void test_toHex(const unsigned char* digest, size_t len, char* hex);
+
+/*
+ * Reports the result of a test.
+ *
+ * @param name The name of the test.
+ *
+ * @return The exit status for the test: 0 if every check passed.
+ */
+int test_finish(const char* name);
+
+#endif // TEST_H